@@ -0,0 +1,260 @@
+#!/usr/bin/env python3
+# Copyright 2024 Google LLC
+#
+# Licensed under the Apache License, Version 2.0 (the "License");
+# you may not use this file except in compliance with the License.
+# You may obtain a copy of the License at
+#
+#      http://www.apache.org/licenses/LICENSE-2.0
+#
+# Unless required by applicable law or agreed to in writing, software
+# distributed under the License is distributed on an "AS IS" BASIS,
+# WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+# See the License for the specific language governing permissions and
+# limitations under the License.
+
+"""Benchmarks REBS itself against a generated universe of packages.
+
+A universe of libraries and applications is generated in a temporary
+directory, and built with a stub compiler that only writes its outputs, so
+that the time measured is REBS's own overhead. Each scenario is built a few
+times, and the median wall time is reported along with the phases from
+--stats.
+
+Jsonnet must be installed, because REBS uses it to evaluate the configs.
+"""
+
+import argparse
+import json
+import os
+import random
+import shutil
+import statistics
+import subprocess
+import sys
+import tempfile
+import time
+
+# A compiler and linker that writes empty outputs. Compiles write a dependency
+# file listing the source and the headers it includes, which are always
+# included by absolute path so they don't need to be resolved.
+STUB_COMPILER = r"""#!/bin/sh
+out=""
+deps=""
+in=""
+while [ $# -gt 0 ]; do
+  case "$1" in
+    -o) out="$2"; shift ;;
+    -MF) deps="$2"; shift ;;
+    -*) ;;
+    *) in="$in $1" ;;
+  esac
+  shift
+done
+if [ -n "$deps" ]; then
+  headers=$(sed -n 's/^#include "\(.*\)"$/\1/p' $in)
+  echo "$out:$in" $headers > "$deps"
+fi
+: > "$out"
+"""
+
+
+def write_file(path, contents):
+  os.makedirs(os.path.dirname(path), exist_ok=True)
+  with open(path, "w") as file:
+    file.write(contents)
+
+
+def generate_universe(root, args):
+  """Generates the packages, the global config and the stub compiler."""
+  rng = random.Random(args.seed)
+  stub_compiler = os.path.join(root, "stub_compiler")
+  write_file(stub_compiler, STUB_COMPILER)
+  os.chmod(stub_compiler, 0o755)
+
+  libraries_directory = os.path.join(root, "universe", "libraries")
+  applications_directory = os.path.join(root, "universe", "applications")
+  os.makedirs(libraries_directory)
+  os.makedirs(applications_directory)
+
+  command = stub_compiler + " -MD -MF ${deps file} -o ${out} ${in}"
+  write_file(
+      os.path.join(root, "config.jsonnet"),
+      json.dumps(
+          {
+              "build_commands": {"cc": command},
+              "linker_command": stub_compiler + " -o ${out} ${in}",
+              "static_linker_command": stub_compiler + " -o ${out} ${in}",
+              "source_directories": [""],
+              "package_type": "application",
+              "package_directories": [libraries_directory,
+                                      applications_directory],
+              "parallel_tasks": args.jobs,
+              "object_cache": 0,
+          },
+          indent=2))
+
+  # Each package depends on packages before it, so there are no cycles.
+  headers_by_library = []
+  for library in range(args.libraries):
+    name = "lib%d" % library
+    package = os.path.join(libraries_directory, name)
+    dependencies = rng.sample(range(library), min(args.fan_out, library))
+    write_file(
+        os.path.join(package, ".package.rebs.jsonnet"),
+        json.dumps({
+            "package_type": "library",
+            "public_include_directories": ["public"],
+            "dependencies": ["lib%d" % dependency
+                             for dependency in dependencies],
+        }))
+    headers = [
+        os.path.join(package, "public", name, "header%d.h" % header)
+        for header in range(args.headers)
+    ]
+    for header in headers:
+      write_file(header, "#pragma once\n")
+    headers_by_library.append(headers)
+
+    visible_headers = headers + [
+        header for dependency in dependencies
+        for header in headers_by_library[dependency]
+    ]
+    for source in range(args.sources):
+      includes = rng.sample(visible_headers,
+                            min(args.headers, len(visible_headers)))
+      write_file(
+          os.path.join(package, "source%d.cc" % source),
+          "".join('#include "%s"\n' % include for include in includes) +
+          "int %s_function%d() { return %d; }\n" % (name, source, source))
+
+  for application in range(args.applications):
+    name = "app%d" % application
+    package = os.path.join(applications_directory, name)
+    dependencies = rng.sample(range(args.libraries),
+                              min(args.fan_out, args.libraries))
+    write_file(
+        os.path.join(package, ".package.rebs.jsonnet"),
+        json.dumps({
+            "dependencies": ["lib%d" % dependency
+                             for dependency in dependencies],
+            "asset_directories": ["assets"],
+            "destination_directory": os.path.join(root, "output", name),
+        }))
+    includes = [
+        header for dependency in dependencies
+        for header in headers_by_library[dependency][:1]
+    ]
+    write_file(
+        os.path.join(package, "main.cc"),
+        "".join('#include "%s"\n' % include for include in includes) +
+        "int main() { return 0; }\n")
+    for asset in range(args.assets):
+      write_file(os.path.join(package, "assets", "asset%d.txt" % asset),
+                 "asset %d\n" % asset)
+
+
+def run_rebs(root, args):
+  """Builds every package. Returns the wall time in seconds and the stats."""
+  stats_file = os.path.join(root, "stats.json")
+  environment = dict(os.environ,
+                     REBS_CONFIG=os.path.join(root, "config.jsonnet"),
+                     TMPDIR=os.path.join(root, "temp"))
+  os.makedirs(environment["TMPDIR"], exist_ok=True)
+  start_time = time.perf_counter()
+  result = subprocess.run(
+      [args.rebs, "--build", "--all", "--stats=" + stats_file],
+      cwd=os.path.join(root, "universe"),
+      env=environment,
+      stdout=subprocess.DEVNULL,
+      stderr=subprocess.PIPE,
+      text=True)
+  duration = time.perf_counter() - start_time
+  if result.returncode != 0:
+    sys.exit("rebs failed:\n" + result.stderr)
+  with open(stats_file) as file:
+    return duration, json.load(file)
+
+
+def touch(path):
+  # Timestamps have millisecond precision, so make sure the file is newer.
+  time.sleep(0.01)
+  os.utime(path)
+
+
+def main():
+  parser = argparse.ArgumentParser(description=__doc__.splitlines()[0])
+  parser.add_argument("--rebs", default="./rebs", help="The rebs to benchmark.")
+  parser.add_argument("--libraries", type=int, default=200)
+  parser.add_argument("--applications", type=int, default=20)
+  parser.add_argument("--fan-out", type=int, default=4,
+                      help="How many packages each package depends on.")
+  parser.add_argument("--sources", type=int, default=20,
+                      help="Source files per library.")
+  parser.add_argument("--headers", type=int, default=10,
+                      help="Headers per library, and included by each source.")
+  parser.add_argument("--assets", type=int, default=5,
+                      help="Asset files per application.")
+  parser.add_argument("--jobs", type=int, default=os.cpu_count())
+  parser.add_argument("--runs", type=int, default=3,
+                      help="How many times to build each scenario.")
+  parser.add_argument("--seed", type=int, default=0)
+  parser.add_argument("--json", help="Write the results to this file.")
+  parser.add_argument("--keep", action="store_true",
+                      help="Keep the generated universe.")
+  args = parser.parse_args()
+  args.rebs = os.path.abspath(args.rebs)
+
+  root = tempfile.mkdtemp(prefix="rebs_benchmark_")
+  try:
+    generate_universe(root, args)
+    libraries_directory = os.path.join(root, "universe", "libraries")
+    # The first library is depended on the most.
+    header = os.path.join(libraries_directory, "lib0", "public", "lib0",
+                          "header0.h")
+    config = os.path.join(libraries_directory, "lib0", ".package.rebs.jsonnet")
+
+    def clean():
+      shutil.rmtree(os.path.join(root, "temp"), ignore_errors=True)
+      shutil.rmtree(os.path.join(root, "output"), ignore_errors=True)
+
+    scenarios = [
+        ("clean", clean),
+        ("no-op", lambda: None),
+        ("touch header", lambda: touch(header)),
+        ("touch config", lambda: touch(config)),
+    ]
+
+    results = []
+    run_rebs(root, args)
+    for name, prepare in scenarios:
+      durations = []
+      for _ in range(args.runs):
+        prepare()
+        duration, stats = run_rebs(root, args)
+        durations.append(duration)
+      median = statistics.median(durations)
+      results.append({
+          "scenario": name,
+          "median_seconds": median,
+          "seconds": durations,
+          "stats": stats,
+      })
+      phases = ", ".join("%s %.1f ms" % (phase["name"],
+                                          phase["duration_us"] / 1000)
+                         for phase in stats["phases"])
+      print("%-14s %8.3f s  (%s)" % (name, median, phases))
+
+    if args.json:
+      with open(args.json, "w") as file:
+        json.dump({"arguments": vars(args), "results": results}, file,
+                  indent=2)
+  finally:
+    if args.keep:
+      print("The universe was kept in " + root)
+    else:
+      shutil.rmtree(root, ignore_errors=True)
+
+
+if __name__ == "__main__":
+  main()
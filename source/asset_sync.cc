@@ -0,0 +1,111 @@
+// Copyright 2024 Google LLC
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//      http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+#include "asset_sync.h"
+
+#include <algorithm>
+#include <cstdint>
+#include <filesystem>
+#include <fstream>
+#include <iomanip>
+#include <sstream>
+#include <system_error>
+#include <vector>
+
+#include "file_copy.h"
+#include "timestamps.h"
+#include "worker_pool.h"
+
+namespace {
+
+// How many assets each task looks up when finding the assets to copy.
+constexpr size_t kAssetsToLookUpPerTask = 64;
+
+// The size of the chunks to compare the contents of files in.
+constexpr size_t kCompareChunkSize = 64 * 1024;
+
+// Returns whether two files have the same contents.
+bool AreContentsEqual(const std::filesystem::path& a,
+                      const std::filesystem::path& b) {
+  std::ifstream file_a(a, std::ios::binary);
+  std::ifstream file_b(b, std::ios::binary);
+  if (!file_a.is_open() || !file_b.is_open()) return false;
+  std::vector<char> chunk_a(kCompareChunkSize);
+  std::vector<char> chunk_b(kCompareChunkSize);
+  while (true) {
+    file_a.read(chunk_a.data(), chunk_a.size());
+    file_b.read(chunk_b.data(), chunk_b.size());
+    if (file_a.gcount() != file_b.gcount() ||
+        !std::equal(chunk_a.begin(), chunk_a.begin() + file_a.gcount(),
+                    chunk_b.begin())) {
+      return false;
+    }
+    if (!file_a || !file_b) return !file_a && !file_b;
+  }
+}
+
+// Returns whether an asset's destination needs to be copied over.
+bool ShouldCopyAsset(const AssetToCopy& asset, bool compare_contents) {
+  uint64_t destination_timestamp = ReadTimestampOfFile(asset.destination);
+  if (destination_timestamp == 0) return true;
+  std::error_code source_error, destination_error;
+  if (std::filesystem::file_size(asset.source, source_error) !=
+          std::filesystem::file_size(asset.destination, destination_error) ||
+      source_error || destination_error)
+    return true;
+  if (ReadTimestampOfFile(asset.source) <= destination_timestamp) return false;
+
+  if (!compare_contents || !AreContentsEqual(asset.source, asset.destination))
+    return true;
+  // Touch the destination so the contents aren't compared again next time.
+  std::error_code error;
+  std::filesystem::last_write_time(
+      asset.destination, std::filesystem::file_time_type::clock::now(), error);
+  return false;
+}
+
+}  // namespace
+
+std::vector<AssetToCopy> FindAssetsToCopy(
+    const std::vector<AssetToCopy>& assets, bool compare_contents) {
+  std::vector<char> should_copy(assets.size(), 0);
+  size_t tasks =
+      (assets.size() + kAssetsToLookUpPerTask - 1) / kAssetsToLookUpPerTask;
+  ParallelFor(tasks, [&](size_t task) {
+    size_t end =
+        std::min((task + 1) * kAssetsToLookUpPerTask, assets.size());
+    for (size_t index = task * kAssetsToLookUpPerTask; index < end; index++)
+      should_copy[index] = ShouldCopyAsset(assets[index], compare_contents);
+  });
+
+  std::vector<AssetToCopy> assets_to_copy;
+  for (size_t index = 0; index < assets.size(); index++)
+    if (should_copy[index]) assets_to_copy.push_back(assets[index]);
+  return assets_to_copy;
+}
+
+bool CopyAssets(const std::vector<AssetToCopy>& assets, bool allow_hard_links,
+                std::stringstream& output) {
+  bool successful = true;
+  for (const auto& asset : assets) {
+    bool copied = allow_hard_links
+                      ? CloneLinkOrCopyFile(asset.source, asset.destination)
+                      : CloneOrCopyFile(asset.source, asset.destination);
+    if (copied) continue;
+    output << "Unable to copy " << std::quoted(asset.source.c_str()) << " to "
+           << std::quoted(asset.destination.c_str()) << "." << std::endl;
+    successful = false;
+  }
+  return successful;
+}
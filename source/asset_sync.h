@@ -0,0 +1,42 @@
+// Copyright 2024 Google LLC
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//      http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+#pragma once
+
+#include <filesystem>
+#include <sstream>
+#include <vector>
+
+// Assets are copied to their destination directories by REBS itself, in
+// batches, rather than by running a command for each file.
+
+// A file to copy, and where to copy it to.
+struct AssetToCopy {
+  std::filesystem::path source;
+  std::filesystem::path destination;
+};
+
+// Returns the assets whose destination doesn't exist, is a different size, or
+// is older than the source. If `compare_contents` is set, an older destination
+// that is the same size is only copied if its contents differ. The files are
+// looked up in parallel.
+std::vector<AssetToCopy> FindAssetsToCopy(
+    const std::vector<AssetToCopy>& assets, bool compare_contents);
+
+// Copies the assets, cloning them where the file system supports it. If
+// `allow_hard_links` is set, assets that can't be cloned are hard linked if
+// they're on the same file system. Returns false and writes which assets failed
+// to `output` if any couldn't be copied.
+bool CopyAssets(const std::vector<AssetToCopy>& assets, bool allow_hard_links,
+                std::stringstream& output);
@@ -14,26 +14,49 @@
 
 #include "build.h"
 
+#include <algorithm>
+#include <deque>
 #include <filesystem>
 #include <format>
+#include <fstream>
 #include <functional>
 #include <iomanip>
 #include <iostream>
+#include <map>
+#include <memory>
 #include <queue>
 #include <set>
 #include <sstream>
 #include <string>
+#include <string_view>
+#include <utility>
+#include <vector>
 
+#include "asset_sync.h"
+#include "command_hashes.h"
 #include "command_queue.h"
+#include "config.h"
 #include "deferred_command.h"
 #include "dependencies.h"
+#include "directory_manifest.h"
+#include "explain.h"
+#include "exported_symbols.h"
+#include "hash.h"
 #include "invocation.h"
+#include "invocation_action.h"
+#include "module_scan.h"
+#include "package_id.h"
 #include "package_metadata.h"
 #include "packages.h"
+#include "response_file.h"
 #include "stage.h"
+#include "stats.h"
 #include "string_replace.h"
 #include "temp_directory.h"
+#include "test_runner.h"
 #include "timestamps.h"
+#include "trace.h"
+#include "worker_pool.h"
 
 namespace {
 
@@ -41,10 +64,118 @@ namespace {
 // run.
 std::set<std::string> packages;
 
+// The commands queued during this run that produce a file that other packages
+// may link against, keyed by the file they produce.
+std::map<std::filesystem::path, DeferredCommand*> commands_by_output_file;
+
 // The name of the subdirectory inside of the package's temporary directory to
 // store the object files in.
 constexpr char kObjectsSubDirectory[] = "objects";
 
+// The name of the subdirectory inside of the objects directory to generate
+// unity batches in. It's hidden so it can't clash with a source directory.
+constexpr char kUnitySubDirectory[] = ".unity";
+
+// The first line of a generated unity batch.
+constexpr std::string_view kUnityBatchHeader =
+    "// A unity batch generated by rebs.\n";
+
+// The name of the subdirectory inside of the objects directory to generate
+// precompiled headers in.
+constexpr char kPrecompiledHeaderSubDirectory[] = ".pch";
+
+// The first line of a generated precompiled header.
+constexpr std::string_view kPrecompiledHeaderHeader =
+    "// A precompiled header generated by rebs.\n";
+
+// A precompiled header is only generated for at least this many source files.
+constexpr size_t kMinimumSourceFilesForPrecompiledHeader = 4;
+
+// The name of the subdirectory inside of the objects directory to write module
+// interfaces to.
+constexpr char kModulesSubDirectory[] = ".modules";
+
+// The extensions of C++ source files, which may provide or import modules.
+constexpr std::string_view kModuleSourceExtensions[] = {
+    ".cc", ".cpp", ".cxx", ".c++", ".cppm", ".ixx"};
+
+// The name of the subdirectory inside of the package's temporary directory for
+// the linker to cache what it optimized with link time optimization.
+constexpr char kLtoCacheSubDirectory[] = "lto_cache";
+
+// The extensions of C and C++ source files, whose debug info may be split, and
+// which are compiled as position independent code for shared libraries.
+constexpr std::string_view kCSourceExtensions[] = {
+    ".c", ".cc", ".cpp", ".cxx", ".c++", ".cppm", ".ixx"};
+
+// How many assets each command copies.
+constexpr size_t kAssetsPerBatch = 64;
+
+// A named module provided by a source file being built during this run.
+struct ModuleInterface {
+  // The source file that provides the module.
+  std::filesystem::path source_file;
+  // The module interface that's written when the source file compiles.
+  std::filesystem::path bmi_file;
+  // The modules that the module imports.
+  std::vector<std::string> imported_modules;
+  // The command that compiles the module during this run, if it's out of date.
+  DeferredCommand* command = nullptr;
+};
+
+// The named modules provided by the packages built during this run, keyed by
+// name.
+std::map<std::string, ModuleInterface> module_interfaces_by_name;
+
+// The output directories that have been created during this run.
+std::set<std::filesystem::path> created_output_directories;
+
+// A precompiled header shared by the source files of a package that have the
+// same precompiled header command.
+struct PrecompiledHeader {
+  // The argument to add to the build commands of the source files that use it.
+  std::string argument;
+  // The command that precompiles the header during this run, if it's out of
+  // date.
+  DeferredCommand* command = nullptr;
+};
+
+// A source file in a package that has a build command.
+struct SourceFileToBuild {
+  std::filesystem::path source_file;
+  std::string object_file;
+  // The build command for this source file's extension.
+  const CommandTemplate* build_command;
+  // Whether the object file needs to be rebuilt.
+  bool is_out_of_date = false;
+  // Why the object file needs to be rebuilt, if explaining.
+  RebuildCause rebuild_cause{};
+  // The hash of the parts of the build command that the object file depends
+  // on.
+  std::string command_hash{};
+  // Whether the source file is a generated unity batch.
+  bool is_unity_batch = false;
+  // The precompiled header to build with, if there is one.
+  const PrecompiledHeader* precompiled_header = nullptr;
+  // The named modules that the source file provides and imports.
+  std::vector<std::string> provided_modules{};
+  std::vector<std::string> imported_modules{};
+  // The file that the debug info is split into, if it is.
+  std::string debug_info_file{};
+};
+
+// A generated source file that includes several of a package's source files.
+struct UnityBatch {
+  std::filesystem::path batch_file;
+  std::string object_file;
+  // The source files in the batch.
+  std::vector<const SourceFileToBuild*> source_files;
+  // Whether the batch hasn't been compiled yet.
+  bool is_new = true;
+  // Whether source files were removed from the batch during this build.
+  bool lost_source_files = false;
+};
+
 // Builds the C includes arguments.
 std::string BuildCIncludes(const PackageMetadata& metadata) {
   std::stringstream c_includes;
@@ -77,32 +208,55 @@ std::string BuildStringOfStringsFromVectorOfStringAndPrefix(
   return str.str();
 }
 
+// Makes a command depend on the command that produces `file` during this run, if
+// there is one.
+void AddDependencyOnCommandProducingFile(DeferredCommand& command,
+                                         const std::filesystem::path& file) {
+  auto itr = commands_by_output_file.find(file);
+  if (itr != commands_by_output_file.end())
+    command.dependencies.push_back(itr->second);
+}
+
 // Returns the linker stage to use for a given package based on its metadata.
 Stage GetLinkerStage(const PackageMetadata& metadata) {
   if (metadata.IsApplication()) return Stage::LinkApplication;
   return Stage::LinkLibrary;
 }
 
-// Recursively loops over a directory of source files.
+// Returns whether a file extension is of a C or C++ source file.
+bool IsCSourceExtension(std::string_view extension) {
+  return std::find(std::begin(kCSourceExtensions), std::end(kCSourceExtensions),
+                   extension) != std::end(kCSourceExtensions);
+}
+
+// Returns whether a package's C and C++ source files are compiled as position
+// independent code, so they can be linked into a shared library.
+bool UsesPositionIndependentCode(const PackageMetadata& metadata) {
+  return IsDevMode() && metadata.IsLibrary();
+}
+
+// Recursively loops over a directory of a package's files, with the path each
+// file maps to in the output directory. The output directories aren't created.
 void ForEachFile(
+    const PackageMetadata& metadata,
     const std::filesystem::path& source_directory,
     const std::filesystem::path& output_directory,
     const std::function<void(const std::filesystem::path&,
                              const std::filesystem::path&)>& on_each_file) {
-  EnsureDirectoriesAndParentsExist(output_directory);
-  for (auto const& dir_entry :
-       std::filesystem::directory_iterator{source_directory}) {
-    auto path = dir_entry.path();
-    std::string filename = path.filename();
-    // Skip hidden files.
-    if (filename.size() == 0 || filename[0] == '.') continue;
-
-    if (dir_entry.is_directory()) {
-      ForEachFile(path, output_directory / filename, on_each_file);
-    } else {
-      on_each_file(path, output_directory / filename);
-    }
-  }
+  ForEachFileInDirectory(
+      metadata.package_id, source_directory,
+      [&](const std::filesystem::path& relative_path) {
+        on_each_file(source_directory / relative_path,
+                     output_directory / relative_path);
+      });
+}
+
+// Creates the directory that a command writes its output to, if it hasn't
+// already been created during this run.
+void EnsureOutputDirectoryExists(const std::filesystem::path& output_file) {
+  std::filesystem::path directory = output_file.parent_path();
+  if (created_output_directories.insert(directory).second)
+    EnsureDirectoriesAndParentsExist(directory);
 }
 
 // Loops over each source file in a package.
@@ -113,7 +267,7 @@ void ForEachSourceFile(
   std::filesystem::path objects_directory =
       metadata.temp_directory / kObjectsSubDirectory;
   for (const auto& source_directory : metadata.source_directories) {
-    ForEachFile(metadata.package_path / source_directory,
+    ForEachFile(metadata, metadata.package_path / source_directory,
                 objects_directory / source_directory, on_each_file);
   }
 }
@@ -123,27 +277,898 @@ void ForEachAssetFile(
     const std::function<void(const std::filesystem::path&,
                              const std::filesystem::path&)>& on_each_file) {
   for (const auto& asset_directory : metadata.asset_directories) {
-    ForEachFile(metadata.package_path / asset_directory,
+    ForEachFile(metadata, metadata.package_path / asset_directory,
                 metadata.destination_directory, on_each_file);
   }
 }
 
-void CopyAssetIfNewer(const std::filesystem::path& source,
-                      const std::filesystem::path& destination) {
-  if (GetTimestampOfFile(source) <= GetTimestampOfFile(destination)) return;
+void CopyAssetFilesForPackage(PackageMetadata& metadata) {
+  std::vector<AssetToCopy> assets;
+  ForEachAssetFile(metadata, [&assets](const std::filesystem::path& source,
+                                       const std::filesystem::path& destination) {
+    assets.push_back({.source = source, .destination = destination});
+  });
+  std::vector<AssetToCopy> assets_to_copy =
+      FindAssetsToCopy(assets, metadata.compare_asset_contents);
+  RecordUpToDateCommands(Stage::CopyAssets,
+                         static_cast<int>(assets.size() - assets_to_copy.size()));
 
+  // Each batch is copied by one command, so that a package with many assets
+  // doesn't start a process per asset.
+  for (size_t start = 0; start < assets_to_copy.size();
+       start += kAssetsPerBatch) {
+    size_t end = std::min(start + kAssetsPerBatch, assets_to_copy.size());
+    std::vector<AssetToCopy> batch(assets_to_copy.begin() + start,
+                                   assets_to_copy.begin() + end);
+    for (const auto& asset : batch) {
+      EnsureOutputDirectoryExists(asset.destination);
+      SetTimestampOfFileToNow(asset.destination);
+    }
+
+    auto command = std::make_unique<DeferredCommand>();
+    command->command =
+        (std::stringstream() << "Copy " << batch.size() << " assets to "
+                             << std::quoted(
+                                    metadata.destination_directory.c_str()))
+            .str();
+    command->destination_file = batch.front().destination;
+    command->package_id = metadata.package_id;
+    command->cacheable = false;
+    command->action = [batch = std::move(batch),
+                       allow_hard_links = metadata.hard_link_assets](
+                          std::stringstream& output) {
+      return CopyAssets(batch, allow_hard_links, output);
+    };
+    QueueCommand(Stage::CopyAssets, std::move(command));
+  }
+}
+
+// Reads the source files included by a unity batch.
+std::vector<std::filesystem::path> ReadUnityBatch(
+    const std::filesystem::path& batch_file) {
+  std::vector<std::filesystem::path> source_files;
+  std::ifstream file(batch_file);
+  std::string line;
+  while (std::getline(file, line)) {
+    if (line.starts_with("#include \"") && line.ends_with("\""))
+      source_files.push_back(line.substr(10, line.size() - 11));
+  }
+  return source_files;
+}
+
+// Writes a generated source file if its contents have changed, and returns
+// whether it did. Generated files are only rewritten when they change, because
+// what includes them must recompile afterwards.
+bool WriteGeneratedFileIfChanged(const std::filesystem::path& path,
+                                 const std::string& contents) {
+  std::ifstream existing_file(path);
+  if (existing_file.is_open()) {
+    std::stringstream existing_contents;
+    existing_contents << existing_file.rdbuf();
+    if (existing_contents.view() == contents) return false;
+    existing_file.close();
+  }
+  std::ofstream file(path);
+  file << contents;
+  return true;
+}
+
+// Writes a unity batch if its source files have changed, and returns whether it
+// did.
+bool WriteUnityBatch(const UnityBatch& batch) {
+  std::string contents(kUnityBatchHeader);
+  for (const auto* source_file : batch.source_files) {
+    contents += "#include \"" +
+                std::filesystem::absolute(source_file->source_file).string() +
+                "\"\n";
+  }
+  return WriteGeneratedFileIfChanged(batch.batch_file, contents);
+}
+
+// Groups the source files of a package that share a file extension into unity
+// batches. Batches keep their source files between builds, so that adding or
+// removing a source file only recompiles one batch. Source files that are
+// edited after their batch was compiled are moved out of their batch and
+// compiled on their own from then on, so that editing the same file again only
+// recompiles that file. They rejoin a batch when that batch needs to recompile
+// anyway. New source files are added to batches that haven't been compiled
+// yet, or to new batches. Returns what to compile: the batches and the source
+// files that are compiled on their own.
+std::vector<SourceFileToBuild> GroupIntoUnityBatches(
+    const PackageMetadata& metadata, const std::string& extension,
+    const std::vector<const SourceFileToBuild*>& source_files) {
+  std::filesystem::path unity_directory =
+      metadata.temp_directory / kObjectsSubDirectory / kUnitySubDirectory;
+  EnsureDirectoriesAndParentsExist(unity_directory);
+  size_t batch_size = std::max(metadata.unity_batch_size, 1);
+  const CommandTemplate* build_command = source_files.front()->build_command;
+
+  std::map<std::filesystem::path, const SourceFileToBuild*>
+      source_files_by_path;
+  for (const auto* source_file : source_files) {
+    source_files_by_path[std::filesystem::absolute(source_file->source_file)] =
+        source_file;
+  }
+
+  // Load the existing batches, dropping source files that no longer exist.
+  std::vector<UnityBatch> batches;
+  std::set<const SourceFileToBuild*> batched_source_files;
+  std::vector<const SourceFileToBuild*> separate_source_files;
+  auto get_batch_file = [&](size_t index) {
+    return unity_directory /
+           (extension.substr(1) + "_" + std::to_string(index) + extension);
+  };
+  while (true) {
+    UnityBatch batch;
+    batch.batch_file = get_batch_file(batches.size());
+    if (!DoesFileExist(batch.batch_file)) break;
+    batch.object_file = batch.batch_file.string() + ".o";
+    for (const auto& path : ReadUnityBatch(batch.batch_file)) {
+      auto itr = source_files_by_path.find(path);
+      if (itr == source_files_by_path.end() ||
+          !batched_source_files.insert(itr->second).second) {
+        batch.lost_source_files = true;
+        continue;
+      }
+      batch.source_files.push_back(itr->second);
+    }
+
+    uint64_t object_timestamp = GetTimestampOfFile(batch.object_file);
+    batch.is_new = object_timestamp == 0;
+    if (!batch.is_new) {
+      std::vector<const SourceFileToBuild*> edited_source_files;
+      std::vector<const SourceFileToBuild*> unedited_source_files;
+      for (const auto* source_file : batch.source_files) {
+        if (GetTimestampOfFile(source_file->source_file) > object_timestamp) {
+          edited_source_files.push_back(source_file);
+        } else {
+          unedited_source_files.push_back(source_file);
+        }
+      }
+      // If every source file was edited, it's just as fast to recompile the
+      // batch.
+      if (!edited_source_files.empty() && !unedited_source_files.empty()) {
+        separate_source_files.insert(separate_source_files.end(),
+                                     edited_source_files.begin(),
+                                     edited_source_files.end());
+        batch.source_files = std::move(unedited_source_files);
+        batch.lost_source_files = true;
+      }
+    }
+    batches.push_back(std::move(batch));
+  }
+
+  // Source files that aren't in a batch are compiled on their own if they have
+  // been before, otherwise they're new.
+  std::vector<const SourceFileToBuild*> new_source_files;
+  for (const auto* source_file : source_files) {
+    if (batched_source_files.contains(source_file)) continue;
+    if (DoesFileExist(source_file->object_file)) {
+      separate_source_files.push_back(source_file);
+    } else {
+      new_source_files.push_back(source_file);
+    }
+  }
+
+  // Separate source files that haven't been edited since they were last
+  // compiled can rejoin a batch.
+  std::vector<std::filesystem::path> object_files;
+  for (const auto& batch : batches) object_files.push_back(batch.object_file);
+  for (const auto* source_file : separate_source_files)
+    object_files.push_back(source_file->object_file);
+  std::vector<bool> out_of_date =
+      AreDependenciesNewerThanFiles(metadata.package_id, object_files);
+  std::vector<const SourceFileToBuild*> rejoining_source_files;
+  std::vector<const SourceFileToBuild*> still_separate_source_files;
+  for (size_t index = 0; index < separate_source_files.size(); index++) {
+    if (out_of_date[batches.size() + index]) {
+      still_separate_source_files.push_back(separate_source_files[index]);
+    } else {
+      rejoining_source_files.push_back(separate_source_files[index]);
+    }
+  }
+
+  // Source files are only added to batches that will compile anyway, so that
+  // nothing compiles that wouldn't have otherwise.
+  auto fill_batch = [batch_size](UnityBatch& batch,
+                                 std::vector<const SourceFileToBuild*>& files) {
+    while (!files.empty() && batch.source_files.size() < batch_size) {
+      batch.source_files.push_back(files.back());
+      files.pop_back();
+    }
+  };
+  for (size_t index = 0; index < batches.size(); index++) {
+    UnityBatch& batch = batches[index];
+    if (!out_of_date[index] && !batch.lost_source_files && !batch.is_new)
+      continue;
+    fill_batch(batch, rejoining_source_files);
+    fill_batch(batch, new_source_files);
+  }
+  still_separate_source_files.insert(still_separate_source_files.end(),
+                                     rejoining_source_files.begin(),
+                                     rejoining_source_files.end());
+  while (!new_source_files.empty()) {
+    UnityBatch batch;
+    batch.batch_file = get_batch_file(batches.size());
+    batch.object_file = batch.batch_file.string() + ".o";
+    fill_batch(batch, new_source_files);
+    batches.push_back(std::move(batch));
+  }
+
+  std::vector<SourceFileToBuild> to_compile;
+  for (const auto& batch : batches) {
+    // Empty batches are kept so the batches after them keep their names.
+    bool changed = WriteUnityBatch(batch);
+    if (batch.source_files.empty()) continue;
+    to_compile.push_back({.source_file = batch.batch_file,
+                          .object_file = batch.object_file,
+                          .build_command = build_command,
+                          .is_out_of_date = changed,
+                          .is_unity_batch = true});
+    if (changed) {
+      SetRebuildCause(to_compile.back().rebuild_cause,
+                      RebuildReason::GeneratedFileChanged, batch.batch_file);
+    }
+  }
+  for (const auto* source_file : still_separate_source_files)
+    to_compile.push_back(*source_file);
+  return to_compile;
+}
+
+// Replaces the source files of a package with what to compile for a unity
+// build.
+void UseUnityBatches(const PackageMetadata& metadata,
+                     std::vector<SourceFileToBuild>& source_files) {
+  std::map<std::string, std::vector<const SourceFileToBuild*>>
+      source_files_by_extension;
+  for (const auto& source_file : source_files) {
+    source_files_by_extension[source_file.source_file.extension()].push_back(
+        &source_file);
+  }
+
+  std::vector<SourceFileToBuild> to_compile;
+  for (const auto& [extension, source_files_with_extension] :
+       source_files_by_extension) {
+    for (auto& source_file : GroupIntoUnityBatches(metadata, extension,
+                                                   source_files_with_extension))
+      to_compile.push_back(std::move(source_file));
+  }
+  source_files = std::move(to_compile);
+}
+
+// Reads the headers that a source file includes before anything else, as
+// they're spelled, such as "<vector>". Stops at the first line that isn't an
+// include, a comment, or blank, because what's included after a macro is
+// defined or inside of a conditional may depend on it.
+std::vector<std::string> ReadIncludesAtTopOfFile(
+    const std::filesystem::path& source_file) {
+  std::vector<std::string> includes;
+  std::ifstream file(source_file);
+  std::string line;
+  bool in_comment = false;
+  auto trim = [](std::string_view& str) {
+    str.remove_prefix(std::min(str.find_first_not_of(" \t"), str.size()));
+  };
+  while (std::getline(file, line)) {
+    std::string_view str = line;
+    trim(str);
+    if (in_comment) {
+      in_comment = str.find("*/") == std::string_view::npos;
+      continue;
+    }
+    if (str.empty() || str.starts_with("//")) continue;
+    if (str.starts_with("/*")) {
+      in_comment = str.find("*/", 2) == std::string_view::npos;
+      continue;
+    }
+    if (!str.starts_with("#")) break;
+    str.remove_prefix(1);
+    trim(str);
+    if (str.starts_with("pragma once")) continue;
+    if (!str.starts_with("include")) break;
+    str.remove_prefix(7);
+    trim(str);
+    if (str.empty() || (str[0] != '<' && str[0] != '"')) break;
+    size_t end = str.find(str[0] == '<' ? '>' : '"', 1);
+    if (end == std::string_view::npos) break;
+    includes.push_back(std::string(str.substr(0, end + 1)));
+  }
+  return includes;
+}
+
+// Returns whether an include, as it's spelled, resolved to a file outside of
+// the package directory the last time the source file was compiled, according
+// to the source file's dependencies.
+bool DoesIncludeResolveOutsideOfPackage(
+    std::string_view include, const std::vector<std::string>& dependencies,
+    std::string_view package_directory) {
+  std::string suffix = "/" + std::string(include.substr(1, include.size() - 2));
+  for (const auto& dependency : dependencies) {
+    if (dependency.ends_with(suffix))
+      return !dependency.starts_with(package_directory);
+  }
+  return false;
+}
+
+// Finds the headers that most of the source files include and that are outside
+// of the package, so they rarely change while the package is worked on. Where
+// each header resolved to is found from the dependencies recorded the last
+// time the source files were compiled, so source files that haven't been
+// compiled yet don't count.
+std::vector<std::string> FindCommonIncludes(
+    const PackageMetadata& metadata,
+    const std::vector<SourceFileToBuild*>& source_files) {
+  std::string package_directory =
+      (std::filesystem::absolute(metadata.package_path) / "")
+          .lexically_normal()
+          .string();
+  std::vector<std::string> includes_in_order;
+  std::map<std::string, size_t> source_files_by_include;
+  size_t compiled_source_files = 0;
+  for (const auto* source_file : source_files) {
+    std::vector<std::string> dependencies;
+    for (const auto& dependency :
+         GetDependenciesOfFile(metadata.package_id, source_file->object_file)) {
+      dependencies.push_back(
+          std::filesystem::absolute(dependency).lexically_normal().string());
+    }
+    if (dependencies.empty()) continue;
+    compiled_source_files++;
+
+    std::vector<std::filesystem::path> files_to_read;
+    if (source_file->is_unity_batch) {
+      files_to_read = ReadUnityBatch(source_file->source_file);
+    } else {
+      files_to_read.push_back(source_file->source_file);
+    }
+    std::set<std::string> includes;
+    for (const auto& file : files_to_read) {
+      for (auto& include : ReadIncludesAtTopOfFile(file)) {
+        if (includes.contains(include) ||
+            !DoesIncludeResolveOutsideOfPackage(include, dependencies,
+                                                package_directory)) {
+          continue;
+        }
+        if (source_files_by_include[include]++ == 0)
+          includes_in_order.push_back(include);
+        includes.insert(std::move(include));
+      }
+    }
+  }
+
+  std::vector<std::string> common_includes;
+  for (const auto& include : includes_in_order) {
+    size_t count = source_files_by_include[include];
+    if (count >= 2 && count * 2 >= compiled_source_files)
+      common_includes.push_back(include);
+  }
+  return common_includes;
+}
+
+// Precompiles the headers that most of a package's source files include, for
+// the source files that have a precompiled header command, and makes them build
+// with it. Only does anything if a source file is being compiled, so that
+// up-to-date packages aren't touched. When the precompiled header is out of
+// date, every source file that uses it recompiles.
+void UsePrecompiledHeaders(
+    const PackageMetadata& metadata,
+    std::vector<SourceFileToBuild>& source_files,
+    std::deque<PrecompiledHeader>& precompiled_headers) {
+  std::map<const std::string*, std::vector<SourceFileToBuild*>>
+      source_files_by_command;
+  for (auto& source_file : source_files) {
+    auto itr = metadata.precompiled_header_commands_by_file_extension.find(
+        source_file.source_file.extension());
+    if (itr != metadata.precompiled_header_commands_by_file_extension.end())
+      source_files_by_command[&itr->second].push_back(&source_file);
+  }
+
+  std::filesystem::path precompiled_header_directory =
+      metadata.temp_directory / kObjectsSubDirectory /
+      kPrecompiledHeaderSubDirectory;
+  for (const auto& [command_str, source_files_with_command] :
+       source_files_by_command) {
+    if (source_files_with_command.size() <
+            kMinimumSourceFilesForPrecompiledHeader ||
+        std::none_of(source_files_with_command.begin(),
+                     source_files_with_command.end(),
+                     [](const SourceFileToBuild* source_file) {
+                       return source_file->is_out_of_date;
+                     })) {
+      continue;
+    }
+    std::vector<std::string> includes =
+        FindCommonIncludes(metadata, source_files_with_command);
+    if (includes.empty()) continue;
+
+    // The header is named after the first extension that uses it.
+    EnsureDirectoriesAndParentsExist(precompiled_header_directory);
+    std::string extension =
+        source_files_with_command.front()->source_file.extension().string();
+    std::filesystem::path header_file =
+        precompiled_header_directory / (extension.substr(1) + ".h");
+    // Named so that GCC finds it when the header is included.
+    std::string precompiled_header_file = header_file.string() + ".gch";
+    std::string contents(kPrecompiledHeaderHeader);
+    for (const auto& include : includes)
+      contents += "#include " + include + "\n";
+    bool changed = WriteGeneratedFileIfChanged(header_file, contents);
+
+    PrecompiledHeader& precompiled_header = precompiled_headers.emplace_back();
+    SetPlaceholder("pch", (std::stringstream()
+                           << std::quoted(precompiled_header_file.c_str()))
+                              .str());
+    SetPlaceholder("pch header",
+                   (std::stringstream() << std::quoted(header_file.c_str()))
+                       .str());
+    precompiled_header.argument = " " + metadata.precompiled_header_argument;
+    ReplacePlaceholdersInString(precompiled_header.argument);
+
+    std::string expanded_command = *command_str;
+    // The precompiled header must be compiled the same way as the source files
+    // that use it.
+    if (UsesPositionIndependentCode(metadata))
+      expanded_command += " " + metadata.position_independent_code_argument;
+    SetPlaceholder("out", (std::stringstream()
+                           << std::quoted(precompiled_header_file.c_str()))
+                              .str());
+    SetPlaceholder("in",
+                   (std::stringstream() << std::quoted(header_file.c_str()))
+                       .str());
+    ReplacePlaceholdersInString(expanded_command);
+    std::string command_hash = HashString(expanded_command);
+
+    RebuildCause cause;
+    bool out_of_date = changed;
+    if (changed) {
+      SetRebuildCause(cause, RebuildReason::GeneratedFileChanged, header_file);
+    } else {
+      std::vector<RebuildCause> causes;
+      out_of_date = AreDependenciesNewerThanFiles(
+          metadata.package_id, {precompiled_header_file},
+          ShouldExplain() ? &causes : nullptr)[0];
+      if (!causes.empty()) cause = std::move(causes[0]);
+      if (!out_of_date && HasCommandChanged(metadata.package_id,
+                                            precompiled_header_file,
+                                            command_hash)) {
+        out_of_date = true;
+        SetRebuildCause(cause, RebuildReason::CommandChanged);
+      }
+    }
+    if (out_of_date) {
+      ExplainCommand(precompiled_header_file, std::move(cause));
+      auto command = std::make_unique<DeferredCommand>();
+      command->command = std::move(expanded_command);
+      command->source_file = header_file;
+      command->destination_file = precompiled_header_file;
+      command->package_id = metadata.package_id;
+      command->command_hash = std::move(command_hash);
+      precompiled_header.command =
+          QueueCommand(Stage::Compile, std::move(command));
+    }
+
+    for (auto* source_file : source_files_with_command) {
+      source_file->precompiled_header = &precompiled_header;
+      // Objects must be built against the precompiled header they're used
+      // with.
+      if (precompiled_header.command != nullptr) {
+        source_file->is_out_of_date = true;
+        SetRebuildCause(source_file->rebuild_cause,
+                        RebuildReason::InputRebuilt, precompiled_header_file);
+      }
+    }
+  }
+}
+
+// Parses a package's build commands, keyed by file extension, with everything
+// but the source and object files filled in. `constants` are the placeholders
+// specific to the package.
+std::map<std::string, CommandTemplate> ParseBuildCommands(
+    const PackageMetadata& metadata,
+    const std::map<std::string, std::string>& constants) {
+  std::map<std::string, CommandTemplate> build_commands;
+  for (const auto& [extension, command] :
+       metadata.build_commands_by_file_extension) {
+    if (UsesPositionIndependentCode(metadata) &&
+        IsCSourceExtension(extension)) {
+      build_commands.emplace(
+          extension,
+          CommandTemplate(
+              command + " " + metadata.position_independent_code_argument,
+              {"in", "out"}, constants));
+    } else {
+      build_commands.emplace(extension,
+                             CommandTemplate(command, {"in", "out"}, constants));
+    }
+  }
+  return build_commands;
+}
+
+// Returns the build command of a source file with its placeholders replaced.
+std::string ExpandBuildCommand(const SourceFileToBuild& source_file) {
+  return source_file.build_command->Expand(
+      {source_file.source_file.native(), source_file.object_file});
+}
+
+// Returns the hash of the parts of a source file's build command that come
+// from the config. The precompiled header and the module interfaces that are
+// added to it are left out, because whether they're used depends on what else
+// is being rebuilt.
+std::string HashBuildCommand(const PackageMetadata& metadata,
+                             const SourceFileToBuild& source_file) {
+  Hasher hasher;
+  hasher.AddString(ExpandBuildCommand(source_file));
+  if (!source_file.debug_info_file.empty())
+    hasher.AddString(metadata.split_debug_info_argument);
+  if (metadata.precompiled_header)
+    hasher.AddString(metadata.precompiled_header_argument);
+  if (metadata.modules) {
+    hasher.AddString(metadata.module_scan_command);
+    hasher.AddString(metadata.module_output_argument);
+    hasher.AddString(metadata.module_file_argument);
+  }
+  return hasher.Finish();
+}
+
+// Sorts source files so that the source files providing a module come before
+// the source files in the same package that import it, because commands must
+// be queued after the commands they depend on. Returns false if the modules
+// import each other in a cycle.
+bool SortByModuleDependencies(std::vector<SourceFileToBuild>& source_files) {
+  std::map<std::string, size_t> providers_by_module;
+  for (size_t index = 0; index < source_files.size(); index++) {
+    for (const auto& module : source_files[index].provided_modules)
+      providers_by_module[module] = index;
+  }
+
+  std::vector<size_t> remaining_imports(source_files.size(), 0);
+  std::vector<std::vector<size_t>> importers(source_files.size());
+  for (size_t index = 0; index < source_files.size(); index++) {
+    for (const auto& module : source_files[index].imported_modules) {
+      auto itr = providers_by_module.find(module);
+      if (itr == providers_by_module.end() || itr->second == index) continue;
+      importers[itr->second].push_back(index);
+      remaining_imports[index]++;
+    }
+  }
+
+  std::queue<size_t> ready;
+  for (size_t index = 0; index < source_files.size(); index++)
+    if (remaining_imports[index] == 0) ready.push(index);
+  std::vector<size_t> order;
+  while (!ready.empty()) {
+    size_t index = ready.front();
+    ready.pop();
+    order.push_back(index);
+    for (size_t importer : importers[index])
+      if (--remaining_imports[importer] == 0) ready.push(importer);
+  }
+  if (order.size() != source_files.size()) {
+    for (size_t index = 0; index < source_files.size(); index++) {
+      if (remaining_imports[index] == 0) continue;
+      std::cerr << "The modules imported by " << source_files[index].source_file
+                << " import each other in a cycle." << std::endl;
+      break;
+    }
+    return false;
+  }
+
+  std::vector<SourceFileToBuild> sorted_source_files;
+  sorted_source_files.reserve(source_files.size());
+  for (size_t index : order)
+    sorted_source_files.push_back(std::move(source_files[index]));
+  source_files = std::move(sorted_source_files);
+  return true;
+}
+
+// Scans a package's C++ source files for the named modules they provide and
+// import, and registers the modules they provide. Source files are only
+// scanned again when they may have changed, otherwise the scan from the last
+// build is used. Returns false if the source files couldn't be scanned, or
+// their modules can't be built.
+bool ScanForModules(const PackageMetadata& metadata,
+                    std::vector<SourceFileToBuild>& source_files) {
+  std::vector<ModuleScan> scans;
+  std::vector<SourceFileToBuild*> scanned_source_files;
+  for (auto& source_file : source_files) {
+    if (std::find(std::begin(kModuleSourceExtensions),
+                  std::end(kModuleSourceExtensions),
+                  source_file.source_file.extension()) ==
+        std::end(kModuleSourceExtensions)) {
+      continue;
+    }
+    std::string scan_file = source_file.object_file + ".ddi";
+    uint64_t scan_timestamp = GetTimestampOfFile(scan_file);
+    ModuleScan& scan = scans.emplace_back();
+    scan.scan_file = scan_file;
+    // The build command's hash includes the scan command, so the source file
+    // is out of date if either changed.
+    scan.should_scan =
+        source_file.is_out_of_date || scan_timestamp == 0 ||
+        scan_timestamp < GetTimestampOfFile(source_file.source_file);
+    SetPlaceholder("command", ExpandBuildCommand(source_file));
+    SetPlaceholder("out",
+                   (std::stringstream() << std::quoted(scan_file)).str());
+    scan.command = metadata.module_scan_command;
+    ReplacePlaceholdersInString(scan.command);
+    // The scanner writes its own dependency file, which isn't needed.
+    ReplaceSubstringInString(
+        scan.command, "${deps file}",
+        (std::stringstream() << std::quoted(scan_file + ".d")).str());
+    if (scan.should_scan) EnsureOutputDirectoryExists(scan_file);
+    scanned_source_files.push_back(&source_file);
+  }
+
+  uint64_t scan_start_time = GetTraceTime();
+  std::vector<ModuleDependencies> dependencies;
+  bool successful = ScanModuleDependencies(scans, dependencies);
+  RecordTraceSpan("Scan for modules", "modules", scan_start_time,
+                  {{"package", GetPackagePathFromID(metadata.package_id)}});
+  if (!successful) return false;
+
+  std::filesystem::path modules_directory =
+      metadata.temp_directory / kObjectsSubDirectory / kModulesSubDirectory;
+  for (size_t index = 0; index < scanned_source_files.size(); index++) {
+    SourceFileToBuild& source_file = *scanned_source_files[index];
+    source_file.provided_modules =
+        std::move(dependencies[index].provided_modules);
+    source_file.imported_modules =
+        std::move(dependencies[index].imported_modules);
+    for (const auto& module : source_file.provided_modules) {
+      auto [itr, added] = module_interfaces_by_name.insert({module, {}});
+      if (!added) {
+        std::cerr << "The module " << std::quoted(module)
+                  << " is provided by both " << itr->second.source_file
+                  << " and " << source_file.source_file << "." << std::endl;
+        return false;
+      }
+      // Partitions are named "module:partition".
+      std::string bmi_filename = module;
+      std::replace(bmi_filename.begin(), bmi_filename.end(), ':', '-');
+      itr->second = {.source_file = source_file.source_file,
+                     .bmi_file = modules_directory / (bmi_filename + ".pcm"),
+                     .imported_modules = source_file.imported_modules};
+      EnsureDirectoriesAndParentsExist(modules_directory);
+      if (!DoesFileExist(itr->second.bmi_file)) {
+        source_file.is_out_of_date = true;
+        SetRebuildCause(source_file.rebuild_cause,
+                        RebuildReason::MissingOutput, itr->second.bmi_file);
+      }
+    }
+  }
+
+  for (const auto* source_file : scanned_source_files) {
+    for (const auto& module : source_file->imported_modules) {
+      if (module_interfaces_by_name.contains(module)) continue;
+      std::cerr << source_file->source_file << " imports the module "
+                << std::quoted(module)
+                << ", which isn't provided by its package or the packages it "
+                   "depends on."
+                << std::endl;
+      return false;
+    }
+  }
+  return SortByModuleDependencies(source_files);
+}
+
+// Adds a module and the modules it imports, recursively, to `modules`, because
+// a source file needs the interfaces of every module it imports indirectly.
+void AddImportedModules(const std::string& module,
+                        std::set<std::string>& modules) {
+  if (!modules.insert(module).second) return;
+  for (const auto& imported_module :
+       module_interfaces_by_name[module].imported_modules)
+    AddImportedModules(imported_module, modules);
+}
+
+// Adds the arguments for the modules that a source file provides and imports to
+// its compile command, and makes it depend on the commands compiling the
+// modules it imports during this run.
+void AddModulesToCommand(const PackageMetadata& metadata,
+                         const SourceFileToBuild& source_file,
+                         const std::set<std::string>& imported_modules,
+                         DeferredCommand& command) {
+  auto add_argument = [&command](const std::string& argument_template,
+                                 const ModuleInterface& interface) {
+    std::string argument = argument_template;
+    SetPlaceholder("bmi", (std::stringstream()
+                           << std::quoted(interface.bmi_file.c_str()))
+                              .str());
+    ReplacePlaceholdersInString(argument);
+    command.command += " " + argument;
+  };
+  for (const auto& module : source_file.provided_modules) {
+    SetPlaceholder("module", module);
+    add_argument(metadata.module_output_argument,
+                 module_interfaces_by_name[module]);
+  }
+  for (const auto& module : imported_modules) {
+    const ModuleInterface& interface = module_interfaces_by_name[module];
+    SetPlaceholder("module", module);
+    add_argument(metadata.module_file_argument, interface);
+    if (interface.command != nullptr)
+      command.dependencies.push_back(interface.command);
+  }
+  if (!source_file.provided_modules.empty() || !imported_modules.empty())
+    command.cacheable = false;
+}
+
+// Splits the debug info of the C and C++ source files into a .dwo file beside
+// each object file, which compilers name after the object file. Source files
+// are out of date if their .dwo file is missing.
+void UseSplitDebugInfo(std::vector<SourceFileToBuild>& source_files) {
+  for (auto& source_file : source_files) {
+    if (!IsCSourceExtension(source_file.source_file.extension().string()))
+      continue;
+    std::string_view object_file = source_file.object_file;
+    if (object_file.ends_with(".o")) object_file.remove_suffix(2);
+    source_file.debug_info_file = std::string(object_file) + ".dwo";
+    if (!DoesFileExist(source_file.debug_info_file)) {
+      source_file.is_out_of_date = true;
+      SetRebuildCause(source_file.rebuild_cause, RebuildReason::MissingOutput,
+                      source_file.debug_info_file);
+    }
+  }
+}
+
+// Returns the path of the package of an application's split debug info.
+std::filesystem::path GetDebugInfoPackagePath(const PackageMetadata& metadata) {
+  return metadata.output_path.string() + ".dwp";
+}
+
+// Returns whether an application's split debug info is packaged after it's
+// linked.
+bool ShouldPackageDebugInfo(const PackageMetadata& metadata) {
+  return metadata.IsApplication() && metadata.split_debug_info &&
+         !metadata.debug_info_package_command.empty();
+}
+
+// Queues the command that packages an application's split debug info beside
+// it. If `link_command` isn't null, it runs after the application is linked,
+// and is skipped if the application didn't change and is already packaged.
+void QueueDebugInfoPackage(const PackageMetadata& metadata,
+                           DeferredCommand* link_command) {
+  std::filesystem::path debug_info_package = GetDebugInfoPackagePath(metadata);
   auto command = std::make_unique<DeferredCommand>();
-  command->command =
-      (std::stringstream() << "cp " << std::quoted(source.c_str()) << " "
-                           << std::quoted(destination.c_str()))
-          .str();
-  QueueCommand(Stage::CopyAssets, std::move(command));
+  command->command = metadata.debug_info_package_command;
+  SetPlaceholder(
+      "in", (std::stringstream() << std::quoted(metadata.output_path.c_str()))
+                .str());
+  SetPlaceholder(
+      "out",
+      (std::stringstream() << std::quoted(debug_info_package.c_str())).str());
+  ReplacePlaceholdersInString(command->command);
+  command->destination_file = debug_info_package;
+  command->package_id = metadata.package_id;
+  // It reads the .dwo files, which the object cache doesn't know about.
+  command->cacheable = false;
+  if (link_command != nullptr) {
+    command->dependencies = {link_command};
+    command->skip_if_dependencies_unchanged =
+        DoesFileExist(debug_info_package);
+  }
+  QueueCommand(Stage::LinkApplication, std::move(command));
+}
+
+// The placeholders, build commands and source files of a package.
+struct PackageSources {
+  std::map<std::string, std::string> placeholders;
+  // Pointed to by the source files.
+  std::map<std::string, CommandTemplate> build_commands;
+  std::vector<SourceFileToBuild> source_files;
+};
+
+// The sources of the packages that will be built during this run, found ahead
+// of time in parallel. Taken by each package as it's built.
+std::map<std::string, std::unique_ptr<PackageSources>> sources_by_package_name;
 
-  SetTimestampOfFileToNow(destination);
+// Finds the source files of a package, and which of them are out of date.
+// Doesn't set any placeholders, so it's thread safe, as long as each package is
+// only found by one thread at a time.
+std::unique_ptr<PackageSources> FindSourcesOfPackage(
+    const std::string& package_name, const PackageMetadata& metadata) {
+  auto sources = std::make_unique<PackageSources>();
+  sources->placeholders = {
+      {"package name", package_name},
+      {"cdefines", UseResponseFileIfLong(BuildCDefines(metadata))},
+      {"cincludes", UseResponseFileIfLong(BuildCIncludes(metadata))},
+      {"lto cache directory",
+       (std::stringstream() << std::quoted(
+            (metadata.temp_directory / kLtoCacheSubDirectory).c_str()))
+           .str()}};
+  sources->build_commands = ParseBuildCommands(metadata, sources->placeholders);
+
+  const auto& build_commands = sources->build_commands;
+  auto& source_files = sources->source_files;
+  ForEachSourceFile(metadata, [&metadata, &build_commands, &source_files](
+                                  const std::filesystem::path& source_file,
+                                  const std::filesystem::path&
+                                      destination_file) {
+    auto build_command_itr = build_commands.find(source_file.extension());
+    if (build_command_itr == build_commands.end()) return;
+
+    if (metadata.files_to_ignore.find(source_file) !=
+        metadata.files_to_ignore.end()) {
+      return;
+    }
+
+    source_files.push_back(
+        {.source_file = source_file,
+         .object_file = std::string(destination_file) + ".o",
+         .build_command = &build_command_itr->second});
+  });
+  // Module interface units can't be batched.
+  if (metadata.unity_build && !metadata.modules)
+    UseUnityBatches(metadata, source_files);
+  if (metadata.split_debug_info) UseSplitDebugInfo(source_files);
+
+  // Check which object files are out of date in one batch, which looks up
+  // the timestamps of every header they depend on in parallel.
+  uint64_t check_start_time = GetTraceTime();
+  std::vector<std::filesystem::path> object_files;
+  object_files.reserve(source_files.size());
+  for (const auto& source_file : source_files)
+    object_files.push_back(source_file.object_file);
+  std::vector<RebuildCause> causes;
+  std::vector<bool> out_of_date = AreDependenciesNewerThanFiles(
+      metadata.package_id, object_files, ShouldExplain() ? &causes : nullptr);
+  for (size_t index = 0; index < source_files.size(); index++) {
+    SourceFileToBuild& source_file = source_files[index];
+    // Objects are rebuilt when their build command changes, rather than
+    // whenever a config that may have changed it is touched.
+    source_file.command_hash = HashBuildCommand(metadata, source_file);
+    if (out_of_date[index]) {
+      source_file.is_out_of_date = true;
+      if (!causes.empty()) {
+        SetRebuildCause(source_file.rebuild_cause, causes[index].reason,
+                        causes[index].file);
+      }
+    } else if (!source_file.is_out_of_date &&
+               HasCommandChanged(metadata.package_id, source_file.object_file,
+                                 source_file.command_hash)) {
+      source_file.is_out_of_date = true;
+      SetRebuildCause(source_file.rebuild_cause,
+                      RebuildReason::CommandChanged);
+    }
+  }
+  RecordTraceSpan("Check up to date", "dependencies", check_start_time,
+                  {{"package", package_name}});
+  return sources;
 }
 
-void CopyAssetFilesForPackage(PackageMetadata& metadata) {
-  ForEachAssetFile(metadata, CopyAssetIfNewer);
+// Finds the sources of the packages that will be built in parallel, because
+// the packages must be queued one at a time, after what they depend on.
+void FindSourcesOfPackages(const std::vector<std::string>& package_names) {
+  std::vector<std::pair<std::string, const PackageMetadata*>> packages_to_find;
+  std::set<std::string> encountered_packages;
+  std::vector<std::string> packages_to_visit(package_names.begin(),
+                                             package_names.end());
+  while (!packages_to_visit.empty()) {
+    std::string package_name = std::move(packages_to_visit.back());
+    packages_to_visit.pop_back();
+    if (!encountered_packages.insert(package_name).second) continue;
+
+    const PackageMetadata* metadata = GetMetadataForPackage(package_name);
+    if (metadata == nullptr) continue;
+    // The same dependencies as BuildPackage builds.
+    if (metadata->IsApplication() || metadata->modules) {
+      for (const auto& dependency : metadata->consolidated_dependencies)
+        packages_to_visit.push_back(dependency);
+    }
+    if (!metadata->no_output_file)
+      packages_to_find.push_back({package_name, metadata});
+  }
+
+  ScopedTraceSpan span("Find sources", "packages");
+  std::vector<std::unique_ptr<PackageSources>> sources(packages_to_find.size());
+  ParallelFor(packages_to_find.size(), [&](size_t index) {
+    sources[index] = FindSourcesOfPackage(packages_to_find[index].first,
+                                          *packages_to_find[index].second);
+  });
+  for (size_t index = 0; index < packages_to_find.size(); index++) {
+    sources_by_package_name[packages_to_find[index].first] =
+        std::move(sources[index]);
+  }
 }
 
 // Builds a package, and returns if it was successful.
@@ -159,8 +1184,9 @@ bool BuildPackage(const std::string& package_name) {
     return false;
   }
 
-  // Applications should build dependent libraries first.
-  if (metadata->IsApplication()) {
+  // Applications should build dependent libraries first, as should packages
+  // that may import modules from them.
+  if (metadata->IsApplication() || metadata->modules) {
     for (const auto& dependency : metadata->consolidated_dependencies)
       if (!BuildPackage(dependency)) return false;
   }
@@ -170,147 +1196,324 @@ bool BuildPackage(const std::string& package_name) {
 
   if (!metadata->no_output_file) {
     std::vector<std::filesystem::path> object_files_to_link;
+    // The queued commands that compile this package's object files.
+    std::vector<DeferredCommand*> compile_commands;
 
-    SetPlaceholder("package name", std::string(package_name));
-    SetPlaceholder("cdefines", BuildCDefines(*metadata));
-    SetPlaceholder("cincludes", BuildCIncludes(*metadata));
+    // The sources may have already been found, along with every other
+    // package's, in parallel.
+    std::unique_ptr<PackageSources> sources;
+    auto sources_itr = sources_by_package_name.find(package_name);
+    if (sources_itr != sources_by_package_name.end()) {
+      sources = std::move(sources_itr->second);
+    } else {
+      sources = FindSourcesOfPackage(package_name, *metadata);
+    }
+    for (const auto& [placeholder, value] : sources->placeholders)
+      SetPlaceholder(placeholder, value);
+    std::vector<SourceFileToBuild>& source_files = sources->source_files;
 
     bool requires_linking = false;
+    // Why the package needs to be linked, if explaining.
+    RebuildCause link_cause;
 
-    ForEachSourceFile(
-        *metadata, [metadata, &object_files_to_link, &requires_linking](
-                       const std::filesystem::path& source_file,
-                       const std::filesystem::path& destination_file) {
-          auto build_command_itr =
-              metadata->build_commands_by_file_extension.find(
-                  source_file.extension());
-          if (build_command_itr ==
-              metadata->build_commands_by_file_extension.end())
-            return;
-
-          if (metadata->files_to_ignore.find(source_file) !=
-              metadata->files_to_ignore.end()) {
-            return;
-          }
-
-          auto object_file = std::string(destination_file) + ".o";
-
-          object_files_to_link.push_back(object_file);
-
-          if (!AreDependenciesNewerThanFile(metadata->package_id,
-                                            metadata->metadata_timestamp,
-                                            object_file)) {
-            return;
-          }
-
-          // if (source_file.extension)
-          auto command = std::make_unique<DeferredCommand>();
-          command->command = build_command_itr->second;
-          SetPlaceholder(
-              "out",
-              (std::stringstream() << std::quoted(object_file.c_str())).str());
-          SetPlaceholder(
-              "in",
-              (std::stringstream() << std::quoted(source_file.c_str())).str());
-          ReplacePlaceholdersInString(command->command);
-          command->source_file = source_file;
-          command->destination_file = object_file;
-          command->package_id = metadata->package_id;
+    if (metadata->modules && !ScanForModules(*metadata, source_files))
+      return false;
+
+    // Pointed to by the source files that use them.
+    std::deque<PrecompiledHeader> precompiled_headers;
+    if (metadata->precompiled_header)
+      UsePrecompiledHeaders(*metadata, source_files, precompiled_headers);
+
+    for (auto& source_file : source_files) {
+      object_files_to_link.push_back(source_file.object_file);
+      std::set<std::string> imported_modules;
+      for (const auto& module : source_file.imported_modules)
+        AddImportedModules(module, imported_modules);
+      // Source files must be built against the interfaces of the modules they
+      // import.
+      for (const auto& module : imported_modules) {
+        const ModuleInterface& module_interface =
+            module_interfaces_by_name[module];
+        if (module_interface.command != nullptr) {
+          source_file.is_out_of_date = true;
+          SetRebuildCause(source_file.rebuild_cause,
+                          RebuildReason::InputRebuilt,
+                          module_interface.bmi_file);
+        }
+      }
+      if (!source_file.is_out_of_date) {
+        RecordUpToDateCommands(Stage::Compile);
+        continue;
+      }
+
+      EnsureOutputDirectoryExists(source_file.object_file);
+      auto command = std::make_unique<DeferredCommand>();
+      command->command = ExpandBuildCommand(source_file);
+      command->source_file = source_file.source_file;
+      command->destination_file = source_file.object_file;
+      command->package_id = metadata->package_id;
+      command->compare_output = true;
+      command->command_hash = source_file.command_hash;
+      if (source_file.precompiled_header != nullptr) {
+        command->command += source_file.precompiled_header->argument;
+        if (source_file.precompiled_header->command != nullptr) {
+          command->dependencies.push_back(
+              source_file.precompiled_header->command);
+        }
+      }
+      if (!source_file.debug_info_file.empty()) {
+        command->command += " " + metadata->split_debug_info_argument;
+        // The .dwo file isn't stored in the object cache.
+        command->cacheable = false;
+      }
+      AddModulesToCommand(*metadata, source_file, imported_modules, *command);
+      ExplainCommand(source_file.object_file,
+                     std::move(source_file.rebuild_cause));
+      DeferredCommand* compile_command =
           QueueCommand(Stage::Compile, std::move(command));
-          requires_linking = true;
-        });
+      compile_commands.push_back(compile_command);
+      for (const auto& module : source_file.provided_modules)
+        module_interfaces_by_name[module].command = compile_command;
+      requires_linking = true;
+      SetRebuildCause(link_cause, RebuildReason::InputRebuilt,
+                      source_file.object_file);
+    }
 
-    size_t object_file_timestamp = 0;
-    if (DoesFileExist(metadata->output_path) && !requires_linking) {
-      object_file_timestamp = GetTimestampOfFile(metadata->output_path);
-    } else {
+    // Whether the only reason to link is that files being linked are rebuilt
+    // during this run, in which case the links are skipped if none of those
+    // files change.
+    bool only_linking_rebuilt_files = true;
+
+    size_t object_file_timestamp = GetTimestampOfFile(metadata->output_path);
+    if (object_file_timestamp == 0) {
       requires_linking = true;
+      only_linking_rebuilt_files = false;
+      SetRebuildCause(link_cause, RebuildReason::MissingOutput);
+    }
+
+    std::filesystem::path shared_library_path;
+    if (metadata->IsLibrary()) {
+      shared_library_path = GetSharedLibraryPath(package_name);
+      // Either variant doesn't exist and needs to be created. Only the shared
+      // library is linked in dev mode.
+      if (!DoesFileExist(shared_library_path) ||
+          (!IsDevMode() &&
+           !DoesFileExist(metadata->statically_linked_library_output_path))) {
+        requires_linking = true;
+        only_linking_rebuilt_files = false;
+        SetRebuildCause(link_cause, RebuildReason::MissingOutput);
+      }
     }
 
     for (const auto& library_object :
          metadata->statically_linked_library_objects) {
       object_files_to_link.push_back(library_object);
-      if (!requires_linking) {
-        size_t library_timestamp = GetTimestampOfFile(library_object);
-        if (library_timestamp == 0 ||
-            library_timestamp > metadata->metadata_timestamp ||
-            library_timestamp > object_file_timestamp) {
+      size_t library_timestamp = GetTimestampOfFile(library_object);
+      if (library_timestamp == 0 || library_timestamp > object_file_timestamp) {
+        requires_linking = true;
+        bool is_rebuilt = commands_by_output_file.contains(library_object);
+        if (!is_rebuilt) only_linking_rebuilt_files = false;
+        SetRebuildCause(link_cause,
+                        is_rebuilt               ? RebuildReason::InputRebuilt
+                        : library_timestamp == 0 ? RebuildReason::MissingDependency
+                                                 : RebuildReason::NewerDependency,
+                        library_object);
+      }
+    }
+
+    // In dev mode, applications link against the shared libraries, and are
+    // only relinked when the symbols they export change.
+    if (metadata->IsApplication() && IsDevMode()) {
+      for (const auto& library : metadata->dynamically_linked_libaries) {
+        std::filesystem::path library_path = GetSharedLibraryPath(library);
+        object_files_to_link.push_back(library_path);
+        size_t symbols_timestamp =
+            GetTimestampOfFile(GetExportedSymbolsPath(library_path));
+        if (symbols_timestamp == 0 ||
+            symbols_timestamp > object_file_timestamp) {
+          requires_linking = true;
+          only_linking_rebuilt_files = false;
+          SetRebuildCause(link_cause,
+                          symbols_timestamp == 0
+                              ? RebuildReason::MissingDependency
+                              : RebuildReason::NewerDependency,
+                          GetExportedSymbolsPath(library_path));
+        } else if (commands_by_output_file.contains(library_path)) {
           requires_linking = true;
+          SetRebuildCause(link_cause, RebuildReason::InputRebuilt,
+                          library_path);
         }
       }
     }
 
-    std::filesystem::path shared_library_path;
-    if (metadata->IsLibrary())
-      shared_library_path = GetDynamicLibraryDirectoryPath() /
-                            (std::string("lib") + package_name + ".so");
-    if (!requires_linking && !shared_library_path.empty() &&
-        !DoesFileExist(shared_library_path)) {
-      // The  shared variant does not exists and needs to be created.
+    // The link commands are expanded ahead of time, so that the outputs are
+    // relinked if their commands changed since they were last linked. The
+    // first links an application or a library's shared library, and the
+    // second links a library's static library.
+    std::string input_files = UseResponseFileIfLong(
+        BuildStringOfFilesFromVectorOfFiles(object_files_to_link));
+    SetPlaceholder("in", input_files);
+    std::string link_command_str;
+    std::string static_link_command_str;
+    if (metadata->IsApplication()) {
+      link_command_str = metadata->statically_link && !IsDevMode()
+                             ? metadata->static_linker_command
+                             : metadata->linker_command;
+      SetPlaceholder("out", (std::stringstream()
+                             << std::quoted(metadata->output_path.c_str()))
+                                .str());
+      if (IsDevMode()) {
+        // The shared libraries are linked by their paths in ${in}.
+        SetPlaceholder("shared_libraries", "");
+      } else if (!metadata->dynamically_linked_libaries.empty()) {
+        SetPlaceholder("shared_libraries",
+                       BuildStringOfStringsFromVectorOfStringAndPrefix(
+                           "-l ", metadata->dynamically_linked_libaries));
+      }
+      ReplacePlaceholdersInString(link_command_str);
+    } else if (metadata->IsLibrary()) {
+      link_command_str = IsDevMode() ? metadata->shared_library_linker_command
+                                     : metadata->linker_command;
+      SetPlaceholder("out", (std::stringstream()
+                             << std::quoted(shared_library_path.c_str()))
+                                .str());
+      ReplacePlaceholdersInString(link_command_str);
+      if (!IsDevMode()) {
+        static_link_command_str = metadata->static_linker_command;
+        SetPlaceholder(
+            "out",
+            (std::stringstream() << std::quoted(
+                 metadata->statically_linked_library_output_path.c_str()))
+                .str());
+        ReplacePlaceholdersInString(static_link_command_str);
+      }
+    }
+    std::string link_command_hash = HashString(link_command_str);
+    std::string static_link_command_hash = HashString(static_link_command_str);
+    auto has_link_command_changed = [&](const std::filesystem::path& output,
+                                        const std::string& command_str,
+                                        const std::string& command_hash) {
+      return !command_str.empty() &&
+             HasCommandChanged(metadata->package_id, output.string(),
+                               command_hash);
+    };
+    if (has_link_command_changed(metadata->IsLibrary()
+                                     ? shared_library_path
+                                     : metadata->output_path,
+                                 link_command_str, link_command_hash) ||
+        has_link_command_changed(
+            metadata->statically_linked_library_output_path,
+            static_link_command_str, static_link_command_hash)) {
       requires_linking = true;
+      only_linking_rebuilt_files = false;
+      SetRebuildCause(link_cause, RebuildReason::CommandChanged);
     }
 
-    if (requires_linking) {
-      std::string input_files =
-          BuildStringOfFilesFromVectorOfFiles(object_files_to_link);
-      SetPlaceholder("in", input_files);
-
+    if (!requires_linking) {
+      // Libraries are linked both dynamically and statically, except in dev
+      // mode.
+      int up_to_date_links = metadata->IsLibrary() && !IsDevMode() ? 2 : 1;
+      if (ShouldPackageDebugInfo(*metadata)) {
+        if (DoesFileExist(GetDebugInfoPackagePath(*metadata))) {
+          up_to_date_links++;
+        } else {
+          QueueDebugInfoPackage(*metadata, /*link_command=*/nullptr);
+        }
+      }
+      RecordUpToDateCommands(GetLinkerStage(*metadata), up_to_date_links);
+    } else {
       if (metadata->IsApplication()) {
         SetTimestampOfFileToNow(metadata->output_path);
         auto command = std::make_unique<DeferredCommand>();
-        command->command = metadata->statically_link
-                               ? metadata->static_linker_command
-                               : metadata->linker_command;
-        SetPlaceholder("out", (std::stringstream()
-                               << std::quoted(metadata->output_path.c_str()))
-                                  .str());
-        if (!metadata->dynamically_linked_libaries.empty()) {
-          SetPlaceholder("shared_libraries",
-                         BuildStringOfStringsFromVectorOfStringAndPrefix(
-                             "-l ", metadata->dynamically_linked_libaries));
-        }
-        ReplacePlaceholdersInString(command->command);
+        command->command = std::move(link_command_str);
+        command->command_hash = std::move(link_command_hash);
         command->destination_file = metadata->output_path;
+        command->input_files = object_files_to_link;
         command->package_id = metadata->package_id;
+        command->dependencies = compile_commands;
+        command->skip_if_dependencies_unchanged = only_linking_rebuilt_files;
+        for (const auto& library_object :
+             metadata->statically_linked_library_objects)
+          AddDependencyOnCommandProducingFile(*command, library_object);
+        for (const auto& library : metadata->dynamically_linked_libaries) {
+          AddDependencyOnCommandProducingFile(*command,
+                                              GetSharedLibraryPath(library));
+        }
 
-        QueueCommand(GetLinkerStage(*metadata), std::move(command));
+        ExplainCommand(metadata->output_path, link_cause);
+        DeferredCommand* link_command =
+            QueueCommand(GetLinkerStage(*metadata), std::move(command));
+        commands_by_output_file[metadata->output_path] = link_command;
+        if (ShouldPackageDebugInfo(*metadata))
+          QueueDebugInfoPackage(*metadata, link_command);
       } else if (metadata->IsLibrary()) {
         // Dynamically link.
         SetTimestampOfFileToNow(shared_library_path);
         auto command = std::make_unique<DeferredCommand>();
-        command->command = metadata->linker_command;
-        SetPlaceholder("out", (std::stringstream()
-                               << std::quoted(shared_library_path.c_str()))
-                                  .str());
-        ReplacePlaceholdersInString(command->command);
+        command->command = std::move(link_command_str);
+        command->command_hash = std::move(link_command_hash);
         command->destination_file = shared_library_path;
+        command->input_files = object_files_to_link;
         command->package_id = metadata->package_id;
-        QueueCommand(GetLinkerStage(*metadata), std::move(command));
+        command->dependencies = compile_commands;
+        // In dev mode, the applications linking against the shared library
+        // only care if its exported symbols changed.
+        if (IsDevMode()) {
+          command->compare_exported_symbols = true;
+        } else {
+          command->compare_output = true;
+        }
+        command->skip_if_dependencies_unchanged = only_linking_rebuilt_files;
+        ExplainCommand(shared_library_path, link_cause);
+        DeferredCommand* shared_library_command =
+            QueueCommand(GetLinkerStage(*metadata), std::move(command));
+        commands_by_output_file[shared_library_path] = shared_library_command;
 
         // Copy the file to the destination directory.
-        SetTimestampOfFileToNow(metadata->output_filename);
+        SetTimestampOfFileToNow(metadata->output_path);
         command = std::make_unique<DeferredCommand>();
         command->command =
-            (std::stringstream() << "cp " << std::quoted(shared_library_path.c_str()) << " "
-                                 << std::quoted(metadata->output_filename.c_str()))
+            (std::stringstream() << "Copy " << std::quoted(shared_library_path.c_str()) << " to "
+                                 << std::quoted(metadata->output_path.c_str()))
                 .str();
-        command->destination_file = metadata->output_filename;
+        command->destination_file = metadata->output_path;
         command->package_id = metadata->package_id;
+        command->cacheable = false;
+        // The library isn't hard linked, because the linker may write to it in
+        // place the next time it's linked.
+        command->action = [asset = AssetToCopy{.source = shared_library_path,
+                                               .destination =
+                                                   metadata->output_path}](
+                              std::stringstream& output) {
+          return CopyAssets({asset}, /*allow_hard_links=*/false, output);
+        };
+        command->dependencies = {shared_library_command};
+        // In dev mode, the shared library may change without its exported
+        // symbols changing.
+        command->skip_if_dependencies_unchanged =
+            only_linking_rebuilt_files && !IsDevMode();
 
         QueueCommand(Stage::CopyAssets, std::move(command));
 
-        // Statically link.
-        SetTimestampOfFileToNow(metadata->statically_linked_library_output_path);
-        command = std::make_unique<DeferredCommand>();
-        command->command = metadata->static_linker_command;
-        SetPlaceholder("out", (std::stringstream()
-                               << std::quoted(metadata->statically_linked_library_output_path.c_str()))
-                                  .str());
-        ReplacePlaceholdersInString(command->command);
-        command->destination_file = metadata->statically_linked_library_output_path;
-        command->package_id = metadata->package_id;
+        // Statically link, unless applications link against the shared
+        // library instead.
+        if (!IsDevMode()) {
+          SetTimestampOfFileToNow(metadata->statically_linked_library_output_path);
+          command = std::make_unique<DeferredCommand>();
+          command->command = std::move(static_link_command_str);
+          command->command_hash = std::move(static_link_command_hash);
+          command->destination_file = metadata->statically_linked_library_output_path;
+          command->input_files = object_files_to_link;
+          command->package_id = metadata->package_id;
+          command->dependencies = compile_commands;
+          command->compare_output = true;
+          command->skip_if_dependencies_unchanged = only_linking_rebuilt_files;
 
-        QueueCommand(GetLinkerStage(*metadata), std::move(command));
+          ExplainCommand(metadata->statically_linked_library_output_path,
+                         link_cause);
+          commands_by_output_file[metadata->statically_linked_library_output_path] =
+              QueueCommand(GetLinkerStage(*metadata), std::move(command));
+        }
       }
     }
   }
@@ -328,15 +1531,47 @@ void InitializePlaceholders() {
   // Prevents ${deps file} from being substituted because it's replaced right
   // before executing with a thread-specific file path.
   SetPlaceholder("deps file", "${deps file}");
+  SetPlaceholder("link threads", std::to_string(GetNumberOfLinkThreads()));
 }
 
 }  // namespace
 
 bool BuildPackages() {
+  // Packages are built again each time they change while watching.
+  packages.clear();
+  commands_by_output_file.clear();
+  module_interfaces_by_name.clear();
+  created_output_directories.clear();
+  sources_by_package_name.clear();
   InitializePlaceholders();
-  bool successful = true;
-  ForEachInputPackage([&successful](const std::string& package_path) {
-    successful &= BuildPackage(GetPackageNameFromPath(package_path));
+  std::vector<std::string> package_names;
+  ForEachInputPackage([&package_names](const std::string& package_path) {
+    package_names.push_back(GetPackageNameFromPath(package_path));
   });
+  LoadMetadataForPackages(package_names);
+  // The tests of the packages are built along with them.
+  if (GetInvocationAction() == InvocationAction::Test) {
+    for (const auto& test : FindTestPackages(package_names)) {
+      if (std::find(package_names.begin(), package_names.end(), test) ==
+          package_names.end())
+        package_names.push_back(test);
+    }
+    LoadMetadataForPackages(package_names);
+  }
+  FindSourcesOfPackages(package_names);
+
+  bool successful = true;
+  for (const auto& package_name : package_names)
+    successful &= BuildPackage(package_name);
   return successful;
 }
+
+DeferredCommand* GetCommandProducingFile(const std::filesystem::path& file) {
+  auto itr = commands_by_output_file.find(file);
+  return itr == commands_by_output_file.end() ? nullptr : itr->second;
+}
+
+std::filesystem::path GetSharedLibraryPath(const std::string& package_name) {
+  return GetDynamicLibraryDirectoryPath() /
+         (std::string("lib") + package_name + ".so");
+}
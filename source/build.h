@@ -14,7 +14,18 @@
 
 #pragma once
 
+#include <filesystem>
 #include <string>
 
-// Builds the packages requested in the input.
+#include "deferred_command.h"
+
+// Builds the packages requested in the input, and their tests if testing.
 bool BuildPackages();
+
+// Returns the command queued during this build that produces `file`, or null
+// if there isn't one.
+DeferredCommand* GetCommandProducingFile(const std::filesystem::path& file);
+
+// Returns the path of the shared library that a library package is linked
+// into.
+std::filesystem::path GetSharedLibraryPath(const std::string& package_name);
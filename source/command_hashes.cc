@@ -0,0 +1,124 @@
+// Copyright 2024 Google LLC
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//      http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+
+#include "command_hashes.h"
+
+#include <stddef.h>
+
+#include <filesystem>
+#include <fstream>
+#include <iostream>
+#include <map>
+#include <mutex>
+#include <set>
+#include <string>
+
+#include "temp_directory.h"
+
+namespace {
+
+// The name of the file that is created in a package's temporary directory that
+// contains the hash of the command that produced each file.
+constexpr char kCommandHashesFile[] = "command_hashes";
+
+// A mapping of Package ID -> {File -> Hash}.
+std::map<size_t, std::map<std::string, std::string>>
+    hashes_per_file_per_package;
+
+// Set of package IDs whose command hashes have changed.
+std::set<size_t> packages_with_invalidated_hashes;
+
+// Guards the hashes above.
+std::mutex hashes_mutex;
+
+std::filesystem::path GetCommandHashesFilePathForPackage(size_t package_id) {
+  return GetTempDirectoryPathForPackageID(package_id) / kCommandHashesFile;
+}
+
+void MaybeLoadCommandHashesForPackage(
+    size_t package_id, std::map<std::string, std::string>& hashes_per_file) {
+  std::ifstream input_file(GetCommandHashesFilePathForPackage(package_id));
+  if (!input_file.is_open()) return;
+
+  std::string file;
+  std::string hash;
+  while (std::getline(input_file, file) && std::getline(input_file, hash))
+    hashes_per_file[file] = hash;
+
+  input_file.close();
+}
+
+// Returns the hashes of a package, loading them if they haven't been loaded.
+// The file is read without holding `lock`, so that packages being scanned in
+// parallel don't wait on each other.
+std::map<std::string, std::string>& GetHashesForPackage(
+    size_t package_id, std::unique_lock<std::mutex>& lock) {
+  auto itr = hashes_per_file_per_package.find(package_id);
+  if (itr != hashes_per_file_per_package.end()) return itr->second;
+
+  lock.unlock();
+  std::map<std::string, std::string> hashes_per_file;
+  MaybeLoadCommandHashesForPackage(package_id, hashes_per_file);
+  lock.lock();
+  // Another thread may have loaded them in the meantime, in which case keep
+  // theirs.
+  return hashes_per_file_per_package
+      .try_emplace(package_id, std::move(hashes_per_file))
+      .first->second;
+}
+
+void WriteCommandHashesForPackage(size_t package_id) {
+  std::ofstream output_file(GetCommandHashesFilePathForPackage(package_id));
+  if (!output_file.is_open()) {
+    std::cerr << "Cannot write to "
+              << GetCommandHashesFilePathForPackage(package_id)
+              << ". Everything in the package will be rebuilt next time."
+              << std::endl;
+    return;
+  }
+
+  for (const auto& [file, hash] : hashes_per_file_per_package[package_id]) {
+    output_file << file << std::endl;
+    output_file << hash << std::endl;
+  }
+
+  output_file.close();
+}
+
+}  // namespace
+
+bool HasCommandChanged(size_t package_id, const std::string& file,
+                       const std::string& hash) {
+  std::unique_lock lock(hashes_mutex);
+  const auto& hashes_per_file = GetHashesForPackage(package_id, lock);
+  auto itr = hashes_per_file.find(file);
+  return itr == hashes_per_file.end() || itr->second != hash;
+}
+
+void SetCommandHash(size_t package_id, const std::string& file,
+                    const std::string& hash) {
+  std::unique_lock lock(hashes_mutex);
+  std::string& recorded_hash = GetHashesForPackage(package_id, lock)[file];
+  if (recorded_hash == hash) return;
+  recorded_hash = hash;
+  packages_with_invalidated_hashes.insert(package_id);
+}
+
+void FlushCommandHashes() {
+  std::scoped_lock lock(hashes_mutex);
+  for (size_t package_id : packages_with_invalidated_hashes)
+    WriteCommandHashesForPackage(package_id);
+  packages_with_invalidated_hashes.clear();
+}
@@ -0,0 +1,37 @@
+// Copyright 2024 Google LLC
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//      http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+
+#pragma once
+
+#include <stddef.h>
+
+#include <string>
+
+// Records a hash of the command that produced each file, keyed by the file, so
+// that a file is only rebuilt when the command that produces it changes, rather
+// than whenever any config it may depend on is touched.
+
+// Returns whether the command producing `file` has a different hash to the
+// last time it successfully ran, or hasn't ran before. Thread safe.
+bool HasCommandChanged(size_t package_id, const std::string& file,
+                       const std::string& hash);
+
+// Records the hash of the command that successfully produced `file`. Thread
+// safe.
+void SetCommandHash(size_t package_id, const std::string& file,
+                    const std::string& hash);
+
+// Flush any changes to the command hashes to disk.
+void FlushCommandHashes();
@@ -14,41 +14,117 @@
 
 #include "command_queue.h"
 
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <condition_variable>
+#include <cstdint>
+#include <filesystem>
 #include <fstream>
+#include <functional>
 #include <iomanip>
 #include <iostream>
 #include <map>
 #include <memory>
 #include <mutex>
+#include <queue>
 #include <sstream>
 #include <string>
-#include <thread>
+#include <string_view>
 #include <vector>
 
+#include "command_hashes.h"
 #include "config.h"
 #include "deferred_command.h"
 #include "dependencies.h"
+#include "diagnostics.h"
+#include "distributed_compile.h"
+#include "durations.h"
 #include "execute.h"
+#include "exported_symbols.h"
+#include "hash.h"
+#include "invocation.h"
+#include "jobserver.h"
+#include "object_cache.h"
+#include "package_id.h"
+#include "remote_cache.h"
 #include "stage.h"
+#include "stats.h"
 #include "string_replace.h"
 #include "temp_directory.h"
 #include "terminal.h"
+#include "trace.h"
+#include "worker_pool.h"
 
 namespace {
 
-// The prefix of the name of the file that is temporarily used by compilers to
-// write the dependencies to.
-constexpr char kDependencyFilePrefix[] = "deps";
+// How often to report the progress of running commands.
+constexpr std::chrono::milliseconds kProgressInterval{100};
 
-// A list of commands, grouped by the stage the command is for.
-std::map<int, std::vector<std::unique_ptr<DeferredCommand>>>
-    deferred_commands_by_stage;
+// How many runnable commands to look past the highest priority one for a
+// command that fits in the available resources.
+constexpr size_t kMaxCommandsToSkip = 64;
 
-// The highest encountered stage, for which there is a queued command.
-int max_stage = 0;
+// A queued command and its place in the command graph.
+struct CommandNode {
+  std::unique_ptr<DeferredCommand> command;
+  Stage stage;
+  // The commands waiting on this command to complete.
+  std::vector<CommandNode*> dependents;
+  // The number of dependencies that have not yet completed.
+  int remaining_dependencies = 0;
+  // The position of this command in the order commands were queued.
+  size_t queue_index;
+  // The estimated time in milliseconds until this command and everything
+  // waiting on it can complete.
+  uint64_t critical_path = 0;
+  // Whether this command has started, which it may do twice if it was not
+  // found in the remote cache.
+  bool started = false;
+  // Whether the object cache has been checked for this command's output.
+  bool checked_object_cache = false;
+  // The key of this command in the object cache, or blank if it can't be
+  // cached.
+  std::string cache_key;
+  // Whether this command should be compiled on this machine rather than on a
+  // remote worker.
+  bool compile_locally = false;
+  // The estimated peak memory usage of this command in kilobytes.
+  uint64_t estimated_memory_usage = 0;
+  // Whether this command is holding resources on this machine.
+  bool holds_resources = false;
+  // The hash of the command's output from before it ran, if it compares its
+  // output.
+  std::string previous_output_hash;
+  // Whether the command changed its output. Assumed unless it compares its
+  // output.
+  bool output_changed = true;
+  // Whether any of the commands this command depends on changed their output.
+  bool dependencies_changed = false;
+};
+
+// The resources used by the commands running on this machine.
+struct ResourceUsage {
+  int running_commands = 0;
+  int running_links = 0;
+  // The parallel tasks that the running commands count as.
+  int used_tasks = 0;
+  // The tokens taken from the jobserver, one for each running command other
+  // than the first.
+  int job_tokens = 0;
+  // In kilobytes.
+  uint64_t reserved_memory = 0;
+};
+
+// The commands in the command graph, in the order they were queued.
+std::vector<std::unique_ptr<CommandNode>> command_nodes;
+
+// Lookup of the node in the command graph for each queued command.
+std::map<DeferredCommand*, CommandNode*> command_nodes_by_command;
+
+// Commands to run after everything else has been built.
+std::vector<std::unique_ptr<DeferredCommand>> run_commands;
 
-//
-int queued_commands_count = 0;
 bool needs_newline = true;
 
 // Run the commands sequentually, with no piping of the input/output.
@@ -61,144 +137,692 @@ void RunCommands(
   for (const auto& command : commands) std::system(command->command.c_str());
 }
 
-std::string GetTempDependencyFilePath(int thread_id) {
-  return GetTempDirectoryPath() /
-         (std::string(kDependencyFilePrefix) + std::to_string(thread_id));
+// Returns whether the output of a command in the command graph may be in the
+// object cache.
+bool IsCacheable(const CommandNode& node) {
+  return IsObjectCacheEnabled() && node.command->cacheable &&
+         (node.stage == Stage::Compile || node.stage == Stage::LinkLibrary ||
+          node.stage == Stage::LinkApplication);
 }
 
-bool ExecuteStage(Stage stage,
-                  const std::vector<std::unique_ptr<DeferredCommand>>& commands,
-                  int& current_command_number,
-                  std::stringstream& combined_output) {
-  if (stage == Stage::Run) {
-    RunCommands(commands);
+// Returns whether a command in the command graph is a link.
+bool IsLink(const CommandNode& node) {
+  return node.stage == Stage::LinkLibrary ||
+         node.stage == Stage::LinkApplication;
+}
+
+// Returns how many of the parallel tasks a command counts as, because links may
+// use several threads.
+int GetTasksUsedByCommand(const CommandNode& node) {
+  return IsLink(node) ? GetNumberOfLinkThreads() : 1;
+}
+
+// Returns whether a command can start on this machine without exceeding the
+// configured resource limits. A command can always start if nothing else is
+// running, even if it's expected to exceed the memory budget on its own.
+bool CanStartCommand(const ResourceUsage& usage, const CommandNode& node) {
+  if (usage.running_commands == 0) return true;
+  int link_limit = GetNumberOfLinkParallelTasks();
+  if (IsLink(node) && link_limit > 0 && usage.running_links >= link_limit)
+    return false;
+  if (usage.used_tasks + GetTasksUsedByCommand(node) >
+      GetNumberOfParallelTasks())
+    return false;
+  uint64_t memory_budget = GetMemoryBudget();
+  return memory_budget == 0 ||
+         usage.reserved_memory + node.estimated_memory_usage <= memory_budget;
+}
+
+// Tries to take what a command needs from outside of REBS to start: a token
+// from the jobserver, and the system's load average being under the limit. The
+// first command to run uses the implicit token, and isn't limited by the load.
+bool TryAcquireExternalResources(ResourceUsage& usage) {
+  if (usage.running_commands == 0) return true;
+  if (IsOverLoadLimit() || !TryAcquireJobToken()) return false;
+  usage.job_tokens++;
+  return true;
+}
+
+void AcquireResources(ResourceUsage& usage, CommandNode& node) {
+  usage.running_commands++;
+  if (IsLink(node)) usage.running_links++;
+  usage.used_tasks += GetTasksUsedByCommand(node);
+  usage.reserved_memory += node.estimated_memory_usage;
+  node.holds_resources = true;
+}
+
+void ReleaseResources(ResourceUsage& usage, CommandNode& node) {
+  if (!node.holds_resources) return;
+  usage.running_commands--;
+  // Tokens are interchangeable, so one is returned no matter which command
+  // took it.
+  if (usage.job_tokens > 0 && usage.job_tokens >= usage.running_commands) {
+    ReleaseJobToken();
+    usage.job_tokens--;
+  }
+  if (IsLink(node)) usage.running_links--;
+  usage.used_tasks -= GetTasksUsedByCommand(node);
+  usage.reserved_memory -= node.estimated_memory_usage;
+  node.holds_resources = false;
+}
+
+// Records whether a command that compares its output changed it, after it has
+// successfully completed.
+void CompareOutput(CommandNode& node) {
+  if (node.command->compare_exported_symbols) {
+    node.output_changed =
+        UpdateExportedSymbols(node.command->destination_file);
+    return;
+  }
+  if (!node.command->compare_output) return;
+  node.output_changed =
+      node.previous_output_hash.empty() ||
+      HashFileContents(node.command->destination_file) !=
+          node.previous_output_hash;
+}
+
+// Records the dependencies of a command restored from the object cache.
+void OnRestoredFromObjectCache(
+    const CommandNode& node,
+    const std::vector<std::filesystem::path>& dependencies) {
+  if (node.stage != Stage::Compile) return;
+  SetDependenciesOfFile(node.command->package_id,
+                        node.command->destination_file, dependencies);
+}
+
+// Returns the compile command with the dependency file for a worker substituted
+// in. Populates whether the command writes a dependency file.
+std::string SubstituteDependencyFile(const DeferredCommand& command,
+                                     const std::string& dependency_file,
+                                     bool& using_dependency_file) {
+  std::string command_str = command.command;
+  using_dependency_file = ReplaceSubstringInString(
+      command_str, "${deps file}",
+      (std::stringstream() << std::quoted(dependency_file.c_str())).str());
+  return command_str;
+}
+
+// Returns the files a compile command that has just ran depends on.
+std::vector<std::filesystem::path> ReadDependenciesOfCompile(
+    const DeferredCommand& command, const std::string& dependency_file,
+    bool using_dependency_file) {
+  if (using_dependency_file) return ReadDependenciesFromFile(dependency_file);
+  return {command.source_file};
+}
+
+// Records the dependencies of a compile command that has successfully ran, and
+// stores its object in the object cache.
+void OnCompiled(const CommandNode& node,
+                const std::vector<std::filesystem::path>& dependencies) {
+  const DeferredCommand& command = *node.command;
+  SetDependenciesOfFile(command.package_id, command.destination_file,
+                        dependencies);
+  if (IsCacheable(node))
+    StoreInObjectCache(node.cache_key, command, dependencies);
+}
+
+// Records a span in the trace for a command in the command graph that started
+// at `start_time` and ends now. `result` describes how it completed.
+void TraceCommand(const CommandNode& node, std::string_view category,
+                  uint64_t start_time, int worker_id, std::string result) {
+  if (!IsTracing()) return;
+  const DeferredCommand& command = *node.command;
+  std::string name =
+      command.destination_file.empty()
+          ? std::string(StageToString(node.stage))
+          : std::filesystem::path(command.destination_file).filename().string();
+  RecordTraceSpan(
+      name, category, start_time,
+      {{"stage", std::string(StageToString(node.stage))},
+       {"package", GetPackagePathFromID(command.package_id).string()},
+       {"worker", std::to_string(worker_id)},
+       {"result", std::move(result)},
+       {"command", command.command}});
+}
+
+// Executes a command in the command graph on a worker. Returns whether it was
+// successful, and populates details about the command that ran.
+bool ExecuteCommandNode(const CommandNode& node, int worker_id,
+                        std::stringstream& output, CommandResult& result) {
+  const DeferredCommand& command = *node.command;
+  if (command.action) {
+    result.exit_status = command.action(output) ? 0 : 1;
+    return result.exit_status == 0;
+  }
+  if (node.stage != Stage::Compile) {
+    // Simplified path where the command does not need to be copied.
+    if (!ExecuteCommand(command.command, &output, &result)) return false;
+    if (IsCacheable(node)) StoreInObjectCache(node.cache_key, command, {});
     return true;
   }
 
-  bool record_dependencies = stage == Stage::Compile;
+  std::string dependency_file = GetTempDependencyFilePath(worker_id);
+  bool using_dependency_file;
+  std::string command_str =
+      SubstituteDependencyFile(command, dependency_file, using_dependency_file);
+  if (!ExecuteCommand(command_str, &output, &result)) return false;
+
+  OnCompiled(node, ReadDependenciesOfCompile(command, dependency_file,
+                                             using_dependency_file));
+  return true;
+}
+
+// Returns a value for each command from when it last ran. Commands that haven't
+// ran before are estimated to be the average of the commands of the same stage.
+std::vector<uint64_t> EstimateFromHistory(
+    const std::function<uint64_t(size_t package_id, const std::string& file)>&
+        get_previous_value) {
+  std::map<Stage, std::pair<uint64_t, uint64_t>> total_and_count_by_stage;
+  std::vector<uint64_t> values;
+  values.reserve(command_nodes.size());
+  for (const auto& node : command_nodes) {
+    uint64_t value = 0;
+    if (!node->command->destination_file.empty()) {
+      value = get_previous_value(node->command->package_id,
+                                 node->command->destination_file);
+    }
+    if (value > 0) {
+      auto& [total, count] = total_and_count_by_stage[node->stage];
+      total += value;
+      count++;
+    }
+    values.push_back(value);
+  }
+
+  for (size_t index = 0; index < command_nodes.size(); index++) {
+    if (values[index] > 0) continue;
+    auto itr = total_and_count_by_stage.find(command_nodes[index]->stage);
+    if (itr != total_and_count_by_stage.end())
+      values[index] = itr->second.first / itr->second.second;
+  }
+  return values;
+}
+
+// Estimates the critical path of each command: how long the command and the
+// longest chain of commands waiting on it will take, based on how long they
+// took last time.
+void EstimateCriticalPaths() {
+  std::vector<uint64_t> durations =
+      EstimateFromHistory(GetPreviousDurationOfCommand);
+
+  // Commands are queued after their dependencies, so walking backwards visits
+  // every dependent before the commands it depends on.
+  for (size_t index = command_nodes.size(); index-- > 0;) {
+    CommandNode& node = *command_nodes[index];
+    uint64_t longest_dependent_path = 0;
+    for (const CommandNode* dependent : node.dependents)
+      longest_dependent_path =
+          std::max(longest_dependent_path, dependent->critical_path);
+    node.critical_path = durations[index] + longest_dependent_path;
+  }
+}
+
+// Estimates the peak memory usage of each command, based on how much memory it
+// used last time. Only needed if there is a memory budget.
+void EstimateMemoryUsage() {
+  if (GetMemoryBudget() == 0) return;
+  std::vector<uint64_t> memory_usages =
+      EstimateFromHistory(GetPreviousPeakMemoryUsageOfCommand);
+  for (size_t index = 0; index < command_nodes.size(); index++)
+    command_nodes[index]->estimated_memory_usage = memory_usages[index];
+}
+
+// Orders runnable commands so that the command with the longest critical path
+// runs first, then by the order they were queued.
+struct RunsAfter {
+  bool operator()(const CommandNode* a, const CommandNode* b) const {
+    if (a->critical_path != b->critical_path)
+      return a->critical_path < b->critical_path;
+    return a->queue_index > b->queue_index;
+  }
+};
+
+// Executes the command graph on the worker pool. A command becomes runnable as
+// soon as all of the commands it depends on have successfully completed, and
+// runnable commands with the longest critical path run first. If a command
+// fails, its output is printed right away, without diagnostics that were
+// already printed, and the commands depending on it will not run. Once the
+// allowed number of commands other than tests have failed, no more commands
+// start, and the running commands are either waited on or terminated.
+// Commands that miss the local object cache are parked while their output is
+// fetched from the remote cache, and compile commands are parked while they
+// run on remote workers, so the workers can run other commands in the
+// meantime.
+bool ExecuteCommandGraph() {
+  int total_commands = command_nodes.size();
+  if (total_commands == 0) return true;
   needs_newline = true;
-  // std::string_view verb = StageToVerb(static_cast<Stage>(stage));
-  int total_commands = commands.size();
-  int next_command_index = 0;
+  ScopedTraceSpan span("Run commands", "commands");
 
+  EstimateCriticalPaths();
+  EstimateMemoryUsage();
+
+  // Guards the fields below, which are shared with the running commands.
   std::mutex mutex;
-  bool successful = true;
+  std::condition_variable all_commands_finished;
+  std::priority_queue<CommandNode*, std::vector<CommandNode*>, RunsAfter>
+      runnable_commands;
+  // The number of tasks on the worker pool that are running commands.
+  int active_runners = 0;
+  // The number of commands waiting on the remote cache or remote workers.
+  int parked_commands = 0;
+  ResourceUsage resource_usage;
+  // The number of commands that have completed, successfully or not.
+  int completed_commands = 0;
+  int failed_commands = 0;
+  // Failed tests are counted separately, because they don't stop the build.
+  int failed_tests = 0;
+  // Whether too many commands have failed for any more to start.
+  bool stopping = false;
+  // Whether the progress was overwritten by the output of a failed command.
+  bool redraw_progress = false;
+  // Whether a command couldn't start because of the jobserver or the load
+  // average, which can change without any commands completing.
+  bool waiting_for_external_resources = false;
 
-  std::mutex dependencies_mutex;
+  // The number of commands that have started. Only used for reporting
+  // progress.
+  std::atomic<int> started_commands = 0;
 
-  // Returns the next command. Thread safe.
-  auto get_next_deferred_command =
-      [&mutex, &next_command_index, &commands, &total_commands,
-       &current_command_number]() -> DeferredCommand* {
-    std::scoped_lock lock(mutex);
-    if (next_command_index >= total_commands) return nullptr;
-    auto command = commands[next_command_index++].get();
+  for (auto& node : command_nodes) {
+    if (node->remaining_dependencies == 0) runnable_commands.push(node.get());
+  }
 
-    std::cout << kEraseLine << "Running " << current_command_number++ << "/"
-              << queued_commands_count << std::flush;
-    return command;
+  // Returns how many more runners to start to run the runnable commands. Must
+  // be called while holding the lock.
+  int max_runners = std::max(GetNumberOfWorkers(), 1);
+  auto reserve_runners = [&]() {
+    if (stopping) return 0;
+    int runners = std::min(static_cast<int>(runnable_commands.size()),
+                           max_runners - active_runners);
+    runners = std::max(runners, 0);
+    active_runners += runners;
+    return runners;
   };
 
-  // Create each thread. There's no point creating more threads than the number
-  // of commands to run.
-  int thread_count = std::min(total_commands, GetNumberOfParallelTasks());
-  std::vector<std::thread> threads;
-  for (int thread_no = 0; thread_no < thread_count; thread_no++) {
-    threads.push_back(std::thread([&get_next_deferred_command, &successful,
-                                   &mutex, &combined_output,
-                                   &dependencies_mutex, record_dependencies,
-                                   thread_no]() {
-      bool thread_successful = true;
-      std::stringstream output;
+  // Marks a command as complete, making the commands waiting on it runnable if
+  // it was successful, or printing its output if it failed. Returns how many
+  // more runners to start. Must be called while holding the lock.
+  int max_failures = GetMaxFailures();
+  auto complete_command = [&](CommandNode* node, bool command_successful,
+                              std::stringstream& output) {
+    ReleaseResources(resource_usage, *node);
+    completed_commands++;
+    if (command_successful) {
+      const DeferredCommand& command = *node->command;
+      if (!command.command_hash.empty()) {
+        SetCommandHash(command.package_id, command.destination_file,
+                       command.command_hash);
+      }
+      for (CommandNode* dependent : node->dependents) {
+        if (node->output_changed) dependent->dependencies_changed = true;
+        if (--dependent->remaining_dependencies == 0)
+          runnable_commands.push(dependent);
+      }
+      return reserve_runners();
+    }
+
+    // Commands that fail after the build stopped were likely terminated, which
+    // isn't worth reporting.
+    if (!stopping || !ShouldTerminateOnFailure()) {
+      if (node->stage == Stage::Test) {
+        failed_tests++;
+      } else {
+        failed_commands++;
+      }
+      std::cout << kEraseLine << std::flush;
+      std::cerr << RemoveRepeatedDiagnostics(output.str()) << std::flush;
+      redraw_progress = true;
+    }
+    if (!stopping && max_failures > 0 && failed_commands >= max_failures) {
+      stopping = true;
+      if (ShouldTerminateOnFailure()) TerminateRunningCommands();
+    }
+    return reserve_runners();
+  };
 
-      std::string dependency_file;
-      std::string quoted_dependency_file;
-      if (record_dependencies) {
-        dependency_file = GetTempDependencyFilePath(thread_no);
-        quoted_dependency_file =
-            (std::stringstream() << std::quoted(dependency_file.c_str())).str();
+  std::function<void(int)> run_commands;
+
+  // Marks a command as no longer waiting in the background. If it completed,
+  // the commands waiting on it may become runnable, otherwise it becomes
+  // runnable again to run locally.
+  auto unpark_command = [&](CommandNode* node, bool completed,
+                            bool command_successful,
+                            std::stringstream& output) {
+    int runners_to_start;
+    {
+      std::scoped_lock lock(mutex);
+      if (completed) {
+        runners_to_start = complete_command(node, command_successful, output);
+      } else {
+        runnable_commands.push(node);
+        runners_to_start = reserve_runners();
       }
+      // Nothing may be touched after the last command finishes, because the
+      // graph will be destroyed.
+      if (--parked_commands == 0 && active_runners == 0)
+        all_commands_finished.notify_all();
+    }
+    for (int runner = 0; runner < runners_to_start; runner++)
+      QueueTask(run_commands);
+  };
+
+  // Marks a command as waiting in the background, which doesn't use any
+  // resources on this machine.
+  auto park_command = [&](CommandNode* node) {
+    std::scoped_lock lock(mutex);
+    ReleaseResources(resource_usage, *node);
+    parked_commands++;
+  };
 
-      while (auto* command = get_next_deferred_command()) {
-        if (record_dependencies) {
-          std::string command_str = command->command;
-          bool using_dependency_file = ReplaceSubstringInString(
-              command_str, "${deps file}", quoted_dependency_file);
-          if (ExecuteCommand(command_str, &output)) {
-            std::vector<std::filesystem::path> dependencies;
-            if (using_dependency_file) {
-              dependencies = ReadDependenciesFromFile(dependency_file);
-            } else {
-              dependencies = {command->source_file};
-            }
-            std::scoped_lock lock(dependencies_mutex);
-            SetDependenciesOfFile(command->package_id,
-                                  command->destination_file, dependencies);
+  // Returns the highest priority runnable command that fits in the available
+  // resources, or null if there isn't one. Must be called while holding the
+  // lock.
+  auto take_runnable_command = [&]() -> CommandNode* {
+    if (stopping) return nullptr;
+    std::vector<CommandNode*> skipped_commands;
+    CommandNode* node = nullptr;
+    while (!runnable_commands.empty() &&
+           skipped_commands.size() < kMaxCommandsToSkip) {
+      CommandNode* candidate = runnable_commands.top();
+      runnable_commands.pop();
+      if (CanStartCommand(resource_usage, *candidate)) {
+        if (TryAcquireExternalResources(resource_usage)) {
+          node = candidate;
+        } else {
+          // No other command could start either.
+          waiting_for_external_resources = true;
+          skipped_commands.push_back(candidate);
+        }
+        break;
+      }
+      skipped_commands.push_back(candidate);
+    }
+    for (CommandNode* skipped_command : skipped_commands)
+      runnable_commands.push(skipped_command);
+    if (node != nullptr) AcquireResources(resource_usage, *node);
+    return node;
+  };
+
+  // Fetches a command's output from the remote cache in the background. If it
+  // isn't there, the command becomes runnable again, to run locally.
+  auto park_for_remote_cache = [&](CommandNode* node) {
+    park_command(node);
+    FetchFromRemoteObjectCache(
+        *node->command, node->cache_key,
+        [&, node](bool restored,
+                  std::vector<std::filesystem::path> dependencies) {
+          if (restored) {
+            OnRestoredFromObjectCache(*node, dependencies);
+            RecordRestoredCommand(node->stage);
+            CompareOutput(*node);
+          }
+          std::stringstream output;
+          unpark_command(node, /*completed=*/restored,
+                         /*command_successful=*/true, output);
+        });
+  };
+
+  // Preprocesses a compile command and sends it to a remote worker, using a
+  // reserved slot. Returns false if the command can't be compiled remotely.
+  auto park_for_remote_compile = [&](CommandNode* node, int worker_id) {
+    const DeferredCommand& command = *node->command;
+    std::string dependency_file = GetTempDependencyFilePath(worker_id);
+    bool using_dependency_file;
+    std::string command_str = SubstituteDependencyFile(
+        command, dependency_file, using_dependency_file);
+
+    auto start_time = std::chrono::steady_clock::now();
+    uint64_t trace_start_time = GetTraceTime();
+    RemoteCompileJob job;
+    if (!PreprocessForRemoteCompile(command, command_str, worker_id, job))
+      return false;
+    // The dependency file is written while preprocessing, and will be
+    // overwritten by the next command this worker runs.
+    std::vector<std::filesystem::path> dependencies = ReadDependenciesOfCompile(
+        command, dependency_file, using_dependency_file);
+
+    park_command(node);
+    CompileRemotely(
+        std::move(job), [&, node, dependencies = std::move(dependencies),
+                         start_time, trace_start_time,
+                         worker_id](RemoteCompileResult result) {
+          TraceCommand(*node, "remote compile", trace_start_time, worker_id,
+                       !result.reached_worker ? "unreachable"
+                       : result.successful    ? "successful"
+                                              : "failed");
+          std::stringstream output;
+          auto duration = std::chrono::duration_cast<std::chrono::milliseconds>(
+              std::chrono::steady_clock::now() - start_time);
+          if (result.reached_worker) {
+            RecordCommandRan(node->stage, node->command->destination_file,
+                             duration.count(), result.successful);
+          }
+          if (!result.reached_worker) {
+            node->compile_locally = true;
+          } else if (result.successful) {
+            OnCompiled(*node, dependencies);
+            CompareOutput(*node);
+            // The memory used on the remote worker isn't known.
+            SetDurationOfCommand(node->command->package_id,
+                                 node->command->destination_file,
+                                 std::max<uint64_t>(duration.count(), 1),
+                                 /*peak_memory_usage=*/0);
           } else {
-            thread_successful = false;
+            output << "Error executing: " << node->command->command
+                   << std::endl;
+            if (!result.output.empty()) output << result.output << std::endl;
           }
-        } else {
-          // Simplified path where the command does not need to be copied.
-          if (!ExecuteCommand(command->command, &output)) {
-            thread_successful = false;
+          unpark_command(node, /*completed=*/result.reached_worker,
+                         result.successful, output);
+        });
+    return true;
+  };
+
+  // Runs the runnable commands, highest priority first, until there are none
+  // left that fit in the available resources.
+  run_commands = [&](int worker_id) {
+    while (true) {
+      CommandNode* node;
+      {
+        std::scoped_lock lock(mutex);
+        node = take_runnable_command();
+        if (node == nullptr) {
+          if (--active_runners == 0 && parked_commands == 0)
+            all_commands_finished.notify_all();
+          return;
+        }
+      }
+
+      // The outputs this command was going to be ran for are the same as
+      // before, so its own output would be too.
+      bool skip = node->command->skip_if_dependencies_unchanged &&
+                  !node->dependencies_changed;
+      if (!node->started) {
+        node->started = true;
+        started_commands++;
+        if (node->command->compare_output && !skip) {
+          node->previous_output_hash =
+              HashFileContents(node->command->destination_file);
+        }
+      }
+
+      if (skip) {
+        TraceCommand(*node, "command", GetTraceTime(), worker_id,
+                     "skipped, inputs unchanged");
+        RecordUpToDateCommands(node->stage);
+        node->output_changed = false;
+        int runners_to_start;
+        {
+          std::scoped_lock lock(mutex);
+          std::stringstream output;
+          runners_to_start = complete_command(node, true, output);
+        }
+        for (int runner = 0; runner < runners_to_start; runner++)
+          QueueTask(run_commands);
+        continue;
+      }
+
+      if (IsCacheable(*node) && !node->checked_object_cache) {
+        node->checked_object_cache = true;
+        uint64_t cache_start_time = GetTraceTime();
+        std::vector<std::filesystem::path> dependencies;
+        if (TryRestoreFromObjectCache(*node->command, node->cache_key,
+                                      dependencies)) {
+          TraceCommand(*node, "object cache", cache_start_time, worker_id,
+                       "restored");
+          RecordRestoredCommand(node->stage);
+          OnRestoredFromObjectCache(*node, dependencies);
+          CompareOutput(*node);
+          int runners_to_start;
+          {
+            std::scoped_lock lock(mutex);
+            std::stringstream output;
+            runners_to_start = complete_command(node, true, output);
           }
+          for (int runner = 0; runner < runners_to_start; runner++)
+            QueueTask(run_commands);
+          continue;
         }
+        if (IsRemoteCacheEnabled() && !node->cache_key.empty()) {
+          park_for_remote_cache(node);
+          continue;
+        }
+      }
+
+      if (node->stage == Stage::Compile && !node->compile_locally &&
+          IsDistributedCompilationEnabled() && TryReserveRemoteCompileSlot()) {
+        if (park_for_remote_compile(node, worker_id)) continue;
+        ReleaseRemoteCompileSlot();
+        node->compile_locally = true;
+      }
+
+      std::stringstream output;
+      CommandResult result;
+      auto start_time = std::chrono::steady_clock::now();
+      uint64_t trace_start_time = GetTraceTime();
+      bool command_successful =
+          ExecuteCommandNode(*node, worker_id, output, result);
+      TraceCommand(*node, "command", trace_start_time, worker_id,
+                   "exit status " + std::to_string(result.exit_status));
+      auto duration = std::chrono::duration_cast<std::chrono::milliseconds>(
+          std::chrono::steady_clock::now() - start_time);
+      RecordCommandRan(node->stage, node->command->destination_file,
+                       duration.count(), command_successful);
+      if (!command_successful &&
+          (result.exit_status > 128 || IsLink(*node)) &&
+          !node->command->destination_file.empty()) {
+        // The command was killed by a signal, and may have left a partially
+        // written output that looks up to date. A link that failed leaves its
+        // old output, which would look up to date if the next build skips the
+        // link because the objects it links didn't change.
+        std::error_code error;
+        std::filesystem::remove(node->command->destination_file, error);
       }
+      if (command_successful && !node->command->destination_file.empty()) {
+        SetDurationOfCommand(node->command->package_id,
+                             node->command->destination_file,
+                             std::max<uint64_t>(duration.count(), 1),
+                             result.peak_memory_usage);
+      }
+      if (command_successful) CompareOutput(*node);
 
-      if (!thread_successful) {
+      int runners_to_start;
+      {
         std::scoped_lock lock(mutex);
-        combined_output << output.rdbuf();
-        successful = false;
+        runners_to_start = complete_command(node, command_successful, output);
       }
-    }));
+      for (int runner = 0; runner < runners_to_start; runner++)
+        QueueTask(run_commands);
+    }
+  };
+
+  int runners_to_start;
+  {
+    std::scoped_lock lock(mutex);
+    runners_to_start = reserve_runners();
   }
+  for (int runner = 0; runner < runners_to_start; runner++)
+    QueueTask(run_commands);
 
-  // Wait for all of the threads to finish running.
-  for (auto& thread : threads) thread.join();
+  // Report progress from this thread while the workers run the commands. Must
+  // be called while holding the lock.
+  int reported_commands = 0;
+  auto report_progress = [&]() {
+    int current_command_number = started_commands;
+    if (current_command_number == reported_commands && !redraw_progress)
+      return;
+    reported_commands = current_command_number;
+    redraw_progress = false;
+    std::cout << kEraseLine << "Running " << current_command_number << "/"
+              << total_commands << std::flush;
+  };
 
-  return successful;
+  std::unique_lock lock(mutex);
+  while (!all_commands_finished.wait_for(lock, kProgressInterval, [&]() {
+    return active_runners == 0 && parked_commands == 0;
+  })) {
+    report_progress();
+    if (waiting_for_external_resources) {
+      waiting_for_external_resources = false;
+      for (int runner = reserve_runners(); runner > 0; runner--)
+        QueueTask(run_commands);
+    }
+  }
+  report_progress();
+
+  if (stopping && completed_commands < total_commands) {
+    std::cout << kEraseLine << std::flush;
+    std::cerr << "Stopped after " << failed_commands << " failed "
+              << (failed_commands == 1 ? "command" : "commands")
+              << ". Pass --keep-going to build as much as possible."
+              << std::endl;
+    needs_newline = false;
+  }
+  return failed_commands == 0 && failed_tests == 0;
 }
 
 }  // namespace
 
-void QueueCommand(Stage stage,
-                  std::unique_ptr<DeferredCommand> deferred_command) {
-  int stage_i = static_cast<int>(stage);
-  auto itr = deferred_commands_by_stage.find(stage_i);
+DeferredCommand* QueueCommand(
+    Stage stage, std::unique_ptr<DeferredCommand> deferred_command) {
+  DeferredCommand* command = deferred_command.get();
+  if (stage == Stage::Run) {
+    run_commands.emplace_back(std::move(deferred_command));
+    return command;
+  }
 
-  if (itr == deferred_commands_by_stage.end()) {
-    const auto [new_itr, _] = deferred_commands_by_stage.insert(
-        {stage_i, std::vector<std::unique_ptr<DeferredCommand>>{}});
-    itr = new_itr;
-    max_stage = std::max(max_stage, stage_i);
+  auto node = std::make_unique<CommandNode>();
+  node->command = std::move(deferred_command);
+  node->stage = stage;
+  for (DeferredCommand* dependency : command->dependencies) {
+    auto itr = command_nodes_by_command.find(dependency);
+    if (itr == command_nodes_by_command.end()) continue;
+    itr->second->dependents.push_back(node.get());
+    node->remaining_dependencies++;
   }
-  itr->second.emplace_back(std::move(deferred_command));
-  queued_commands_count++;
+  node->queue_index = command_nodes.size();
+  command_nodes_by_command[command] = node.get();
+  command_nodes.emplace_back(std::move(node));
+  return command;
 }
 
 bool RunQueuedCommands() {
-  int current_command_number = 1;
-  bool successful = true;
-  std::stringstream output;
-  for (int stage = 0; stage <= max_stage; stage++) {
-    auto itr = deferred_commands_by_stage.find(stage);
-    if (itr == deferred_commands_by_stage.end()) continue;
-    if (!ExecuteStage(static_cast<Stage>(stage), itr->second,
-                      current_command_number, output)) {
-      successful = false;
-      break;
-    }
-  }
+  bool successful = ExecuteCommandGraph();
+  if (successful && !run_commands.empty()) RunCommands(run_commands);
 
   if (needs_newline) {
     std::cout << std::endl;
     needs_newline = false;
   }
 
-  if (!successful) {
-    std::cerr << output.rdbuf();
-    return false;
-  }
+  DiscardQueuedCommands();
+  return successful;
+}
 
-  return true;
+void DiscardQueuedCommands() {
+  command_nodes_by_command.clear();
+  command_nodes.clear();
+  run_commands.clear();
+  needs_newline = true;
 }
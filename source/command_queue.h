@@ -19,10 +19,15 @@
 #include "deferred_command.h"
 #include "stage.h"
 
-// Queues up a command for a stage.
-void QueueCommand(Stage stage,
-                  std::unique_ptr<DeferredCommand> deferred_command);
+// Queues up a command for a stage. Returns the queued command so that commands
+// queued later can depend on it.
+DeferredCommand* QueueCommand(
+    Stage stage, std::unique_ptr<DeferredCommand> deferred_command);
 
-// Runs through the queued commands for each stage. Returns if they were all
-// successful.
+// Runs the queued commands, each as soon as its dependencies have completed.
+// Returns if they were all successful.
 bool RunQueuedCommands();
+
+// Discards the queued commands without running them, so that packages can be
+// queued again.
+void DiscardQueuedCommands();
@@ -12,6 +12,7 @@
 // See the License for the specific language governing permissions and
 // limitations under the License.
 
+#include <algorithm>
 #include <cstdint>
 #include <cstdlib>
 #include <filesystem>
@@ -20,10 +21,15 @@
 #include <functional>
 #include <iostream>
 #include <iterator>
+#include <memory>
+#include <mutex>
+#include <sstream>
 #include <string>
 #include <string_view>
 #include <thread>
+#include <vector>
 
+#include "config.h"
 #include "execute.h"
 #include "invocation.h"
 #include "nlohmann/json.hpp"
@@ -31,6 +37,14 @@
 #include "string_replace.h"
 #include "temp_directory.h"
 #include "timestamps.h"
+#include "trace.h"
+#include "worker_pool.h"
+
+#ifdef REBS_USE_LIBJSONNET
+extern "C" {
+#include <libjsonnet.h>
+}
+#endif
 
 using json = ::nlohmann::json;
 
@@ -46,6 +60,9 @@ constexpr char kPackageConfigFile[] = ".package.rebs.jsonnet";
 constexpr char kConfigJsonFile[] = "rebs.json";
 // The name of the generated concatinated jsonett file;
 constexpr char kTempConcatinatedConfigFile[] = "temp.jsonnet";
+// The name of the generated concatinated jsonnet file in a package's temp
+// directory. Each package has its own, so they can be generated in parallel.
+constexpr char kTempPackageConfigFile[] = "package.jsonnet";
 
 // The default config file contents.
 constexpr char kDefaultConfigFileContents[] = R"json(
@@ -53,20 +70,23 @@ local optimization_level = std.extVar("optimization_level");
 {
   local cpp_compiler = "clang++",
   local archiver = "llvm-ar",
+  local c_optimizations =
+    if optimization_level == "optimized" then
+      " -g -O3 -fomit-frame-pointer -flto"
+    else if optimization_level == "thin-optimized" then
+      " -g -O3 -fomit-frame-pointer -flto=thin"
+    else if optimization_level == "debug" then
+      " -g -Og"
+    else
+      "",
   "build_commands": {
     // C and C++:
-    local c_optimizations =
-      if optimization_level == "optimized" then
-        " -g -O3 -fomit-frame-pointer -flto"
-      else if optimization_level == "debug" then
-        " -g -Og"
-      else
-        "",
     local cpp_command = cpp_compiler + c_optimizations +
       " -c -std=c++20 ${cdefines} ${cincludes} -MD -MF ${deps file} -o ${out} ${in} ",
 
     "cc": cpp_command,
     "cpp": cpp_command,
+    "cppm": cpp_command,
     "c": cpp_compiler + c_optimizations +
       " -c -std=c17 ${cdefines} ${cincludes} -MD -MF ${deps file} -o ${out} ${in}",
 
@@ -78,9 +98,21 @@ local optimization_level = std.extVar("optimization_level");
     "s": att_asm,
     "S": att_asm
   },
+  // Used by packages with "precompiled_header" set:
+  "precompiled_header_commands": {
+    local cpp_command = cpp_compiler + c_optimizations +
+      " -x c++-header -std=c++20 ${cdefines} ${cincludes} -MD -MF ${deps file} -o ${out} ${in}",
+
+    "cc": cpp_command,
+    "cpp": cpp_command
+  },
   local application_linker_optimizations =
       if optimization_level == "optimized" then
         " -O3 -g -s --gc-sections"
+      else if optimization_level == "thin-optimized" then
+        " -O3 -g -s -fuse-ld=lld -flto=thin -Wl,--gc-sections" +
+        " -Wl,--thinlto-jobs=${link threads}" +
+        " -Wl,--thinlto-cache-dir=${lto cache directory}"
       else " -g",
   "linker_command":
     if self.package_type == "application" then
@@ -89,6 +121,9 @@ local optimization_level = std.extVar("optimization_level");
       archiver + " rcs ${out} ${in}"
     else
       "",
+  // Used by libraries in --dev builds:
+  "shared_library_linker_command":
+    cpp_compiler + c_optimizations + " -shared -o ${out} ${in}",
   "output_extension":
     if self.package_type == "application" then
       ""
@@ -106,11 +141,20 @@ local optimization_level = std.extVar("optimization_level");
   "source_directories": [
     ""
   ],
+  // Set to keep the debug info out of the objects, so links don't process it.
+  "split_debug_info": 0,
   "package_type": "application",
   "package_directories": [
 ${package_directories}
   ],
-  "parallel_tasks" : ${parallel_tasks}
+  "parallel_tasks" : ${parallel_tasks},
+  // ThinLTO links optimize on several threads.
+  "link_threads":
+    if optimization_level == "thin-optimized" then
+      std.max(1, std.floor(self.parallel_tasks / 2))
+    else
+      1,
+  "object_cache": 0
 }
 
 )json";
@@ -123,6 +167,7 @@ std::string jsonet_command;
 // The global config files concatinated together, with an extra "+" ready to
 // append a local jsonet file onto the end.
 std::string prepended_jsonet_configs;
+std::once_flag read_prepended_jsonet_configs;
 
 std::vector<std::string> global_config_files;
 
@@ -132,25 +177,41 @@ uint64_t global_config_file_timestamp;
 std::vector<std::filesystem::path> package_directories;
 int number_of_parallel_tasks;
 
+// Limits on the resources commands running at once may use. 0 means no limit.
+int number_of_link_parallel_tasks = 0;
+// How many of the parallel tasks each link uses.
+int number_of_link_threads = 1;
+int memory_budget_mb = 0;
+
+// Whether to use the object cache, and where to store it.
+bool use_object_cache = false;
+std::filesystem::path object_cache_directory;
+// The maximum size of the object cache in megabytes.
+int object_cache_size = 10 * 1024;
+
+// The remote cache to share objects through, and how many connections to make
+// to it.
+std::string remote_cache_url;
+int remote_cache_connections = 4;
+
+// The remote workers to distribute compile commands to, and how many commands
+// to run on each at once.
+std::vector<std::string> remote_workers;
+int remote_parallel_tasks = 4;
+
+// How long a list of arguments may be before it's written to a response file.
+// Kept well under the longest argument Linux allows, because commands that run
+// through the shell are a single argument.
+int response_file_threshold = 32 * 1024;
+
+// How many kilobytes of output to keep from each command. 0 means no limit.
+int output_limit = 256;
+
 // There is a run command to use after every package has been built. If one is
 // set, then this command is ran instead of attempting to execute each
 // individual package.
 std::string global_run_command;
 
-// Returns the user's home directory.
-std::filesystem::path GetHomeDirectory() {
-  // Check the POSIX home directory.
-  const char* home_env = getenv("HOME");
-  if (home_env != nullptr) return home_env;
-
-  // Check the Windows home directory.
-  home_env = getenv("USERPROFILE");
-  if (home_env != nullptr) return home_env;
-
-  // Fallback. This usually doesn't work but something is better than nothing.
-  return "~";
-}
-
 // Populates the command used to call Jsonett.
 void PopulateJsonnettCommand() {
   jsonet_command = std::vformat(
@@ -247,16 +308,50 @@ std::string ReadAndConcatinateGlobalConfigFiles() {
   return concatinated_contents_string;
 }
 
-bool GenerateGlobalJsonFile(const std::string& generated_json_file) {
-  std::string concatinated_contents_string =
-      ReadAndConcatinateGlobalConfigFiles();
+#ifdef REBS_USE_LIBJSONNET
+
+// Evaluates Jsonnet in this process and writes the resulting JSON to a file.
+// Each thread keeps its own VM. Thread safe.
+bool EvaluateJsonnet(const std::string& contents,
+                     const std::filesystem::path& temp_jsonnet_file,
+                     const std::filesystem::path& generated_json_file,
+                     std::stringstream* opt_output) {
+  thread_local std::unique_ptr<JsonnetVm, decltype(&jsonnet_destroy)> vm(
+      nullptr, jsonnet_destroy);
+  if (!vm) {
+    vm.reset(jsonnet_make());
+    jsonnet_ext_var(
+        vm.get(), "optimization_level",
+        std::string(OptimizationLevelToString(GetOptimizationLevel())).c_str());
+  }
+
+  // The temp file isn't written, but is the name used in error messages.
+  int error = 0;
+  char* result = jsonnet_evaluate_snippet(
+      vm.get(), temp_jsonnet_file.c_str(), contents.c_str(), &error);
+  bool successful = error == 0;
+  if (successful) {
+    std::ofstream file(generated_json_file);
+    file << result;
+    successful = file.good();
+  } else {
+    (opt_output ? *opt_output : std::cerr) << result << std::endl;
+  }
+  jsonnet_realloc(vm.get(), result, 0);
+  return successful;
+}
 
-  std::filesystem::path temp_jsonnet_file =
-      GetTempDirectoryPath() / kTempConcatinatedConfigFile;
+#else
 
+// Evaluates Jsonnet by writing it to a temp file and running the Jsonnet
+// command on it. Thread safe if each thread uses its own temp file.
+bool EvaluateJsonnet(const std::string& contents,
+                     const std::filesystem::path& temp_jsonnet_file,
+                     const std::filesystem::path& generated_json_file,
+                     std::stringstream* opt_output) {
   std::ofstream file(temp_jsonnet_file);
   if (file.is_open()) {
-    file << concatinated_contents_string;
+    file << contents;
     file.close();
   }
 
@@ -264,42 +359,68 @@ bool GenerateGlobalJsonFile(const std::string& generated_json_file) {
       "{} -o \"{}\" \"{}\"",
       std::make_format_args(jsonet_command, (std::string)generated_json_file,
                             (std::string)temp_jsonnet_file));
-  if (!ExecuteCommand(command)) return false;
+  return ExecuteCommand(command, opt_output);
+}
+
+#endif
+
+bool GenerateGlobalJsonFile(const std::string& generated_json_file) {
+  ScopedTraceSpan span("Generate global config", "config");
+  if (!EvaluateJsonnet(ReadAndConcatinateGlobalConfigFiles(),
+                       GetTempDirectoryPath() / kTempConcatinatedConfigFile,
+                       generated_json_file, /*opt_output=*/nullptr)) {
+    return false;
+  }
   SetTimestampOfFileToNow(generated_json_file);
   return true;
 }
 
+// Generates the JSON config for a package. Thread safe.
 bool GenerateConfigFileForPackage(
     const std::filesystem::path& config_path,
-    const std::filesystem::path& generated_config_path) {
-  if (prepended_jsonet_configs.size() == 0) {
+    const std::filesystem::path& generated_config_path,
+    std::stringstream* opt_output) {
+  ScopedTraceSpan span("Generate config", "config");
+  span.AddArgument("config", config_path.string());
+  std::call_once(read_prepended_jsonet_configs, []() {
     prepended_jsonet_configs = ReadAndConcatinateGlobalConfigFiles() + "+";
+  });
+
+  std::string contents = prepended_jsonet_configs;
+  std::ifstream config_file(config_path);
+  if (config_file.is_open()) {
+    contents.append(std::istreambuf_iterator<char>(config_file),
+                    std::istreambuf_iterator<char>());
+    config_file.close();
   }
 
-  std::filesystem::path temp_jsonnet_file =
-      GetTempDirectoryPath() / kTempConcatinatedConfigFile;
-
-  std::ofstream temp_file(temp_jsonnet_file);
-  if (temp_file.is_open()) {
-    temp_file << prepended_jsonet_configs;
-
-    std::ifstream config_file(config_path);
-    if (config_file.is_open()) {
-      temp_file << config_file.rdbuf();
-      config_file.close();
-    }
-    temp_file.close();
+  if (!EvaluateJsonnet(contents,
+                       generated_config_path.parent_path() /
+                           kTempPackageConfigFile,
+                       generated_config_path, opt_output)) {
+    return false;
   }
-
-  std::string command = std::vformat(
-      "{} -o \"{}\" \"{}\"",
-      std::make_format_args(jsonet_command, (std::string)generated_config_path,
-                            (std::string)temp_jsonnet_file));
-  if (!ExecuteCommand(command)) return false;
   SetTimestampOfFileToNow(generated_config_path);
   return true;
 }
 
+// Returns the path of a package's config file, and populates the path of the
+// JSON generated from it and when either of the files it was generated from
+// last changed.
+std::filesystem::path GetConfigPathsForPackage(
+    const std::filesystem::path& package_path,
+    std::filesystem::path& generated_config_path, uint64_t& timestamp) {
+  std::filesystem::path config_path = package_path / kPackageConfigFile;
+  timestamp =
+      std::max(global_config_file_timestamp, GetTimestampOfFile(config_path));
+
+  std::filesystem::path temp_path =
+      GetTempDirectoryPathForPackagePath(package_path);
+  EnsureDirectoriesAndParentsExist(temp_path);
+  generated_config_path = temp_path / kPackageConfigFile;
+  return config_path;
+}
+
 bool LoadGlobalConfigFile() {
   global_config_files = GetGlobalConfigFiles();
 
@@ -337,9 +458,61 @@ void ParseGlobalConfig() {
   for (const auto& directory : global_config_file["package_directories"]) {
     package_directories.push_back(directory.template get<std::string>());
   }
+  auto link_parallel_tasks_val = global_config_file["link_parallel_tasks"];
+  if (link_parallel_tasks_val.is_number_integer())
+    number_of_link_parallel_tasks = link_parallel_tasks_val.template get<int>();
+  auto link_threads_val = global_config_file["link_threads"];
+  if (link_threads_val.is_number_integer())
+    number_of_link_threads = link_threads_val.template get<int>();
+  auto memory_budget_val = global_config_file["memory_budget_mb"];
+  if (memory_budget_val.is_number_integer())
+    memory_budget_mb = memory_budget_val.template get<int>();
+
   auto global_run_command_val = global_config_file["global_run_command"];
   if (global_run_command_val.is_string())
     global_run_command = global_run_command_val.template get<std::string>();
+
+  auto object_cache_val = global_config_file["object_cache"];
+  if (object_cache_val.is_number_integer())
+    use_object_cache = object_cache_val.template get<int>() > 0;
+  auto object_cache_directory_val = global_config_file["object_cache_directory"];
+  if (object_cache_directory_val.is_string()) {
+    object_cache_directory =
+        object_cache_directory_val.template get<std::string>();
+  }
+  auto object_cache_size_val = global_config_file["object_cache_size"];
+  if (object_cache_size_val.is_number_integer())
+    object_cache_size = object_cache_size_val.template get<int>();
+
+  auto remote_cache_val = global_config_file["remote_cache"];
+  if (remote_cache_val.is_string())
+    remote_cache_url = remote_cache_val.template get<std::string>();
+  auto remote_cache_connections_val =
+      global_config_file["remote_cache_connections"];
+  if (remote_cache_connections_val.is_number_integer()) {
+    remote_cache_connections =
+        remote_cache_connections_val.template get<int>();
+  }
+
+  auto response_file_threshold_val =
+      global_config_file["response_file_threshold"];
+  if (response_file_threshold_val.is_number_integer()) {
+    response_file_threshold =
+        response_file_threshold_val.template get<int>();
+  }
+
+  auto output_limit_val = global_config_file["output_limit"];
+  if (output_limit_val.is_number_integer())
+    output_limit = output_limit_val.template get<int>();
+
+  auto remote_workers_val = global_config_file["remote_workers"];
+  if (remote_workers_val.is_array()) {
+    for (const auto& remote_worker : remote_workers_val)
+      remote_workers.push_back(remote_worker.template get<std::string>());
+  }
+  auto remote_parallel_tasks_val = global_config_file["remote_parallel_tasks"];
+  if (remote_parallel_tasks_val.is_number_integer())
+    remote_parallel_tasks = remote_parallel_tasks_val.template get<int>();
 }
 
 }  // namespace
@@ -357,6 +530,59 @@ std::string_view GetGlobalRunCommand() { return global_run_command; }
 
 int GetNumberOfParallelTasks() { return number_of_parallel_tasks; }
 
+int GetNumberOfLinkParallelTasks() {
+  return std::max(number_of_link_parallel_tasks, 0);
+}
+
+int GetNumberOfLinkThreads() {
+  return std::clamp(number_of_link_threads, 1,
+                    std::max(number_of_parallel_tasks, 1));
+}
+
+uint64_t GetMemoryBudget() {
+  return static_cast<uint64_t>(std::max(memory_budget_mb, 0)) * 1024;
+}
+
+bool ShouldUseObjectCache() { return use_object_cache; }
+
+std::filesystem::path GetObjectCacheDirectory() {
+  return object_cache_directory;
+}
+
+uint64_t GetObjectCacheSize() {
+  return static_cast<uint64_t>(std::max(object_cache_size, 0)) * 1024 * 1024;
+}
+
+std::string_view GetRemoteCacheUrl() { return remote_cache_url; }
+
+int GetNumberOfRemoteCacheConnections() { return remote_cache_connections; }
+
+const std::vector<std::string>& GetRemoteWorkers() { return remote_workers; }
+
+int GetNumberOfRemoteParallelTasks() { return remote_parallel_tasks; }
+
+size_t GetResponseFileThreshold() {
+  return static_cast<size_t>(std::max(response_file_threshold, 0));
+}
+
+size_t GetCommandOutputLimit() {
+  return static_cast<size_t>(std::max(output_limit, 0)) * 1024;
+}
+
+// Returns the user's home directory.
+std::filesystem::path GetHomeDirectory() {
+  // Check the POSIX home directory.
+  const char* home_env = getenv("HOME");
+  if (home_env != nullptr) return home_env;
+
+  // Check the Windows home directory.
+  home_env = getenv("USERPROFILE");
+  if (home_env != nullptr) return home_env;
+
+  // Fallback. This usually doesn't work but something is better than nothing.
+  return "~";
+}
+
 // Calls a function for each directory that may contain packages.
 void ForEachPackageDirectory(
     const std::function<void(const std::filesystem::path&)>&
@@ -365,23 +591,61 @@ void ForEachPackageDirectory(
     on_each_directory(directory);
 }
 
-std::optional<::nlohmann::json> LoadConfigFileForPackage(
-    const std::string& package_name, const std::filesystem::path& package_path,
-    uint64_t& timestamp) {
+void ForEachGlobalConfigFilePath(
+    const std::function<void(const std::filesystem::path&)>& on_each_file) {
+  on_each_file(GetRootConfigFilePath());
+  on_each_file(std::filesystem::absolute(kUniverseConfigFile));
+}
+
+bool IsPackageConfigFile(const std::filesystem::path& path) {
+  return path.filename() == kPackageConfigFile;
+}
+
+uint64_t GetGlobalConfigTimestamp() { return global_config_file_timestamp; }
+
+uint64_t GetConfigTimestampOfPackage(
+    const std::filesystem::path& package_path) {
   std::filesystem::path config_path = package_path / kPackageConfigFile;
-  if (!DoesFileExist(config_path)) return global_config_file;
+  if (!DoesFileExist(config_path)) return 0;
+  return std::max(global_config_file_timestamp, GetTimestampOfFile(config_path));
+}
 
-  timestamp =
-      std::max(global_config_file_timestamp, GetTimestampOfFile(config_path));
+void GenerateConfigFilesForPackages(
+    const std::vector<std::filesystem::path>& package_paths) {
+  std::vector<std::pair<std::filesystem::path, std::filesystem::path>>
+      configs_to_generate;
+  for (const auto& package_path : package_paths) {
+    if (!DoesFileExist(package_path / kPackageConfigFile)) continue;
+    std::filesystem::path generated_config_path;
+    uint64_t timestamp;
+    std::filesystem::path config_path =
+        GetConfigPathsForPackage(package_path, generated_config_path, timestamp);
+    if (timestamp > GetTimestampOfFile(generated_config_path))
+      configs_to_generate.push_back({config_path, generated_config_path});
+  }
 
-  std::filesystem::path temp_path =
-      GetTempDirectoryPathForPackagePath(package_path);
-  EnsureDirectoriesAndParentsExist(temp_path);
+  ParallelFor(configs_to_generate.size(), [&configs_to_generate](
+                                              size_t index) {
+    // Errors are reported when the package is loaded, which tries again.
+    std::stringstream output;
+    GenerateConfigFileForPackage(configs_to_generate[index].first,
+                                 configs_to_generate[index].second, &output);
+  });
+}
+
+std::optional<::nlohmann::json> LoadConfigFileForPackage(
+    const std::string& package_name, const std::filesystem::path& package_path,
+    uint64_t& timestamp) {
+  if (!DoesFileExist(package_path / kPackageConfigFile))
+    return global_config_file;
 
-  std::filesystem::path generated_config_path = temp_path / kPackageConfigFile;
+  std::filesystem::path generated_config_path;
+  std::filesystem::path config_path =
+      GetConfigPathsForPackage(package_path, generated_config_path, timestamp);
   if (timestamp > GetTimestampOfFile(generated_config_path)) {
     // One of the files is newer than the generated one.
-    if (!GenerateConfigFileForPackage(config_path, generated_config_path)) {
+    if (!GenerateConfigFileForPackage(config_path, generated_config_path,
+                                      /*opt_output=*/nullptr)) {
       std::cerr << "Cannot parse config file for " << package_name << std::endl;
       return std::nullopt;
     }
@@ -14,11 +14,15 @@
 
 #pragma once
 
+#include <stddef.h>
+
 #include <cstdint>
 #include <filesystem>
 #include <functional>
 #include <optional>
 #include <string>
+#include <string_view>
+#include <vector>
 
 #include "nlohmann/json_fwd.hpp"
 
@@ -29,10 +33,65 @@ bool LoadConfigFile();
 // Returns the number of parallel tasks.
 int GetNumberOfParallelTasks();
 
+// Returns the number of link commands that may run at once, or 0 if links are
+// only limited by the number of parallel tasks.
+int GetNumberOfLinkParallelTasks();
+
+// Returns how many threads each link command uses, which it counts as that
+// many of the parallel tasks. At least 1, and at most the number of parallel
+// tasks.
+int GetNumberOfLinkThreads();
+
+// Returns how much memory in kilobytes the commands running at once may use,
+// or 0 if it isn't limited.
+uint64_t GetMemoryBudget();
+
+// Returns whether compiled objects should be shared through the object cache.
+bool ShouldUseObjectCache();
+
+// Returns the directory to store the object cache in, or a blank path to use
+// the default.
+std::filesystem::path GetObjectCacheDirectory();
+
+// Returns the maximum size of the object cache in bytes.
+uint64_t GetObjectCacheSize();
+
+// Returns the URL of the remote cache, or a blank string if there isn't one.
+std::string_view GetRemoteCacheUrl();
+
+// Returns the number of connections to make to the remote cache.
+int GetNumberOfRemoteCacheConnections();
+
+// Returns the addresses (host[:port]) of the remote workers to distribute
+// compile commands to.
+const std::vector<std::string>& GetRemoteWorkers();
+
+// Returns the number of compile commands to run at once on each remote worker.
+int GetNumberOfRemoteParallelTasks();
+
+// Returns the length in bytes that a list of arguments may be before it's
+// written to a response file, or 0 if response files aren't used.
+size_t GetResponseFileThreshold();
+
+// Returns how many bytes of output to keep from each command, or 0 if it isn't
+// limited.
+size_t GetCommandOutputLimit();
+
+// Returns the user's home directory.
+std::filesystem::path GetHomeDirectory();
+
 // Calls a function for each directory that may contain packages.
 void ForEachPackageDirectory(
     const std::function<void(const std::filesystem::path&)>& on_each_directory);
 
+// Calls a function with the path of each global config file, including the
+// local config file, even if it doesn't exist yet.
+void ForEachGlobalConfigFilePath(
+    const std::function<void(const std::filesystem::path&)>& on_each_file);
+
+// Returns whether a file is a package's config file.
+bool IsPackageConfigFile(const std::filesystem::path& path);
+
 // Returns whether there is a local config file, causing this build to be in an
 // isolated universe.
 bool IsThereALocalConfig();
@@ -40,6 +99,18 @@ bool IsThereALocalConfig();
 // Returns the global run command if one is set, otherwise a blank string.
 std::string_view GetGlobalRunCommand();
 
+// Returns when the global config files last changed.
+uint64_t GetGlobalConfigTimestamp();
+
+// Returns when a package's config, or the global config files it's appended
+// to, last changed, or 0 if the package has no config of its own.
+uint64_t GetConfigTimestampOfPackage(const std::filesystem::path& package_path);
+
+// Regenerates the configs of packages that have changed in parallel, so they
+// don't have to be generated one at a time as each package is loaded.
+void GenerateConfigFilesForPackages(
+    const std::vector<std::filesystem::path>& package_paths);
+
 // Loads a config flie for a package. Populates the timestamp with when it
 // was changed.
 std::optional<::nlohmann::json> LoadConfigFileForPackage(
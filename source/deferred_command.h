@@ -16,13 +16,45 @@
 
 #include <stddef.h>
 
+#include <filesystem>
+#include <functional>
+#include <sstream>
 #include <string>
+#include <vector>
 
 // A command that can be ran.
 struct DeferredCommand {
   std::string command;
+  // If set, ran by REBS itself instead of `command`, which then only describes
+  // what it does. Returns whether it was successful, and writes any errors to
+  // `output`.
+  std::function<bool(std::stringstream& output)> action;
   std::string destination_file;
   std::string source_file;
+  // The files a link command reads, used to look up its output in the object
+  // cache.
+  std::vector<std::filesystem::path> input_files;
   bool output_warnings;
   size_t package_id;
+  // Whether the output may be stored in and restored from the object cache.
+  // Commands that read or write files the cache doesn't know about, such as
+  // module interfaces, can't be.
+  bool cacheable = true;
+  // Whether to compare the output from before and after the command runs, so
+  // that the commands waiting on it can be skipped if it didn't change.
+  bool compare_output = false;
+  // Whether the output is a shared library that counts as changed only when
+  // the symbols it exports change, because that's all that the commands
+  // linking against it depend on.
+  bool compare_exported_symbols = false;
+  // Whether to skip the command if none of the commands it depends on changed
+  // their outputs, because they're the only reason it's being ran.
+  bool skip_if_dependencies_unchanged = false;
+  // The hash of what the output depends on in the command, recorded once the
+  // command successfully completes, so that the output is rebuilt when it
+  // changes. Blank if it isn't recorded.
+  std::string command_hash;
+  // Commands that must successfully complete before this command can run. They
+  // must be queued before this command.
+  std::vector<DeferredCommand*> dependencies;
 };
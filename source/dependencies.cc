@@ -16,159 +16,433 @@
 
 #include <stddef.h>
 
+#include <algorithm>
+#include <condition_variable>
+#include <cstdint>
+#include <cstring>
+#include <deque>
 #include <filesystem>
 #include <fstream>
 #include <functional>
 #include <iostream>
 #include <map>
-#include <set>
+#include <mutex>
+#include <span>
 #include <sstream>
 #include <string>
+#include <string_view>
+#include <unordered_map>
+#include <utility>
 #include <vector>
 
+#include "mapped_file.h"
 #include "temp_directory.h"
 #include "timestamps.h"
+#include "trace.h"
+#include "worker_pool.h"
 
 namespace {
 
-// The name of the file that is created in a package's temporary directory that
-// contains the object files and their dependencies.
-constexpr char kDependenciesFile[] = "dependencies";
+// The name of the database in the temp directory that contains the
+// dependencies of every object file.
+constexpr char kDependencyDatabaseFile[] = "dependency_database";
+
+// The start of the database. This should change whenever the format changes,
+// so that old databases are ignored. Its length is a multiple of 4, so the
+// records after it are aligned.
+constexpr std::string_view kDatabaseVersion = "rebs dependencies 1\n";
+static_assert(kDatabaseVersion.size() % sizeof(uint32_t) == 0);
 
 // The prefix of the name of the file that is temporarily used by compilers to
 // write the dependencies to. There is one file per running thread.
 constexpr char kThreadDependencyFilePrefix[] = "deps";
 
-// A mapping of Package ID -> {File -> Dependencies}.
-std::map<size_t,
-         std::map<std::filesystem::path, std::vector<std::filesystem::path>>>
-    dependencies_per_file_per_package;
+// The database is a log of records, each made of 32-bit words, that is
+// appended to as dependencies change. A path record adds a path to the string
+// table, and is followed by the path's length and the path, padded to a
+// multiple of 4 bytes. A dependencies record is followed by the package ID, the
+// ID of the file, the number of dependencies, and their path IDs. It replaces
+// any earlier record for the same file.
+enum RecordType : uint32_t { kPathRecord = 1, kDependenciesRecord = 2 };
+
+// The timestamp of a path that hasn't been looked up yet.
+constexpr uint64_t kUnknownTimestamp = UINT64_MAX;
+
+// The timestamp of a path that is being looked up.
+constexpr uint64_t kPendingTimestamp = UINT64_MAX - 1;
+
+// How many paths each task looks up when checking dependencies in parallel.
+constexpr size_t kPathsToLookUpPerTask = 64;
+
+// The database is rewritten from scratch instead of appended to once the
+// records that have been replaced make up most of it.
+constexpr size_t kMinimumBytesToCompact = 1024 * 1024;
+
+// The dependencies of a file.
+struct DependencyRecord {
+  // Points into either the mapped database or `new_path_ids`.
+  std::span<const uint32_t> path_ids;
+  std::vector<uint32_t> new_path_ids;
+};
+
+// The string table of paths, indexed by path ID. Points into either the mapped
+// database or `new_paths`.
+std::vector<std::string_view> paths;
+std::deque<std::string> new_paths;
+std::unordered_map<std::string_view, uint32_t> path_ids_by_path;
+
+// A mapping of {Package ID, File's path ID} -> Dependencies.
+std::map<std::pair<size_t, uint32_t>, DependencyRecord>
+    dependencies_by_package_and_file;
+
+// The timestamps of paths by path ID, looked up while checking dependencies.
+// A deque, so timestamps can be written without holding the lock while more
+// are added.
+std::deque<uint64_t> timestamps_by_path_id;
+
+bool loaded_database = false;
+
+// The records to append to the database when it's flushed.
+std::string records_to_append;
+
+// The size of the valid records in the database on disk, and how many of those
+// bytes are in records that have since been replaced.
+size_t database_size = 0;
+size_t replaced_bytes = 0;
+
+// Guards the dependencies above, which are read while checking which files are
+// up to date and written as commands complete, both on the worker pool.
+std::mutex dependencies_mutex;
+
+// Notified when timestamps have been looked up, for checks that are waiting on
+// paths that another check running at the same time was looking up.
+std::condition_variable timestamps_looked_up;
+
+std::filesystem::path GetDependencyDatabasePath() {
+  return GetTempDirectoryPath() / kDependencyDatabaseFile;
+}
 
-// Set of package IDs whos dependencies have changed.
-std::set<size_t> packages_with_invalidated_dependencies;
+size_t GetSizeOfDependenciesRecord(size_t dependencies) {
+  return (4 + dependencies) * sizeof(uint32_t);
+}
 
-std::filesystem::path GetDependencyFilePathForPackage(size_t package_id) {
-  return GetTempDirectoryPathForPackageID(package_id) / kDependenciesFile;
+void AppendWord(std::string& out, uint32_t word) {
+  out.append(reinterpret_cast<const char*>(&word), sizeof(word));
 }
 
-void MaybeLoadDependenciesForPackage(
-    size_t package_id,
-    std::map<std::filesystem::path, std::vector<std::filesystem::path>>&
-        dependencies_per_file) {
-  std::ifstream input_file(GetDependencyFilePathForPackage(package_id));
-  if (!input_file.is_open()) return;
-  std::vector<std::filesystem::path>* dependencies = nullptr;
+void AppendPathRecord(std::string& out, std::string_view path) {
+  AppendWord(out, kPathRecord);
+  AppendWord(out, path.size());
+  out.append(path);
+  out.append((sizeof(uint32_t) - path.size() % sizeof(uint32_t)) %
+                 sizeof(uint32_t),
+             '\0');
+}
 
-  while (true) {
-    std::string line;
-    if (!std::getline(input_file, line)) break;
+void AppendDependenciesRecord(std::string& out, size_t package_id,
+                              uint32_t file_id,
+                              std::span<const uint32_t> path_ids) {
+  AppendWord(out, kDependenciesRecord);
+  AppendWord(out, package_id);
+  AppendWord(out, file_id);
+  AppendWord(out, path_ids.size());
+  for (uint32_t path_id : path_ids) AppendWord(out, path_id);
+}
 
-    if (line.size() == 0) {
-      dependencies = nullptr;
-      continue;
-    }
-    std::filesystem::path path = line;
-    if (dependencies == nullptr) {
-      std::filesystem::path path = line;
-      auto [itr, _] = dependencies_per_file.insert(
-          std::make_pair(path, std::vector<std::filesystem::path>()));
-      dependencies = &itr->second;
+// Loads the records from the database. Stops at the first record that is
+// incomplete or invalid, such as one that was being written when REBS was
+// killed, and what follows it will be overwritten.
+void MaybeLoadDatabase() {
+  if (loaded_database) return;
+  loaded_database = true;
+  ScopedTraceSpan span("Load dependencies", "dependencies");
+
+  std::string_view database = MapFile(GetDependencyDatabasePath());
+  if (!database.starts_with(kDatabaseVersion)) return;
+  const uint32_t* words =
+      reinterpret_cast<const uint32_t*>(database.data()) +
+      kDatabaseVersion.size() / sizeof(uint32_t);
+  size_t word_count =
+      (database.size() - kDatabaseVersion.size()) / sizeof(uint32_t);
+
+  size_t index = 0;
+  while (index < word_count) {
+    size_t remaining_words = word_count - index;
+    if (words[index] == kPathRecord && remaining_words >= 2) {
+      size_t length = words[index + 1];
+      size_t length_in_words =
+          (length + sizeof(uint32_t) - 1) / sizeof(uint32_t);
+      if (remaining_words - 2 < length_in_words) break;
+      std::string_view path(reinterpret_cast<const char*>(&words[index + 2]),
+                            length);
+      path_ids_by_path[path] = paths.size();
+      paths.push_back(path);
+      index += 2 + length_in_words;
+    } else if (words[index] == kDependenciesRecord && remaining_words >= 4) {
+      size_t package_id = words[index + 1];
+      uint32_t file_id = words[index + 2];
+      size_t count = words[index + 3];
+      if (remaining_words - 4 < count || file_id >= paths.size()) break;
+      std::span<const uint32_t> path_ids(&words[index + 4], count);
+      bool valid = true;
+      for (uint32_t path_id : path_ids) valid &= path_id < paths.size();
+      if (!valid) break;
+
+      auto [itr, added] =
+          dependencies_by_package_and_file.insert({{package_id, file_id}, {}});
+      if (!added) {
+        replaced_bytes +=
+            GetSizeOfDependenciesRecord(itr->second.path_ids.size());
+      }
+      itr->second.path_ids = path_ids;
+      index += 4 + count;
     } else {
-      dependencies->push_back(path);
+      break;
     }
   }
-
-  input_file.close();
+  database_size = kDatabaseVersion.size() + index * sizeof(uint32_t);
 }
 
-std::map<std::filesystem::path, std::vector<std::filesystem::path>>*
-GetDependenciesForPackage(size_t package_id) {
-  auto itr = dependencies_per_file_per_package.find(package_id);
-  if (itr != dependencies_per_file_per_package.end()) return &itr->second;
-  auto [itr2, added] = dependencies_per_file_per_package.insert(std::make_pair(
-      package_id,
-      std::map<std::filesystem::path, std::vector<std::filesystem::path>>()));
-  MaybeLoadDependenciesForPackage(package_id, itr2->second);
-  return &itr2->second;
+// Returns the ID of a path, adding it to the string table if it's new. Must be
+// called while holding the lock.
+uint32_t InternPath(const std::string& path) {
+  auto itr = path_ids_by_path.find(path);
+  if (itr != path_ids_by_path.end()) return itr->second;
+
+  std::string_view interned_path = new_paths.emplace_back(path);
+  uint32_t path_id = paths.size();
+  paths.push_back(interned_path);
+  path_ids_by_path[interned_path] = path_id;
+  AppendPathRecord(records_to_append, interned_path);
+  return path_id;
 }
 
-void WriteDependenciesForPackage(size_t package_id) {
-  std::ofstream output_file(GetDependencyFilePathForPackage(package_id));
+// Rewrites the database with only the current records. Path IDs stay the
+// same, so more records can be appended afterwards.
+void CompactDatabase() {
+  std::string contents(kDatabaseVersion);
+  for (std::string_view path : paths) AppendPathRecord(contents, path);
+  for (const auto& [package_and_file, record] :
+       dependencies_by_package_and_file) {
+    AppendDependenciesRecord(contents, package_and_file.first,
+                             package_and_file.second, record.path_ids);
+  }
+
+  // Write to a temporary file and rename it over the database, because the old
+  // database is still mapped.
+  std::filesystem::path database_path = GetDependencyDatabasePath();
+  std::filesystem::path temp_database_path = database_path;
+  temp_database_path += ".tmp";
+  std::ofstream output_file(temp_database_path, std::ios::binary);
   if (!output_file.is_open()) {
-    std::cerr << "Cannot write to "
-              << GetDependencyFilePathForPackage(package_id)
+    std::cerr << "Cannot write to " << temp_database_path
               << ". Output cannot be cached." << std::endl;
     return;
   }
+  output_file << contents;
+  output_file.close();
 
-  auto* dependencies_per_file = GetDependenciesForPackage(package_id);
+  std::error_code error;
+  std::filesystem::rename(temp_database_path, database_path, error);
+  if (error) return;
+  database_size = contents.size();
+  replaced_bytes = 0;
+  records_to_append.clear();
+}
 
-  for (const auto& file_and_dependencies : *dependencies_per_file) {
-    output_file << file_and_dependencies.first.string() << std::endl;
-    for (const auto& dependency : file_and_dependencies.second)
-      output_file << dependency.string() << std::endl;
-    output_file << std::endl;
+// Appends the new records to the end of the database.
+void AppendToDatabase() {
+  std::filesystem::path database_path = GetDependencyDatabasePath();
+  // Truncate anything after the last valid record.
+  std::error_code error;
+  if (database_size > 0)
+    std::filesystem::resize_file(database_path, database_size, error);
+
+  // Start a new database if there wasn't a valid one.
+  std::ofstream output_file(
+      database_path, std::ios::binary |
+                         (database_size > 0 ? std::ios::app : std::ios::trunc));
+  if (!output_file.is_open()) {
+    std::cerr << "Cannot write to " << database_path
+              << ". Output cannot be cached." << std::endl;
+    return;
   }
-
+  if (database_size == 0) {
+    output_file << kDatabaseVersion;
+    database_size = kDatabaseVersion.size();
+  }
+  output_file << records_to_append;
   output_file.close();
+  database_size += records_to_append.size();
+  records_to_append.clear();
 }
 
 }  // namespace
 
-bool AreDependenciesNewerThanFile(size_t package_id, size_t threshold_timestamp,
-                                  std::filesystem::path file) {
-  size_t timestamp_of_destination = GetTimestampOfFile(file);
-
-  // File doesn't exist, so it needs to be created, or it's older than the
-  // treshold.
-  if (timestamp_of_destination == 0 ||
-      threshold_timestamp > timestamp_of_destination) {
-    return true;
+std::vector<bool> AreDependenciesNewerThanFiles(
+    size_t package_id, const std::vector<std::filesystem::path>& files,
+    std::vector<RebuildCause>* opt_causes) {
+  std::vector<bool> out_of_date(files.size(), true);
+  if (opt_causes != nullptr) {
+    opt_causes->assign(files.size(),
+                       {.reason = RebuildReason::NoDependencyRecord,
+                        .file = {}});
+  }
+  // The dependency records of each file, or null if there isn't one.
+  std::vector<const DependencyRecord*> records(files.size(), nullptr);
+  std::vector<uint32_t> file_ids(files.size());
+  // The paths that haven't been looked up before.
+  std::vector<std::pair<std::string_view, uint64_t*>> paths_to_look_up;
+  // The paths that were already being looked up, possibly by another check.
+  std::vector<const uint64_t*> pending_timestamps;
+  {
+    std::scoped_lock lock(dependencies_mutex);
+    MaybeLoadDatabase();
+    timestamps_by_path_id.resize(paths.size(), kUnknownTimestamp);
+
+    auto maybe_look_up_path = [&](uint32_t path_id) {
+      uint64_t& timestamp = timestamps_by_path_id[path_id];
+      if (timestamp == kPendingTimestamp)
+        pending_timestamps.push_back(&timestamp);
+      if (timestamp != kUnknownTimestamp) return;
+      // Looking up the path is now pending, so it's only looked up once.
+      timestamp = kPendingTimestamp;
+      paths_to_look_up.push_back({paths[path_id], &timestamp});
+    };
+
+    for (size_t index = 0; index < files.size(); index++) {
+      auto file_itr = path_ids_by_path.find(files[index].string());
+      // Don't know what the dependencies of this file are, so it needs to be
+      // recalculated.
+      if (file_itr == path_ids_by_path.end()) continue;
+      auto itr = dependencies_by_package_and_file.find(
+          {package_id, file_itr->second});
+      if (itr == dependencies_by_package_and_file.end()) continue;
+
+      file_ids[index] = file_itr->second;
+      records[index] = &itr->second;
+      maybe_look_up_path(file_itr->second);
+      for (uint32_t path_id : itr->second.path_ids)
+        maybe_look_up_path(path_id);
+    }
   }
 
-  auto* dependencies_per_file = GetDependenciesForPackage(package_id);
-
-  auto itr = dependencies_per_file->find(file);
-
-  // Don't know what the dependencies of this file are, so it needs to be
-  // recalculated.
-  if (itr == dependencies_per_file->end()) return true;
-
-  for (const auto& dependency : itr->second) {
-    auto timestamp_of_dependency = GetTimestampOfFile(dependency);
-
-    if (timestamp_of_dependency == 0 ||
-        timestamp_of_dependency > timestamp_of_destination) {
-      // Either the dependency disappeared or is newer than the destination.
-      return true;
+  size_t tasks = (paths_to_look_up.size() + kPathsToLookUpPerTask - 1) /
+                 kPathsToLookUpPerTask;
+  // Written to the shared timestamps once they've all been looked up, because
+  // other checks may be reading them.
+  std::vector<uint64_t> looked_up_timestamps(paths_to_look_up.size());
+  ParallelFor(tasks, [&paths_to_look_up, &looked_up_timestamps](size_t task) {
+    size_t end = std::min((task + 1) * kPathsToLookUpPerTask,
+                          paths_to_look_up.size());
+    for (size_t index = task * kPathsToLookUpPerTask; index < end; index++) {
+      looked_up_timestamps[index] =
+          ReadTimestampOfFile(std::string(paths_to_look_up[index].first));
+    }
+  });
+
+  // Nothing that was looked up will change while the records are read, because
+  // the records of a file are only replaced once its command has completed.
+  std::unique_lock lock(dependencies_mutex);
+  for (size_t index = 0; index < paths_to_look_up.size(); index++)
+    *paths_to_look_up[index].second = looked_up_timestamps[index];
+  if (!paths_to_look_up.empty()) timestamps_looked_up.notify_all();
+  timestamps_looked_up.wait(lock, [&pending_timestamps]() {
+    return std::none_of(pending_timestamps.begin(), pending_timestamps.end(),
+                        [](const uint64_t* timestamp) {
+                          return *timestamp == kPendingTimestamp;
+                        });
+  });
+  for (size_t index = 0; index < files.size(); index++) {
+    if (records[index] == nullptr) continue;
+    uint64_t timestamp_of_destination = timestamps_by_path_id[file_ids[index]];
+    // File doesn't exist, so it needs to be created.
+    if (timestamp_of_destination == 0) {
+      if (opt_causes != nullptr)
+        (*opt_causes)[index].reason = RebuildReason::MissingOutput;
+      continue;
+    }
+    auto newer_dependency = std::find_if(
+        records[index]->path_ids.begin(), records[index]->path_ids.end(),
+        [timestamp_of_destination](uint32_t path_id) {
+          uint64_t timestamp_of_dependency = timestamps_by_path_id[path_id];
+          // Either the dependency disappeared or is newer than the
+          // destination.
+          return timestamp_of_dependency == 0 ||
+                 timestamp_of_dependency > timestamp_of_destination;
+        });
+    out_of_date[index] = newer_dependency != records[index]->path_ids.end();
+    if (opt_causes == nullptr) continue;
+    if (out_of_date[index]) {
+      (*opt_causes)[index] = {
+          .reason = timestamps_by_path_id[*newer_dependency] == 0
+                        ? RebuildReason::MissingDependency
+                        : RebuildReason::NewerDependency,
+          .file = paths[*newer_dependency]};
+    } else {
+      (*opt_causes)[index] = {};
     }
   }
-  return false;
+  return out_of_date;
 }
 
 void SetDependenciesOfFile(
     size_t package_id, const std::filesystem::path& file,
     const std::vector<std::filesystem::path>& dependencies) {
-  auto* dependencies_per_file = GetDependenciesForPackage(package_id);
-  auto itr = dependencies_per_file->find(file);
-  if (itr != dependencies_per_file->end()) {
-    const auto& old_dependencies = itr->second;
-    if (old_dependencies.size() == dependencies.size()) {
-      bool anything_changed = false;
-      for (int i = 0; i < dependencies.size() && !anything_changed; i++) {
-        if (old_dependencies[i] != dependencies[i]) anything_changed = true;
-      }
-      if (!anything_changed) return;
+  std::scoped_lock lock(dependencies_mutex);
+  MaybeLoadDatabase();
+  std::vector<uint32_t> path_ids;
+  path_ids.reserve(dependencies.size());
+  for (const auto& dependency : dependencies)
+    path_ids.push_back(InternPath(dependency.string()));
+  uint32_t file_id = InternPath(file.string());
+
+  auto [itr, added] =
+      dependencies_by_package_and_file.insert({{package_id, file_id}, {}});
+  DependencyRecord& record = itr->second;
+  if (!added) {
+    if (std::equal(record.path_ids.begin(), record.path_ids.end(),
+                   path_ids.begin(), path_ids.end())) {
+      return;
     }
+    replaced_bytes += GetSizeOfDependenciesRecord(record.path_ids.size());
   }
 
-  (*dependencies_per_file)[file] = dependencies;
-  packages_with_invalidated_dependencies.insert(package_id);
+  record.new_path_ids = std::move(path_ids);
+  record.path_ids = record.new_path_ids;
+  AppendDependenciesRecord(records_to_append, package_id, file_id,
+                           record.path_ids);
+}
+
+std::vector<std::filesystem::path> GetDependenciesOfFile(
+    size_t package_id, const std::filesystem::path& file) {
+  std::scoped_lock lock(dependencies_mutex);
+  MaybeLoadDatabase();
+  std::vector<std::filesystem::path> dependencies;
+  auto file_itr = path_ids_by_path.find(file.string());
+  if (file_itr == path_ids_by_path.end()) return dependencies;
+  auto itr =
+      dependencies_by_package_and_file.find({package_id, file_itr->second});
+  if (itr == dependencies_by_package_and_file.end()) return dependencies;
+  dependencies.reserve(itr->second.path_ids.size());
+  for (uint32_t path_id : itr->second.path_ids)
+    dependencies.push_back(paths[path_id]);
+  return dependencies;
+}
+
+void InvalidateTimestampsOfDependencies() {
+  std::scoped_lock lock(dependencies_mutex);
+  timestamps_by_path_id.clear();
 }
 
 void FlushDependencies() {
-  for (size_t package_id : packages_with_invalidated_dependencies)
-    WriteDependenciesForPackage(package_id);
+  if (records_to_append.empty()) return;
+  if (replaced_bytes >= kMinimumBytesToCompact &&
+      replaced_bytes * 2 > database_size + records_to_append.size()) {
+    CompactDatabase();
+  } else {
+    AppendToDatabase();
+  }
 }
 
 std::vector<std::filesystem::path> ReadDependenciesFromFile(
@@ -183,10 +457,10 @@ std::vector<std::filesystem::path> ReadDependenciesFromFile(
 
   bool encountered_first_colon = false;
   std::vector<std::filesystem::path> dependencies;
-  int start_index = 0;
-  int path_length = 0;
+  size_t start_index = 0;
+  size_t path_length = 0;
 
-  auto is_escaped_space = [&input_contents](int index) -> bool {
+  auto is_escaped_space = [&input_contents](size_t index) -> bool {
     return input_contents[index] == '\\' &&
            (index + 1) < input_contents.size() &&
            input_contents[index + 1] == ' ';
@@ -194,12 +468,12 @@ std::vector<std::filesystem::path> ReadDependenciesFromFile(
 
   auto maybe_add_path = [&start_index, &path_length, &dependencies,
                          &input_contents, &is_escaped_space]() {
-    if (path_length <= 0) return;
+    if (path_length == 0) return;
 
     std::string path_str;
     path_str.reserve(path_length);
     bool encountered_non_space = false;
-    for (int i = 0, index = start_index; i < path_length; i++, index++) {
+    for (size_t i = 0, index = start_index; i < path_length; i++, index++) {
       if (is_escaped_space(index)) {
         path_str += ' ';
         index++;  // Skip over escaped path.
@@ -212,7 +486,7 @@ std::vector<std::filesystem::path> ReadDependenciesFromFile(
     if (encountered_non_space) dependencies.push_back(path_str);
   };
 
-  for (int i = 0; i < input_contents.size(); i++) {
+  for (size_t i = 0; i < input_contents.size(); i++) {
     char c = input_contents[i];
 
     // Skip everything before and including the initial colon.
@@ -21,16 +21,35 @@
 #include <string>
 #include <vector>
 
-// Returns if the dependencies are newer than a file, or if there are no records
-// of the dependencies.
-bool AreDependenciesNewerThanFile(size_t package_id, size_t threshold_timestamp,
-                                  std::filesystem::path file);
+#include "explain.h"
+
+// The dependencies of every object file are stored in a single database in the
+// temp directory, with each unique path stored once, which is mapped into
+// memory and appended to as dependencies change.
+
+// Returns whether each file's dependencies are newer than it, or if there are
+// no records of its dependencies. The timestamps are looked up in parallel and
+// remembered by path, so each file and dependency is only looked up once no
+// matter how many files depend on it. If `opt_causes` is not null, it is
+// populated with why each file that's out of date is. Thread safe.
+std::vector<bool> AreDependenciesNewerThanFiles(
+    size_t package_id, const std::vector<std::filesystem::path>& files,
+    std::vector<RebuildCause>* opt_causes = nullptr);
 
 // Sets the dependencies of a file.
 void SetDependenciesOfFile(
     size_t package_id, const std::filesystem::path& file,
     const std::vector<std::filesystem::path>& dependencies);
 
+// Returns the dependencies recorded the last time a file was built, or nothing
+// if there is no record of them.
+std::vector<std::filesystem::path> GetDependenciesOfFile(
+    size_t package_id, const std::filesystem::path& file);
+
+// Forgets the timestamps looked up while checking dependencies, so that files
+// that have changed since are looked up again.
+void InvalidateTimestampsOfDependencies();
+
 // Flush any changes to the dependencies to disk.
 void FlushDependencies();
 
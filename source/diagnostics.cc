@@ -0,0 +1,127 @@
+// Copyright 2024 Google LLC
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//      http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+
+#include "diagnostics.h"
+
+#include <mutex>
+#include <set>
+#include <string>
+#include <string_view>
+#include <vector>
+
+namespace {
+
+// Guards `printed_diagnostics`.
+std::mutex diagnostics_mutex;
+
+// The diagnostics that have been printed during this run.
+std::set<std::string> printed_diagnostics;
+
+// Returns whether a line reports an error or a warning.
+bool IsDiagnosticLine(std::string_view line) {
+  return line.find(": error:") != std::string_view::npos ||
+         line.find(": fatal error:") != std::string_view::npos ||
+         line.find(": warning:") != std::string_view::npos;
+}
+
+// Returns whether a line describes where the diagnostic after it came from,
+// such as the chain of files that included a header, or the function it's in.
+bool IsContextLine(std::string_view line) {
+  if (line.starts_with("In file included from ") ||
+      line.starts_with("In module ") ||
+      line.find(": In ") != std::string_view::npos) {
+    return true;
+  }
+  size_t first_character = line.find_first_not_of(' ');
+  return first_character != 0 && first_character != std::string_view::npos &&
+         line.substr(first_character).starts_with("from ");
+}
+
+// Returns whether a line summarizes the diagnostics, such as Clang's
+// "2 errors generated.", which ends the last diagnostic rather than being part
+// of it.
+bool IsSummaryLine(std::string_view line) {
+  while (!line.empty() && (line.back() == '\n' || line.back() == '\r'))
+    line.remove_suffix(1);
+  return line.ends_with(" generated.") || line == "compilation terminated.";
+}
+
+// A diagnostic being gathered from the output.
+struct Diagnostic {
+  // The lines before the diagnostic's line, which describe where it came from.
+  std::string context;
+  // The diagnostic's line and the lines after it. This is what's compared,
+  // because the same diagnostic in a header is included from a different
+  // chain of files each time.
+  std::string body;
+  bool has_diagnostic_line = false;
+};
+
+}  // namespace
+
+std::string RemoveRepeatedDiagnostics(std::string_view output) {
+  std::string result;
+  int hidden_diagnostics = 0;
+  Diagnostic diagnostic;
+
+  std::scoped_lock lock(diagnostics_mutex);
+  auto finish_diagnostic = [&]() {
+    if (diagnostic.has_diagnostic_line) {
+      if (printed_diagnostics.insert(diagnostic.body).second) {
+        result += diagnostic.context;
+        result += diagnostic.body;
+      } else {
+        hidden_diagnostics++;
+      }
+    } else {
+      // Context that wasn't followed by a diagnostic.
+      result += diagnostic.context;
+    }
+    diagnostic = Diagnostic();
+  };
+
+  while (!output.empty()) {
+    size_t line_end = output.find('\n');
+    line_end = line_end == std::string_view::npos ? output.size() : line_end + 1;
+    std::string_view line = output.substr(0, line_end);
+    output.remove_prefix(line_end);
+
+    if (IsContextLine(line)) {
+      if (diagnostic.has_diagnostic_line) finish_diagnostic();
+      diagnostic.context += line;
+    } else if (IsDiagnosticLine(line)) {
+      if (diagnostic.has_diagnostic_line) finish_diagnostic();
+      diagnostic.body += line;
+      diagnostic.has_diagnostic_line = true;
+    } else if (diagnostic.has_diagnostic_line && !IsSummaryLine(line)) {
+      diagnostic.body += line;
+    } else {
+      // A line that isn't part of a diagnostic.
+      finish_diagnostic();
+      result += line;
+    }
+  }
+  finish_diagnostic();
+
+  if (hidden_diagnostics > 0) {
+    if (!result.empty() && result.back() != '\n') result += '\n';
+    result += hidden_diagnostics == 1
+                  ? "1 diagnostic was hidden because it was already printed.\n"
+                  : std::to_string(hidden_diagnostics) +
+                        " diagnostics were hidden because they were already "
+                        "printed.\n";
+  }
+  return result;
+}
@@ -0,0 +1,31 @@
+// Copyright 2024 Google LLC
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//      http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+
+#pragma once
+
+#include <string>
+#include <string_view>
+
+// Compilers report the same error or warning in a header once for every source
+// file that includes it, which can bury the first useful diagnostic. Each
+// diagnostic is only printed the first time it's seen during a run. A
+// diagnostic is the line with the error or warning, along with the lines
+// describing where it was included or instantiated from before it, and the
+// notes and source snippets after it.
+
+// Returns the output of a failed command with the diagnostics that have already
+// been printed during this run removed, and remembers the rest as printed.
+// Output that isn't part of a diagnostic is kept. Thread safe.
+std::string RemoveRepeatedDiagnostics(std::string_view output);
@@ -0,0 +1,199 @@
+// Copyright 2024 Google LLC
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//      http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+#include "directory_manifest.h"
+
+#include <stddef.h>
+
+#include <algorithm>
+#include <chrono>
+#include <cstdint>
+#include <filesystem>
+#include <fstream>
+#include <functional>
+#include <iostream>
+#include <map>
+#include <mutex>
+#include <string>
+#include <system_error>
+#include <vector>
+
+#include "temp_directory.h"
+#include "timestamps.h"
+
+namespace {
+
+// The name of the file that is created in a package's temporary directory that
+// contains the files in each of the package's directories.
+constexpr char kDirectoryManifestFile[] = "directory_manifest";
+
+// A directory that was modified this recently, in milliseconds, before it was
+// listed could be modified again without its timestamp changing, so it's
+// listed again next time.
+constexpr uint64_t kRacyTimestampInterval = 2000;
+
+// The entries in a directory the last time it was listed.
+struct DirectoryListing {
+  // The timestamp of the directory when it was listed, or 0 if it must be
+  // listed again next time.
+  uint64_t timestamp = 0;
+  // The names of the files and subdirectories in the directory, in order.
+  std::vector<std::string> files;
+  std::vector<std::string> subdirectories;
+  // Whether the directory was visited during this run. Directories that
+  // weren't are dropped from the manifest when it's written.
+  bool visited = false;
+};
+
+struct DirectoryManifest {
+  std::map<std::string, DirectoryListing> listings_by_directory;
+  bool changed = false;
+};
+
+// A mapping of Package ID -> Manifest. std::map doesn't move its values, so a
+// manifest can be used without holding the lock.
+std::map<size_t, DirectoryManifest> manifests_by_package;
+std::mutex manifests_mutex;
+
+std::filesystem::path GetManifestFilePathForPackage(size_t package_id) {
+  return GetTempDirectoryPathForPackageID(package_id) / kDirectoryManifestFile;
+}
+
+void ReadNames(std::ifstream& input_file, size_t count,
+               std::vector<std::string>& names) {
+  std::string name;
+  for (size_t i = 0; i < count && std::getline(input_file, name); i++)
+    names.push_back(name);
+}
+
+void LoadManifestForPackage(size_t package_id, DirectoryManifest& manifest) {
+  std::ifstream input_file(GetManifestFilePathForPackage(package_id));
+  if (!input_file.is_open()) return;
+
+  std::string directory;
+  while (std::getline(input_file, directory)) {
+    // The directory is followed by its timestamp and how many files and
+    // subdirectories it contains, then their names.
+    DirectoryListing listing;
+    size_t files = 0;
+    size_t subdirectories = 0;
+    if (!(input_file >> listing.timestamp >> files >> subdirectories)) break;
+    input_file.ignore(1);
+    ReadNames(input_file, files, listing.files);
+    ReadNames(input_file, subdirectories, listing.subdirectories);
+    if (!input_file) break;
+    manifest.listings_by_directory[directory] = std::move(listing);
+  }
+}
+
+DirectoryManifest& GetManifestForPackage(size_t package_id) {
+  std::scoped_lock lock(manifests_mutex);
+  auto itr = manifests_by_package.find(package_id);
+  if (itr != manifests_by_package.end()) return itr->second;
+  DirectoryManifest& manifest = manifests_by_package[package_id];
+  LoadManifestForPackage(package_id, manifest);
+  return manifest;
+}
+
+void WriteManifestForPackage(size_t package_id,
+                             const DirectoryManifest& manifest) {
+  std::ofstream output_file(GetManifestFilePathForPackage(package_id));
+  if (!output_file.is_open()) {
+    std::cerr << "Cannot write to " << GetManifestFilePathForPackage(package_id)
+              << ". Directories will be listed again next time." << std::endl;
+    return;
+  }
+
+  for (const auto& [directory, listing] : manifest.listings_by_directory) {
+    if (!listing.visited) continue;
+    output_file << directory << "\n"
+                << listing.timestamp << " " << listing.files.size() << " "
+                << listing.subdirectories.size() << "\n";
+    for (const auto& name : listing.files) output_file << name << "\n";
+    for (const auto& name : listing.subdirectories) output_file << name << "\n";
+  }
+}
+
+uint64_t GetMillisecondsSinceEpoch() {
+  return std::chrono::duration_cast<std::chrono::milliseconds>(
+             std::chrono::system_clock::now().time_since_epoch())
+      .count();
+}
+
+// Lists the entries in a directory.
+DirectoryListing ListDirectory(const std::filesystem::path& directory,
+                               uint64_t timestamp) {
+  DirectoryListing listing;
+  if (timestamp + kRacyTimestampInterval < GetMillisecondsSinceEpoch())
+    listing.timestamp = timestamp;
+
+  std::error_code error;
+  for (std::filesystem::directory_iterator itr(directory, error), end;
+       !error && itr != end; itr.increment(error)) {
+    std::string filename = itr->path().filename().string();
+    // Skip hidden files.
+    if (filename.size() == 0 || filename[0] == '.') continue;
+
+    std::error_code type_error;
+    if (itr->is_directory(type_error)) {
+      listing.subdirectories.push_back(filename);
+    } else {
+      listing.files.push_back(filename);
+    }
+  }
+  std::sort(listing.files.begin(), listing.files.end());
+  std::sort(listing.subdirectories.begin(), listing.subdirectories.end());
+  return listing;
+}
+
+void ForEachFileInDirectory(
+    DirectoryManifest& manifest, const std::filesystem::path& directory,
+    const std::filesystem::path& relative_directory,
+    const std::function<void(const std::filesystem::path& relative_path)>&
+        on_each_file) {
+  uint64_t timestamp = GetTimestampOfFile(directory);
+  DirectoryListing& listing =
+      manifest.listings_by_directory[directory.string()];
+  if (timestamp == 0 || listing.timestamp != timestamp) {
+    DirectoryListing new_listing = ListDirectory(directory, timestamp);
+    manifest.changed |= new_listing.timestamp != listing.timestamp ||
+                        new_listing.files != listing.files ||
+                        new_listing.subdirectories != listing.subdirectories;
+    listing = std::move(new_listing);
+  }
+  listing.visited = true;
+
+  for (const auto& file : listing.files) on_each_file(relative_directory / file);
+  for (const auto& subdirectory : listing.subdirectories) {
+    ForEachFileInDirectory(manifest, directory / subdirectory,
+                           relative_directory / subdirectory, on_each_file);
+  }
+}
+
+}  // namespace
+
+void ForEachFileInDirectory(
+    size_t package_id, const std::filesystem::path& directory,
+    const std::function<void(const std::filesystem::path& relative_path)>&
+        on_each_file) {
+  ForEachFileInDirectory(GetManifestForPackage(package_id), directory,
+                         std::filesystem::path(), on_each_file);
+}
+
+void FlushDirectoryManifests() {
+  for (auto& [package_id, manifest] : manifests_by_package) {
+    if (manifest.changed) WriteManifestForPackage(package_id, manifest);
+    manifest.changed = false;
+  }
+}
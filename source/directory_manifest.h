@@ -0,0 +1,37 @@
+// Copyright 2024 Google LLC
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//      http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+#pragma once
+
+#include <stddef.h>
+
+#include <filesystem>
+#include <functional>
+
+// Remembers the files in each of a package's directories between runs, along
+// with the timestamp of the directory when it was listed. Adding, removing or
+// renaming an entry in a directory updates its timestamp, so only directories
+// whose timestamps have changed are listed again.
+
+// Calls `on_each_file` with the path, relative to `directory`, of each file in
+// the directory and its subdirectories, skipping hidden files and directories.
+// The files are visited in the same order every time. Thread safe, as long as
+// each package is only listed by one thread at a time.
+void ForEachFileInDirectory(
+    size_t package_id, const std::filesystem::path& directory,
+    const std::function<void(const std::filesystem::path& relative_path)>&
+        on_each_file);
+
+// Flush any changes to the directory manifests to disk.
+void FlushDirectoryManifests();
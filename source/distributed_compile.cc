@@ -0,0 +1,616 @@
+// Copyright 2024 Google LLC
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//      http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+
+#include "distributed_compile.h"
+
+#include <algorithm>
+#include <atomic>
+#include <condition_variable>
+#include <cstdint>
+#include <deque>
+#include <filesystem>
+#include <fstream>
+#include <functional>
+#include <iostream>
+#include <memory>
+#include <mutex>
+#include <optional>
+#include <random>
+#include <semaphore>
+#include <sstream>
+#include <string>
+#include <string_view>
+#include <thread>
+#include <vector>
+
+#include "config.h"
+#include "deferred_command.h"
+#include "execute.h"
+#include "network.h"
+#include "response_file.h"
+#include "temp_directory.h"
+
+namespace {
+
+// The port compile servers listen on if one isn't specified.
+constexpr std::string_view kDefaultCompileServerPort = "8377";
+
+// Sent at the start of every request, so mismatched versions of REBS don't
+// misunderstand each other.
+constexpr std::string_view kProtocolVersion = "rebs compile 1";
+
+// How long to wait on a remote worker before giving up. Compiles can be slow,
+// so this is generous.
+constexpr int kTimeoutSeconds = 5 * 60;
+
+// After this many requests to a remote worker fail in a row, it is treated as
+// unreachable for the rest of the run.
+constexpr int kMaxConsecutiveFailures = 3;
+
+// The largest string the compile server will accept, which guards against
+// garbage requests.
+constexpr uint64_t kMaxStringSize = 1024 * 1024 * 1024;
+// The most arguments the compile server will accept.
+constexpr uint64_t kMaxArguments = 64 * 1024;
+
+// The name of the preprocessed source file inside of the temp directory, which
+// is followed by the worker ID.
+constexpr char kPreprocessedFilePrefix[] = "preprocessed_";
+// The name of the directory inside of the temp directory the compile server
+// compiles in.
+constexpr char kCompileServerSubdirectoryName[] = "compile_server";
+
+// Compilers that remote workers may run. They may also have a version suffix,
+// such as "clang++-17".
+constexpr std::string_view kAllowedCompilers[] = {"cc",  "c++",   "gcc",
+                                                  "g++", "clang", "clang++"};
+
+// The only arguments that compile servers accept, other than "-c". Anything
+// else is refused, because it might read or write files other than the source
+// and object, or run other programs.
+constexpr std::string_view kAllowedArguments[] = {
+    "-ansi", "-pedantic", "-pedantic-errors", "-pipe", "-pthread", "-w"};
+
+// The prefixes of the code generation, optimization, debug info, language
+// standard and warning arguments that compile servers accept.
+constexpr std::string_view kAllowedArgumentPrefixes[] = {
+    "--std=", "--target=", "-O", "-W", "-f", "-g", "-m", "-std="};
+
+// Arguments with an allowed prefix that are still refused, because they read
+// or write other files, load code, or pass arguments on to other programs.
+constexpr std::string_view kDisallowedArgumentPrefixes[] = {
+    "-Wa,",
+    "-Wl,",
+    "-Wp,",
+    "-fauto-profile",
+    "-fbasic-block-sections",
+    "-fcallgraph-info",
+    "-fcoverage-data-file",
+    "-fcoverage-notes-file",
+    "-fcrash-diagnostics",
+    "-fcs-profile",
+    "-fdebug-prefix-map",
+    "-fdeps",
+    "-fdiagnostics-add-output",
+    "-fdiagnostics-format",
+    "-fdiagnostics-set-output",
+    "-fdump",
+    "-fembed-offload-object",
+    "-fexperimental-sanitize-metadata-ignorelist",
+    "-ffile-prefix-map",
+    "-fmacro-prefix-map",
+    "-fmemory-profile",
+    "-fmodule",
+    "-fopenmp-host-ir-file-path",
+    "-fopt-info",
+    "-fpass-plugin",
+    "-fplugin",
+    "-fprebuilt-module",
+    "-fproc-stat-report",
+    "-fprofile",
+    "-fsanitize-blacklist",
+    "-fsanitize-coverage-allowlist",
+    "-fsanitize-coverage-blacklist",
+    "-fsanitize-coverage-ignorelist",
+    "-fsanitize-coverage-whitelist",
+    "-fsanitize-ignorelist",
+    "-fsanitize-system-ignorelist",
+    "-fsave-optimization-record",
+    "-fself-test",
+    "-fstack-usage",
+    "-ftest-coverage",
+    "-fthinlto-index",
+    "-ftime-trace",
+    "-fuse-ld",
+    "-fxray",
+    "-gsplit-dwarf",
+    "-mllvm"};
+
+// Preprocessor arguments, which are removed before sending a command to a
+// remote worker, and whether they take a separate value if they're not joined
+// with one. The first prefix that an argument starts with is used, so
+// "-include-pch" comes before "-include".
+struct PreprocessorArgument {
+  std::string_view prefix;
+  bool takes_value;
+};
+constexpr PreprocessorArgument kPreprocessorArguments[] = {
+    {"-D", true},        {"-I", true},       {"-U", true},
+    {"-MD", false},      {"-MMD", false},    {"-MP", false},
+    {"-MF", true},       {"-MQ", true},      {"-MT", true},
+    {"-idirafter", true}, {"-imacros", true}, {"-include-pch", true},
+    {"-include", true},  {"-iquote", true},  {"-isystem", true}};
+
+// The file extensions of sources that can be preprocessed, and the extension of
+// the preprocessed source.
+constexpr std::pair<std::string_view, std::string_view>
+    kPreprocessedExtensions[] = {{".c", ".i"},   {".C", ".ii"},  {".c++", ".ii"},
+                                 {".cc", ".ii"}, {".cpp", ".ii"}, {".cxx", ".ii"}};
+
+// A remote worker to compile on.
+struct RemoteWorker {
+  std::string host;
+  std::string port;
+  std::atomic<int> consecutive_failures = 0;
+};
+
+// A job waiting for a connection to a remote worker.
+struct QueuedJob {
+  RemoteCompileJob job;
+  std::function<void(RemoteCompileResult)> on_complete;
+};
+
+std::vector<std::unique_ptr<RemoteWorker>> remote_workers;
+// Each slot has a thread with its own connection to a remote worker.
+std::vector<std::thread> slot_threads;
+
+// Guards the fields below.
+std::mutex jobs_mutex;
+std::condition_variable job_queued;
+std::deque<QueuedJob> queued_jobs;
+// The number of slots that are not reserved, on remote workers that can be
+// reached.
+int available_slots = 0;
+bool shutting_down = false;
+
+// Used to give the compile server's files unique names that clients can't
+// predict, so they can't plant files for a later job to read.
+std::mutex job_name_mutex;
+std::random_device job_name_random_device;
+
+// Returns whether the program is a compiler that remote workers may run.
+bool IsAllowedCompiler(std::string_view program) {
+  for (std::string_view compiler : kAllowedCompilers) {
+    if (program == compiler) return true;
+    if (!program.starts_with(compiler) || program.size() <= compiler.size() + 1 ||
+        program[compiler.size()] != '-')
+      continue;
+    std::string_view version = program.substr(compiler.size() + 1);
+    if (version.find_first_not_of("0123456789.") == std::string_view::npos)
+      return true;
+  }
+  return false;
+}
+
+// Returns whether a compile server may run a compiler with these arguments.
+// The compile server adds the input and output files itself.
+bool AreRemoteArgumentsAllowed(const std::vector<std::string>& arguments) {
+  if (arguments.empty() || !IsAllowedCompiler(arguments[0])) return false;
+  bool compile_only = false;
+  for (size_t index = 1; index < arguments.size(); index++) {
+    std::string_view argument = arguments[index];
+    // Anything that isn't a flag would be another file.
+    if (!argument.starts_with("-")) return false;
+    if (argument == "-c") {
+      compile_only = true;
+      continue;
+    }
+    if (std::find(std::begin(kAllowedArguments), std::end(kAllowedArguments),
+                  argument) != std::end(kAllowedArguments))
+      continue;
+    if (std::none_of(std::begin(kAllowedArgumentPrefixes),
+                     std::end(kAllowedArgumentPrefixes),
+                     [argument](std::string_view prefix) {
+                       return argument.starts_with(prefix);
+                     }))
+      return false;
+    for (std::string_view prefix : kDisallowedArgumentPrefixes)
+      if (argument.starts_with(prefix)) return false;
+  }
+  return compile_only;
+}
+
+// Returns a name for a compile server job's files that can't be predicted.
+std::string GenerateJobName() {
+  constexpr char kHexDigits[] = "0123456789abcdef";
+  std::string name = "job_";
+  std::scoped_lock lock(job_name_mutex);
+  for (int i = 0; i < 4; i++) {
+    uint32_t random = job_name_random_device();
+    for (int digit = 0; digit < 8; digit++) {
+      name.push_back(kHexDigits[random & 0xF]);
+      random >>= 4;
+    }
+  }
+  return name;
+}
+
+// Returns the preprocessor argument that an argument is, if it is one.
+const PreprocessorArgument* FindPreprocessorArgument(std::string_view argument) {
+  for (const auto& preprocessor_argument : kPreprocessorArguments) {
+    if (argument.starts_with(preprocessor_argument.prefix))
+      return &preprocessor_argument;
+  }
+  return nullptr;
+}
+
+// Returns the extension to give the preprocessed version of a source file, or
+// nothing if it can't be preprocessed.
+std::optional<std::string_view> GetPreprocessedExtension(
+    const std::filesystem::path& source_file) {
+  std::string extension = source_file.extension().string();
+  for (const auto& [source_extension, preprocessed_extension] :
+       kPreprocessedExtensions) {
+    if (extension == source_extension) return preprocessed_extension;
+  }
+  return std::nullopt;
+}
+
+void AppendNumber(std::string& message, uint64_t number) {
+  for (int byte = 0; byte < 8; byte++)
+    message.push_back(static_cast<char>((number >> (byte * 8)) & 0xFF));
+}
+
+void AppendString(std::string& message, std::string_view str) {
+  AppendNumber(message, str.size());
+  message.append(str);
+}
+
+bool ReceiveNumber(int socket, uint64_t& number) {
+  std::string bytes;
+  if (!ReceiveExactly(socket, 8, bytes)) return false;
+  number = 0;
+  for (int byte = 0; byte < 8; byte++)
+    number |= static_cast<uint64_t>(static_cast<unsigned char>(bytes[byte]))
+              << (byte * 8);
+  return true;
+}
+
+bool ReceiveString(int socket, std::string& str) {
+  uint64_t size;
+  return ReceiveNumber(socket, size) && size <= kMaxStringSize &&
+         ReceiveExactly(socket, size, str);
+}
+
+std::optional<std::string> ReadFileIntoString(
+    const std::filesystem::path& path) {
+  std::ifstream input_file(path, std::ios::binary);
+  if (!input_file.is_open()) return std::nullopt;
+  std::stringstream buffer;
+  buffer << input_file.rdbuf();
+  return buffer.str();
+}
+
+bool WriteStringToFile(const std::filesystem::path& path,
+                       std::string_view contents) {
+  std::ofstream output_file(path, std::ios::binary);
+  if (!output_file.is_open()) return false;
+  output_file.write(contents.data(), contents.size());
+  output_file.close();
+  return static_cast<bool>(output_file);
+}
+
+// Compiles one request on the compile server. Returns whether it was
+// successful, and populates the compiler's output and the object.
+bool CompileRequest(std::vector<std::string> arguments,
+                    std::string_view source_extension,
+                    std::string_view preprocessed_source,
+                    std::counting_semaphore<>& compile_slots,
+                    std::string& output, std::string& object) {
+  if (!AreRemoteArgumentsAllowed(arguments) ||
+      (source_extension != ".i" && source_extension != ".ii")) {
+    output = "The compile server does not allow this command.";
+    return false;
+  }
+
+  std::filesystem::path job_path =
+      GetTempDirectoryPath() / kCompileServerSubdirectoryName /
+      GenerateJobName();
+  std::filesystem::path source_path = job_path.string() + std::string(source_extension);
+  std::filesystem::path object_path = job_path.string() + ".o";
+  if (!WriteStringToFile(source_path, preprocessed_source)) {
+    output = "The compile server cannot write the source file.";
+    return false;
+  }
+
+  arguments.push_back(source_path.string());
+  arguments.push_back("-o");
+  arguments.push_back(object_path.string());
+
+  compile_slots.acquire();
+  bool successful = ExecuteArguments(arguments, output);
+  compile_slots.release();
+
+  if (successful) {
+    auto contents = ReadFileIntoString(object_path);
+    if (contents) {
+      object = std::move(*contents);
+    } else {
+      output = "The compile server cannot read the object file.";
+      successful = false;
+    }
+  }
+
+  std::error_code error;
+  std::filesystem::remove(source_path, error);
+  std::filesystem::remove(object_path, error);
+  return successful;
+}
+
+// Handles the requests on a connection to the compile server until it closes.
+void ServeConnection(int connection,
+                     std::counting_semaphore<>& compile_slots) {
+  while (true) {
+    std::string version;
+    uint64_t argument_count;
+    if (!ReceiveString(connection, version) || version != kProtocolVersion ||
+        !ReceiveNumber(connection, argument_count) ||
+        argument_count > kMaxArguments)
+      break;
+
+    std::vector<std::string> arguments(argument_count);
+    std::string source_extension;
+    std::string preprocessed_source;
+    bool received = true;
+    for (auto& argument : arguments)
+      received = received && ReceiveString(connection, argument);
+    if (!received || !ReceiveString(connection, source_extension) ||
+        !ReceiveString(connection, preprocessed_source))
+      break;
+
+    std::string output;
+    std::string object;
+    bool successful =
+        CompileRequest(std::move(arguments), source_extension,
+                       preprocessed_source, compile_slots, output, object);
+
+    std::string response;
+    AppendNumber(response, successful ? 1 : 0);
+    AppendString(response, output);
+    AppendString(response, object);
+    if (!SendAll(connection, response)) break;
+  }
+  CloseSocket(connection);
+}
+
+// Sends a job to a remote worker, reusing the connection if it's still open.
+RemoteCompileResult SendJobToWorker(const RemoteWorker& worker, int& connection,
+                                    const RemoteCompileJob& job) {
+  std::string request;
+  AppendString(request, kProtocolVersion);
+  AppendNumber(request, job.arguments.size());
+  for (const auto& argument : job.arguments) AppendString(request, argument);
+  AppendString(request, job.source_extension);
+  AppendString(request, job.preprocessed_source);
+
+  // A reused connection may have been closed by the worker while it was idle,
+  // so retry once with a new connection.
+  RemoteCompileResult result;
+  for (int attempt = 0; attempt < 2; attempt++) {
+    bool reused = connection >= 0;
+    if (!reused) {
+      connection = ConnectToServer(worker.host, worker.port, kTimeoutSeconds);
+      if (connection < 0) return result;
+    }
+
+    uint64_t successful;
+    std::string object;
+    if (SendAll(connection, request) && ReceiveNumber(connection, successful) &&
+        ReceiveString(connection, result.output) &&
+        ReceiveString(connection, object)) {
+      result.reached_worker = true;
+      result.successful = successful != 0;
+      if (result.successful && !WriteStringToFile(job.object_file, object)) {
+        result.successful = false;
+        result.output = "Cannot write " + job.object_file.string();
+      }
+      return result;
+    }
+    CloseSocket(connection);
+    connection = -1;
+    if (!reused) return result;
+  }
+  return result;
+}
+
+// Runs the jobs for a slot on a remote worker.
+void RunSlot(RemoteWorker& worker) {
+  int connection = -1;
+  while (true) {
+    QueuedJob queued_job;
+    {
+      std::unique_lock lock(jobs_mutex);
+      job_queued.wait(lock,
+                      []() { return !queued_jobs.empty() || shutting_down; });
+      if (queued_jobs.empty()) break;
+      queued_job = std::move(queued_jobs.front());
+      queued_jobs.pop_front();
+    }
+
+    RemoteCompileResult result;
+    if (worker.consecutive_failures < kMaxConsecutiveFailures) {
+      result = SendJobToWorker(worker, connection, queued_job.job);
+      if (result.reached_worker) {
+        worker.consecutive_failures = 0;
+      } else if (++worker.consecutive_failures == kMaxConsecutiveFailures) {
+        std::cerr << "Cannot reach the remote worker at " << worker.host << ":"
+                  << worker.port
+                  << ". It won't be used for the rest of this build."
+                  << std::endl;
+      }
+    }
+
+    // Slots on unreachable workers are not made available again.
+    bool reachable = worker.consecutive_failures < kMaxConsecutiveFailures;
+    if (reachable) {
+      std::scoped_lock lock(jobs_mutex);
+      available_slots++;
+    }
+    queued_job.on_complete(std::move(result));
+    if (!reachable) break;
+  }
+  if (connection >= 0) CloseSocket(connection);
+}
+
+}  // namespace
+
+bool RunCompileServer(std::string_view port) {
+  std::string port_str(port.empty() ? kDefaultCompileServerPort : port);
+  int listening_socket = ListenOnPort(port_str);
+  if (listening_socket < 0) {
+    std::cerr << "Cannot listen on port " << port_str << "." << std::endl;
+    return false;
+  }
+  EnsureDirectoriesAndParentsExist(GetTempDirectoryPath() /
+                                   kCompileServerSubdirectoryName);
+
+  // Limit how many compiles run at once, no matter how many machines are
+  // connected.
+  std::counting_semaphore<> compile_slots(
+      std::max(GetNumberOfParallelTasks(), 1));
+  std::cout << "Compile server listening on port " << port_str << "."
+            << std::endl;
+  while (true) {
+    int connection = AcceptConnection(listening_socket);
+    if (connection < 0) continue;
+    std::thread(ServeConnection, connection, std::ref(compile_slots)).detach();
+  }
+}
+
+void InitializeDistributedCompilation() {
+  int slots_per_worker = std::max(GetNumberOfRemoteParallelTasks(), 1);
+  for (const auto& address : GetRemoteWorkers()) {
+    auto worker = std::make_unique<RemoteWorker>();
+    if (!SplitHostAndPort(address, kDefaultCompileServerPort, worker->host,
+                          worker->port)) {
+      std::cerr << "Ignoring invalid remote worker address " << address << "."
+                << std::endl;
+      continue;
+    }
+    for (int slot = 0; slot < slots_per_worker; slot++)
+      slot_threads.push_back(std::thread(RunSlot, std::ref(*worker)));
+    available_slots += slots_per_worker;
+    remote_workers.push_back(std::move(worker));
+  }
+}
+
+void ShutdownDistributedCompilation() {
+  {
+    std::scoped_lock lock(jobs_mutex);
+    shutting_down = true;
+  }
+  job_queued.notify_all();
+  for (auto& thread : slot_threads) thread.join();
+  slot_threads.clear();
+  remote_workers.clear();
+}
+
+bool IsDistributedCompilationEnabled() { return !remote_workers.empty(); }
+
+bool TryReserveRemoteCompileSlot() {
+  std::scoped_lock lock(jobs_mutex);
+  if (available_slots == 0) return false;
+  available_slots--;
+  return true;
+}
+
+void ReleaseRemoteCompileSlot() {
+  std::scoped_lock lock(jobs_mutex);
+  available_slots++;
+}
+
+bool PreprocessForRemoteCompile(const DeferredCommand& command,
+                                const std::string& command_str, int worker_id,
+                                RemoteCompileJob& job) {
+  auto preprocessed_extension = GetPreprocessedExtension(command.source_file);
+  if (!preprocessed_extension) return false;
+
+  std::vector<std::string> arguments;
+  if (!SplitCommandIntoArguments(command_str, arguments) || arguments.empty())
+    return false;
+
+  std::filesystem::path preprocessed_file =
+      GetTempDirectoryPath() /
+      (kPreprocessedFilePrefix + std::to_string(worker_id) +
+       std::string(*preprocessed_extension));
+
+  // Split the command into the command to preprocess locally, and the
+  // arguments to compile remotely.
+  std::vector<std::string> preprocess_arguments = {arguments[0]};
+  job.arguments = {std::filesystem::path(arguments[0]).filename().string()};
+  bool has_output = false;
+  for (size_t index = 1; index < arguments.size(); index++) {
+    const std::string& argument = arguments[index];
+    if (argument == "-c") {
+      preprocess_arguments.push_back("-E");
+      job.arguments.push_back(argument);
+    } else if (argument == "-o") {
+      if (++index == arguments.size() || arguments[index] != command.destination_file)
+        return false;
+      preprocess_arguments.push_back(argument);
+      preprocess_arguments.push_back(preprocessed_file.string());
+      has_output = true;
+    } else if (argument == command.source_file) {
+      preprocess_arguments.push_back(argument);
+    } else if (IsResponseFileArgument(argument)) {
+      // REBS only writes preprocessor arguments to the response files used
+      // by compile commands.
+      preprocess_arguments.push_back(argument);
+    } else if (const auto* preprocessor_argument =
+                   FindPreprocessorArgument(argument)) {
+      preprocess_arguments.push_back(argument);
+      if (preprocessor_argument->takes_value &&
+          argument == preprocessor_argument->prefix) {
+        if (++index == arguments.size()) return false;
+        preprocess_arguments.push_back(arguments[index]);
+      }
+    } else {
+      preprocess_arguments.push_back(argument);
+      job.arguments.push_back(argument);
+    }
+  }
+  if (!has_output || !AreRemoteArgumentsAllowed(job.arguments)) return false;
+
+  std::string output;
+  if (!ExecuteArguments(preprocess_arguments, output)) return false;
+  auto preprocessed_source = ReadFileIntoString(preprocessed_file);
+  if (!preprocessed_source) return false;
+
+  job.source_extension = *preprocessed_extension;
+  job.preprocessed_source = std::move(*preprocessed_source);
+  job.object_file = command.destination_file;
+  return true;
+}
+
+void CompileRemotely(
+    RemoteCompileJob job,
+    std::function<void(RemoteCompileResult result)> on_complete) {
+  {
+    std::scoped_lock lock(jobs_mutex);
+    queued_jobs.push_back(
+        {.job = std::move(job), .on_complete = std::move(on_complete)});
+  }
+  job_queued.notify_one();
+}
@@ -0,0 +1,87 @@
+// Copyright 2024 Google LLC
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//      http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+
+#pragma once
+
+#include <filesystem>
+#include <functional>
+#include <string>
+#include <string_view>
+#include <vector>
+
+#include "deferred_command.h"
+
+// Distributed compilation farms compile commands out to remote workers, which
+// are other machines running `rebs --compile-server`. Sources are preprocessed
+// on this machine, so remote workers only need the same compiler and not the
+// headers. Links always run locally.
+
+// Runs a compile server on a port, or the default port if it is blank. Only
+// returns if the server can't start.
+bool RunCompileServer(std::string_view port);
+
+// Starts the connections to the remote workers, if any are configured.
+void InitializeDistributedCompilation();
+
+// Stops the connections to the remote workers.
+void ShutdownDistributedCompilation();
+
+// Returns whether there are remote workers to compile on.
+bool IsDistributedCompilationEnabled();
+
+// Tries to reserve a slot to compile on a remote worker. Returns false if every
+// remote worker is busy or unreachable. Thread safe.
+bool TryReserveRemoteCompileSlot();
+
+// Releases a reserved slot that wasn't used. Thread safe.
+void ReleaseRemoteCompileSlot();
+
+// A compile command that has been preprocessed and is ready to be sent to a
+// remote worker.
+struct RemoteCompileJob {
+  // The compiler and its arguments, without the preprocessor arguments or the
+  // input and output files.
+  std::vector<std::string> arguments;
+  // The extension of the preprocessed source, which tells the compiler what
+  // language it is.
+  std::string source_extension;
+  std::string preprocessed_source;
+  std::filesystem::path object_file;
+};
+
+// Preprocesses a compile command on this machine so it can be compiled on a
+// remote worker. `command_str` is the command with the dependency file
+// substituted, so the dependency file is written while preprocessing. Returns
+// false if the command can't be compiled remotely, in which case it should be
+// compiled locally.
+bool PreprocessForRemoteCompile(const DeferredCommand& command,
+                                const std::string& command_str, int worker_id,
+                                RemoteCompileJob& job);
+
+// The result of compiling on a remote worker.
+struct RemoteCompileResult {
+  // Whether the remote worker could be reached. If not, the command should be
+  // compiled locally.
+  bool reached_worker = false;
+  bool successful = false;
+  // The output of the compiler.
+  std::string output;
+};
+
+// Compiles a job on a remote worker in the background using a reserved slot,
+// and writes the object file. `on_complete` is called from another thread.
+// Thread safe.
+void CompileRemotely(RemoteCompileJob job,
+                     std::function<void(RemoteCompileResult result)> on_complete);
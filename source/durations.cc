@@ -0,0 +1,144 @@
+// Copyright 2024 Google LLC
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//      http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+#include "durations.h"
+
+#include <stddef.h>
+
+#include <cstdint>
+#include <cstdlib>
+#include <filesystem>
+#include <fstream>
+#include <iostream>
+#include <map>
+#include <mutex>
+#include <set>
+#include <string>
+
+#include "temp_directory.h"
+
+namespace {
+
+// The name of the file that is created in a package's temporary directory that
+// contains how long each command took to run.
+constexpr char kDurationsFile[] = "durations";
+
+// What is known about the last time a command ran.
+struct CommandHistory {
+  // In milliseconds.
+  uint64_t duration = 0;
+  // In kilobytes.
+  uint64_t peak_memory_usage = 0;
+};
+
+// A mapping of Package ID -> {File -> History}.
+std::map<size_t, std::map<std::string, CommandHistory>>
+    histories_per_file_per_package;
+
+// Set of package IDs whos durations have changed.
+std::set<size_t> packages_with_invalidated_durations;
+
+// Guards the durations above.
+std::mutex durations_mutex;
+
+std::filesystem::path GetDurationsFilePathForPackage(size_t package_id) {
+  return GetTempDirectoryPathForPackageID(package_id) / kDurationsFile;
+}
+
+void MaybeLoadDurationsForPackage(
+    size_t package_id,
+    std::map<std::string, CommandHistory>& histories_per_file) {
+  std::ifstream input_file(GetDurationsFilePathForPackage(package_id));
+  if (!input_file.is_open()) return;
+
+  std::string file;
+  std::string duration_str;
+  while (true) {
+    // Read the file the command produces.
+    if (!std::getline(input_file, file)) break;
+    // Read the duration, optionally followed by the peak memory usage.
+    if (!std::getline(input_file, duration_str)) break;
+
+    char* last_char{};
+    CommandHistory history;
+    history.duration =
+        std::strtoull(duration_str.c_str(), &last_char, /*base=*/10);
+    if (duration_str.c_str() == last_char) continue;
+    history.peak_memory_usage =
+        std::strtoull(last_char, nullptr, /*base=*/10);
+    histories_per_file[file] = history;
+  }
+
+  input_file.close();
+}
+
+std::map<std::string, CommandHistory>* GetHistoriesForPackage(
+    size_t package_id) {
+  auto itr = histories_per_file_per_package.find(package_id);
+  if (itr != histories_per_file_per_package.end()) return &itr->second;
+  auto [itr2, added] = histories_per_file_per_package.insert(
+      std::make_pair(package_id, std::map<std::string, CommandHistory>()));
+  MaybeLoadDurationsForPackage(package_id, itr2->second);
+  return &itr2->second;
+}
+
+void WriteDurationsForPackage(size_t package_id) {
+  std::ofstream output_file(GetDurationsFilePathForPackage(package_id));
+  if (!output_file.is_open()) {
+    std::cerr << "Cannot write to " << GetDurationsFilePathForPackage(package_id)
+              << ". Durations cannot be cached." << std::endl;
+    return;
+  }
+
+  for (const auto& [file, history] : *GetHistoriesForPackage(package_id)) {
+    output_file << file << std::endl;
+    output_file << history.duration << " " << history.peak_memory_usage
+                << std::endl;
+  }
+
+  output_file.close();
+}
+
+}  // namespace
+
+uint64_t GetPreviousDurationOfCommand(size_t package_id,
+                                      const std::string& file) {
+  std::scoped_lock lock(durations_mutex);
+  auto* histories_per_file = GetHistoriesForPackage(package_id);
+  auto itr = histories_per_file->find(file);
+  return itr == histories_per_file->end() ? 0 : itr->second.duration;
+}
+
+uint64_t GetPreviousPeakMemoryUsageOfCommand(size_t package_id,
+                                             const std::string& file) {
+  std::scoped_lock lock(durations_mutex);
+  auto* histories_per_file = GetHistoriesForPackage(package_id);
+  auto itr = histories_per_file->find(file);
+  return itr == histories_per_file->end() ? 0 : itr->second.peak_memory_usage;
+}
+
+void SetDurationOfCommand(size_t package_id, const std::string& file,
+                          uint64_t duration, uint64_t peak_memory_usage) {
+  std::scoped_lock lock(durations_mutex);
+  CommandHistory& history = (*GetHistoriesForPackage(package_id))[file];
+  history.duration = duration;
+  if (peak_memory_usage > 0) history.peak_memory_usage = peak_memory_usage;
+  packages_with_invalidated_durations.insert(package_id);
+}
+
+void FlushDurations() {
+  for (size_t package_id : packages_with_invalidated_durations)
+    WriteDurationsForPackage(package_id);
+  packages_with_invalidated_durations.clear();
+}
@@ -0,0 +1,43 @@
+// Copyright 2024 Google LLC
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//      http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+#pragma once
+
+#include <stddef.h>
+
+#include <cstdint>
+#include <string>
+
+// Records how long commands took to run and how much memory they used, keyed
+// by the file they produce, so that later runs can start the longest commands
+// first and avoid running too many memory hungry commands at once.
+
+// Returns how long the command producing `file` took in milliseconds the last
+// time it ran, or 0 if it is unknown. Thread safe.
+uint64_t GetPreviousDurationOfCommand(size_t package_id,
+                                      const std::string& file);
+
+// Returns the peak memory usage in kilobytes of the command producing `file`
+// the last time it ran locally, or 0 if it is unknown. Thread safe.
+uint64_t GetPreviousPeakMemoryUsageOfCommand(size_t package_id,
+                                             const std::string& file);
+
+// Records how long the command producing `file` took in milliseconds, and its
+// peak memory usage in kilobytes. A peak memory usage of 0 (such as for a
+// command that ran remotely) keeps the previously recorded usage. Thread safe.
+void SetDurationOfCommand(size_t package_id, const std::string& file,
+                          uint64_t duration, uint64_t peak_memory_usage);
+
+// Flush any changes to the durations to disk.
+void FlushDurations();
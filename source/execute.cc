@@ -15,60 +15,453 @@
 #include "execute.h"
 
 #include <array>
+#include <atomic>
+#include <csignal>
+#include <cstdint>
+#include <cstdlib>
+#include <cstring>
+#include <iomanip>
 #include <iostream>
+#include <mutex>
 #include <ostream>
+#include <set>
 #include <sstream>
 #include <string>
+#include <string_view>
+#include <vector>
+
+#include "config.h"
 
 #ifdef _WIN32
 #define popen _popen
 #define pclose _pclose
 #define WEXITSTATUS
+#else
+#include <errno.h>
+#include <fcntl.h>
+#include <signal.h>
+#include <spawn.h>
+#include <sys/resource.h>
+#include <sys/types.h>
+#include <sys/wait.h>
+#include <unistd.h>
+
+extern char** environ;
 #endif
 
 namespace {
 
+// Characters that have a special meaning to the shell when they are not
+// quoted. Commands containing them are ran through the shell.
+constexpr std::string_view kShellSpecialCharacters = "|&;<>()$`*?[]#~{}!\n\r";
+
+// Shell builtins and keywords, which can't be started as programs.
+constexpr std::string_view kShellBuiltins[] = {
+    ".",     "alias", "case",  "cd",    "eval",   "exec", "exit",
+    "export", "for",  "if",    "read",  "return", "set",  "shift",
+    "source", "trap", "ulimit", "umask", "unset", "until", "wait",
+    "while"};
+
+// The size of the chunks to read the output of a command in.
+constexpr size_t kOutputChunkSize = 64 * 1024;
+
+// The exit status of a command that was terminated, matching the shell's
+// convention for programs killed by SIGTERM.
+constexpr int kTerminatedExitStatus = 128 + 15;
+
+// Guards the fields below.
+std::mutex running_commands_mutex;
+// Whether running commands have been terminated, in which case no more may
+// start.
+bool terminating = false;
+#ifndef _WIN32
+// The process IDs of the commands that are running.
+std::set<pid_t> running_processes;
+
+// Commands run in their own process groups, so that terminating a command also
+// terminates any programs it started, such as a compiler driver's cc1plus.
+// Signals sent by the terminal no longer reach them, so they are forwarded by
+// a signal handler, which can't take a lock. These are the process groups of
+// running commands, or 0 for unused slots. Commands that don't get a slot stay
+// in this process's group.
+constexpr size_t kMaxProcessGroups = 256;
+std::atomic<pid_t> process_groups[kMaxProcessGroups];
+
+// The signals to forward to the running commands.
+constexpr int kForwardedSignals[] = {SIGHUP, SIGINT, SIGTERM};
+
+std::once_flag install_signal_handlers;
+#endif
+
 // Returns the output stream, which is the provided stream, if it's not null, or
 // stderr.
 std::ostream& OutputStream(std::stringstream* opt_output) {
   return opt_output ? *opt_output : std::cerr;
 }
 
-}  // namespace
+// Appends output read from a command, keeping at most `output_limit` bytes if
+// it's not 0. Returns how many bytes were dropped.
+size_t AppendOutput(std::string& output, const char* data, size_t length,
+                    size_t output_limit) {
+  if (output_limit == 0 || output.size() + length <= output_limit) {
+    output.append(data, length);
+    return 0;
+  }
+  size_t kept = output.size() < output_limit ? output_limit - output.size() : 0;
+  output.append(data, kept);
+  return length - kept;
+}
+
+// Notes in the output how much of it was dropped.
+void NoteDroppedOutput(std::string& output, uint64_t dropped_bytes) {
+  if (dropped_bytes == 0) return;
+  if (!output.empty() && output.back() != '\n') output += '\n';
+  output += "... " + std::to_string(dropped_bytes) +
+            " more bytes of output were dropped.";
+}
+
+#ifdef _WIN32
 
-bool ExecuteCommand(const std::string& command, std::stringstream* opt_output) {
+// Runs a command through the shell, capturing its output. Returns whether the
+// command could be started.
+bool RunCommand(const std::string& command, size_t output_limit,
+                std::string& output, CommandResult& result) {
   // Redirect stderr to stdout.
   std::string raw_command = command + " 2>&1";
 
   // Try to run the command and open a pipe to it.
   FILE* pipe = popen(raw_command.c_str(), "r");
-  if (pipe == nullptr) {
+  if (pipe == nullptr) return false;
+
+  // Read the output from the program into `output`.
+  std::size_t bytesread;
+  std::array<char, 1024> buffer{};
+  uint64_t dropped_bytes = 0;
+  while ((bytesread = std::fread(buffer.data(), sizeof(buffer.at(0)),
+                                 sizeof(buffer), pipe)) != 0) {
+    dropped_bytes +=
+        AppendOutput(output, buffer.data(), bytesread, output_limit);
+  }
+  NoteDroppedOutput(output, dropped_bytes);
+
+  result.exit_status = WEXITSTATUS(pclose(pipe));
+  return true;
+}
+
+// Runs a program with arguments, capturing its output. Returns whether the
+// program could be started.
+bool RunArguments(const std::vector<std::string>& arguments,
+                  size_t output_limit, std::string& output,
+                  CommandResult& result) {
+  std::stringstream command;
+  for (const auto& argument : arguments) command << std::quoted(argument) << " ";
+  return RunCommand(command.str(), output_limit, output, result);
+}
+
+#else
+
+// Returns whether the program is a shell builtin or keyword.
+bool IsShellBuiltin(std::string_view program) {
+  for (std::string_view builtin : kShellBuiltins)
+    if (program == builtin) return true;
+  return false;
+}
+
+// Forwards a signal to the running commands, then handles it the default way.
+void ForwardSignalToCommands(int signal_number) {
+  for (auto& process_group : process_groups) {
+    pid_t pgid = process_group.load();
+    if (pgid > 0) kill(-pgid, signal_number);
+  }
+  std::signal(signal_number, SIG_DFL);
+  std::raise(signal_number);
+}
+
+void InstallSignalHandlers() {
+  for (int signal_number : kForwardedSignals) {
+    struct sigaction action {};
+    action.sa_handler = ForwardSignalToCommands;
+    sigemptyset(&action.sa_mask);
+    sigaction(signal_number, &action, nullptr);
+  }
+}
+
+// Claims a slot for the process group of a command that is about to start.
+// Returns the slot, or nullptr if they are all used.
+std::atomic<pid_t>* ClaimProcessGroupSlot() {
+  for (auto& process_group : process_groups) {
+    pid_t unused = 0;
+    // -1 marks the slot as claimed until the process ID is known.
+    if (process_group.compare_exchange_strong(unused, -1))
+      return &process_group;
+  }
+  return nullptr;
+}
+
+// Creates a pipe that isn't inherited by child processes.
+bool CreatePipe(int pipe_fds[2]) {
+#ifdef __linux__
+  return pipe2(pipe_fds, O_CLOEXEC) == 0;
+#else
+  if (pipe(pipe_fds) != 0) return false;
+  fcntl(pipe_fds[0], F_SETFD, FD_CLOEXEC);
+  fcntl(pipe_fds[1], F_SETFD, FD_CLOEXEC);
+  return true;
+#endif
+}
+
+// Reads everything from a file descriptor until it is closed, keeping at most
+// `output_limit` bytes if it's not 0. The rest is still read, so the program
+// doesn't block writing to a full pipe.
+void ReadAll(int fd, size_t output_limit, std::string& output) {
+  std::vector<char> buffer(kOutputChunkSize);
+  uint64_t dropped_bytes = 0;
+  while (true) {
+    ssize_t bytes_read = read(fd, buffer.data(), buffer.size());
+    if (bytes_read > 0) {
+      dropped_bytes +=
+          AppendOutput(output, buffer.data(), bytes_read, output_limit);
+    } else if (bytes_read == 0 || errno != EINTR) {
+      break;
+    }
+  }
+  NoteDroppedOutput(output, dropped_bytes);
+}
+
+// Runs a program with arguments, capturing its combined stdout and stderr.
+// Returns whether the program could be started.
+bool RunArguments(std::vector<std::string> arguments, size_t output_limit,
+                  std::string& output, CommandResult& result) {
+  if (arguments.empty()) {
+    // There's nothing to run, which a shell would treat as a success.
+    result.exit_status = EXIT_SUCCESS;
+    return true;
+  }
+
+  std::vector<char*> argv;
+  argv.reserve(arguments.size() + 1);
+  for (auto& argument : arguments) argv.push_back(argument.data());
+  argv.push_back(nullptr);
+
+  int pipe_fds[2];
+  if (!CreatePipe(pipe_fds)) return false;
+
+  std::call_once(install_signal_handlers, InstallSignalHandlers);
+  std::atomic<pid_t>* process_group_slot = ClaimProcessGroupSlot();
+
+  std::unique_lock lock(running_commands_mutex);
+  if (terminating) {
+    close(pipe_fds[0]);
+    close(pipe_fds[1]);
+    if (process_group_slot != nullptr) *process_group_slot = 0;
+    result.exit_status = kTerminatedExitStatus;
+    return true;
+  }
+  // Start the program without holding the lock, so that commands can start in
+  // parallel.
+  lock.unlock();
+
+  // Redirect stdout and stderr into the same pipe, so the output is
+  // interleaved the same as it would be on a terminal.
+  posix_spawn_file_actions_t file_actions;
+  posix_spawn_file_actions_init(&file_actions);
+  posix_spawn_file_actions_adddup2(&file_actions, pipe_fds[1], STDOUT_FILENO);
+  posix_spawn_file_actions_adddup2(&file_actions, pipe_fds[1], STDERR_FILENO);
+  posix_spawnattr_t attributes;
+  posix_spawnattr_init(&attributes);
+  if (process_group_slot != nullptr) {
+    posix_spawnattr_setflags(&attributes, POSIX_SPAWN_SETPGROUP);
+    posix_spawnattr_setpgroup(&attributes, 0);
+  }
+
+  pid_t pid;
+  int error = posix_spawnp(&pid, argv[0], &file_actions, &attributes,
+                           argv.data(), environ);
+  posix_spawnattr_destroy(&attributes);
+  posix_spawn_file_actions_destroy(&file_actions);
+  close(pipe_fds[1]);
+  lock.lock();
+  if (error == 0) {
+    running_processes.insert(pid);
+    // The running commands were terminated while this one was starting.
+    if (terminating && kill(-pid, SIGTERM) != 0) kill(pid, SIGTERM);
+  }
+  if (process_group_slot != nullptr) *process_group_slot = error == 0 ? pid : 0;
+  lock.unlock();
+
+  if (error != 0) {
+    close(pipe_fds[0]);
+    output = arguments[0] + ": " + std::strerror(error);
+    // The same exit status as a shell that can't find the command.
+    result.exit_status = 127;
+    return true;
+  }
+
+  ReadAll(pipe_fds[0], output_limit, output);
+  close(pipe_fds[0]);
+
+  int status;
+  struct rusage usage {};
+  int wait_result;
+  while ((wait_result = wait4(pid, &status, 0, &usage)) == -1 &&
+         errno == EINTR) {
+  }
+  if (process_group_slot != nullptr) *process_group_slot = 0;
+  lock.lock();
+  running_processes.erase(pid);
+  lock.unlock();
+  if (wait_result == -1) return false;
+
+  if (WIFEXITED(status)) {
+    result.exit_status = WEXITSTATUS(status);
+  } else {
+    // Match the shell's convention for programs killed by a signal.
+    result.exit_status = 128 + WTERMSIG(status);
+  }
+#ifdef __APPLE__
+  // macOS reports the peak resident set size in bytes.
+  result.peak_memory_usage = usage.ru_maxrss / 1024;
+#else
+  result.peak_memory_usage = usage.ru_maxrss;
+#endif
+  result.cpu_time =
+      (usage.ru_utime.tv_sec + usage.ru_stime.tv_sec) * 1000 +
+      (usage.ru_utime.tv_usec + usage.ru_stime.tv_usec) / 1000;
+  return true;
+}
+
+// Runs a command, capturing its combined stdout and stderr. The program is
+// started directly unless the command needs a shell. Returns whether the
+// command could be started.
+bool RunCommand(const std::string& command, size_t output_limit,
+                std::string& output, CommandResult& result) {
+  std::vector<std::string> arguments;
+  if (!SplitCommandIntoArguments(command, arguments) ||
+      (!arguments.empty() && IsShellBuiltin(arguments[0]))) {
+    arguments = {"/bin/sh", "-c", command};
+  }
+  return RunArguments(std::move(arguments), output_limit, output, result);
+}
+
+#endif
+
+// Reports the result of running a command. Returns whether it was successful.
+bool ReportResult(bool started, const std::string& command,
+                  const std::string& output, const CommandResult& result,
+                  std::stringstream* opt_output, CommandResult* opt_result) {
+  if (opt_result != nullptr) *opt_result = result;
+
+  if (!started) {
     OutputStream(opt_output)
         << "Unknown error executing: " << command << std::endl;
     return false;
   }
 
+  // Return if the program closed without error.
+  if (result.exit_status == EXIT_SUCCESS) return true;
+
+  OutputStream(opt_output) << "Error executing: " << command << std::endl;
+  if (output.size() > 0) OutputStream(opt_output) << output << std::endl;
+  return false;
+}
+
+}  // namespace
+
+bool ExecuteCommand(const std::string& command, std::stringstream* opt_output,
+                    CommandResult* opt_result) {
   // Temporary string to show the output of the program, which may be outputted
   // if the program doesn't successfully run.
   std::string output;
+  CommandResult result;
+  bool started = RunCommand(command, GetCommandOutputLimit(), output, result);
+  return ReportResult(started, command, output, result, opt_output,
+                      opt_result);
+}
 
-  try {
-    // Read the output from the program into `output`.
-    std::size_t bytesread;
-    std::array<char, 1024> buffer{};
-    while ((bytesread = std::fread(buffer.data(), sizeof(buffer.at(0)),
-                                   sizeof(buffer), pipe)) != 0) {
-      output += std::string(buffer.data(), bytesread);
-    }
+bool ExecuteArguments(const std::vector<std::string>& arguments,
+                      std::string& output, CommandResult* opt_result) {
+  CommandResult result;
+  // The output may be used as data, so it isn't limited.
+  bool started = RunArguments(arguments, /*output_limit=*/0, output, result);
+  if (opt_result != nullptr) *opt_result = result;
+  return started && result.exit_status == EXIT_SUCCESS;
+}
 
-    // Return if the program closed without error.
-    int return_code = pclose(pipe);
-    if (WEXITSTATUS(return_code) == EXIT_SUCCESS) return true;
-  } catch (...) {
-    throw;
+void TerminateRunningCommands() {
+  std::scoped_lock lock(running_commands_mutex);
+  terminating = true;
+#ifndef _WIN32
+  for (pid_t pid : running_processes) {
+    // Commands without their own process group are in this process's group.
+    if (kill(-pid, SIGTERM) != 0) kill(pid, SIGTERM);
   }
+#endif
+}
 
-  OutputStream(opt_output) << "Error executing: " << command << std::endl;
-  if (output.size() > 0) OutputStream(opt_output) << output << std::endl;
-  return false;
+bool SplitCommandIntoArguments(const std::string& command,
+                               std::vector<std::string>& arguments) {
+  arguments.clear();
+  std::string argument;
+  // Whether an argument has been started, which may be an empty quoted string.
+  bool in_argument = false;
+
+  for (size_t i = 0; i < command.size(); i++) {
+    char c = command[i];
+    switch (c) {
+      case ' ':
+      case '\t':
+        if (in_argument) {
+          arguments.push_back(std::move(argument));
+          argument.clear();
+          in_argument = false;
+        }
+        break;
+      case '\'': {
+        // Everything up to the closing quote is literal.
+        size_t end = command.find('\'', i + 1);
+        if (end == std::string::npos) return false;
+        argument.append(command, i + 1, end - i - 1);
+        i = end;
+        in_argument = true;
+        break;
+      }
+      case '"':
+        in_argument = true;
+        for (i++;; i++) {
+          if (i >= command.size()) return false;
+          char quoted = command[i];
+          if (quoted == '"') break;
+          // Substitutions are still expanded inside of double quotes.
+          if (quoted == '$' || quoted == '`') return false;
+          if (quoted == '\\' && i + 1 < command.size()) {
+            char escaped = command[i + 1];
+            if (escaped == '\n') return false;
+            if (escaped == '"' || escaped == '\\' || escaped == '$' ||
+                escaped == '`') {
+              argument += escaped;
+              i++;
+              continue;
+            }
+          }
+          argument += quoted;
+        }
+        break;
+      case '\\':
+        if (i + 1 >= command.size() || command[i + 1] == '\n') return false;
+        argument += command[++i];
+        in_argument = true;
+        break;
+      default:
+        if (kShellSpecialCharacters.find(c) != std::string_view::npos)
+          return false;
+        // A variable assignment before the program.
+        if (c == '=' && arguments.empty()) return false;
+        argument += c;
+        in_argument = true;
+        break;
+    }
+  }
+
+  if (in_argument) arguments.push_back(std::move(argument));
+  return true;
 }
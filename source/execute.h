@@ -14,11 +14,47 @@
 
 #pragma once
 
+#include <cstdint>
 #include <sstream>
 #include <string>
+#include <vector>
+
+// Details about a command that was executed.
+struct CommandResult {
+  // The exit status of the command, or -1 if it could not be started.
+  int exit_status = -1;
+  // The peak resident set size of the command, in kilobytes.
+  uint64_t peak_memory_usage = 0;
+  // The CPU time (user and system) the command used, in milliseconds.
+  uint64_t cpu_time = 0;
+};
 
 // Executes a command. Returns whether the command was successful. The output is
 // silent successful. If not successful, the output is either written to
-// `opt_output` (if not null), or stderr.
+// `opt_output` (if not null), or stderr. If `opt_result` is not null, it is
+// populated with details about the command.
+// Only as much of the output as the configured output limit is kept, and the
+// rest is dropped as it's read.
+//
+// Commands are started directly, without a shell, unless they use shell
+// syntax such as pipes, redirection, variables, or globs.
 bool ExecuteCommand(const std::string& command,
-                    std::stringstream* opt_output = nullptr);
+                    std::stringstream* opt_output = nullptr,
+                    CommandResult* opt_result = nullptr);
+
+// Executes a program with arguments, without a shell. Returns whether the
+// program was successful. `output` is populated with the program's combined
+// stdout and stderr whether or not it was successful. If `opt_result` is not
+// null, it is populated with details about the program.
+bool ExecuteArguments(const std::vector<std::string>& arguments,
+                      std::string& output, CommandResult* opt_result = nullptr);
+
+// Sends SIGTERM to every running command, and stops any more commands from
+// starting. Thread safe.
+void TerminateRunningCommands();
+
+// Splits a command into its arguments the way a POSIX shell would. Returns
+// false if the command uses shell syntax beyond quoting and escaping, and so
+// needs to be ran by a shell.
+bool SplitCommandIntoArguments(const std::string& command,
+                               std::vector<std::string>& arguments);
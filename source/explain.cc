@@ -0,0 +1,151 @@
+// Copyright 2024 Google LLC
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//      http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+
+#include "explain.h"
+
+#include <algorithm>
+#include <cstdint>
+#include <filesystem>
+#include <iostream>
+#include <map>
+#include <mutex>
+#include <string>
+#include <string_view>
+#include <utility>
+#include <vector>
+
+#include "invocation.h"
+
+namespace {
+
+// How many of the files that caused the most commands to be queued to report.
+constexpr size_t kFilesToBlameToReport = 10;
+
+// Why a command was queued.
+struct Explanation {
+  std::filesystem::path destination_file;
+  RebuildCause cause;
+};
+
+// Guards the fields below.
+std::mutex explanations_mutex;
+std::vector<Explanation> explanations;
+
+// Describes a reason in a few words, for the summary.
+std::string_view ReasonToString(RebuildReason reason) {
+  switch (reason) {
+    case RebuildReason::None:
+      return "unknown";
+    case RebuildReason::MissingOutput:
+      return "missing output";
+    case RebuildReason::NoDependencyRecord:
+      return "no dependency record";
+    case RebuildReason::CommandChanged:
+      return "command changed";
+    case RebuildReason::MissingDependency:
+      return "missing dependency";
+    case RebuildReason::NewerDependency:
+      return "newer dependency";
+    case RebuildReason::GeneratedFileChanged:
+      return "generated file changed";
+    case RebuildReason::InputRebuilt:
+      return "input rebuilt";
+  }
+  return "unknown";
+}
+
+// Describes why a command was queued.
+std::string_view ReasonToSentence(RebuildReason reason) {
+  switch (reason) {
+    case RebuildReason::None:
+      return "no reason was recorded";
+    case RebuildReason::MissingOutput:
+      return "it doesn't exist";
+    case RebuildReason::NoDependencyRecord:
+      return "there's no record of what it depends on";
+    case RebuildReason::CommandChanged:
+      return "its command changed";
+    case RebuildReason::MissingDependency:
+      return "a file it depends on no longer exists";
+    case RebuildReason::NewerDependency:
+      return "a file it depends on is newer";
+    case RebuildReason::GeneratedFileChanged:
+      return "the file it's generated from changed";
+    case RebuildReason::InputRebuilt:
+      return "a file it's built from is rebuilt";
+  }
+  return "no reason was recorded";
+}
+
+}  // namespace
+
+void SetRebuildCause(RebuildCause& cause, RebuildReason reason,
+                     const std::filesystem::path& file) {
+  if (!ShouldExplain() || cause.reason != RebuildReason::None) return;
+  cause.reason = reason;
+  cause.file = file;
+}
+
+void ExplainCommand(const std::filesystem::path& destination_file,
+                    RebuildCause cause) {
+  if (!ShouldExplain()) return;
+  std::scoped_lock lock(explanations_mutex);
+  explanations.push_back(
+      {.destination_file = destination_file, .cause = std::move(cause)});
+}
+
+void ReportExplanations() {
+  if (!ShouldExplain()) return;
+  std::scoped_lock lock(explanations_mutex);
+  if (explanations.empty()) {
+    std::cout << "No compile or link commands were queued." << std::endl;
+    return;
+  }
+
+  std::map<RebuildReason, int> commands_by_reason;
+  std::map<std::filesystem::path, int> commands_by_file;
+  std::cout << "Commands queued:" << std::endl;
+  for (const auto& explanation : explanations) {
+    const RebuildCause& cause = explanation.cause;
+    std::cout << "  " << explanation.destination_file.string() << ": "
+              << ReasonToSentence(cause.reason);
+    if (!cause.file.empty()) std::cout << ", " << cause.file.string();
+    std::cout << std::endl;
+    commands_by_reason[cause.reason]++;
+    if (!cause.file.empty()) commands_by_file[cause.file]++;
+  }
+
+  std::cout << " Reasons:" << std::endl;
+  for (const auto& [reason, count] : commands_by_reason) {
+    std::cout << "  " << count << " " << ReasonToString(reason) << std::endl;
+  }
+
+  // The files that caused the most commands to be queued, which are the first
+  // place to look when a small change rebuilds a lot.
+  std::vector<std::pair<std::filesystem::path, int>> files_to_blame(
+      commands_by_file.begin(), commands_by_file.end());
+  std::stable_sort(files_to_blame.begin(), files_to_blame.end(),
+                   [](const auto& a, const auto& b) {
+                     return a.second > b.second;
+                   });
+  if (files_to_blame.size() > kFilesToBlameToReport)
+    files_to_blame.resize(kFilesToBlameToReport);
+  if (!files_to_blame.empty())
+    std::cout << " Files causing the most commands to be queued:" << std::endl;
+  for (const auto& [file, count] : files_to_blame)
+    std::cout << "  " << count << " " << file.string() << std::endl;
+
+  explanations.clear();
+}
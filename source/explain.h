@@ -0,0 +1,65 @@
+// Copyright 2024 Google LLC
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//      http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+
+#pragma once
+
+#include <filesystem>
+
+// With --explain, the reason each compile and link command is queued is
+// printed before the commands run, along with how many commands were queued
+// for each reason and the files that caused the most commands to be queued,
+// to find what causes a rebuild to cascade. Nothing is recorded otherwise.
+
+// Why a command was queued.
+enum class RebuildReason {
+  // The command isn't out of date.
+  None = 0,
+  // The output doesn't exist.
+  MissingOutput,
+  // There is no record of what the output depends on.
+  NoDependencyRecord,
+  // The command that builds it changed since it was last built, such as from
+  // a config changing its arguments.
+  CommandChanged,
+  // A file that the output depends on no longer exists.
+  MissingDependency,
+  // A file that the output depends on is newer than it.
+  NewerDependency,
+  // The generated file that it's built from changed.
+  GeneratedFileChanged,
+  // A file that it's built from is rebuilt during this build.
+  InputRebuilt
+};
+
+// Why a command was queued, and the file that caused it, if there is one.
+struct RebuildCause {
+  RebuildReason reason = RebuildReason::None;
+  std::filesystem::path file;
+};
+
+// Sets the cause of a command being queued, if it doesn't have one yet, so the
+// first cause that's found is the one that's explained. Does nothing if not
+// explaining.
+void SetRebuildCause(RebuildCause& cause, RebuildReason reason,
+                     const std::filesystem::path& file = {});
+
+// Records why the command producing `destination_file` was queued. Thread
+// safe.
+void ExplainCommand(const std::filesystem::path& destination_file,
+                    RebuildCause cause);
+
+// Prints why each command was queued, and how many were queued for each
+// reason, then forgets them for the next build.
+void ReportExplanations();
@@ -0,0 +1,262 @@
+// Copyright 2024 Google LLC
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//      http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+#include "exported_symbols.h"
+
+#include <stddef.h>
+
+#include <algorithm>
+#include <cstdint>
+#include <filesystem>
+#include <fstream>
+#include <iterator>
+#include <optional>
+#include <string>
+#include <string_view>
+#include <vector>
+
+#include "hash.h"
+
+namespace {
+
+// The extension added to a shared library's path to remember the hash of its
+// exported symbols.
+constexpr char kExportedSymbolsExtension[] = ".symbols";
+
+// Values from the ELF specification.
+constexpr std::string_view kElfMagic = "\x7f"
+                                       "ELF";
+constexpr uint8_t kElfClass32 = 1;
+constexpr uint8_t kElfClass64 = 2;
+constexpr uint8_t kElfLittleEndian = 1;
+constexpr uint16_t kElfTypeSharedObject = 3;
+constexpr uint32_t kSectionTypeDynamicSymbols = 11;
+constexpr uint16_t kUndefinedSection = 0;
+constexpr uint8_t kBindingGlobal = 1;
+constexpr uint8_t kBindingWeak = 2;
+constexpr uint8_t kBindingUnique = 10;
+constexpr uint8_t kTypeObject = 1;
+constexpr uint8_t kTypeTls = 6;
+constexpr uint8_t kVisibilityDefault = 0;
+constexpr uint8_t kVisibilityProtected = 3;
+
+// Reads little endian integers from an ELF file.
+class ElfReader {
+ public:
+  explicit ElfReader(const std::filesystem::path& path)
+      : file_(path, std::ios::binary) {}
+
+  // Reads `size` bytes at `offset`. Returns nothing if the file is too short.
+  std::optional<std::string> Read(uint64_t offset, uint64_t size) {
+    std::string bytes(size, '\0');
+    file_.seekg(offset);
+    if (!file_.read(bytes.data(), size)) return std::nullopt;
+    return bytes;
+  }
+
+ private:
+  std::ifstream file_;
+};
+
+// Returns the little endian integer of `size` bytes at `offset` in `bytes`.
+uint64_t ReadInteger(std::string_view bytes, size_t offset, size_t size) {
+  uint64_t value = 0;
+  for (size_t index = size; index-- > 0;)
+    value = (value << 8) | static_cast<uint8_t>(bytes[offset + index]);
+  return value;
+}
+
+// The layout of the parts of the ELF headers that are read, which depends on
+// whether the file is 32 or 64 bit.
+struct ElfLayout {
+  size_t header_size;
+  size_t section_headers_offset;
+  size_t word_size;
+  size_t section_entry_size_offset;
+  size_t section_count_offset;
+  // Offsets into a section header.
+  size_t section_offset_offset;
+  size_t section_size_offset;
+  size_t section_link_offset;
+  // The size of, and offsets into, a symbol.
+  size_t symbol_size;
+  size_t symbol_info_offset;
+  size_t symbol_other_offset;
+  size_t symbol_section_offset;
+  size_t symbol_size_offset;
+};
+
+constexpr ElfLayout kElf32Layout = {.header_size = 52,
+                                    .section_headers_offset = 0x20,
+                                    .word_size = 4,
+                                    .section_entry_size_offset = 0x2E,
+                                    .section_count_offset = 0x30,
+                                    .section_offset_offset = 0x10,
+                                    .section_size_offset = 0x14,
+                                    .section_link_offset = 0x18,
+                                    .symbol_size = 16,
+                                    .symbol_info_offset = 12,
+                                    .symbol_other_offset = 13,
+                                    .symbol_section_offset = 14,
+                                    .symbol_size_offset = 8};
+
+constexpr ElfLayout kElf64Layout = {.header_size = 64,
+                                    .section_headers_offset = 0x28,
+                                    .word_size = 8,
+                                    .section_entry_size_offset = 0x3A,
+                                    .section_count_offset = 0x3C,
+                                    .section_offset_offset = 0x18,
+                                    .section_size_offset = 0x20,
+                                    .section_link_offset = 0x28,
+                                    .symbol_size = 24,
+                                    .symbol_info_offset = 4,
+                                    .symbol_other_offset = 5,
+                                    .symbol_section_offset = 6,
+                                    .symbol_size_offset = 16};
+
+// A section of an ELF file.
+struct ElfSection {
+  uint32_t type;
+  uint64_t offset;
+  uint64_t size;
+  uint32_t link;
+};
+
+// Returns the exported symbols of a shared library, each described by a line
+// with its name, and its size if applications may copy it. Returns nothing if
+// it isn't an ELF shared library that can be read.
+std::optional<std::vector<std::string>> ReadExportedSymbols(
+    const std::filesystem::path& shared_library) {
+  ElfReader reader(shared_library);
+  std::optional<std::string> header = reader.Read(0, kElf32Layout.header_size);
+  if (!header || !header->starts_with(kElfMagic) ||
+      static_cast<uint8_t>((*header)[5]) != kElfLittleEndian)
+    return std::nullopt;
+  uint8_t elf_class = (*header)[4];
+  if (elf_class != kElfClass32 && elf_class != kElfClass64) return std::nullopt;
+  const ElfLayout& layout =
+      elf_class == kElfClass64 ? kElf64Layout : kElf32Layout;
+  header = reader.Read(0, layout.header_size);
+  if (!header || ReadInteger(*header, 16, 2) != kElfTypeSharedObject)
+    return std::nullopt;
+
+  uint64_t section_headers_offset =
+      ReadInteger(*header, layout.section_headers_offset, layout.word_size);
+  uint64_t section_entry_size =
+      ReadInteger(*header, layout.section_entry_size_offset, 2);
+  uint64_t section_count = ReadInteger(*header, layout.section_count_offset, 2);
+  if (section_entry_size < layout.section_link_offset + 4) return std::nullopt;
+  std::optional<std::string> section_headers = reader.Read(
+      section_headers_offset, section_entry_size * section_count);
+  if (!section_headers) return std::nullopt;
+
+  std::vector<ElfSection> sections;
+  for (uint64_t index = 0; index < section_count; index++) {
+    size_t offset = index * section_entry_size;
+    sections.push_back(
+        {.type = static_cast<uint32_t>(
+             ReadInteger(*section_headers, offset + 4, 4)),
+         .offset = ReadInteger(*section_headers,
+                               offset + layout.section_offset_offset,
+                               layout.word_size),
+         .size = ReadInteger(*section_headers,
+                             offset + layout.section_size_offset,
+                             layout.word_size),
+         .link = static_cast<uint32_t>(ReadInteger(
+             *section_headers, offset + layout.section_link_offset, 4))});
+  }
+
+  auto dynamic_symbols =
+      std::find_if(sections.begin(), sections.end(), [](const auto& section) {
+        return section.type == kSectionTypeDynamicSymbols;
+      });
+  if (dynamic_symbols == sections.end() ||
+      dynamic_symbols->link >= sections.size())
+    return std::nullopt;
+  const ElfSection& string_table = sections[dynamic_symbols->link];
+  std::optional<std::string> symbols =
+      reader.Read(dynamic_symbols->offset, dynamic_symbols->size);
+  std::optional<std::string> strings =
+      reader.Read(string_table.offset, string_table.size);
+  if (!symbols || !strings) return std::nullopt;
+
+  std::vector<std::string> exported_symbols;
+  for (size_t offset = 0; offset + layout.symbol_size <= symbols->size();
+       offset += layout.symbol_size) {
+    uint8_t info = (*symbols)[offset + layout.symbol_info_offset];
+    uint8_t visibility = (*symbols)[offset + layout.symbol_other_offset] & 3;
+    uint8_t binding = info >> 4;
+    uint8_t type = info & 0xf;
+    if (ReadInteger(*symbols, offset + layout.symbol_section_offset, 2) ==
+            kUndefinedSection ||
+        (binding != kBindingGlobal && binding != kBindingWeak &&
+         binding != kBindingUnique) ||
+        (visibility != kVisibilityDefault &&
+         visibility != kVisibilityProtected))
+      continue;
+
+    size_t name_offset = ReadInteger(*symbols, offset, 4);
+    if (name_offset >= strings->size()) return std::nullopt;
+    std::string symbol(strings->c_str() + name_offset);
+    // Applications may copy data symbols into themselves, so they must be
+    // relinked if the size changes.
+    if (type == kTypeObject || type == kTypeTls) {
+      symbol += " " + std::to_string(ReadInteger(
+                          *symbols, offset + layout.symbol_size_offset,
+                          layout.word_size));
+    }
+    exported_symbols.push_back(std::move(symbol));
+  }
+  // The order of the symbols may change between links.
+  std::sort(exported_symbols.begin(), exported_symbols.end());
+  return exported_symbols;
+}
+
+}  // namespace
+
+std::string HashExportedSymbols(const std::filesystem::path& shared_library) {
+  std::optional<std::vector<std::string>> exported_symbols =
+      ReadExportedSymbols(shared_library);
+  if (!exported_symbols) return "";
+  Hasher hasher;
+  for (const auto& symbol : *exported_symbols) hasher.AddString(symbol);
+  return hasher.Finish();
+}
+
+std::filesystem::path GetExportedSymbolsPath(
+    const std::filesystem::path& shared_library) {
+  std::filesystem::path path = shared_library;
+  path += kExportedSymbolsExtension;
+  return path;
+}
+
+bool UpdateExportedSymbols(const std::filesystem::path& shared_library) {
+  std::string hash = HashExportedSymbols(shared_library);
+  if (hash.empty()) hash = HashFileContents(shared_library);
+
+  std::filesystem::path path = GetExportedSymbolsPath(shared_library);
+  std::string previous_hash;
+  {
+    std::ifstream file(path);
+    previous_hash.assign(std::istreambuf_iterator<char>(file),
+                         std::istreambuf_iterator<char>());
+  }
+  if (!hash.empty() && hash == previous_hash) return false;
+
+  // Only written when the symbols change, so that its timestamp is when they
+  // last changed.
+  std::ofstream file(path, std::ios::trunc);
+  file << hash;
+  return true;
+}
@@ -0,0 +1,36 @@
+// Copyright 2024 Google LLC
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//      http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+#pragma once
+
+#include <filesystem>
+#include <string>
+
+// An application only needs to be relinked against a shared library when the
+// symbols the library exports change, rather than every time it's relinked.
+
+// Returns a hash of the dynamic symbols that an ELF shared library defines,
+// along with the sizes of its data symbols, because applications copy them.
+// Returns a blank string if it isn't an ELF shared library that can be read.
+std::string HashExportedSymbols(const std::filesystem::path& shared_library);
+
+// Returns the path of the file that remembers the hash of a shared library's
+// exported symbols. Its timestamp is when they last changed.
+std::filesystem::path GetExportedSymbolsPath(
+    const std::filesystem::path& shared_library);
+
+// Updates the hash of the symbols a shared library exports, after it has been
+// linked, and returns whether they changed. If they can't be read, the hash of
+// the library's contents is used instead. Thread safe.
+bool UpdateExportedSymbols(const std::filesystem::path& shared_library);
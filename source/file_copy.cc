@@ -0,0 +1,136 @@
+// Copyright 2024 Google LLC
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//      http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+#include "file_copy.h"
+
+#include <filesystem>
+#include <system_error>
+
+#ifdef __linux__
+#include <fcntl.h>
+#include <linux/fs.h>
+#include <sys/ioctl.h>
+#include <sys/sendfile.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#endif
+
+namespace {
+
+// Tries to create a reflink of a file. Returns false if the file system
+// doesn't support it.
+bool TryCloneFile(const std::filesystem::path& source,
+                  const std::filesystem::path& destination) {
+#ifdef __linux__
+  int source_fd = open(source.c_str(), O_RDONLY | O_CLOEXEC);
+  if (source_fd < 0) return false;
+  struct stat source_stat;
+  if (fstat(source_fd, &source_stat) != 0) {
+    close(source_fd);
+    return false;
+  }
+  int destination_fd = open(destination.c_str(),
+                            O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC,
+                            source_stat.st_mode & 07777);
+  if (destination_fd < 0) {
+    close(source_fd);
+    return false;
+  }
+  bool cloned = ioctl(destination_fd, FICLONE, source_fd) == 0;
+  close(destination_fd);
+  close(source_fd);
+  return cloned;
+#else
+  return false;
+#endif
+}
+
+// Tries to copy a file inside of the kernel, without reading it into memory,
+// with copy_file_range, or sendfile if the file systems don't support it.
+// Returns false if neither are supported.
+bool TryCopyFileInKernel(const std::filesystem::path& source,
+                         const std::filesystem::path& destination) {
+#ifdef __linux__
+  int source_fd = open(source.c_str(), O_RDONLY | O_CLOEXEC);
+  if (source_fd < 0) return false;
+  struct stat source_stat;
+  if (fstat(source_fd, &source_stat) != 0) {
+    close(source_fd);
+    return false;
+  }
+  int destination_fd = open(destination.c_str(),
+                            O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC,
+                            source_stat.st_mode & 07777);
+  if (destination_fd < 0) {
+    close(source_fd);
+    return false;
+  }
+
+  off_t remaining = source_stat.st_size;
+  bool use_sendfile = false;
+  while (remaining > 0) {
+    ssize_t copied =
+        use_sendfile
+            ? sendfile(destination_fd, source_fd, nullptr, remaining)
+            : copy_file_range(source_fd, nullptr, destination_fd, nullptr,
+                              remaining, 0);
+    if (copied < 0 && !use_sendfile && remaining == source_stat.st_size) {
+      // Not supported between these file systems.
+      use_sendfile = true;
+      continue;
+    }
+    // Stop if the file was truncated while it was being copied.
+    if (copied <= 0) break;
+    remaining -= copied;
+  }
+  close(destination_fd);
+  close(source_fd);
+  return remaining == 0;
+#else
+  return false;
+#endif
+}
+
+}  // namespace
+
+bool CloneOrCopyFile(const std::filesystem::path& source,
+                     const std::filesystem::path& destination) {
+  // Remove the destination rather than writing over it, in case it shares its
+  // data with another file.
+  std::error_code error;
+  std::filesystem::remove(destination, error);
+
+  if (TryCloneFile(source, destination) ||
+      TryCopyFileInKernel(source, destination)) {
+    return true;
+  }
+
+  std::filesystem::copy_file(
+      source, destination, std::filesystem::copy_options::overwrite_existing,
+      error);
+  return !error;
+}
+
+bool CloneLinkOrCopyFile(const std::filesystem::path& source,
+                         const std::filesystem::path& destination) {
+  std::error_code error;
+  std::filesystem::remove(destination, error);
+
+  if (TryCloneFile(source, destination)) return true;
+  // Hard linking fails if they're on different file systems.
+  std::filesystem::remove(destination, error);
+  std::filesystem::create_hard_link(source, destination, error);
+  if (!error) return true;
+  return CloneOrCopyFile(source, destination);
+}
@@ -0,0 +1,31 @@
+// Copyright 2024 Google LLC
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//      http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+#pragma once
+
+#include <filesystem>
+
+// Copies a file, replacing the destination if it exists. If the file system
+// supports it, the copy shares the source's data (a reflink) instead of
+// duplicating it. Otherwise the data is copied by the kernel where possible.
+// Returns whether it was successful.
+bool CloneOrCopyFile(const std::filesystem::path& source,
+                     const std::filesystem::path& destination);
+
+// Like `CloneOrCopyFile`, but if the file can't be cloned and the destination
+// is on the same file system, it's made a hard link to the source instead of
+// a copy. A hard link is the same file as the source, so writing to one
+// changes the other.
+bool CloneLinkOrCopyFile(const std::filesystem::path& source,
+                         const std::filesystem::path& destination);
@@ -0,0 +1,171 @@
+// Copyright 2024 Google LLC
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//      http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+#include "hash.h"
+
+#include <stddef.h>
+
+#include <cstdint>
+#include <cstring>
+#include <filesystem>
+#include <fstream>
+#include <string>
+#include <string_view>
+#include <vector>
+
+namespace {
+
+constexpr uint64_t kC1 = 0x87c37b91114253d5ULL;
+constexpr uint64_t kC2 = 0x4cf5ad432745937fULL;
+
+// The size of the chunks to read files in.
+constexpr size_t kFileChunkSize = 64 * 1024;
+
+uint64_t RotateLeft(uint64_t x, int r) { return (x << r) | (x >> (64 - r)); }
+
+uint64_t LoadLittleEndian(const unsigned char* bytes) {
+  uint64_t value = 0;
+  for (int i = 7; i >= 0; i--) value = (value << 8) | bytes[i];
+  return value;
+}
+
+uint64_t FinalMix(uint64_t k) {
+  k ^= k >> 33;
+  k *= 0xff51afd7ed558ccdULL;
+  k ^= k >> 33;
+  k *= 0xc4ceb9fe1a85ec53ULL;
+  k ^= k >> 33;
+  return k;
+}
+
+}  // namespace
+
+void Hasher::AddBlock(const unsigned char* block) {
+  uint64_t k1 = LoadLittleEndian(block);
+  uint64_t k2 = LoadLittleEndian(block + 8);
+
+  k1 *= kC1;
+  k1 = RotateLeft(k1, 31);
+  k1 *= kC2;
+  h1_ ^= k1;
+  h1_ = RotateLeft(h1_, 27);
+  h1_ += h2_;
+  h1_ = h1_ * 5 + 0x52dce729;
+
+  k2 *= kC2;
+  k2 = RotateLeft(k2, 33);
+  k2 *= kC1;
+  h2_ ^= k2;
+  h2_ = RotateLeft(h2_, 31);
+  h2_ += h1_;
+  h2_ = h2_ * 5 + 0x38495ab5;
+}
+
+void Hasher::AddBytes(std::string_view bytes) {
+  total_length_ += bytes.size();
+  const auto* data = reinterpret_cast<const unsigned char*>(bytes.data());
+  size_t length = bytes.size();
+
+  // Top up a partially filled block first.
+  if (pending_length_ > 0) {
+    size_t to_copy = std::min(length, sizeof(pending_) - pending_length_);
+    std::memcpy(pending_ + pending_length_, data, to_copy);
+    pending_length_ += to_copy;
+    data += to_copy;
+    length -= to_copy;
+    if (pending_length_ < sizeof(pending_)) return;
+    AddBlock(pending_);
+    pending_length_ = 0;
+  }
+
+  for (; length >= sizeof(pending_);
+       data += sizeof(pending_), length -= sizeof(pending_))
+    AddBlock(data);
+
+  std::memcpy(pending_, data, length);
+  pending_length_ = length;
+}
+
+void Hasher::AddString(std::string_view str) {
+  AddNumber(str.size());
+  AddBytes(str);
+}
+
+void Hasher::AddNumber(uint64_t number) {
+  unsigned char bytes[8];
+  for (int i = 0; i < 8; i++) bytes[i] = (number >> (i * 8)) & 0xff;
+  AddBytes(std::string_view(reinterpret_cast<const char*>(bytes), 8));
+}
+
+bool Hasher::AddFileContents(const std::filesystem::path& path) {
+  std::ifstream file(path, std::ios::binary);
+  if (!file.is_open()) return false;
+  std::vector<char> buffer(kFileChunkSize);
+  while (file) {
+    file.read(buffer.data(), buffer.size());
+    AddBytes(std::string_view(buffer.data(), file.gcount()));
+  }
+  return !file.bad();
+}
+
+std::string Hasher::Finish() {
+  // Mix in the tail.
+  uint64_t k1 = 0;
+  uint64_t k2 = 0;
+  for (size_t i = pending_length_; i-- > 8;)
+    k2 = (k2 << 8) | pending_[i];
+  for (size_t i = std::min<size_t>(pending_length_, 8); i-- > 0;)
+    k1 = (k1 << 8) | pending_[i];
+  if (pending_length_ > 8) {
+    k2 *= kC2;
+    k2 = RotateLeft(k2, 33);
+    k2 *= kC1;
+    h2_ ^= k2;
+  }
+  if (pending_length_ > 0) {
+    k1 *= kC1;
+    k1 = RotateLeft(k1, 31);
+    k1 *= kC2;
+    h1_ ^= k1;
+  }
+
+  uint64_t h1 = h1_ ^ total_length_;
+  uint64_t h2 = h2_ ^ total_length_;
+  h1 += h2;
+  h2 += h1;
+  h1 = FinalMix(h1);
+  h2 = FinalMix(h2);
+  h1 += h2;
+  h2 += h1;
+
+  constexpr char kHexDigits[] = "0123456789abcdef";
+  std::string hash(32, '0');
+  for (int i = 0; i < 16; i++) {
+    hash[15 - i] = kHexDigits[(h1 >> (i * 4)) & 0xf];
+    hash[31 - i] = kHexDigits[(h2 >> (i * 4)) & 0xf];
+  }
+  return hash;
+}
+
+std::string HashString(std::string_view str) {
+  Hasher hasher;
+  hasher.AddBytes(str);
+  return hasher.Finish();
+}
+
+std::string HashFileContents(const std::filesystem::path& path) {
+  Hasher hasher;
+  if (!hasher.AddFileContents(path)) return "";
+  return hasher.Finish();
+}
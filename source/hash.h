@@ -0,0 +1,61 @@
+// Copyright 2024 Google LLC
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//      http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+#pragma once
+
+#include <stddef.h>
+
+#include <cstdint>
+#include <filesystem>
+#include <string>
+#include <string_view>
+
+// Calculates a 128-bit non-cryptographic hash (MurmurHash3) of a stream of
+// data, used for content addressing files and commands.
+class Hasher {
+ public:
+  // Adds raw bytes to the hash.
+  void AddBytes(std::string_view bytes);
+
+  // Adds a string to the hash, prefixed with its length so that consecutive
+  // strings can't be confused with each other.
+  void AddString(std::string_view str);
+
+  // Adds a number to the hash.
+  void AddNumber(uint64_t number);
+
+  // Adds the contents of a file to the hash. Returns false if the file can't be
+  // read.
+  bool AddFileContents(const std::filesystem::path& path);
+
+  // Returns the hash of everything added, as a hexadecimal string.
+  std::string Finish();
+
+ private:
+  void AddBlock(const unsigned char* block);
+
+  uint64_t h1_ = 0;
+  uint64_t h2_ = 0;
+  uint64_t total_length_ = 0;
+  // Bytes that have been added but don't yet fill a block.
+  unsigned char pending_[16];
+  size_t pending_length_ = 0;
+};
+
+// Returns the hash of a string.
+std::string HashString(std::string_view str);
+
+// Returns the hash of a file's contents, or an empty string if the file can't
+// be read.
+std::string HashFileContents(const std::filesystem::path& path);
@@ -14,9 +14,12 @@
 
 #include "invocation.h"
 
+#include <cstdlib>
 #include <functional>
 #include <iostream>
+#include <optional>
 #include <string>
+#include <string_view>
 #include <vector>
 
 #include "invocation_action.h"
@@ -26,8 +29,46 @@ namespace {
 
 InvocationAction invocation_action = InvocationAction::Run;
 OptimizationLevel optimization_level = OptimizationLevel::Fast;
+bool dev_mode = false;
+bool explain = false;
 std::vector<std::string> input_packages;
 bool all_known_packages = false;
+std::string compile_server_port;
+// The number of commands that may fail before the build stops, or 0 if it never
+// stops.
+int max_failures = 1;
+bool terminate_on_failure = false;
+bool watch = false;
+std::string trace_file;
+bool only_changed_tests = false;
+double max_load_average = 0;
+bool record_stats = false;
+std::string stats_file;
+
+// The argument for running the compile server, which may be followed by
+// "=PORT".
+constexpr std::string_view kCompileServerArgument = "--compile-server";
+// The argument for continuing after failures, which may be followed by "=N".
+constexpr std::string_view kKeepGoingArgument = "--keep-going";
+// The argument for testing, which may be followed by "=changed".
+constexpr std::string_view kTestArgument = "--test";
+// The argument for limiting the load average, which must be followed by "=N".
+constexpr std::string_view kLoadAverageArgument = "--load-average";
+// The argument for printing statistics, which may be followed by "=FILE".
+constexpr std::string_view kStatsArgument = "--stats";
+// The argument for recording a trace, which must be followed by "=FILE".
+constexpr std::string_view kTraceArgument = "--trace";
+
+// Returns whether an argument is `name`, optionally followed by "=value".
+// Populates `value` if there is one.
+bool MatchArgumentWithOptionalValue(const std::string& argument,
+                                    std::string_view name,
+                                    std::optional<std::string>& value) {
+  if (argument == name) return true;
+  if (!argument.starts_with(std::string(name) + "=")) return false;
+  value = argument.substr(name.size() + 1);
+  return true;
+}
 
 void PrintHelp() {
   std::cout << R"(Usage:
@@ -41,17 +82,46 @@ Package arguments:
 Invocation action arguments:
   --build      - Build but don't run.
   --clean      - Clean the temp files for the packages.
+  --compile-server[=PORT]
+               - Compile commands sent from other machines, instead of
+                 building. The default port is 8377.
   --deep-clean - Clean all the temp files and any cached repositories.
   --run        - Build and run the packages. (Default)
-  --test       - Build and run unit tests for the packages.
+  --test[=changed]
+               - Build and run unit tests for the packages, in parallel. With
+                 =changed, only runs the tests that changed since they last
+                 passed.
 
  Optimization levels:
   --debug     - Build with all debug symbols.
   --fast      - Quickly build, with some optimizations enabled.
   --optimized - Build will all optimizations enabled.
+  --thin-optimized
+              - Build with all optimizations enabled, using ThinLTO, which
+                links faster and caches what it optimizes between links.
+  --dev       - Link libraries as shared libraries, which applications are
+                only relinked against when their exported symbols change.
+
+ Failure handling:
+  --keep-going[=N]       - Keep building until N commands have failed, or no
+                           matter how many fail if N isn't given. By default
+                           the build stops after the first failure.
+  --terminate-on-failure - When the build stops, terminate the commands that
+                           are still running instead of waiting for them.
 
  Other arguments:
-  --help - Print this message.
+  --explain      - Print why each compile and link command is queued, and
+                   which files caused the most of them to be.
+  --help         - Print this message.
+  --load-average=N
+                 - Don't start more commands while the system's load average
+                   is N or more, unless nothing else is running.
+  --stats[=FILE] - Print statistics about the build when it finishes, and
+                   write them to FILE as JSON if it's given.
+  --trace=FILE   - Write a trace of where the time is spent building to FILE,
+                   which can be opened in chrome://tracing or Perfetto.
+  --watch        - After building, keep watching the packages and rebuild
+                   them each time their files change.
 )";
 }
 
@@ -62,6 +132,7 @@ bool ParseInvocation(int argc, char* argv[]) {
 
   for (int i = 1; i < argc; i++) {
     std::string argument = argv[i];
+    std::optional<std::string> value;
 
     if (argument.size() == 0) continue;
     if (argument[0] == '-') {
@@ -71,19 +142,72 @@ bool ParseInvocation(int argc, char* argv[]) {
         invocation_action = InvocationAction::Build;
       } else if (argument == "--clean") {
         invocation_action = InvocationAction::Clean;
+      } else if (MatchArgumentWithOptionalValue(
+                     argument, kCompileServerArgument, value)) {
+        invocation_action = InvocationAction::CompileServer;
+        if (value) compile_server_port = *value;
       } else if (argument == "--debug") {
         optimization_level = OptimizationLevel::Debug;
       } else if (argument == "--deep-clean") {
         invocation_action = InvocationAction::DeepClean;
+      } else if (argument == "--dev") {
+        dev_mode = true;
+      } else if (argument == "--explain") {
+        explain = true;
       } else if (argument == "--fast") {
         optimization_level = OptimizationLevel::Fast;
       } else if (argument == "--help") {
         PrintHelp();
         abort = true;
+      } else if (MatchArgumentWithOptionalValue(argument, kKeepGoingArgument,
+                                                value)) {
+        max_failures = value ? std::atoi(value->c_str()) : 0;
+        if (max_failures < 0 || (value && max_failures == 0 && *value != "0")) {
+          std::cerr << "Invalid number of failures: " << argument
+                    << std::endl;
+          abort = true;
+        }
+      } else if (MatchArgumentWithOptionalValue(argument, kLoadAverageArgument,
+                                                value)) {
+        max_load_average = value ? std::atof(value->c_str()) : 0;
+        if (max_load_average <= 0) {
+          std::cerr << "--load-average needs a positive load average, such as "
+                       "--load-average=8."
+                    << std::endl;
+          abort = true;
+        }
       } else if (argument == "--optimized") {
         optimization_level = OptimizationLevel::Optimized;
       } else if (argument == "--run") {
         invocation_action = InvocationAction::Run;
+      } else if (MatchArgumentWithOptionalValue(argument, kTestArgument,
+                                                value)) {
+        invocation_action = InvocationAction::Test;
+        if (value && *value != "changed") {
+          std::cerr << "Unknown tests to run: " << argument << std::endl;
+          abort = true;
+        }
+        only_changed_tests = value.has_value();
+      } else if (argument == "--thin-optimized") {
+        optimization_level = OptimizationLevel::ThinOptimized;
+      } else if (argument == "--terminate-on-failure") {
+        terminate_on_failure = true;
+      } else if (MatchArgumentWithOptionalValue(argument, kStatsArgument,
+                                                value)) {
+        record_stats = true;
+        if (value) stats_file = *value;
+      } else if (MatchArgumentWithOptionalValue(argument, kTraceArgument,
+                                                value)) {
+        if (!value || value->empty()) {
+          std::cerr << "--trace needs a file to write to, such as "
+                       "--trace=trace.json."
+                    << std::endl;
+          abort = true;
+        } else {
+          trace_file = *value;
+        }
+      } else if (argument == "--watch") {
+        watch = true;
       } else {
         std::cerr << "Unknown argument: " << argument << std::endl;
         abort = true;
@@ -100,6 +224,10 @@ InvocationAction GetInvocationAction() { return invocation_action; }
 
 OptimizationLevel GetOptimizationLevel() { return optimization_level; }
 
+bool IsDevMode() { return dev_mode; }
+
+bool ShouldExplain() { return explain; }
+
 void ForEachRawInputPackage(
     const std::function<void(const std::string&)>& on_each_package) {
   if (input_packages.empty()) {
@@ -110,3 +238,21 @@ void ForEachRawInputPackage(
 }
 
 bool RunOnAllKnownPackages() { return all_known_packages; }
+
+std::string_view GetCompileServerPort() { return compile_server_port; }
+
+int GetMaxFailures() { return max_failures; }
+
+bool ShouldTerminateOnFailure() { return terminate_on_failure; }
+
+bool ShouldWatch() { return watch; }
+
+std::string_view GetTraceFile() { return trace_file; }
+
+bool ShouldOnlyRunChangedTests() { return only_changed_tests; }
+
+double GetMaxLoadAverage() { return max_load_average; }
+
+bool ShouldRecordStats() { return record_stats; }
+
+std::string_view GetStatsFile() { return stats_file; }
@@ -16,6 +16,7 @@
 
 #include <functional>
 #include <string>
+#include <string_view>
 
 #include "invocation_action.h"
 #include "optimization_level.h"
@@ -29,6 +30,13 @@ InvocationAction GetInvocationAction();
 // Returns the optimization level to build with.
 OptimizationLevel GetOptimizationLevel();
 
+// Returns whether libraries are linked as shared libraries, so applications
+// only need to be relinked when the symbols the libraries export change.
+bool IsDevMode();
+
+// Returns whether to explain why each compile and link command is queued.
+bool ShouldExplain();
+
 // Loops over each raw package that was used as the program's arguments. Even if
 // none were provided, then this will call `on_each_package` once with a blank
 // string.
@@ -38,3 +46,37 @@ void ForEachRawInputPackage(
 // Returns whether the user requested that the invocation action be performed
 // for all known packages.
 bool RunOnAllKnownPackages();
+
+// Returns the port to run the compile server on, or a blank string to use the
+// default.
+std::string_view GetCompileServerPort();
+
+// Returns how many commands may fail before the build stops, or 0 if the build
+// should keep going no matter how many fail.
+int GetMaxFailures();
+
+// Returns whether running commands should be terminated when the build stops
+// because of failures.
+bool ShouldTerminateOnFailure();
+
+// Returns whether to keep watching the packages for changes and rebuilding
+// them after the invocation.
+bool ShouldWatch();
+
+// Returns the file to write a trace of the build to, or a blank string if a
+// trace shouldn't be recorded.
+std::string_view GetTraceFile();
+
+// Returns whether to only run the tests that changed since they last passed.
+bool ShouldOnlyRunChangedTests();
+
+// Returns the load average at which to stop starting more commands, or 0 if
+// there's no limit.
+double GetMaxLoadAverage();
+
+// Returns whether to print statistics about the build.
+bool ShouldRecordStats();
+
+// Returns the file to write statistics about the build to as JSON, or a blank
+// string if they should only be printed.
+std::string_view GetStatsFile();
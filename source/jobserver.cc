@@ -0,0 +1,264 @@
+// Copyright 2024 Google LLC
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//      http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+
+#include "jobserver.h"
+
+#include <stdlib.h>
+
+#include <algorithm>
+#include <chrono>
+#include <cstdlib>
+#include <filesystem>
+#include <iostream>
+#include <mutex>
+#include <optional>
+#include <sstream>
+#include <string>
+#include <string_view>
+#include <vector>
+
+#ifndef _WIN32
+#include <errno.h>
+#include <fcntl.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#endif
+
+#include "config.h"
+#include "invocation.h"
+#include "temp_directory.h"
+
+namespace {
+
+// The MAKEFLAGS arguments that describe the jobserver. Versions of make before
+// 4.2 use --jobserver-fds.
+constexpr std::string_view kJobserverAuthArgument = "--jobserver-auth=";
+constexpr std::string_view kJobserverFdsArgument = "--jobserver-fds=";
+// Jobservers that are named FIFOs, rather than inherited pipes, are prefixed
+// with this.
+constexpr std::string_view kFifoPrefix = "fifo:";
+// The MAKEFLAGS argument that sets the load average limit.
+constexpr std::string_view kLoadAverageArgument = "-l";
+
+// The name of the FIFO in the shared temp directory of the jobserver started by
+// REBS, which is followed by the process ID.
+constexpr char kJobserverFifoName[] = "jobserver_";
+
+// The token written to the jobserver started by REBS, which is what make uses.
+constexpr char kJobToken = '+';
+
+// How often to read the load average of the system.
+constexpr std::chrono::seconds kLoadAverageInterval{1};
+
+// The file descriptors to read and write tokens with, or -1 if there is no
+// jobserver. Reads don't block.
+int read_fd = -1;
+int write_fd = -1;
+// The FIFO of the jobserver started by REBS.
+std::filesystem::path fifo_path;
+// MAKEFLAGS from before the jobserver was started, if it was set.
+std::optional<std::string> original_makeflags;
+bool jobserver_started = false;
+
+// Guards the tokens that have been taken, which must be returned as they were
+// read, in case they mean something to the jobserver.
+std::mutex tokens_mutex;
+std::vector<char> acquired_tokens;
+
+double max_load_average = 0;
+// Guards the most recently read load average.
+std::mutex load_average_mutex;
+double load_average = 0;
+std::chrono::steady_clock::time_point load_average_read_time;
+
+// Splits MAKEFLAGS into its arguments.
+std::vector<std::string> SplitMakeflags(std::string_view makeflags) {
+  std::vector<std::string> arguments;
+  std::stringstream stream{std::string(makeflags)};
+  std::string argument;
+  while (stream >> argument) arguments.push_back(argument);
+  return arguments;
+}
+
+#ifndef _WIN32
+
+// Connects to the jobserver described by the value of --jobserver-auth.
+bool ConnectToJobserver(const std::string& auth) {
+  if (auth.starts_with(kFifoPrefix)) {
+    std::string path = auth.substr(kFifoPrefix.size());
+    read_fd = open(path.c_str(), O_RDWR | O_NONBLOCK | O_CLOEXEC);
+    write_fd = read_fd;
+    return read_fd >= 0;
+  }
+
+  // Otherwise it's a pipe that was inherited from the parent, described by
+  // "read fd,write fd". Make doesn't pass it to commands it doesn't think are
+  // recursive makes.
+  int inherited_read_fd = -1;
+  int inherited_write_fd = -1;
+  size_t comma = auth.find(',');
+  if (comma == std::string::npos) return false;
+  inherited_read_fd = std::atoi(auth.c_str());
+  inherited_write_fd = std::atoi(auth.c_str() + comma + 1);
+  if (inherited_read_fd < 0 || inherited_write_fd < 0 ||
+      fcntl(inherited_read_fd, F_GETFD) < 0 ||
+      fcntl(inherited_write_fd, F_GETFD) < 0)
+    return false;
+  // The pipe is opened again, so that reading from it doesn't block without
+  // changing how it behaves for the other processes sharing it.
+  read_fd = open(("/proc/self/fd/" + std::to_string(inherited_read_fd)).c_str(),
+                 O_RDONLY | O_NONBLOCK | O_CLOEXEC);
+  if (read_fd < 0) return false;
+  write_fd = inherited_write_fd;
+  return true;
+}
+
+// Starts a jobserver with a token for each parallel task other than the
+// implicit one, and passes it to the commands that are ran through MAKEFLAGS.
+bool StartJobserver() {
+  const char* makeflags = getenv("MAKEFLAGS");
+  if (makeflags != nullptr) original_makeflags = makeflags;
+
+  fifo_path = GetSharedTempDirectoryPath() /
+              (kJobserverFifoName + std::to_string(getpid()));
+  unlink(fifo_path.c_str());
+  if (mkfifo(fifo_path.c_str(), 0600) != 0) return false;
+  read_fd = open(fifo_path.c_str(), O_RDWR | O_NONBLOCK | O_CLOEXEC);
+  if (read_fd < 0) {
+    unlink(fifo_path.c_str());
+    return false;
+  }
+  write_fd = read_fd;
+  jobserver_started = true;
+
+  std::string tokens(std::max(GetNumberOfParallelTasks() - 1, 0), kJobToken);
+  if (!tokens.empty() && write(write_fd, tokens.data(), tokens.size()) !=
+                             static_cast<ssize_t>(tokens.size()))
+    return false;
+
+  std::string new_makeflags;
+  if (original_makeflags) new_makeflags = *original_makeflags + " ";
+  new_makeflags += "-j" + std::to_string(GetNumberOfParallelTasks()) + " " +
+                   std::string(kJobserverAuthArgument) +
+                   std::string(kFifoPrefix) + fifo_path.string();
+  if (max_load_average > 0) {
+    new_makeflags += " " + std::string(kLoadAverageArgument) +
+                     std::to_string(max_load_average);
+  }
+  setenv("MAKEFLAGS", new_makeflags.c_str(), /*overwrite=*/1);
+  return true;
+}
+
+#endif
+
+}  // namespace
+
+void InitializeJobserver() {
+  std::optional<std::string> auth;
+  const char* makeflags = getenv("MAKEFLAGS");
+  if (makeflags != nullptr) {
+    for (const auto& argument : SplitMakeflags(makeflags)) {
+      // The last of each argument is the one that applies.
+      if (argument.starts_with(kJobserverAuthArgument)) {
+        auth = argument.substr(kJobserverAuthArgument.size());
+      } else if (argument.starts_with(kJobserverFdsArgument)) {
+        auth = argument.substr(kJobserverFdsArgument.size());
+      } else if (argument.starts_with(kLoadAverageArgument)) {
+        max_load_average =
+            std::atof(argument.c_str() + kLoadAverageArgument.size());
+      }
+    }
+  }
+  if (GetMaxLoadAverage() > 0) max_load_average = GetMaxLoadAverage();
+
+#ifndef _WIN32
+  if (auth) {
+    if (ConnectToJobserver(*auth)) return;
+    std::cerr << "Cannot connect to the jobserver in MAKEFLAGS, so REBS will "
+                 "use its own."
+              << std::endl;
+    read_fd = -1;
+    write_fd = -1;
+  }
+  if (!StartJobserver()) {
+    std::cerr << "Cannot start a jobserver, so the commands REBS runs won't "
+                 "share its parallel tasks."
+              << std::endl;
+    ShutdownJobserver();
+  }
+#endif
+}
+
+void ShutdownJobserver() {
+#ifndef _WIN32
+  if (jobserver_started) {
+    close(read_fd);
+    unlink(fifo_path.c_str());
+    if (original_makeflags) {
+      setenv("MAKEFLAGS", original_makeflags->c_str(), /*overwrite=*/1);
+    } else {
+      unsetenv("MAKEFLAGS");
+    }
+    jobserver_started = false;
+  } else if (read_fd >= 0) {
+    // Tokens are all returned by the time the commands have finished.
+    close(read_fd);
+  }
+#endif
+  read_fd = -1;
+  write_fd = -1;
+}
+
+bool TryAcquireJobToken() {
+  if (read_fd < 0) return true;
+#ifndef _WIN32
+  char token;
+  if (read(read_fd, &token, 1) != 1) return false;
+  std::scoped_lock lock(tokens_mutex);
+  acquired_tokens.push_back(token);
+#endif
+  return true;
+}
+
+void ReleaseJobToken() {
+  if (write_fd < 0) return;
+#ifndef _WIN32
+  char token;
+  {
+    std::scoped_lock lock(tokens_mutex);
+    if (acquired_tokens.empty()) return;
+    token = acquired_tokens.back();
+    acquired_tokens.pop_back();
+  }
+  while (write(write_fd, &token, 1) < 0 && errno == EINTR) {
+  }
+#endif
+}
+
+bool IsOverLoadLimit() {
+  if (max_load_average <= 0) return false;
+#ifdef _WIN32
+  return false;
+#else
+  std::scoped_lock lock(load_average_mutex);
+  auto now = std::chrono::steady_clock::now();
+  if (now - load_average_read_time >= kLoadAverageInterval) {
+    double averages[1];
+    if (getloadavg(averages, 1) == 1) load_average = averages[0];
+    load_average_read_time = now;
+  }
+  return load_average >= max_load_average;
+#endif
+}
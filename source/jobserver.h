@@ -0,0 +1,42 @@
+// Copyright 2024 Google LLC
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//      http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+
+#pragma once
+
+// REBS shares how many commands may run at once with the other processes
+// building on the machine, using the GNU make jobserver protocol. When REBS is
+// ran by make (or another REBS), it takes tokens from the parent's jobserver.
+// Otherwise it starts its own jobserver with `parallel_tasks` tokens, which is
+// passed to the commands it runs through MAKEFLAGS, so that sub-builds share
+// them. A command can always run without a token if no other command is
+// running, because every process has one implicit token.
+
+// Connects to the jobserver in MAKEFLAGS, or starts a jobserver.
+void InitializeJobserver();
+
+// Stops the jobserver that was started, and restores MAKEFLAGS.
+void ShutdownJobserver();
+
+// Tries to take a token from the jobserver without waiting, to run another
+// command at the same time. Thread safe.
+bool TryAcquireJobToken();
+
+// Returns a token to the jobserver. Thread safe.
+void ReleaseJobToken();
+
+// Returns whether the system's load average is at or over the limit set with
+// --load-average or by make's -l, in which case no more commands should start
+// while others are running. Thread safe.
+bool IsOverLoadLimit();
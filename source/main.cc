@@ -12,23 +12,56 @@
 // See the License for the specific language governing permissions and
 // limitations under the License.
 
+#include <chrono>
+#include <functional>
 #include <iostream>
 #include <memory>
+#include <string_view>
+
+#ifndef _WIN32
+#include <unistd.h>
+#endif
 
 #include "build.h"
+#include "command_hashes.h"
 #include "command_queue.h"
 #include "config.h"
 #include "dependencies.h"
+#include "directory_manifest.h"
+#include "distributed_compile.h"
+#include "durations.h"
+#include "explain.h"
 #include "invocation.h"
 #include "invocation_action.h"
+#include "jobserver.h"
+#include "metadata_snapshot.h"
+#include "object_cache.h"
 #include "package_id.h"
 #include "packages.h"
+#include "remote_cache.h"
 #include "run.h"
 #include "stage.h"
+#include "stats.h"
 #include "temp_directory.h"
+#include "test_runner.h"
+#include "trace.h"
+#include "watch.h"
+#include "worker_pool.h"
 
 namespace {
 
+// Runs a phase of the invocation, recording how long it takes in the stats and
+// the trace. Returns whether the phase was successful.
+bool RunPhase(std::string_view name, const std::function<bool()>& phase) {
+  ScopedTraceSpan span(name, "phase");
+  auto start_time = std::chrono::steady_clock::now();
+  bool successful = phase();
+  RecordPhase(name, std::chrono::duration_cast<std::chrono::microseconds>(
+                        std::chrono::steady_clock::now() - start_time)
+                        .count());
+  return successful;
+}
+
 // Handles the invocation (clean, build, run, etc.) after everything has been
 // initialized.
 bool HandleInvocation() {
@@ -40,13 +73,13 @@ bool HandleInvocation() {
       std::cerr << "Cleaning is not implement." << std::endl;
       return false;
     case InvocationAction::Build:
-      return BuildPackages();
+      return RunPhase("Build packages", BuildPackages);
     case InvocationAction::Run:
-      if (!BuildPackages()) return false;
+      if (!RunPhase("Build packages", BuildPackages)) return false;
       return RunPackages();
     case InvocationAction::Test:
-      std::cerr << "Testing is not implement." << std::endl;
-      return false;
+      if (!RunPhase("Build packages", BuildPackages)) return false;
+      return TestPackages();
     default:
       std::cerr << "Unknown invocation." << std::endl;
       return false;
@@ -57,24 +90,85 @@ bool HandleInvocation() {
 // without having to worry about cleaning up. Returns whether the execution is
 // successful.
 bool WrappedMain() {
-  if (!HandleInvocation()) return false;
-  if (!RunQueuedCommands()) return false;
-  return true;
+  if (!HandleInvocation()) {
+    DiscardQueuedCommands();
+    return false;
+  }
+  ReportExplanations();
+  bool successful = RunPhase("Run commands", RunQueuedCommands);
+  // Tests are summarized even if some of them failed.
+  if (GetInvocationAction() == InvocationAction::Test)
+    successful &= ReportTestResults();
+  return successful;
+}
+
+// Writes everything that is remembered between runs to disk.
+void FlushCaches() {
+  FlushObjectCache();
+  FlushCommandHashes();
+  FlushDependencies();
+  FlushDirectoryManifests();
+  FlushDurations();
+  FlushMetadataSnapshot();
+  FlushPackageIDs();
+  FlushTrace();
 }
 
 }  // namespace
 
 int main(int argc, char* argv[]) {
   if (!ParseInvocation(argc, argv)) return -1;
-  InitializeTempDirectory();
-  if (!LoadConfigFile()) return -1;
-  InitializePackageIDs();
-  InitializePackages();
+  InitializeTrace();
+  InitializeStats();
+  RunPhase("Initialize temp directory", []() {
+    InitializeTempDirectory();
+    return true;
+  });
+  if (!RunPhase("Load config", LoadConfigFile)) return -1;
+  if (GetInvocationAction() == InvocationAction::CompileServer)
+    return RunCompileServer(GetCompileServerPort()) ? 0 : -1;
+  if (!InitializeRemoteCache()) return -1;
+  InitializeWorkerPool(GetNumberOfParallelTasks());
+  InitializeJobserver();
+  InitializeObjectCache();
+  InitializeDistributedCompilation();
+  RunPhase("Initialize package IDs", []() {
+    InitializePackageIDs();
+    return true;
+  });
+  RunPhase("Initialize packages", []() {
+    InitializePackages();
+    return true;
+  });
 
   bool success = WrappedMain();
+  ReportStats();
+  bool restart = false;
+  if (ShouldWatch()) {
+    FlushCaches();
+    restart = WatchForChanges([&success]() {
+      success = WrappedMain();
+      ReportStats();
+      FlushCaches();
+    });
+  }
 
-  FlushDependencies();
-  FlushPackageIDs();
+  ShutdownWorkerPool();
+  ShutdownDistributedCompilation();
+  ShutdownRemoteCache();
+  ShutdownJobserver();
+  FlushCaches();
+
+#ifndef _WIN32
+  if (restart) {
+    // Start over with the same arguments, because the global config or the
+    // packages on the system have changed.
+    std::cout << "Restarting..." << std::endl;
+    execvp(argv[0], argv);
+    std::cerr << "Cannot restart " << argv[0] << "." << std::endl;
+    return -1;
+  }
+#endif
 
   return success ? 0 : -1;
 }
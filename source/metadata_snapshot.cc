@@ -0,0 +1,381 @@
+// Copyright 2024 Google LLC
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//      http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+#include "metadata_snapshot.h"
+
+#include <cstdint>
+#include <cstring>
+#include <filesystem>
+#include <fstream>
+#include <iostream>
+#include <map>
+#include <memory>
+#include <string>
+#include <string_view>
+#include <vector>
+
+#include "config.h"
+#include "mapped_file.h"
+#include "package_metadata.h"
+#include "packages.h"
+#include "temp_directory.h"
+
+namespace {
+
+// The name of the snapshot file in the temp directory.
+constexpr char kMetadataSnapshotFile[] = "metadata_snapshot";
+
+// The start of the snapshot file. This should change whenever the format
+// changes, so that old snapshots are ignored.
+constexpr std::string_view kSnapshotVersion = "rebs metadata snapshot 9\n";
+
+// A package in the snapshot. The metadata is only decoded if it's used.
+struct SnapshotEntry {
+  std::filesystem::path package_path;
+  // When the package's config changed when the snapshot was taken.
+  uint64_t config_timestamp;
+  // Points into the mapped snapshot file.
+  std::string_view encoded_metadata;
+};
+
+bool loaded_snapshot = false;
+
+// The packages in the snapshot that was loaded.
+std::map<std::string, SnapshotEntry> entries_by_package_name;
+
+// Whether each package in the loaded snapshot is current.
+std::map<std::string, bool> is_entry_current_by_package_name;
+
+// The encoded entries of packages that have been stored during this run.
+std::map<std::string, std::string> stored_entries_by_package_name;
+
+// Decodes values from the snapshot. Reading past the end sets `ok` to false
+// and returns empty values.
+struct SnapshotReader {
+  std::string_view data;
+  bool ok = true;
+};
+
+uint64_t ReadInteger(SnapshotReader& reader) {
+  uint64_t value = 0;
+  if (reader.data.size() < sizeof(value)) {
+    reader.ok = false;
+    return 0;
+  }
+  std::memcpy(&value, reader.data.data(), sizeof(value));
+  reader.data.remove_prefix(sizeof(value));
+  return value;
+}
+
+std::string_view ReadBytes(SnapshotReader& reader, uint64_t length) {
+  if (reader.data.size() < length) {
+    reader.ok = false;
+    return {};
+  }
+  std::string_view bytes = reader.data.substr(0, length);
+  reader.data.remove_prefix(length);
+  return bytes;
+}
+
+std::string_view ReadString(SnapshotReader& reader) {
+  return ReadBytes(reader, ReadInteger(reader));
+}
+
+template <typename T>
+void ReadStrings(SnapshotReader& reader, std::vector<T>& strings) {
+  uint64_t count = ReadInteger(reader);
+  for (uint64_t i = 0; i < count && reader.ok; i++)
+    strings.push_back(T(ReadString(reader)));
+}
+
+void WriteInteger(std::string& out, uint64_t value) {
+  out.append(reinterpret_cast<const char*>(&value), sizeof(value));
+}
+
+void WriteString(std::string& out, std::string_view str) {
+  WriteInteger(out, str.size());
+  out.append(str);
+}
+
+void WriteString(std::string& out, const std::string& str) {
+  WriteString(out, std::string_view(str));
+}
+
+void WriteString(std::string& out, const std::filesystem::path& path) {
+  WriteString(out, path.string());
+}
+
+template <typename Strings>
+void WriteStrings(std::string& out, const Strings& strings) {
+  WriteInteger(out, strings.size());
+  for (const auto& str : strings) WriteString(out, str);
+}
+
+// Encodes everything in the metadata except for what's stored in the entry or
+// populated by the caller.
+std::string EncodeMetadata(const PackageMetadata& metadata) {
+  std::string out;
+  WriteInteger(out, static_cast<uint64_t>(metadata.type));
+  WriteInteger(out, metadata.build_commands_by_file_extension.size());
+  for (const auto& [extension, command] :
+       metadata.build_commands_by_file_extension) {
+    WriteString(out, extension);
+    WriteString(out, command);
+  }
+  WriteString(out, metadata.linker_command);
+  WriteString(out, metadata.static_linker_command);
+  WriteString(out, metadata.shared_library_linker_command);
+  WriteString(out, metadata.position_independent_code_argument);
+  WriteString(out, metadata.output_filename);
+  WriteString(out, metadata.output_path);
+  WriteString(out, metadata.statically_linked_library_output_path);
+  WriteStrings(out, metadata.source_directories);
+  WriteStrings(out, metadata.public_include_directories);
+  WriteStrings(out, metadata.include_directories);
+  WriteInteger(out, static_cast<uint64_t>(metadata.include_priorty));
+  WriteStrings(out, metadata.public_defines);
+  WriteStrings(out, metadata.defines);
+  WriteStrings(out, metadata.dependencies);
+  WriteStrings(out, metadata.files_to_ignore);
+  WriteInteger(out, metadata.unity_build);
+  WriteInteger(out, static_cast<uint64_t>(metadata.unity_batch_size));
+  WriteInteger(out, metadata.precompiled_header);
+  WriteInteger(out,
+               metadata.precompiled_header_commands_by_file_extension.size());
+  for (const auto& [extension, command] :
+       metadata.precompiled_header_commands_by_file_extension) {
+    WriteString(out, extension);
+    WriteString(out, command);
+  }
+  WriteString(out, metadata.precompiled_header_argument);
+  WriteInteger(out, metadata.modules);
+  WriteString(out, metadata.module_scan_command);
+  WriteString(out, metadata.module_output_argument);
+  WriteString(out, metadata.module_file_argument);
+  WriteInteger(out, metadata.split_debug_info);
+  WriteString(out, metadata.split_debug_info_argument);
+  WriteString(out, metadata.debug_info_package_command);
+  WriteInteger(out, metadata.should_skip);
+  WriteInteger(out, metadata.no_output_file);
+  WriteInteger(out, metadata.test);
+  WriteStrings(out, metadata.tests);
+  WriteInteger(out, metadata.test_shards);
+  WriteInteger(out, metadata.statically_link);
+  WriteString(out, metadata.destination_directory);
+  WriteStrings(out, metadata.asset_directories);
+  WriteInteger(out, metadata.compare_asset_contents);
+  WriteInteger(out, metadata.hard_link_assets);
+  WriteStrings(out, metadata.consolidated_defines);
+  WriteStrings(out, metadata.consolidated_dependencies);
+  WriteStrings(out, metadata.consolidated_includes);
+  WriteStrings(out, metadata.statically_linked_library_objects);
+  WriteStrings(out, metadata.dynamically_linked_libaries);
+  return out;
+}
+
+// Decodes metadata encoded with `EncodeMetadata`. Returns whether it was
+// successful.
+bool DecodeMetadata(std::string_view encoded_metadata,
+                    PackageMetadata& metadata) {
+  SnapshotReader reader{encoded_metadata};
+  metadata.type = static_cast<PackageType>(ReadInteger(reader));
+  uint64_t build_commands = ReadInteger(reader);
+  for (uint64_t i = 0; i < build_commands && reader.ok; i++) {
+    std::string extension(ReadString(reader));
+    metadata.build_commands_by_file_extension[extension] = ReadString(reader);
+  }
+  metadata.linker_command = ReadString(reader);
+  metadata.static_linker_command = ReadString(reader);
+  metadata.shared_library_linker_command = ReadString(reader);
+  metadata.position_independent_code_argument = ReadString(reader);
+  metadata.output_filename = ReadString(reader);
+  metadata.output_path = ReadString(reader);
+  metadata.statically_linked_library_output_path = ReadString(reader);
+  ReadStrings(reader, metadata.source_directories);
+  ReadStrings(reader, metadata.public_include_directories);
+  ReadStrings(reader, metadata.include_directories);
+  metadata.include_priorty = static_cast<int>(ReadInteger(reader));
+  ReadStrings(reader, metadata.public_defines);
+  ReadStrings(reader, metadata.defines);
+  ReadStrings(reader, metadata.dependencies);
+  uint64_t files_to_ignore = ReadInteger(reader);
+  for (uint64_t i = 0; i < files_to_ignore && reader.ok; i++)
+    metadata.files_to_ignore.insert(ReadString(reader));
+  metadata.unity_build = ReadInteger(reader);
+  metadata.unity_batch_size = static_cast<int>(ReadInteger(reader));
+  metadata.precompiled_header = ReadInteger(reader);
+  uint64_t precompiled_header_commands = ReadInteger(reader);
+  for (uint64_t i = 0; i < precompiled_header_commands && reader.ok; i++) {
+    std::string extension(ReadString(reader));
+    metadata.precompiled_header_commands_by_file_extension[extension] =
+        ReadString(reader);
+  }
+  metadata.precompiled_header_argument = ReadString(reader);
+  metadata.modules = ReadInteger(reader);
+  metadata.module_scan_command = ReadString(reader);
+  metadata.module_output_argument = ReadString(reader);
+  metadata.module_file_argument = ReadString(reader);
+  metadata.split_debug_info = ReadInteger(reader);
+  metadata.split_debug_info_argument = ReadString(reader);
+  metadata.debug_info_package_command = ReadString(reader);
+  metadata.should_skip = ReadInteger(reader);
+  metadata.no_output_file = ReadInteger(reader);
+  metadata.test = ReadInteger(reader);
+  ReadStrings(reader, metadata.tests);
+  metadata.test_shards = ReadInteger(reader);
+  metadata.statically_link = ReadInteger(reader);
+  metadata.destination_directory = ReadString(reader);
+  ReadStrings(reader, metadata.asset_directories);
+  metadata.compare_asset_contents = ReadInteger(reader);
+  metadata.hard_link_assets = ReadInteger(reader);
+  ReadStrings(reader, metadata.consolidated_defines);
+  ReadStrings(reader, metadata.consolidated_dependencies);
+  ReadStrings(reader, metadata.consolidated_includes);
+  ReadStrings(reader, metadata.statically_linked_library_objects);
+  ReadStrings(reader, metadata.dynamically_linked_libaries);
+  return reader.ok && reader.data.empty();
+}
+
+// Encodes an entry in the snapshot file.
+std::string EncodeEntry(const std::string& package_name,
+                        const SnapshotEntry& entry) {
+  std::string out;
+  WriteString(out, package_name);
+  WriteString(out, entry.package_path);
+  WriteInteger(out, entry.config_timestamp);
+  WriteString(out, entry.encoded_metadata);
+  return out;
+}
+
+std::filesystem::path GetSnapshotFilePath() {
+  return GetTempDirectoryPath() / kMetadataSnapshotFile;
+}
+
+void MaybeLoadSnapshot() {
+  if (loaded_snapshot) return;
+  loaded_snapshot = true;
+
+  SnapshotReader reader{MapFile(GetSnapshotFilePath())};
+  if (ReadBytes(reader, kSnapshotVersion.size()) != kSnapshotVersion) return;
+  // Everything is out of date if the global config changed.
+  if (ReadInteger(reader) != GetGlobalConfigTimestamp()) return;
+
+  while (reader.ok && !reader.data.empty()) {
+    std::string package_name(ReadString(reader));
+    SnapshotEntry entry;
+    entry.package_path = ReadString(reader);
+    entry.config_timestamp = ReadInteger(reader);
+    entry.encoded_metadata = ReadString(reader);
+    if (reader.ok) entries_by_package_name[package_name] = entry;
+  }
+}
+
+// Returns whether a package is in the snapshot and its config hasn't changed
+// since.
+bool IsEntryCurrent(const std::string& package_name) {
+  auto cached_itr = is_entry_current_by_package_name.find(package_name);
+  if (cached_itr != is_entry_current_by_package_name.end())
+    return cached_itr->second;
+
+  bool is_current = false;
+  auto itr = entries_by_package_name.find(package_name);
+  if (itr != entries_by_package_name.end()) {
+    const auto& package_path = GetPackagePathFromName(package_name);
+    is_current = !package_path.empty() &&
+                 package_path == itr->second.package_path &&
+                 GetConfigTimestampOfPackage(package_path) ==
+                     itr->second.config_timestamp;
+  }
+  is_entry_current_by_package_name[package_name] = is_current;
+  return is_current;
+}
+
+}  // namespace
+
+std::unique_ptr<PackageMetadata> RestoreMetadataFromSnapshot(
+    const std::string& package_name) {
+  MaybeLoadSnapshot();
+  if (!IsEntryCurrent(package_name)) return nullptr;
+
+  const SnapshotEntry& entry = entries_by_package_name[package_name];
+  auto metadata = std::make_unique<PackageMetadata>();
+  if (!DecodeMetadata(entry.encoded_metadata, *metadata)) return nullptr;
+
+  // The consolidated information is out of date if anything this package
+  // depends on changed.
+  for (const auto& dependency : metadata->consolidated_dependencies) {
+    if (!IsEntryCurrent(dependency)) return nullptr;
+  }
+
+  metadata->package_path = entry.package_path;
+  metadata->has_consolidated_information = true;
+  return metadata;
+}
+
+void StoreMetadataInSnapshot(const std::string& package_name,
+                             const PackageMetadata& metadata) {
+  std::string encoded_metadata = EncodeMetadata(metadata);
+  SnapshotEntry entry = {
+      .package_path = metadata.package_path,
+      .config_timestamp = GetConfigTimestampOfPackage(metadata.package_path),
+      .encoded_metadata = encoded_metadata};
+  stored_entries_by_package_name[package_name] =
+      EncodeEntry(package_name, entry);
+}
+
+void FlushMetadataSnapshot() {
+  if (stored_entries_by_package_name.empty()) return;
+
+  std::string contents(kSnapshotVersion);
+  WriteInteger(contents, GetGlobalConfigTimestamp());
+  for (const auto& [package_name, encoded_entry] :
+       stored_entries_by_package_name)
+    contents += encoded_entry;
+  // Keep the packages that weren't used during this run, unless they are known
+  // to be out of date.
+  for (const auto& [package_name, entry] : entries_by_package_name) {
+    if (stored_entries_by_package_name.contains(package_name)) continue;
+    auto itr = is_entry_current_by_package_name.find(package_name);
+    if (itr != is_entry_current_by_package_name.end() && !itr->second)
+      continue;
+    contents += EncodeEntry(package_name, entry);
+  }
+
+  // Write to a temporary file and rename it over the snapshot, because the old
+  // snapshot is still mapped.
+  std::filesystem::path snapshot_path = GetSnapshotFilePath();
+  std::filesystem::path temp_snapshot_path = snapshot_path;
+  temp_snapshot_path += ".tmp";
+  std::ofstream file(temp_snapshot_path, std::ios::binary);
+  if (!file.is_open()) {
+    std::cerr << "Cannot write to " << temp_snapshot_path
+              << ". Package metadata cannot be cached." << std::endl;
+    return;
+  }
+  file << contents;
+  file.close();
+
+  std::error_code error;
+  std::filesystem::rename(temp_snapshot_path, snapshot_path, error);
+  if (error) return;
+
+  // Load the new snapshot the next time it's used, so that flushing again only
+  // writes anything if something has changed since.
+  InvalidateMetadataSnapshot();
+  entries_by_package_name.clear();
+  stored_entries_by_package_name.clear();
+  loaded_snapshot = false;
+}
+
+void InvalidateMetadataSnapshot() { is_entry_current_by_package_name.clear(); }
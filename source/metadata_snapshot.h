@@ -0,0 +1,44 @@
+// Copyright 2024 Google LLC
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//      http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+#pragma once
+
+#include <memory>
+#include <string>
+
+#include "package_metadata.h"
+
+// A snapshot of the consolidated metadata of every package that has been
+// built, stored in a compact binary file in the temp directory that is mapped
+// into memory, so that builds with nothing to do don't have to regenerate,
+// parse and consolidate every package's config. A package's snapshot is only
+// used if neither its config, the config of anything it depends on, nor the
+// global config has changed since it was taken.
+
+// Returns the metadata of a package from the snapshot, or null if it isn't in
+// the snapshot or is out of date. The package ID and temp directory aren't
+// stored, and must be populated by the caller.
+std::unique_ptr<PackageMetadata> RestoreMetadataFromSnapshot(
+    const std::string& package_name);
+
+// Stores the consolidated metadata of a package in the snapshot.
+void StoreMetadataInSnapshot(const std::string& package_name,
+                             const PackageMetadata& metadata);
+
+// Writes the snapshot to disk if anything changed.
+void FlushMetadataSnapshot();
+
+// Forgets which packages in the snapshot are up to date, so that they are
+// checked again after their configs may have changed.
+void InvalidateMetadataSnapshot();
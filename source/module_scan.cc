@@ -0,0 +1,98 @@
+// Copyright 2024 Google LLC
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//      http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+#include "module_scan.h"
+
+#include <filesystem>
+#include <fstream>
+#include <iostream>
+#include <sstream>
+#include <string>
+#include <vector>
+
+#include "execute.h"
+#include "nlohmann/json.hpp"
+#include "worker_pool.h"
+
+using json = ::nlohmann::json;
+
+namespace {
+
+// Reads the modules from a P1689 dependency file. Returns false if it's not
+// valid, or it imports a header unit, which isn't supported.
+bool ReadScanFile(const std::filesystem::path& scan_file,
+                  ModuleDependencies& dependencies, std::string& error) {
+  std::ifstream file(scan_file);
+  json scan = json::parse(file, /*cb=*/nullptr, /*allow_exceptions=*/false);
+  if (!scan.is_object() || !scan["rules"].is_array()) {
+    error = "Unable to read the module dependencies in " + scan_file.string() +
+            ".";
+    return false;
+  }
+
+  for (auto& rule : scan["rules"]) {
+    if (!rule.is_object()) continue;
+    if (rule["provides"].is_array()) {
+      for (auto& provided : rule["provides"]) {
+        if (provided["logical-name"].is_string()) {
+          dependencies.provided_modules.push_back(
+              provided["logical-name"].template get<std::string>());
+        }
+      }
+    }
+    if (rule["requires"].is_array()) {
+      for (auto& required : rule["requires"]) {
+        if (!required["logical-name"].is_string()) continue;
+        std::string name = required["logical-name"].template get<std::string>();
+        // Only header units are looked up like includes.
+        if (required.contains("lookup-method")) {
+          error = "Header units such as " + name + " are not supported.";
+          return false;
+        }
+        dependencies.imported_modules.push_back(std::move(name));
+      }
+    }
+  }
+  return true;
+}
+
+}  // namespace
+
+bool ScanModuleDependencies(const std::vector<ModuleScan>& scans,
+                            std::vector<ModuleDependencies>& dependencies) {
+  dependencies.assign(scans.size(), {});
+  std::vector<std::string> errors(scans.size());
+  ParallelFor(scans.size(), [&](size_t index) {
+    const ModuleScan& scan = scans[index];
+    std::stringstream output;
+    if (scan.should_scan && !ExecuteCommand(scan.command, &output)) {
+      errors[index] =
+          "Unable to scan for modules: " + scan.command + "\n" + output.str();
+    } else if (ReadScanFile(scan.scan_file, dependencies[index],
+                            errors[index])) {
+      return;
+    }
+    // Don't leave a bad scan behind to be read by the next build.
+    std::error_code error_code;
+    std::filesystem::remove(scan.scan_file, error_code);
+  });
+
+  bool successful = true;
+  for (const auto& error : errors) {
+    if (error.empty()) continue;
+    std::cerr << error << std::endl;
+    successful = false;
+  }
+  return successful;
+}
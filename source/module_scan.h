@@ -0,0 +1,46 @@
+// Copyright 2024 Google LLC
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//      http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+#pragma once
+
+#include <filesystem>
+#include <string>
+#include <vector>
+
+// Finds the C++20 named modules that source files provide and import, by
+// running a scanner that writes P1689 dependency files, such as
+// `clang-scan-deps -format=p1689`.
+
+// A source file to scan.
+struct ModuleScan {
+  // The command that writes the source file's P1689 dependency file.
+  std::string command;
+  // The P1689 dependency file, which is kept between builds.
+  std::filesystem::path scan_file;
+  // Whether to scan the source file again, instead of reading the scan file
+  // from a previous build.
+  bool should_scan;
+};
+
+// The named modules a source file provides and imports.
+struct ModuleDependencies {
+  std::vector<std::string> provided_modules;
+  std::vector<std::string> imported_modules;
+};
+
+// Scans the source files that need scanning in parallel, and reads the
+// modules of every source file. Returns false and prints why if a source file
+// couldn't be scanned.
+bool ScanModuleDependencies(const std::vector<ModuleScan>& scans,
+                            std::vector<ModuleDependencies>& dependencies);
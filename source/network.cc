@@ -0,0 +1,157 @@
+// Copyright 2024 Google LLC
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//      http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+
+#include "network.h"
+
+#include <netdb.h>
+#include <sys/socket.h>
+#include <sys/time.h>
+#include <sys/types.h>
+#include <unistd.h>
+
+#include <cerrno>
+#include <string>
+#include <string_view>
+
+namespace {
+
+// The number of connections that may be waiting to be accepted.
+constexpr int kListenBacklog = 64;
+
+#ifdef MSG_NOSIGNAL
+// Don't raise SIGPIPE if the other side has closed the connection.
+constexpr int kSendFlags = MSG_NOSIGNAL;
+#else
+constexpr int kSendFlags = 0;
+#endif
+
+// Returns the addresses for a host, or null if it can't be resolved.
+struct addrinfo* ResolveAddress(const char* host, const std::string& port,
+                                bool passive) {
+  struct addrinfo hints {};
+  hints.ai_family = AF_UNSPEC;
+  hints.ai_socktype = SOCK_STREAM;
+  if (passive) hints.ai_flags = AI_PASSIVE;
+  struct addrinfo* addresses = nullptr;
+  if (getaddrinfo(host, port.c_str(), &hints, &addresses) != 0) return nullptr;
+  return addresses;
+}
+
+}  // namespace
+
+int ConnectToServer(const std::string& host, const std::string& port,
+                    int timeout_seconds) {
+  struct addrinfo* addresses =
+      ResolveAddress(host.c_str(), port, /*passive=*/false);
+  if (addresses == nullptr) return -1;
+
+  int connected_socket = -1;
+  for (auto* address = addresses; address != nullptr;
+       address = address->ai_next) {
+    int fd = socket(address->ai_family, address->ai_socktype | SOCK_CLOEXEC,
+                    address->ai_protocol);
+    if (fd < 0) continue;
+
+    struct timeval timeout {};
+    timeout.tv_sec = timeout_seconds;
+    setsockopt(fd, SOL_SOCKET, SO_RCVTIMEO, &timeout, sizeof(timeout));
+    setsockopt(fd, SOL_SOCKET, SO_SNDTIMEO, &timeout, sizeof(timeout));
+
+    if (connect(fd, address->ai_addr, address->ai_addrlen) == 0) {
+      connected_socket = fd;
+      break;
+    }
+    close(fd);
+  }
+  freeaddrinfo(addresses);
+  return connected_socket;
+}
+
+int ListenOnPort(const std::string& port) {
+  struct addrinfo* addresses = ResolveAddress(nullptr, port, /*passive=*/true);
+  if (addresses == nullptr) return -1;
+
+  int listening_socket = -1;
+  for (auto* address = addresses; address != nullptr;
+       address = address->ai_next) {
+    int fd = socket(address->ai_family, address->ai_socktype | SOCK_CLOEXEC,
+                    address->ai_protocol);
+    if (fd < 0) continue;
+
+    int reuse_address = 1;
+    setsockopt(fd, SOL_SOCKET, SO_REUSEADDR, &reuse_address,
+               sizeof(reuse_address));
+    if (bind(fd, address->ai_addr, address->ai_addrlen) == 0 &&
+        listen(fd, kListenBacklog) == 0) {
+      listening_socket = fd;
+      break;
+    }
+    close(fd);
+  }
+  freeaddrinfo(addresses);
+  return listening_socket;
+}
+
+int AcceptConnection(int listening_socket) {
+  while (true) {
+    int fd = accept(listening_socket, nullptr, nullptr);
+    if (fd < 0 && errno == EINTR) continue;
+    return fd;
+  }
+}
+
+bool SplitHostAndPort(std::string_view address, std::string_view default_port,
+                      std::string& host, std::string& port) {
+  size_t port_start = address.rfind(':');
+  if (port_start == std::string_view::npos) {
+    host = address;
+    port = default_port;
+  } else {
+    host = address.substr(0, port_start);
+    port = address.substr(port_start + 1);
+  }
+  return !host.empty() && !port.empty();
+}
+
+bool SendAll(int socket, std::string_view data) {
+  while (!data.empty()) {
+    ssize_t sent = send(socket, data.data(), data.size(), kSendFlags);
+    if (sent < 0 && errno == EINTR) continue;
+    if (sent <= 0) return false;
+    data.remove_prefix(sent);
+  }
+  return true;
+}
+
+size_t ReceiveSome(int socket, char* buffer, size_t size) {
+  while (true) {
+    ssize_t bytes_read = recv(socket, buffer, size, 0);
+    if (bytes_read < 0 && errno == EINTR) continue;
+    return bytes_read > 0 ? bytes_read : 0;
+  }
+}
+
+bool ReceiveExactly(int socket, size_t length, std::string& data) {
+  data.resize(length);
+  size_t offset = 0;
+  while (offset < length) {
+    size_t bytes_read = ReceiveSome(socket, data.data() + offset, length - offset);
+    if (bytes_read == 0) return false;
+    offset += bytes_read;
+  }
+  return true;
+}
+
+void CloseSocket(int socket) { close(socket); }
@@ -0,0 +1,55 @@
+// Copyright 2024 Google LLC
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//      http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+
+#pragma once
+
+#include <stddef.h>
+
+#include <string>
+#include <string_view>
+
+// Helpers for the blocking TCP connections REBS makes to other machines.
+
+// Connects to a server, with `timeout_seconds` applied to every send and
+// receive. Returns the socket, or -1 if it can't connect.
+int ConnectToServer(const std::string& host, const std::string& port,
+                    int timeout_seconds);
+
+// Starts listening for connections on a port on every interface. Returns the
+// socket, or -1 on failure.
+int ListenOnPort(const std::string& port);
+
+// Waits for a connection on a listening socket. Returns the connected socket,
+// or -1 on failure.
+int AcceptConnection(int listening_socket);
+
+// Splits an address in the form host[:port], using the default port if one
+// isn't provided. Returns false if the address is invalid.
+bool SplitHostAndPort(std::string_view address, std::string_view default_port,
+                      std::string& host, std::string& port);
+
+// Sends all of the data. Returns false if the connection failed.
+bool SendAll(int socket, std::string_view data);
+
+// Receives up to `size` bytes. Returns the number of bytes received, or 0 if
+// the connection was closed or failed.
+size_t ReceiveSome(int socket, char* buffer, size_t size);
+
+// Receives exactly `length` bytes into `data`. Returns false if the connection
+// was closed or failed first.
+bool ReceiveExactly(int socket, size_t length, std::string& data);
+
+// Closes a socket.
+void CloseSocket(int socket);
@@ -0,0 +1,643 @@
+// Copyright 2024 Google LLC
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//      http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+#include "object_cache.h"
+
+#include <unistd.h>
+
+#include <algorithm>
+#include <atomic>
+#include <cstdint>
+#include <cstdlib>
+#include <filesystem>
+#include <fstream>
+#include <functional>
+#include <iomanip>
+#include <istream>
+#include <map>
+#include <mutex>
+#include <optional>
+#include <sstream>
+#include <string>
+#include <string_view>
+#include <system_error>
+#include <utility>
+#include <vector>
+
+#include "config.h"
+#include "deferred_command.h"
+#include "execute.h"
+#include "file_copy.h"
+#include "hash.h"
+#include "remote_cache.h"
+#include "temp_directory.h"
+
+namespace {
+
+// The name of the object cache directory inside of the shared temp directory.
+constexpr char kCacheSubdirectoryName[] = "cache";
+// The subdirectory storing the manifests.
+constexpr char kManifestsSubdirectoryName[] = "manifests";
+// The subdirectory storing the objects.
+constexpr char kObjectsSubdirectoryName[] = "objects";
+
+// Mixed into every key, so that changing how keys are calculated doesn't
+// restore objects stored by an older version.
+constexpr char kCacheVersion[] = "rebs object cache 3";
+
+// Replaces the home directory in paths and commands stored in the cache.
+constexpr std::string_view kHomePlaceholder = "${home}/";
+
+// When the cache grows over its size limit, the least recently used objects are
+// evicted until it's this fraction of the limit, so that it isn't trimmed on
+// every run.
+constexpr uint64_t kTrimmedSizePercent = 90;
+
+// The maximum number of different sets of dependencies remembered for each
+// manifest. A source file may have been compiled against different headers,
+// such as on different branches.
+constexpr size_t kMaxManifestEntries = 8;
+
+bool object_cache_enabled = false;
+std::filesystem::path cache_directory;
+
+// The home directory with a trailing separator.
+std::string home_prefix;
+
+// The number of bytes added to the cache during this run.
+std::atomic<uint64_t> bytes_stored = 0;
+
+// Cache of the content hashes of files read during this run, and the
+// identities of programs.
+std::map<std::string, std::string> content_hashes_by_file;
+std::map<std::string, std::string> identities_by_program;
+std::mutex hashes_mutex;
+
+// Used to give temporary files unique names.
+std::atomic<int> next_temp_file_number = 0;
+
+// A set of dependencies a source file was compiled against, and the key of the
+// object it produced.
+struct ManifestEntry {
+  std::string object_key;
+  // The path and content hash of each dependency.
+  std::vector<std::pair<std::string, std::string>> dependency_hashes;
+};
+
+// Splits a key into a path, using the first two characters as a subdirectory
+// so that no directory gets too large.
+std::filesystem::path GetPathForKey(const char* subdirectory,
+                                    const std::string& key) {
+  return cache_directory / subdirectory / key.substr(0, 2) / key;
+}
+
+// Returns the path of a key in the remote cache.
+std::string GetRemotePathForKey(const char* subdirectory,
+                                const std::string& key) {
+  return std::string(subdirectory) + "/" + key;
+}
+
+// Returns the path with the home directory replaced with a placeholder.
+std::string ToPortablePath(const std::string& path) {
+  if (home_prefix.empty() || !path.starts_with(home_prefix)) return path;
+  return std::string(kHomePlaceholder) + path.substr(home_prefix.size());
+}
+
+// Returns the path with the home directory placeholder replaced with this
+// user's home directory.
+std::string FromPortablePath(const std::string& path) {
+  if (!path.starts_with(kHomePlaceholder)) return path;
+  return home_prefix + path.substr(kHomePlaceholder.size());
+}
+
+// Returns the content hash of a file, or an empty string if it can't be read.
+std::string GetContentHashOfFile(const std::string& file) {
+  {
+    std::scoped_lock lock(hashes_mutex);
+    auto itr = content_hashes_by_file.find(file);
+    if (itr != content_hashes_by_file.end()) return itr->second;
+  }
+  std::string hash = HashFileContents(file);
+  std::scoped_lock lock(hashes_mutex);
+  content_hashes_by_file[file] = hash;
+  return hash;
+}
+
+// Returns the path to the program that will run, using the PATH if the program
+// isn't a path itself.
+std::filesystem::path FindProgram(const std::string& program) {
+  if (program.find('/') != std::string::npos) return program;
+  const char* path_env = getenv("PATH");
+  if (path_env == nullptr) return program;
+  std::string_view paths = path_env;
+  while (!paths.empty()) {
+    size_t separator = paths.find(':');
+    std::filesystem::path candidate =
+        std::filesystem::path(paths.substr(0, separator)) / program;
+    if (access(candidate.c_str(), X_OK) == 0) return candidate;
+    if (separator == std::string_view::npos) break;
+    paths.remove_prefix(separator + 1);
+  }
+  return program;
+}
+
+// Returns a string that changes whenever the program running a command
+// changes, such as when the compiler is upgraded.
+std::string GetIdentityOfProgram(const std::string& command) {
+  std::vector<std::string> arguments;
+  if (!SplitCommandIntoArguments(command, arguments) || arguments.empty())
+    return "";
+
+  const std::string& program = arguments[0];
+  {
+    std::scoped_lock lock(hashes_mutex);
+    auto itr = identities_by_program.find(program);
+    if (itr != identities_by_program.end()) return itr->second;
+  }
+
+  std::string identity;
+  std::error_code error;
+  std::filesystem::path program_path =
+      std::filesystem::canonical(FindProgram(program), error);
+  if (!error) {
+    auto size = std::filesystem::file_size(program_path, error);
+    auto last_write_time = std::filesystem::last_write_time(program_path, error);
+    identity = (std::stringstream()
+                << program_path.string() << " " << size << " "
+                << last_write_time.time_since_epoch().count())
+                   .str();
+  }
+
+  std::scoped_lock lock(hashes_mutex);
+  identities_by_program[program] = identity;
+  return identity;
+}
+
+// Replaces every occurrence of `from` in `str` with `to`.
+void ReplaceAllInString(std::string& str, const std::string& from,
+                        std::string_view to) {
+  if (from.empty()) return;
+  for (size_t index = str.find(from); index != std::string::npos;
+       index = str.find(from, index + to.size())) {
+    str.replace(index, from.size(), to);
+  }
+}
+
+// Returns whether a command asks the compiler for debug info, which records the
+// absolute paths of the source files and the directory they were built in.
+bool RequestsDebugInfo(const DeferredCommand& command) {
+  // The command may still contain placeholders, so it isn't parsed like a
+  // shell would.
+  std::istringstream arguments(command.command);
+  std::string argument;
+  while (arguments >> argument) {
+    if (argument.starts_with("-g") && argument != "-g0") return true;
+  }
+  return false;
+}
+
+// Returns the command with the paths of the input and output files replaced
+// with placeholders, so the same inputs built in the same way share a key no
+// matter where the output is written to.
+std::string NormalizeCommand(const DeferredCommand& command) {
+  auto quoted = [](const std::string& path) {
+    return (std::stringstream() << std::quoted(path)).str();
+  };
+  std::string normalized = command.command;
+  ReplaceAllInString(normalized, quoted(command.destination_file), "${out}");
+  if (!command.source_file.empty())
+    ReplaceAllInString(normalized, quoted(command.source_file), "${in}");
+  for (const auto& input_file : command.input_files)
+    ReplaceAllInString(normalized, quoted(input_file.string()), "${in}");
+  // Debug info records the paths of headers too.
+  if (!RequestsDebugInfo(command))
+    ReplaceAllInString(normalized, home_prefix, kHomePlaceholder);
+  return normalized;
+}
+
+// Returns whether a command links input files rather than compiles a source
+// file.
+bool IsLinkCommand(const DeferredCommand& command) {
+  return !command.input_files.empty();
+}
+
+// Returns the key of the manifest listing the dependencies a command has been
+// compiled against, or an empty string if the command can't be cached.
+std::string CalculateManifestKey(const DeferredCommand& command) {
+  std::string source_hash = GetContentHashOfFile(command.source_file);
+  if (source_hash.empty()) return "";
+
+  Hasher hasher;
+  hasher.AddString(kCacheVersion);
+  hasher.AddString(GetIdentityOfProgram(command.command));
+  hasher.AddString(NormalizeCommand(command));
+  hasher.AddString(source_hash);
+  if (RequestsDebugInfo(command)) {
+    // Objects with debug info are only shared by builds of the same source
+    // file from the same directory, so they point debuggers at the right
+    // files.
+    std::error_code error;
+    std::filesystem::path working_directory =
+        std::filesystem::current_path(error);
+    if (error) return "";
+    hasher.AddString(command.source_file);
+    hasher.AddString(working_directory.string());
+  }
+  return hasher.Finish();
+}
+
+// Returns the key of the output of a link command, or an empty string if the
+// command can't be cached.
+std::string CalculateLinkKey(const DeferredCommand& command) {
+  if (command.command.find_first_not_of(' ') == std::string::npos) return "";
+
+  Hasher hasher;
+  hasher.AddString(kCacheVersion);
+  hasher.AddString(GetIdentityOfProgram(command.command));
+  hasher.AddString(NormalizeCommand(command));
+  for (const auto& input_file : command.input_files) {
+    std::string hash = GetContentHashOfFile(input_file.string());
+    if (hash.empty()) return "";
+    hasher.AddString(hash);
+  }
+  return hasher.Finish();
+}
+
+// Returns the key of the object produced from a manifest and a set of
+// dependencies.
+std::string CalculateObjectKey(
+    const std::string& manifest_key,
+    const std::vector<std::pair<std::string, std::string>>&
+        dependency_hashes) {
+  Hasher hasher;
+  hasher.AddString(manifest_key);
+  for (const auto& [path, hash] : dependency_hashes) {
+    hasher.AddString(path);
+    hasher.AddString(hash);
+  }
+  return hasher.Finish();
+}
+
+std::vector<ManifestEntry> ParseManifest(std::istream& input) {
+  std::vector<ManifestEntry> entries;
+  std::string object_key;
+  std::string count_str;
+  while (std::getline(input, object_key) && std::getline(input, count_str)) {
+    ManifestEntry entry;
+    entry.object_key = object_key;
+    size_t count = std::strtoull(count_str.c_str(), nullptr, /*base=*/10);
+    for (size_t i = 0; i < count; i++) {
+      std::string dependency;
+      std::string hash;
+      if (!std::getline(input, dependency) || !std::getline(input, hash))
+        return entries;
+      entry.dependency_hashes.push_back({dependency, hash});
+    }
+    entries.push_back(std::move(entry));
+  }
+  return entries;
+}
+
+std::vector<ManifestEntry> ReadManifest(const std::filesystem::path& path) {
+  std::ifstream input_file(path);
+  if (!input_file.is_open()) return {};
+  return ParseManifest(input_file);
+}
+
+std::string SerializeManifest(const std::vector<ManifestEntry>& entries) {
+  std::stringstream output;
+  for (const auto& entry : entries) {
+    output << entry.object_key << "\n" << entry.dependency_hashes.size()
+           << "\n";
+    for (const auto& [dependency, hash] : entry.dependency_hashes)
+      output << dependency << "\n" << hash << "\n";
+  }
+  return output.str();
+}
+
+// Returns whether the dependencies in a manifest entry are unchanged.
+bool DoDependenciesMatch(const ManifestEntry& entry) {
+  for (const auto& [dependency, hash] : entry.dependency_hashes) {
+    if (GetContentHashOfFile(FromPortablePath(dependency)) != hash)
+      return false;
+  }
+  return true;
+}
+
+std::vector<std::filesystem::path> GetDependenciesOfEntry(
+    const ManifestEntry& entry) {
+  std::vector<std::filesystem::path> dependencies;
+  for (const auto& [dependency, hash] : entry.dependency_hashes)
+    dependencies.push_back(FromPortablePath(dependency));
+  return dependencies;
+}
+
+std::optional<std::string> ReadFileIntoString(
+    const std::filesystem::path& path) {
+  std::ifstream input_file(path, std::ios::binary);
+  if (!input_file.is_open()) return std::nullopt;
+  std::stringstream buffer;
+  buffer << input_file.rdbuf();
+  return buffer.str();
+}
+
+// Returns a path next to `path` to write to before moving it into place, so
+// other processes never see a partially written file.
+std::filesystem::path GetTempPathFor(const std::filesystem::path& path) {
+  return path.string() + "." + std::to_string(getpid()) + "." +
+         std::to_string(next_temp_file_number++) + ".tmp";
+}
+
+// Moves a temporary file into place.
+bool MoveIntoPlace(const std::filesystem::path& temp_path,
+                   const std::filesystem::path& path) {
+  std::error_code error;
+  std::filesystem::rename(temp_path, path, error);
+  if (!error) return true;
+  std::filesystem::remove(temp_path, error);
+  return false;
+}
+
+// Writes a file by writing to a temporary file and moving it into place.
+bool WriteFileAtomically(const std::filesystem::path& path,
+                         std::string_view contents) {
+  EnsureDirectoriesAndParentsExist(path.parent_path());
+  std::filesystem::path temp_path = GetTempPathFor(path);
+  std::ofstream output_file(temp_path, std::ios::binary);
+  if (!output_file.is_open()) return false;
+  output_file.write(contents.data(), contents.size());
+  output_file.close();
+  if (!output_file) {
+    std::error_code error;
+    std::filesystem::remove(temp_path, error);
+    return false;
+  }
+  return MoveIntoPlace(temp_path, path);
+}
+
+// Copies a file into the cache as an object, if it isn't already there.
+bool StoreObject(const std::string& object_key,
+                 const std::filesystem::path& file) {
+  std::filesystem::path object_path =
+      GetPathForKey(kObjectsSubdirectoryName, object_key);
+  if (std::filesystem::exists(object_path)) return true;
+
+  EnsureDirectoriesAndParentsExist(object_path.parent_path());
+  std::filesystem::path temp_path = GetTempPathFor(object_path);
+  if (!CloneOrCopyFile(file, temp_path) || !MoveIntoPlace(temp_path, object_path))
+    return false;
+
+  std::error_code error;
+  auto size = std::filesystem::file_size(object_path, error);
+  if (!error) bytes_stored += size;
+  return true;
+}
+
+// Copies an object out of the cache, and marks it as recently used.
+bool RestoreObject(const std::string& object_key,
+                   const std::filesystem::path& destination) {
+  std::filesystem::path object_path =
+      GetPathForKey(kObjectsSubdirectoryName, object_key);
+  if (!CloneOrCopyFile(object_path, destination)) return false;
+
+  std::error_code error;
+  std::filesystem::last_write_time(
+      object_path, std::filesystem::file_time_type::clock::now(), error);
+  return true;
+}
+
+// Writes a downloaded object into the cache, then copies it out. The remote
+// cache doesn't store file permissions, so linked outputs are assumed to be
+// executable.
+bool StoreAndRestoreDownloadedObject(const std::string& object_key,
+                                     const std::string& contents,
+                                     bool is_executable,
+                                     const std::filesystem::path& destination) {
+  std::filesystem::path object_path =
+      GetPathForKey(kObjectsSubdirectoryName, object_key);
+  if (!WriteFileAtomically(object_path, contents)) return false;
+  bytes_stored += contents.size();
+
+  if (is_executable) {
+    std::error_code error;
+    std::filesystem::permissions(object_path,
+                                 std::filesystem::perms::owner_exec |
+                                     std::filesystem::perms::group_exec |
+                                     std::filesystem::perms::others_exec,
+                                 std::filesystem::perm_options::add, error);
+  }
+  return RestoreObject(object_key, destination);
+}
+
+// Adds an entry to the front of a manifest, as it's the most likely to be used
+// next. Returns the new contents of the manifest.
+std::string AddEntryToManifest(const std::string& manifest_key,
+                               const ManifestEntry& entry) {
+  std::filesystem::path manifest_path =
+      GetPathForKey(kManifestsSubdirectoryName, manifest_key);
+  std::vector<ManifestEntry> entries = {entry};
+  for (auto& existing_entry : ReadManifest(manifest_path)) {
+    if (entries.size() >= kMaxManifestEntries) break;
+    if (existing_entry.object_key != entry.object_key)
+      entries.push_back(std::move(existing_entry));
+  }
+  std::string contents = SerializeManifest(entries);
+  WriteFileAtomically(manifest_path, contents);
+  return contents;
+}
+
+// Uploads an object in the local cache to the remote cache.
+void UploadObject(const std::string& object_key) {
+  auto contents =
+      ReadFileIntoString(GetPathForKey(kObjectsSubdirectoryName, object_key));
+  if (!contents) return;
+  UploadToRemoteCache(GetRemotePathForKey(kObjectsSubdirectoryName, object_key),
+                      std::move(*contents));
+}
+
+}  // namespace
+
+void InitializeObjectCache() {
+  object_cache_enabled = ShouldUseObjectCache();
+  if (!object_cache_enabled) return;
+
+  cache_directory = GetObjectCacheDirectory();
+  if (cache_directory.empty())
+    cache_directory = GetSharedTempDirectoryPath() / kCacheSubdirectoryName;
+  EnsureDirectoriesAndParentsExist(cache_directory);
+
+  std::error_code error;
+  std::filesystem::path home_directory =
+      std::filesystem::canonical(GetHomeDirectory(), error);
+  if (!error && home_directory != home_directory.root_path())
+    home_prefix = home_directory.string() + "/";
+}
+
+void FlushObjectCache() {
+  // Only look for objects to evict if the cache has grown.
+  if (!object_cache_enabled || bytes_stored == 0) return;
+  bytes_stored = 0;
+
+  struct CachedObject {
+    std::filesystem::path path;
+    uint64_t size;
+    std::filesystem::file_time_type last_used;
+  };
+  std::vector<CachedObject> objects;
+  uint64_t total_size = 0;
+  std::error_code error;
+  for (const auto& entry : std::filesystem::recursive_directory_iterator(
+           cache_directory / kObjectsSubdirectoryName, error)) {
+    // Skip directories and objects still being written.
+    if (!entry.is_regular_file(error) || entry.path().extension() == ".tmp")
+      continue;
+    uint64_t size = entry.file_size(error);
+    if (error) continue;
+    std::filesystem::file_time_type last_used = entry.last_write_time(error);
+    if (error) continue;
+    total_size += size;
+    objects.push_back(
+        {.path = entry.path(), .size = size, .last_used = last_used});
+  }
+
+  uint64_t size_limit = GetObjectCacheSize();
+  if (total_size <= size_limit) return;
+
+  std::sort(objects.begin(), objects.end(),
+            [](const CachedObject& a, const CachedObject& b) {
+              return a.last_used < b.last_used;
+            });
+  uint64_t trimmed_size = size_limit / 100 * kTrimmedSizePercent;
+  for (const auto& object : objects) {
+    if (total_size <= trimmed_size) break;
+    if (std::filesystem::remove(object.path, error)) total_size -= object.size;
+  }
+}
+
+void InvalidateContentHashes() {
+  std::scoped_lock lock(hashes_mutex);
+  content_hashes_by_file.clear();
+}
+
+bool IsObjectCacheEnabled() { return object_cache_enabled; }
+
+bool TryRestoreFromObjectCache(
+    const DeferredCommand& command, std::string& key,
+    std::vector<std::filesystem::path>& dependencies) {
+  dependencies.clear();
+  if (IsLinkCommand(command)) {
+    key = CalculateLinkKey(command);
+    return !key.empty() && RestoreObject(key, command.destination_file);
+  }
+
+  key = CalculateManifestKey(command);
+  if (key.empty()) return false;
+
+  for (const auto& entry :
+       ReadManifest(GetPathForKey(kManifestsSubdirectoryName, key))) {
+    if (!DoDependenciesMatch(entry) ||
+        !RestoreObject(entry.object_key, command.destination_file))
+      continue;
+    dependencies = GetDependenciesOfEntry(entry);
+    return true;
+  }
+  return false;
+}
+
+void FetchFromRemoteObjectCache(
+    const DeferredCommand& command, const std::string& key,
+    std::function<void(bool restored,
+                       std::vector<std::filesystem::path> dependencies)>
+        on_complete) {
+  if (key.empty() || !IsRemoteCacheEnabled()) {
+    on_complete(false, {});
+    return;
+  }
+
+  const DeferredCommand* command_ptr = &command;
+  if (IsLinkCommand(command)) {
+    FetchFromRemoteCache(
+        GetRemotePathForKey(kObjectsSubdirectoryName, key),
+        [command_ptr, key, on_complete](std::optional<std::string> object) {
+          on_complete(object && StoreAndRestoreDownloadedObject(
+                                    key, *object, /*is_executable=*/true,
+                                    command_ptr->destination_file),
+                      {});
+        });
+    return;
+  }
+
+  // Fetch the manifest, then the object of the first entry with matching
+  // dependencies.
+  FetchFromRemoteCache(
+      GetRemotePathForKey(kManifestsSubdirectoryName, key),
+      [command_ptr, key, on_complete](std::optional<std::string> manifest) {
+        if (!manifest) {
+          on_complete(false, {});
+          return;
+        }
+        std::istringstream manifest_stream(*manifest);
+        for (auto& entry : ParseManifest(manifest_stream)) {
+          if (!DoDependenciesMatch(entry)) continue;
+          std::string object_key = entry.object_key;
+          FetchFromRemoteCache(
+              GetRemotePathForKey(kObjectsSubdirectoryName, object_key),
+              [command_ptr, key, entry = std::move(entry),
+               on_complete](std::optional<std::string> object) {
+                if (!object ||
+                    !StoreAndRestoreDownloadedObject(
+                        entry.object_key, *object, /*is_executable=*/false,
+                        command_ptr->destination_file)) {
+                  on_complete(false, {});
+                  return;
+                }
+                AddEntryToManifest(key, entry);
+                on_complete(true, GetDependenciesOfEntry(entry));
+              });
+          return;
+        }
+        on_complete(false, {});
+      });
+}
+
+void StoreInObjectCache(
+    const std::string& key, const DeferredCommand& command,
+    const std::vector<std::filesystem::path>& dependencies) {
+  if (key.empty()) return;
+
+  if (IsLinkCommand(command)) {
+    if (StoreObject(key, command.destination_file) && IsRemoteCacheEnabled())
+      UploadObject(key);
+    return;
+  }
+
+  ManifestEntry entry;
+  for (const auto& dependency : dependencies) {
+    std::string hash = GetContentHashOfFile(dependency);
+    // Something that can't be read can't be checked later.
+    if (hash.empty()) return;
+    entry.dependency_hashes.push_back(
+        {ToPortablePath(dependency.string()), hash});
+  }
+  entry.object_key = CalculateObjectKey(key, entry.dependency_hashes);
+
+  if (!StoreObject(entry.object_key, command.destination_file)) return;
+  std::string manifest = AddEntryToManifest(key, entry);
+
+  if (IsRemoteCacheEnabled()) {
+    UploadObject(entry.object_key);
+    UploadToRemoteCache(GetRemotePathForKey(kManifestsSubdirectoryName, key),
+                        std::move(manifest));
+  }
+}
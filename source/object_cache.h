@@ -0,0 +1,70 @@
+// Copyright 2024 Google LLC
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//      http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+#pragma once
+
+#include <filesystem>
+#include <functional>
+#include <string>
+#include <vector>
+
+#include "deferred_command.h"
+
+// The object cache is a content addressed store of compiled objects and linked
+// outputs, shared between packages, checkouts and optimization levels. Objects
+// are keyed by a hash of the compile command, the compiler, and the contents of
+// the source file and every file it depended on the last time it was compiled.
+// Linked outputs are keyed by a hash of the link command, the linker, and the
+// contents of the files being linked.
+//
+// If a remote cache is configured, the local cache sits in front of it: misses
+// are fetched from the remote cache, and new objects are uploaded to it. Paths
+// under the home directory are stored relative to it, so objects can be shared
+// between users with the same layout of packages.
+
+// Initializes the object cache.
+void InitializeObjectCache();
+
+// Evicts the least recently used objects if the cache has grown over its size
+// limit.
+void FlushObjectCache();
+
+// Forgets the content hashes of files, so that files that have changed since
+// are hashed again.
+void InvalidateContentHashes();
+
+// Returns whether the object cache is enabled.
+bool IsObjectCacheEnabled();
+
+// Tries to restore the output of a command from the local cache. On success,
+// populates `dependencies` with the files a compiled object depends on.
+// Populates `key` with the command's key in the cache, or a blank string if
+// the command can't be cached. Thread safe.
+bool TryRestoreFromObjectCache(const DeferredCommand& command, std::string& key,
+                               std::vector<std::filesystem::path>& dependencies);
+
+// Tries to restore the output of a command from the remote cache in the
+// background, after it was not found in the local cache. `on_complete` is
+// called from another thread with whether it was restored, and if so, the files
+// a compiled object depends on. Thread safe.
+void FetchFromRemoteObjectCache(
+    const DeferredCommand& command, const std::string& key,
+    std::function<void(bool restored,
+                       std::vector<std::filesystem::path> dependencies)>
+        on_complete);
+
+// Stores the output of a command that has successfully ran in the cache, and
+// uploads it to the remote cache. Thread safe.
+void StoreInObjectCache(const std::string& key, const DeferredCommand& command,
+                        const std::vector<std::filesystem::path>& dependencies);
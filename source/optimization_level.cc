@@ -24,6 +24,8 @@ std::string_view OptimizationLevelToString(OptimizationLevel level) {
       return "fast";
     case OptimizationLevel::Optimized:
       return "optimized";
+    case OptimizationLevel::ThinOptimized:
+      return "thin-optimized";
     default:
       return "unknown";
   }
@@ -23,7 +23,10 @@ enum class OptimizationLevel {
   // Default level of optimization, for building really quickly.
   Fast,
   // Aggressive, whole program optimization.
-  Optimized
+  Optimized,
+  // Aggressive optimization with ThinLTO, which optimizes across modules in
+  // parallel at link time and caches what it optimized between links.
+  ThinOptimized
 };
 
 // Converts an optimization level into a human readable string.
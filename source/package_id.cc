@@ -21,6 +21,7 @@
 #include <fstream>
 #include <iostream>
 #include <map>
+#include <mutex>
 #include <string>
 
 #include "packages.h"
@@ -35,6 +36,10 @@ size_t next_package_number = 0;
 std::map<std::filesystem::path, size_t> package_path_to_id;
 bool package_ids_invalidated = false;
 
+// Guards the package IDs, which are looked up while packages are loaded in
+// parallel.
+std::mutex package_ids_mutex;
+
 std::filesystem::path GetPackageFilePath() {
   return GetTempDirectoryPath() / kPackageIdFile;
 }
@@ -97,6 +102,7 @@ size_t GetIDOfPackageFromName(const std::string& package_name) {
 }
 
 size_t GetIDOfPackageFromPath(const std::filesystem::path& package_path) {
+  std::scoped_lock lock(package_ids_mutex);
   auto itr = package_path_to_id.find(package_path);
   if (itr != package_path_to_id.end()) return itr->second;
 
@@ -109,3 +115,11 @@ size_t GetIDOfPackageFromPath(const std::filesystem::path& package_path) {
 
   return id;
 }
+
+std::filesystem::path GetPackagePathFromID(size_t package_id) {
+  std::scoped_lock lock(package_ids_mutex);
+  for (const auto& [package_path, id] : package_path_to_id) {
+    if (id == package_id) return package_path;
+  }
+  return {};
+}
@@ -31,5 +31,10 @@ void FlushPackageIDs();
 // Returns a package ID from its name.
 size_t GetIDOfPackageFromName(const std::string& package_name);
 
-// Returns a package ID from a path.
+// Returns a package ID from a path. Thread safe.
 size_t GetIDOfPackageFromPath(const std::filesystem::path& package_path);
+
+// Returns the path of the package with an ID, or a blank path if no package has
+// the ID. This searches every package, so it's only meant for reporting. Thread
+// safe.
+std::filesystem::path GetPackagePathFromID(size_t package_id);
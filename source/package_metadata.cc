@@ -14,30 +14,70 @@
 
 #include "package_metadata.h"
 
+#include <stdint.h>
+
+#include <algorithm>
+#include <filesystem>
 #include <functional>
 #include <iomanip>
 #include <iostream>
 #include <map>
 #include <memory>
-#include <queue>
+#include <mutex>
+#include <optional>
+#include <ostream>
 #include <set>
+#include <sstream>
 #include <string>
+#include <string_view>
+#include <utility>
+#include <vector>
 
 #include "config.h"
+#include "invocation.h"
+#include "metadata_snapshot.h"
 #include "nlohmann/json.hpp"
 #include "package_id.h"
 #include "packages.h"
 #include "string_replace.h"
 #include "temp_directory.h"
+#include "trace.h"
+#include "worker_pool.h"
 
 namespace {
 
 // The default include priority of a package if one isn't defined.
 constexpr int kDefaultIncludePriority = 1000;
 
+// The default number of source files to include in each unity batch.
+constexpr int kDefaultUnityBatchSize = 16;
+
+// The default argument added to build commands to use a precompiled header.
+constexpr char kDefaultPrecompiledHeaderArgument[] = "-include-pch ${pch}";
+
+// The defaults for building named modules with Clang.
+constexpr char kDefaultModuleScanCommand[] =
+    "clang-scan-deps -format=p1689 -- ${command} > ${out}";
+constexpr char kDefaultModuleOutputArgument[] = "-fmodule-output=${bmi}";
+constexpr char kDefaultModuleFileArgument[] = "-fmodule-file=${module}=${bmi}";
+
+// The default argument added to build commands to split the debug info.
+constexpr char kDefaultSplitDebugInfoArgument[] = "-gsplit-dwarf";
+
+// The defaults for building libraries as shared libraries in dev mode.
+constexpr char kDefaultSharedLibraryLinkerCommand[] =
+    "clang++ -shared -o ${out} ${in}";
+constexpr char kDefaultPositionIndependentCodeArgument[] = "-fPIC";
+
+// The metadata of each package that has been loaded, or null if it failed to
+// load.
 std::map<std::string, std::unique_ptr<PackageMetadata>>
     metadata_by_package_name;
 
+// The packages whose metadata couldn't be consolidated, so that the errors are
+// only reported once.
+std::set<std::string> packages_that_failed_to_consolidate;
+
 void ForEachStringInConfigAray(
     nlohmann::json& config_array,
     const std::function<void(const std::string&)>& on_each_string) {
@@ -95,6 +135,19 @@ bool ParseConfigIntoMetadata(const std::string& package_name,
         static_linker_command.template get<std::string>();
   }
 
+  auto& shared_library_linker_command = config["shared_library_linker_command"];
+  metadata.shared_library_linker_command =
+      shared_library_linker_command.is_string()
+          ? shared_library_linker_command.template get<std::string>()
+          : kDefaultSharedLibraryLinkerCommand;
+
+  auto& position_independent_code_argument =
+      config["position_independent_code_argument"];
+  metadata.position_independent_code_argument =
+      position_independent_code_argument.is_string()
+          ? position_independent_code_argument.template get<std::string>()
+          : kDefaultPositionIndependentCodeArgument;
+
   auto& no_output_file = config["no_output_file"];
   if (no_output_file.is_number_integer())
     metadata.no_output_file = no_output_file.template get<int>() > 0;
@@ -127,10 +180,102 @@ bool ParseConfigIntoMetadata(const std::string& package_name,
   PopulateVectorOfStringsFromConfigArray(config["asset_directories"],
                                          metadata.asset_directories);
 
+  auto& compare_asset_contents = config["compare_asset_contents"];
+  metadata.compare_asset_contents =
+      compare_asset_contents.is_number_integer() &&
+      compare_asset_contents.template get<int>() > 0;
+
+  auto& hard_link_assets = config["hard_link_assets"];
+  metadata.hard_link_assets = !hard_link_assets.is_number_integer() ||
+                              hard_link_assets.template get<int>() > 0;
+
+  auto& unity_build = config["unity_build"];
+  if (unity_build.is_number_integer())
+    metadata.unity_build = unity_build.template get<int>() > 0;
+
+  auto& unity_batch_size = config["unity_batch_size"];
+  if (unity_batch_size.is_number_integer() &&
+      unity_batch_size.template get<int>() > 0) {
+    metadata.unity_batch_size = unity_batch_size.template get<int>();
+  } else {
+    metadata.unity_batch_size = kDefaultUnityBatchSize;
+  }
+
+  auto& precompiled_header = config["precompiled_header"];
+  if (precompiled_header.is_number_integer())
+    metadata.precompiled_header = precompiled_header.template get<int>() > 0;
+
+  auto& precompiled_header_commands = config["precompiled_header_commands"];
+  if (precompiled_header_commands.is_object()) {
+    for (auto& command : precompiled_header_commands.items()) {
+      if (command.value().is_string()) {
+        metadata.precompiled_header_commands_by_file_extension
+            ["." + command.key()] = command.value().template get<std::string>();
+      }
+    }
+  }
+
+  auto& precompiled_header_argument = config["precompiled_header_argument"];
+  if (precompiled_header_argument.is_string()) {
+    metadata.precompiled_header_argument =
+        precompiled_header_argument.template get<std::string>();
+  } else {
+    metadata.precompiled_header_argument = kDefaultPrecompiledHeaderArgument;
+  }
+
+  auto& modules = config["modules"];
+  if (modules.is_number_integer())
+    metadata.modules = modules.template get<int>() > 0;
+
+  auto& module_scan_command = config["module_scan_command"];
+  metadata.module_scan_command =
+      module_scan_command.is_string()
+          ? module_scan_command.template get<std::string>()
+          : kDefaultModuleScanCommand;
+
+  auto& module_output_argument = config["module_output_argument"];
+  metadata.module_output_argument =
+      module_output_argument.is_string()
+          ? module_output_argument.template get<std::string>()
+          : kDefaultModuleOutputArgument;
+
+  auto& module_file_argument = config["module_file_argument"];
+  metadata.module_file_argument =
+      module_file_argument.is_string()
+          ? module_file_argument.template get<std::string>()
+          : kDefaultModuleFileArgument;
+
+  auto& split_debug_info = config["split_debug_info"];
+  metadata.split_debug_info = split_debug_info.is_number_integer() &&
+                              split_debug_info.template get<int>() > 0;
+
+  auto& split_debug_info_argument = config["split_debug_info_argument"];
+  metadata.split_debug_info_argument =
+      split_debug_info_argument.is_string()
+          ? split_debug_info_argument.template get<std::string>()
+          : kDefaultSplitDebugInfoArgument;
+
+  auto& debug_info_package_command = config["debug_info_package_command"];
+  if (debug_info_package_command.is_string()) {
+    metadata.debug_info_package_command =
+        debug_info_package_command.template get<std::string>();
+  }
+
   auto& should_skip = config["should_skip"];
   if (should_skip.is_number_integer())
     metadata.should_skip = should_skip.template get<int>();
 
+  auto& test = config["test"];
+  metadata.test = test.is_number_integer() && test.template get<int>() > 0;
+
+  PopulateVectorOfStringsFromConfigArray(config["tests"], metadata.tests);
+
+  auto& test_shards = config["test_shards"];
+  metadata.test_shards =
+      test_shards.is_number_integer()
+          ? std::max(test_shards.template get<int>(), 1)
+          : 1;
+
   auto& statically_link = config["statically_link"];
   if (statically_link.is_number_integer())
     metadata.statically_link = statically_link.template get<int>();
@@ -144,28 +289,40 @@ bool ParseConfigIntoMetadata(const std::string& package_name,
 
   auto& destination_directory = config["destination_directory"];
   if (destination_directory.is_string()) {
-    std::string destination_directory_str =
-        destination_directory.template get<std::string>();
-    ReplacePlaceholdersInString(destination_directory_str);
-    metadata.destination_directory = destination_directory_str;
+    // Parsed as a template, rather than through the registered placeholders,
+    // so that packages can be parsed in parallel.
+    CommandTemplate destination_directory_template(
+        destination_directory.template get<std::string>(), /*variables=*/{},
+        {{"package name", package_name}});
+    metadata.destination_directory = destination_directory_template.Expand({});
   }
 
   return true;
 }
 
-PackageMetadata* GetUnconsolidatedMetadataForPackage(
-    const std::string& package_name) {
-  auto itr = metadata_by_package_name.find(package_name);
-  if (itr != metadata_by_package_name.end()) return itr->second.get();
+// Restores the consolidated metadata for a package from the snapshot. Returns
+// null if it isn't in the snapshot or is out of date.
+PackageMetadata* RestoreMetadataForPackage(const std::string& package_name) {
+  auto metadata = RestoreMetadataFromSnapshot(package_name);
+  if (!metadata) return nullptr;
+  metadata->temp_directory =
+      GetTempDirectoryPathForPackagePath(metadata->package_path);
+  metadata->package_id = GetIDOfPackageFromPath(metadata->package_path);
 
-  SetPlaceholder("package name", package_name);
-
-  std::filesystem::path package_path = GetPackagePathFromName(package_name);
-  if (package_path == "") return nullptr;
+  PackageMetadata* metadata_ptr = metadata.get();
+  metadata_by_package_name[package_name] = std::move(metadata);
+  return metadata_ptr;
+}
 
+// Loads a package's metadata from its config, without consolidating it.
+// Returns null if the config can't be loaded. Thread safe.
+std::unique_ptr<PackageMetadata> LoadMetadataFromConfig(
+    const std::string& package_name,
+    const std::filesystem::path& package_path) {
   auto metadata = std::make_unique<PackageMetadata>();
-  auto config = LoadConfigFileForPackage(package_name, package_path,
-                                         metadata->metadata_timestamp);
+  uint64_t config_timestamp;
+  auto config =
+      LoadConfigFileForPackage(package_name, package_path, config_timestamp);
   if (!config) return nullptr;
   metadata->package_path = package_path;
   metadata->temp_directory = GetTempDirectoryPathForPackagePath(package_path);
@@ -200,159 +357,401 @@ PackageMetadata* GetUnconsolidatedMetadataForPackage(
         metadata->destination_directory / metadata->output_filename;
   }
   metadata->package_id = GetIDOfPackageFromPath(package_path);
+  return metadata;
+}
 
+PackageMetadata* GetUnconsolidatedMetadataForPackage(
+    const std::string& package_name) {
+  auto itr = metadata_by_package_name.find(package_name);
+  if (itr != metadata_by_package_name.end()) return itr->second.get();
+
+  PackageMetadata* restored_metadata = RestoreMetadataForPackage(package_name);
+  if (restored_metadata != nullptr) return restored_metadata;
+
+  // Remember failures so they are only reported once.
+  metadata_by_package_name[package_name] = nullptr;
+
+  std::filesystem::path package_path = GetPackagePathFromName(package_name);
+  if (package_path == "") return nullptr;
+
+  auto metadata = LoadMetadataFromConfig(package_name, package_path);
   PackageMetadata* metadata_ptr = metadata.get();
   metadata_by_package_name[package_name] = std::move(metadata);
   return metadata_ptr;
 }
 
-bool ConsolidateMetadataForPackage(const std::string& package_name,
-                                   PackageMetadata& metadata) {
-  // Walk through each encountered dependencies and add anything they expose
-  // to this package.
-  std::set<std::string> encountered_dependencies;
-  encountered_dependencies.insert(package_name);
-
-  std::queue<std::string> dependencies_to_visit;
-  auto add_dependency = [&encountered_dependencies, &dependencies_to_visit](
-                            const std::string& dependency) {
-    if (encountered_dependencies.contains(dependency)) return;
-    encountered_dependencies.insert(dependency);
-    dependencies_to_visit.push(dependency);
-  };
+struct PackageNode;
+
+// The dependencies of a package and everything they depend on.
+struct DependencyClosure {
+  // The packages in the closure, in the order they're linked: the package's
+  // dependencies, followed by their closures in turn.
+  std::vector<const PackageNode*> packages;
+  // Which packages are in the closure, indexed by package ID.
+  std::vector<bool> contains_package;
+  // A package in the closure that isn't found or isn't a library, if there is
+  // one. The rest of the closure is incomplete.
+  const PackageNode* invalid_package = nullptr;
+
+  // Adds a package to the end of the closure if it's not already in it.
+  void Add(const PackageNode* package);
+
+  // Adds the packages in another closure.
+  void Merge(const DependencyClosure& closure);
+};
+
+// What a package exposes to the packages that depend on it.
+struct PackageNode {
+  std::string package_name;
+  // Null if the package isn't found.
+  const PackageMetadata* metadata;
+  // The public include directories of the package that exist.
+  std::vector<std::filesystem::path> public_includes;
+  // The package's closure, once it's known. Never changes once it's set.
+  std::unique_ptr<const DependencyClosure> closure;
+};
+
+void DependencyClosure::Add(const PackageNode* package) {
+  size_t package_id = package->metadata->package_id;
+  if (package_id >= contains_package.size())
+    contains_package.resize(package_id + 1);
+  if (contains_package[package_id]) return;
+  contains_package[package_id] = true;
+  packages.push_back(package);
+}
 
-  // List of include paths sorted by priorities.
-  std::map<int, std::vector<std::filesystem::path>> include_paths_by_priority;
-
-  // Cached lookup into `include_paths_by_priority` to avoid a lot of map
-  // lookups.
-  int last_include_priority = -1;
-  std::vector<std::filesystem::path>* include_paths_at_priority = nullptr;
-
-  auto add_include_directory =
-      [&include_paths_by_priority, &last_include_priority,
-       &include_paths_at_priority](const std::filesystem::path& path,
-                                   int priority) {
-        if (!std::filesystem::exists(path)) return;
-
-        if (include_paths_at_priority == nullptr ||
-            priority != last_include_priority) {
-          auto itr = include_paths_by_priority.find(priority);
-          if (itr == include_paths_by_priority.end()) {
-            include_paths_by_priority.insert(
-                {priority, std::vector<std::filesystem::path>()});
-            include_paths_at_priority = &include_paths_by_priority[priority];
-          } else {
-            include_paths_at_priority = &itr->second;
-          }
-          last_include_priority = priority;
-        }
-        include_paths_at_priority->push_back(path);
-      };
-
-  // Add initial dependencies from the top level package.
-  for (const auto& dependency : metadata.dependencies) {
-    add_dependency(dependency);
+void DependencyClosure::Merge(const DependencyClosure& closure) {
+  if (closure.invalid_package != nullptr) {
+    invalid_package = closure.invalid_package;
+    return;
   }
+  for (const PackageNode* package : closure.packages) Add(package);
+}
 
-  // Defines are stored in a set because there's a possibility there could be
-  // duplicates.
-  std::set<std::string> defines;
-  std::set<std::string> undefines;
+// The package nodes that have been created, keyed by package name. Guards the
+// nodes' closures.
+std::map<std::string, std::unique_ptr<PackageNode>> package_nodes_by_name;
+std::mutex package_nodes_mutex;
 
-  auto add_define = [&defines, &undefines](const std::string& define) {
-    if (define.size() > 0 && define[0] == '-') {
-      undefines.insert(define.substr(1));
-    } else {
-      defines.insert(define);
+PackageNode& GetPackageNode(const std::string& package_name) {
+  std::scoped_lock lock(package_nodes_mutex);
+  auto& node = package_nodes_by_name[package_name];
+  if (node != nullptr) return *node;
+
+  node = std::make_unique<PackageNode>();
+  node->package_name = package_name;
+  node->metadata = GetUnconsolidatedMetadataForPackage(package_name);
+  if (node->metadata != nullptr) {
+    for (const auto& include_directory :
+         node->metadata->public_include_directories) {
+      std::filesystem::path path =
+          node->metadata->package_path / include_directory;
+      if (std::filesystem::exists(path))
+        node->public_includes.push_back(std::move(path));
     }
-  };
+  }
+  return *node;
+}
 
-  // Add values from the top level package.
-  for (const auto& define : metadata.defines) add_define(define);
-  for (const auto& define : metadata.public_defines) add_define(define);
-  for (const auto& include_directory : metadata.include_directories)
-    add_include_directory(metadata.package_path / include_directory,
-                          metadata.include_priorty);
-  for (const auto& include_directory : metadata.public_include_directories)
-    add_include_directory(metadata.package_path / include_directory,
-                          metadata.include_priorty);
-
-  // Walk through the dependencies.
-  while (!dependencies_to_visit.empty()) {
-    const auto& dependency = dependencies_to_visit.front();
-    metadata.consolidated_dependencies.push_back(dependency);
-    auto* child_metadata = GetUnconsolidatedMetadataForPackage(dependency);
-    if (!child_metadata) {
-      std::cerr << std::quoted(package_name) << " depends on "
-                << std::quoted(dependency) << " but the latter isn't found."
-                << std::endl;
-      return false;
+const DependencyClosure* GetKnownClosure(const PackageNode& node) {
+  std::scoped_lock lock(package_nodes_mutex);
+  return node.closure.get();
+}
+
+// Calculates the closure of a package, remembering it if it's complete.
+// `packages_being_visited` are the packages that the closure is being
+// calculated for further up the stack. Their closures aren't known yet, so the
+// closures of packages that depend on them are incomplete, and are only
+// remembered by the package furthest up the stack that they depend on. Returns
+// the depth of the furthest up package, if the closure is incomplete.
+std::optional<size_t> CalculateClosure(
+    PackageNode& node, std::vector<const PackageNode*>& packages_being_visited,
+    DependencyClosure& closure) {
+  size_t depth = packages_being_visited.size();
+  packages_being_visited.push_back(&node);
+  std::optional<size_t> incomplete_from_depth;
+
+  // A package doesn't depend on itself, even if it's in a cycle, so it's
+  // treated as already being in its closure.
+  size_t package_id = node.metadata->package_id;
+  closure.contains_package.resize(
+      std::max(closure.contains_package.size(), package_id + 1));
+  closure.contains_package[package_id] = true;
+
+  std::vector<PackageNode*> dependencies;
+  for (const auto& dependency : node.metadata->dependencies) {
+    PackageNode& dependency_node = GetPackageNode(dependency);
+    if (dependency_node.metadata == nullptr ||
+        !dependency_node.metadata->IsLibrary()) {
+      closure.invalid_package = &dependency_node;
+      break;
     }
-    if (!child_metadata->IsLibrary()) {
-      std::cerr << std::quoted(package_name) << " depends on "
-                << std::quoted(dependency) << " but the latter isn't a library."
-                << std::endl;
-      return false;
+    closure.Add(&dependency_node);
+    dependencies.push_back(&dependency_node);
+  }
+
+  for (PackageNode* dependency : dependencies) {
+    if (closure.invalid_package != nullptr) break;
+    if (const DependencyClosure* known_closure = GetKnownClosure(*dependency)) {
+      closure.Merge(*known_closure);
+      continue;
+    }
+    auto being_visited = std::find(packages_being_visited.begin(),
+                                   packages_being_visited.end(), dependency);
+    if (being_visited != packages_being_visited.end()) {
+      size_t dependency_depth = being_visited - packages_being_visited.begin();
+      incomplete_from_depth =
+          std::min(incomplete_from_depth.value_or(dependency_depth),
+                   dependency_depth);
+      continue;
     }
+    DependencyClosure dependency_closure;
+    std::optional<size_t> dependency_incomplete_from_depth =
+        CalculateClosure(*dependency, packages_being_visited,
+                         dependency_closure);
+    if (dependency_incomplete_from_depth) {
+      incomplete_from_depth =
+          std::min(incomplete_from_depth.value_or(SIZE_MAX),
+                   *dependency_incomplete_from_depth);
+    }
+    closure.Merge(dependency_closure);
+  }
 
-    // Add values from this package.
-    if (!child_metadata->no_output_file && metadata.IsApplication()) {
-      if (metadata.statically_link) {
-        metadata.statically_linked_library_objects.push_back(
-            child_metadata->statically_linked_library_output_path);
+  closure.contains_package[package_id] = false;
+  packages_being_visited.pop_back();
+  if (incomplete_from_depth && *incomplete_from_depth < depth)
+    return incomplete_from_depth;
+
+  std::scoped_lock lock(package_nodes_mutex);
+  if (node.closure == nullptr)
+    node.closure = std::make_unique<DependencyClosure>(closure);
+  return std::nullopt;
+}
+
+// Returns the closure of a package. Thread safe, as long as the packages in it
+// have been loaded.
+const DependencyClosure& GetDependencyClosure(PackageNode& node) {
+  if (const DependencyClosure* known_closure = GetKnownClosure(node))
+    return *known_closure;
+  // Nothing is further up the stack, so the closure is always complete and
+  // remembered.
+  std::vector<const PackageNode*> packages_being_visited;
+  DependencyClosure closure;
+  CalculateClosure(node, packages_being_visited, closure);
+  return *GetKnownClosure(node);
+}
+
+// Consolidates what a package's dependencies expose into its metadata. Errors
+// are written to `errors`. Thread safe, as long as no other package's metadata
+// is loaded or consolidated at the same time as its dependencies.
+bool ConsolidateMetadataForPackage(const std::string& package_name,
+                                   PackageMetadata& metadata,
+                                   std::ostream& errors) {
+  PackageNode& node = GetPackageNode(package_name);
+  const DependencyClosure& closure = GetDependencyClosure(node);
+  if (closure.invalid_package != nullptr) {
+    errors << std::quoted(package_name) << " depends on "
+           << std::quoted(closure.invalid_package->package_name)
+           << (closure.invalid_package->metadata == nullptr
+                   ? " but the latter isn't found."
+                   : " but the latter isn't a library.")
+           << std::endl;
+    return false;
+  }
+
+  // Include directories are ordered by priority, then in the order they're
+  // encountered.
+  std::vector<std::pair<int, std::filesystem::path>> include_paths;
+  for (const auto& include_directory : metadata.include_directories) {
+    std::filesystem::path path = metadata.package_path / include_directory;
+    if (std::filesystem::exists(path))
+      include_paths.push_back({metadata.include_priorty, std::move(path)});
+  }
+
+  std::vector<std::string_view> defines;
+  std::vector<std::string_view> undefines;
+  auto add_defines = [&defines, &undefines](
+                         const std::vector<std::string>& defines_to_add) {
+    for (const auto& define : defines_to_add) {
+      if (define.size() > 0 && define[0] == '-') {
+        undefines.push_back(std::string_view(define).substr(1));
       } else {
-        metadata.dynamically_linked_libaries.push_back(dependency);
+        defines.push_back(define);
       }
     }
+  };
 
-    for (const auto& define : child_metadata->public_defines)
-      add_define(define);
-
-    for (const auto& include_directory :
-         child_metadata->public_include_directories) {
-      add_include_directory(child_metadata->package_path / include_directory,
-                            child_metadata->include_priorty);
+  // Add values from the top level package.
+  add_defines(metadata.defines);
+  add_defines(metadata.public_defines);
+  for (const auto& path : node.public_includes)
+    include_paths.push_back({metadata.include_priorty, path});
+
+  // Add values from everything it depends on.
+  for (const PackageNode* dependency : closure.packages) {
+    const PackageMetadata& child_metadata = *dependency->metadata;
+    metadata.consolidated_dependencies.push_back(dependency->package_name);
+    if (!child_metadata.no_output_file && metadata.IsApplication()) {
+      // In dev mode, applications link against the shared libraries so they
+      // don't need to be relinked whenever a library is.
+      if (metadata.statically_link && !IsDevMode()) {
+        metadata.statically_linked_library_objects.push_back(
+            child_metadata.statically_linked_library_output_path);
+      } else {
+        metadata.dynamically_linked_libaries.push_back(
+            dependency->package_name);
+      }
     }
 
-    metadata.metadata_timestamp = std::max(metadata.metadata_timestamp,
-                                           child_metadata->metadata_timestamp);
-
-    // Add sub-dependencies.
-    for (const auto& subdependency : child_metadata->dependencies)
-      add_dependency(subdependency);
-
-    dependencies_to_visit.pop();
+    add_defines(child_metadata.public_defines);
+    for (const auto& path : dependency->public_includes)
+      include_paths.push_back({child_metadata.include_priorty, path});
   }
 
+  // Defines are sorted and deduplicated.
+  std::sort(defines.begin(), defines.end());
+  defines.erase(std::unique(defines.begin(), defines.end()), defines.end());
+  std::sort(undefines.begin(), undefines.end());
   for (const auto& define : defines) {
-    if (undefines.find(define) == undefines.end())
-      metadata.consolidated_defines.push_back(define);
+    if (!std::binary_search(undefines.begin(), undefines.end(), define))
+      metadata.consolidated_defines.push_back(std::string(define));
   }
 
   metadata.has_consolidated_information = true;
 
-  // Sort and consolidate the includes.
-  std::vector<int> include_priorities;
-  for (const auto& priority_and_paths : include_paths_by_priority)
-    include_priorities.push_back(priority_and_paths.first);
-  std::sort(include_priorities.begin(), include_priorities.end());
+  std::stable_sort(include_paths.begin(), include_paths.end(),
+                   [](const auto& a, const auto& b) { return a.first < b.first; });
+  for (auto& [priority, path] : include_paths)
+    metadata.consolidated_includes.push_back(std::move(path));
+  return true;
+}
 
-  for (int priority : include_priorities) {
-    auto& paths_at_priority = include_paths_by_priority[priority];
-    for (auto& path : paths_at_priority)
-      metadata.consolidated_includes.push_back(std::move(path));
+// Consolidates the metadata of every loaded package in parallel. Packages are
+// consolidated in waves, each of the packages whose dependencies have already
+// been consolidated, because a package reads its dependencies' metadata.
+void ConsolidateLoadedPackages() {
+  ScopedTraceSpan span("Consolidate metadata", "packages");
+  std::map<std::string_view, PackageMetadata*> remaining;
+  for (auto& [package_name, metadata] : metadata_by_package_name) {
+    if (metadata != nullptr && !metadata->has_consolidated_information &&
+        !packages_that_failed_to_consolidate.contains(package_name))
+      remaining[package_name] = metadata.get();
+  }
+
+  while (!remaining.empty()) {
+    std::vector<std::pair<std::string_view, PackageMetadata*>> wave;
+    for (const auto& [package_name, metadata] : remaining) {
+      if (std::none_of(metadata->dependencies.begin(),
+                       metadata->dependencies.end(),
+                       [&remaining](const std::string& dependency) {
+                         return remaining.contains(dependency);
+                       }))
+        wave.push_back({package_name, metadata});
+    }
+    // The remaining packages depend on each other in a cycle, so they're
+    // consolidated one at a time.
+    if (wave.empty()) wave.push_back(*remaining.begin());
+
+    std::vector<std::stringstream> errors(wave.size());
+    std::vector<char> successful(wave.size(), 0);
+    ParallelFor(wave.size(), [&](size_t index) {
+      successful[index] = ConsolidateMetadataForPackage(
+          std::string(wave[index].first), *wave[index].second, errors[index]);
+    });
+
+    for (size_t index = 0; index < wave.size(); index++) {
+      std::string package_name(wave[index].first);
+      if (successful[index]) {
+        StoreMetadataInSnapshot(package_name, *wave[index].second);
+      } else {
+        std::cerr << errors[index].str();
+        packages_that_failed_to_consolidate.insert(package_name);
+      }
+      remaining.erase(wave[index].first);
+    }
   }
-  return true;
 }
 
 }  // namespace
 
+void LoadMetadataForPackages(const std::vector<std::string>& package_names) {
+  ScopedTraceSpan span("Load metadata", "packages");
+  // Load the packages a level of dependencies at a time, generating and
+  // parsing the configs of each level in parallel.
+  std::set<std::string> packages_to_load(package_names.begin(),
+                                         package_names.end());
+  while (!packages_to_load.empty()) {
+    std::vector<std::string> package_names_to_parse;
+    std::vector<std::filesystem::path> package_paths;
+    for (const auto& package_name : packages_to_load) {
+      // Packages in the snapshot don't need their configs.
+      if (metadata_by_package_name.contains(package_name) ||
+          RestoreMetadataForPackage(package_name) != nullptr) {
+        continue;
+      }
+      const auto& package_path = GetPackagePathFromName(package_name);
+      if (package_path.empty()) {
+        // Remember failures so they are only reported once.
+        metadata_by_package_name[package_name] = nullptr;
+        continue;
+      }
+      package_names_to_parse.push_back(package_name);
+      package_paths.push_back(package_path);
+    }
+    GenerateConfigFilesForPackages(package_paths);
+
+    std::vector<std::unique_ptr<PackageMetadata>> parsed_metadata(
+        package_paths.size());
+    ParallelFor(package_paths.size(), [&](size_t index) {
+      parsed_metadata[index] = LoadMetadataFromConfig(
+          package_names_to_parse[index], package_paths[index]);
+    });
+    for (size_t index = 0; index < package_paths.size(); index++) {
+      metadata_by_package_name[package_names_to_parse[index]] =
+          std::move(parsed_metadata[index]);
+    }
+
+    std::set<std::string> dependencies;
+    for (const auto& package_name : packages_to_load) {
+      auto* metadata = GetUnconsolidatedMetadataForPackage(package_name);
+      if (metadata == nullptr) continue;
+      for (const auto& dependency : metadata->dependencies) {
+        if (!metadata_by_package_name.contains(dependency))
+          dependencies.insert(dependency);
+      }
+    }
+    packages_to_load = std::move(dependencies);
+  }
+  ConsolidateLoadedPackages();
+}
+
+void ForEachLoadedPackage(
+    const std::function<void(const PackageMetadata&)>& on_each_package) {
+  for (const auto& [package_name, metadata] : metadata_by_package_name) {
+    if (metadata != nullptr) on_each_package(*metadata);
+  }
+}
+
+void InvalidateMetadata() {
+  package_nodes_by_name.clear();
+  metadata_by_package_name.clear();
+  packages_that_failed_to_consolidate.clear();
+  InvalidateMetadataSnapshot();
+}
+
 PackageMetadata* GetMetadataForPackage(const std::string& package_name) {
   PackageMetadata* metadata = GetUnconsolidatedMetadataForPackage(package_name);
-  if (metadata == nullptr) return nullptr;
+  if (metadata == nullptr ||
+      packages_that_failed_to_consolidate.contains(package_name))
+    return nullptr;
   if (!metadata->has_consolidated_information) {
-    if (!ConsolidateMetadataForPackage(package_name, *metadata)) return nullptr;
+    ScopedTraceSpan span("Consolidate metadata", "packages");
+    span.AddArgument("package", package_name);
+    if (!ConsolidateMetadataForPackage(package_name, *metadata, std::cerr)) {
+      packages_that_failed_to_consolidate.insert(package_name);
+      return nullptr;
+    }
+    StoreMetadataInSnapshot(package_name, *metadata);
   }
   return metadata;
 }
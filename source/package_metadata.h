@@ -16,6 +16,7 @@
 
 #include <cstdint>
 #include <filesystem>
+#include <functional>
 #include <map>
 #include <set>
 #include <string>
@@ -42,6 +43,11 @@ struct PackageMetadata {
   std::string linker_command;
   // The linker command to build a statically linked variant of this package.
   std::string static_linker_command;
+  // The linker command to build a library as a shared library in dev mode.
+  std::string shared_library_linker_command;
+  // The argument added to the build commands of a library's C and C++ source
+  // files in dev mode, so they can be linked into a shared library.
+  std::string position_independent_code_argument;
 
   // The path of the package's root directory.
   std::filesystem::path package_path;
@@ -76,15 +82,55 @@ struct PackageMetadata {
   std::vector<std::string> dependencies;
   // A list of files to ignore when building.
   std::set<std::filesystem::path> files_to_ignore;
-  // The timestamp of when the metadata was last updated.
-  uint64_t metadata_timestamp;
+  // Whether to compile the source files in batches, each including several
+  // source files, so that the headers they share are only parsed once per
+  // batch.
+  bool unity_build;
+  // The most source files to include in each unity batch.
+  int unity_batch_size;
+  // Whether to precompile the headers that most of this package's source files
+  // include.
+  bool precompiled_header;
+  // A map of file extensions to the commands to precompile a header for the
+  // source files with that extension.
+  std::map<std::string, std::string>
+      precompiled_header_commands_by_file_extension;
+  // The argument added to build commands to use a precompiled header.
+  std::string precompiled_header_argument;
+  // Whether this package's C++ source files may provide or import named
+  // modules.
+  bool modules;
+  // The command that scans a source file for the modules it provides and
+  // imports.
+  std::string module_scan_command;
+  // The argument added to the build command of a source file that provides a
+  // module, to write its module interface.
+  std::string module_output_argument;
+  // The argument added to build commands for each module they import.
+  std::string module_file_argument;
+  // Whether to write the debug info of C and C++ source files to a separate
+  // .dwo file beside each object file, so the linker doesn't have to process
+  // it.
+  bool split_debug_info;
+  // The argument added to build commands to split the debug info.
+  std::string split_debug_info_argument;
+  // The command that packages the split debug info of an application into a
+  // .dwp file beside it after it's linked, or blank to not package it.
+  std::string debug_info_package_command;
 
   // Whether this package should skip building.
   bool should_skip;
   // Whether this package has no built output file.
   bool no_output_file;
+  // Whether this application is a test, which is ran by --test.
+  bool test;
+  // The test packages that are built and ran by --test for this package.
+  std::vector<std::string> tests;
+  // How many shards to split this test's cases into, which run in parallel.
+  int test_shards;
   // Whether to statically link this application against its dependent
-  // libraries. This only applies to application packages.
+  // libraries. This only applies to application packages, and not in dev
+  // mode.
   bool statically_link;
 
   // The destination directory to copy the binary and all assets to after a
@@ -94,6 +140,12 @@ struct PackageMetadata {
   // The directories in the package to copy to the destination directory after a
   // successful build.
   std::vector<std::string> asset_directories;
+  // Whether to compare the contents of assets that are newer than their copy
+  // but the same size, and skip copying them if they're the same.
+  bool compare_asset_contents;
+  // Whether assets may be hard linked into the destination directory, when
+  // they can't be cloned.
+  bool hard_link_assets;
 
   // Whether this metadata has consolidated information. The consolidated
   // fields contain the data consolidated from all of the dependencies that is
@@ -114,5 +166,17 @@ struct PackageMetadata {
   std::vector<std::string> dynamically_linked_libaries;
 };
 
+// Loads and consolidates the metadata for packages and everything they depend
+// on, generating and parsing their configs in parallel.
+void LoadMetadataForPackages(const std::vector<std::string>& package_names);
+
 // Returns the metadata for a package.
 PackageMetadata* GetMetadataForPackage(const std::string& package_name);
+
+// Loops over the metadata of each package that has been loaded.
+void ForEachLoadedPackage(
+    const std::function<void(const PackageMetadata&)>& on_each_package);
+
+// Forgets the metadata of every package, so that it's loaded again after their
+// configs may have changed.
+void InvalidateMetadata();
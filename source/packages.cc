@@ -19,11 +19,15 @@
 #include <map>
 #include <sstream>
 #include <string>
+#include <system_error>
+#include <vector>
 
 #include "config.h"
 #include "invocation.h"
 #include "string_replace.h"
 #include "temp_directory.h"
+#include "trace.h"
+#include "worker_pool.h"
 
 namespace {
 
@@ -69,6 +73,7 @@ void RegisterPackagePath(const std::string& package_path) {
 }  // namespace
 
 void InitializePackages() {
+  ScopedTraceSpan span("Discover packages", "packages");
   // Register the packages directly mentioned in the input first.
   if (!RunOnAllKnownPackages()) {
     ForEachRawInputPackage([](const std::string& name_or_path) {
@@ -84,21 +89,37 @@ void InitializePackages() {
     });
   }
 
-  ForEachPackageDirectory([](const std::filesystem::path& package_directory) {
-    if (!std::filesystem::exists(package_directory)) return;
-    for (auto const& dir_entry :
-         std::filesystem::directory_iterator{package_directory}) {
+  // The package directories are listed in parallel, then their packages are
+  // registered in order, so that earlier directories take precedence.
+  std::vector<std::filesystem::path> package_directories;
+  ForEachPackageDirectory(
+      [&package_directories](const std::filesystem::path& package_directory) {
+        package_directories.push_back(package_directory);
+      });
+  std::vector<std::vector<std::filesystem::path>> packages_by_directory(
+      package_directories.size());
+  ParallelFor(package_directories.size(), [&](size_t index) {
+    // Errors can't be thrown from the worker pool, and a directory that can't
+    // be listed has no packages.
+    const auto& package_directory = package_directories[index];
+    std::error_code error;
+    for (std::filesystem::directory_iterator itr(package_directory, error), end;
+         !error && itr != end; itr.increment(error)) {
       // Skip files.
-      if (!dir_entry.is_directory()) continue;
-      std::filesystem::path path = dir_entry.path();
+      std::error_code type_error;
+      if (!itr->is_directory(type_error)) continue;
+      std::filesystem::path path = itr->path();
 
       // Skip hidden directories.
       std::string filename = path.filename();
       if (filename.size() == 0 || filename[0] == '.') continue;
 
-      RegisterPackagePath(path);
+      packages_by_directory[index].push_back(path);
     }
   });
+  for (const auto& packages_in_directory : packages_by_directory) {
+    for (const auto& path : packages_in_directory) RegisterPackagePath(path);
+  }
 
   dynamic_library_directory_path =
       GetTempDirectoryPath() / kDynamicLibrariesSubdirectoryName;
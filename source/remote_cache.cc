@@ -0,0 +1,355 @@
+// Copyright 2024 Google LLC
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//      http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+#include "remote_cache.h"
+
+#include <algorithm>
+#include <atomic>
+#include <cctype>
+#include <charconv>
+#include <condition_variable>
+#include <cstdlib>
+#include <deque>
+#include <functional>
+#include <iostream>
+#include <mutex>
+#include <optional>
+#include <string>
+#include <string_view>
+#include <thread>
+#include <vector>
+
+#include "config.h"
+#include "network.h"
+
+namespace {
+
+// The only supported URL scheme.
+constexpr std::string_view kHttpScheme = "http://";
+
+// How long to wait on the server before giving up on a request.
+constexpr int kTimeoutSeconds = 10;
+
+// After this many requests fail in a row, the remote cache is treated as
+// unreachable for the rest of the run so that it doesn't slow the build down.
+constexpr int kMaxConsecutiveFailures = 3;
+
+// The size of the chunks to read responses in.
+constexpr size_t kReadChunkSize = 64 * 1024;
+
+// The largest response body that is accepted, so that a bad response can't
+// exhaust memory.
+constexpr size_t kMaxBodySize = size_t{4} << 30;
+
+bool remote_cache_enabled = false;
+
+// The parsed URL of the remote cache.
+std::string host;
+std::string port;
+std::string path_prefix;
+
+// A request to make to the remote cache.
+struct Request {
+  bool is_upload;
+  std::string path;
+  // The blob to upload.
+  std::string blob;
+  // Called with the response to a fetch.
+  std::function<void(std::optional<std::string>)> on_complete;
+};
+
+// Guards the queued requests.
+std::mutex requests_mutex;
+std::condition_variable request_queued;
+std::deque<Request> fetches;
+std::deque<Request> uploads;
+bool shutting_down = false;
+
+std::vector<std::thread> connection_threads;
+
+std::atomic<int> consecutive_failures = 0;
+
+// A connection to the remote cache server.
+struct Connection {
+  int fd = -1;
+  // Bytes that have been received but not yet parsed.
+  std::string received;
+
+  void Close() {
+    if (fd >= 0) CloseSocket(fd);
+    fd = -1;
+    received.clear();
+  }
+};
+
+// Parses a URL in the form http://host[:port][/path].
+bool ParseUrl(std::string_view url) {
+  if (!url.starts_with(kHttpScheme)) return false;
+  url.remove_prefix(kHttpScheme.size());
+
+  size_t path_start = url.find('/');
+  std::string_view authority = url.substr(0, path_start);
+  if (path_start != std::string_view::npos) {
+    path_prefix = url.substr(path_start);
+    while (!path_prefix.empty() && path_prefix.back() == '/')
+      path_prefix.pop_back();
+  }
+
+  return SplitHostAndPort(authority, "80", host, port);
+}
+
+// Reads more data from the connection into its received buffer.
+bool ReceiveMore(Connection& connection) {
+  char buffer[kReadChunkSize];
+  size_t bytes_read = ReceiveSome(connection.fd, buffer, sizeof(buffer));
+  if (bytes_read == 0) return false;
+  connection.received.append(buffer, bytes_read);
+  return true;
+}
+
+// Takes a line ending in CRLF from the received data.
+bool ReceiveLine(Connection& connection, std::string& line) {
+  size_t end;
+  while ((end = connection.received.find("\r\n")) == std::string::npos) {
+    if (!ReceiveMore(connection)) return false;
+  }
+  line = connection.received.substr(0, end);
+  connection.received.erase(0, end + 2);
+  return true;
+}
+
+// Takes an exact number of bytes from the received data.
+bool ReceiveBytes(Connection& connection, size_t length, std::string& bytes) {
+  while (connection.received.size() < length) {
+    if (!ReceiveMore(connection)) return false;
+  }
+  bytes.append(connection.received, 0, length);
+  connection.received.erase(0, length);
+  return true;
+}
+
+std::string ToLower(std::string_view str) {
+  std::string lower(str);
+  std::transform(lower.begin(), lower.end(), lower.begin(),
+                 [](unsigned char c) { return std::tolower(c); });
+  return lower;
+}
+
+// Parses the length at the start of `value`, which must be no more than
+// `kMaxBodySize`. Anything after the digits must start with one of
+// `allowed_suffixes`.
+bool ParseLength(std::string_view value, int base,
+                 std::string_view allowed_suffixes, size_t& length) {
+  const char* end = value.data() + value.size();
+  auto [ptr, error] = std::from_chars(value.data(), end, length, base);
+  if (error != std::errc() || length > kMaxBodySize) return false;
+  return ptr == end || allowed_suffixes.find(*ptr) != std::string_view::npos;
+}
+
+// Reads a response from the server. Returns false if the connection failed.
+bool ReceiveResponse(Connection& connection, bool is_head, int& status,
+                     std::string& body, bool& keep_alive) {
+  std::string line;
+  if (!ReceiveLine(connection, line)) return false;
+  // The status line looks like "HTTP/1.1 200 OK".
+  size_t status_start = line.find(' ');
+  if (!line.starts_with("HTTP/") || status_start == std::string::npos)
+    return false;
+  status = std::atoi(line.c_str() + status_start + 1);
+
+  std::optional<size_t> content_length;
+  bool chunked = false;
+  keep_alive = true;
+  while (true) {
+    if (!ReceiveLine(connection, line)) return false;
+    if (line.empty()) break;
+    size_t colon = line.find(':');
+    if (colon == std::string::npos) continue;
+    std::string name = ToLower(line.substr(0, colon));
+    std::string value = ToLower(line.substr(colon + 1));
+    value.erase(0, value.find_first_not_of(' '));
+    if (name == "content-length") {
+      size_t length;
+      if (!ParseLength(value, /*base=*/10, /*allowed_suffixes=*/" \t", length))
+        return false;
+      content_length = length;
+    } else if (name == "transfer-encoding") {
+      chunked = value.find("chunked") != std::string::npos;
+    } else if (name == "connection") {
+      keep_alive = value.find("close") == std::string::npos;
+    }
+  }
+
+  body.clear();
+  if (is_head) return true;
+  if (chunked) {
+    while (true) {
+      if (!ReceiveLine(connection, line)) return false;
+      // The size may be followed by chunk extensions.
+      size_t chunk_size;
+      if (!ParseLength(line, /*base=*/16, /*allowed_suffixes=*/" \t;",
+                       chunk_size) ||
+          chunk_size > kMaxBodySize - body.size())
+        return false;
+      if (chunk_size == 0) {
+        // Skip any trailers.
+        do {
+          if (!ReceiveLine(connection, line)) return false;
+        } while (!line.empty());
+        return true;
+      }
+      if (!ReceiveBytes(connection, chunk_size, body) ||
+          !ReceiveLine(connection, line))
+        return false;
+    }
+  }
+  if (content_length) return ReceiveBytes(connection, *content_length, body);
+
+  // The body runs until the server closes the connection.
+  keep_alive = false;
+  while (ReceiveMore(connection)) {
+    if (connection.received.size() > kMaxBodySize) return false;
+  }
+  body = std::move(connection.received);
+  return true;
+}
+
+// Makes a request to the server, reusing the connection if it's still open.
+// Returns false if the server couldn't be reached.
+bool PerformRequest(Connection& connection, const Request& request,
+                    int& status, std::string& body) {
+  std::string method = request.is_upload ? "PUT" : "GET";
+  std::string header = method + " " + path_prefix + "/" + request.path +
+                       " HTTP/1.1\r\nHost: " + host + "\r\n";
+  if (request.is_upload) {
+    header += "Content-Length: " + std::to_string(request.blob.size()) +
+              "\r\nContent-Type: application/octet-stream\r\n";
+  }
+  header += "\r\n";
+
+  // A reused connection may have been closed by the server while it was idle,
+  // so retry once with a new connection.
+  for (int attempt = 0; attempt < 2; attempt++) {
+    bool reused = connection.fd >= 0;
+    if (!reused) {
+      connection.fd = ConnectToServer(host, port, kTimeoutSeconds);
+      if (connection.fd < 0) return false;
+    }
+
+    bool keep_alive;
+    if (SendAll(connection.fd, header) &&
+        (!request.is_upload || SendAll(connection.fd, request.blob)) &&
+        ReceiveResponse(connection, /*is_head=*/false, status, body,
+                        keep_alive)) {
+      if (!keep_alive) connection.Close();
+      return true;
+    }
+    connection.Close();
+    if (!reused) return false;
+  }
+  return false;
+}
+
+void RunConnection() {
+  Connection connection;
+  while (true) {
+    Request request;
+    {
+      std::unique_lock lock(requests_mutex);
+      request_queued.wait(lock, []() {
+        return !fetches.empty() || !uploads.empty() || shutting_down;
+      });
+      // Fetches come first, because something may be waiting on them.
+      if (!fetches.empty()) {
+        request = std::move(fetches.front());
+        fetches.pop_front();
+      } else if (!uploads.empty()) {
+        request = std::move(uploads.front());
+        uploads.pop_front();
+      } else {
+        break;
+      }
+    }
+
+    std::optional<std::string> blob;
+    if (consecutive_failures < kMaxConsecutiveFailures) {
+      int status;
+      std::string body;
+      if (PerformRequest(connection, request, status, body)) {
+        consecutive_failures = 0;
+        if (!request.is_upload && status == 200) blob = std::move(body);
+      } else if (++consecutive_failures == kMaxConsecutiveFailures) {
+        std::cerr << "Cannot reach the remote cache at " << host << ":" << port
+                  << ". It won't be used for the rest of this build."
+                  << std::endl;
+      }
+    }
+    if (request.on_complete) request.on_complete(std::move(blob));
+  }
+  connection.Close();
+}
+
+}  // namespace
+
+bool InitializeRemoteCache() {
+  std::string_view url = GetRemoteCacheUrl();
+  if (url.empty()) return true;
+  if (!ParseUrl(url)) {
+    std::cerr << "The remote cache must be an http:// URL, but it is \"" << url
+              << "\"." << std::endl;
+    return false;
+  }
+
+  remote_cache_enabled = true;
+  int connections = std::max(GetNumberOfRemoteCacheConnections(), 1);
+  for (int i = 0; i < connections; i++)
+    connection_threads.push_back(std::thread(RunConnection));
+  return true;
+}
+
+void ShutdownRemoteCache() {
+  {
+    std::scoped_lock lock(requests_mutex);
+    shutting_down = true;
+  }
+  request_queued.notify_all();
+  for (auto& thread : connection_threads) thread.join();
+  connection_threads.clear();
+}
+
+bool IsRemoteCacheEnabled() { return remote_cache_enabled; }
+
+void FetchFromRemoteCache(
+    const std::string& path,
+    std::function<void(std::optional<std::string> blob)> on_complete) {
+  {
+    std::scoped_lock lock(requests_mutex);
+    fetches.push_back({.is_upload = false,
+                       .path = path,
+                       .blob = {},
+                       .on_complete = std::move(on_complete)});
+  }
+  request_queued.notify_one();
+}
+
+void UploadToRemoteCache(const std::string& path, std::string blob) {
+  {
+    std::scoped_lock lock(requests_mutex);
+    uploads.push_back({.is_upload = true,
+                       .path = path,
+                       .blob = std::move(blob),
+                       .on_complete = {}});
+  }
+  request_queued.notify_one();
+}
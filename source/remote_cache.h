@@ -0,0 +1,45 @@
+// Copyright 2024 Google LLC
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//      http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+#pragma once
+
+#include <functional>
+#include <optional>
+#include <string>
+
+// A remote cache is an HTTP server that stores blobs with GET and PUT
+// requests, such as bazel-remote or nginx with WebDAV enabled. Requests are
+// made in the background by a few threads, each keeping its own connection
+// open, so they overlap with commands running locally.
+
+// Connects to the remote cache, if one is configured. Returns false if the
+// configuration is invalid.
+bool InitializeRemoteCache();
+
+// Waits for any uploads to complete and stops the remote cache threads.
+void ShutdownRemoteCache();
+
+// Returns whether there is a remote cache to use.
+bool IsRemoteCacheEnabled();
+
+// Fetches a blob from the remote cache in the background. `on_complete` is
+// called from a remote cache thread with the blob, or nothing if the blob isn't
+// in the cache or the cache can't be reached. Thread safe.
+void FetchFromRemoteCache(
+    const std::string& path,
+    std::function<void(std::optional<std::string> blob)> on_complete);
+
+// Uploads a blob to the remote cache in the background. Uploads never delay
+// fetches. Thread safe.
+void UploadToRemoteCache(const std::string& path, std::string blob);
@@ -0,0 +1,92 @@
+// Copyright 2024 Google LLC
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//      http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+#include "response_file.h"
+
+#include <filesystem>
+#include <fstream>
+#include <iomanip>
+#include <iostream>
+#include <mutex>
+#include <set>
+#include <sstream>
+#include <string>
+#include <string_view>
+#include <system_error>
+
+#include "config.h"
+#include "hash.h"
+#include "temp_directory.h"
+
+namespace {
+
+// The name of the subdirectory inside of the temp directory to write response
+// files to.
+constexpr char kResponseFilesSubDirectory[] = "response_files";
+
+// Guards `written_response_files`.
+std::mutex response_files_mutex;
+
+// The response files that have been written or found during this run.
+std::set<std::filesystem::path> written_response_files;
+
+std::filesystem::path GetResponseFilesDirectory() {
+  return GetTempDirectoryPath() / kResponseFilesSubDirectory;
+}
+
+// Writes a response file if it doesn't already exist. It's written to another
+// file and renamed, so that a build that's interrupted can't leave a partially
+// written response file behind.
+bool WriteResponseFile(const std::filesystem::path& path,
+                       std::string_view arguments) {
+  std::error_code error;
+  if (std::filesystem::exists(path, error)) return true;
+  EnsureDirectoriesAndParentsExist(path.parent_path());
+  std::filesystem::path temp_path = path.string() + ".tmp";
+  {
+    std::ofstream file(temp_path, std::ios::binary);
+    file << arguments;
+    if (!file) return false;
+  }
+  std::filesystem::rename(temp_path, path, error);
+  return !error;
+}
+
+}  // namespace
+
+std::string UseResponseFileIfLong(std::string arguments) {
+  size_t threshold = GetResponseFileThreshold();
+  if (threshold == 0 || arguments.size() <= threshold) return arguments;
+
+  std::filesystem::path path = GetResponseFilesDirectory() /
+                               (HashString(arguments) + ".rsp");
+  {
+    std::scoped_lock lock(response_files_mutex);
+    if (!written_response_files.contains(path)) {
+      if (!WriteResponseFile(path, arguments)) {
+        std::cerr << "Cannot write the response file " << path
+                  << ". The arguments will be passed directly." << std::endl;
+        return arguments;
+      }
+      written_response_files.insert(path);
+    }
+  }
+  return (std::stringstream() << " @" << std::quoted(path.c_str())).str();
+}
+
+bool IsResponseFileArgument(std::string_view argument) {
+  return argument.starts_with("@") &&
+         std::filesystem::path(argument.substr(1)).parent_path() ==
+             GetResponseFilesDirectory();
+}
@@ -0,0 +1,34 @@
+// Copyright 2024 Google LLC
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//      http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+#pragma once
+
+#include <string>
+#include <string_view>
+
+// Long lists of arguments, such as a package's include directories or the
+// objects being linked, are written to response files, which compilers and
+// linkers read arguments from when given "@file". This keeps commands under
+// the operating system's limits on their length, and makes them cheaper to
+// build and store.
+
+// Returns `arguments` if they are no longer than the response file threshold,
+// or else an argument that reads them from a response file, with the same
+// leading space. Response files are named after the hash of their contents,
+// so the command changes whenever the arguments do. Thread safe.
+std::string UseResponseFileIfLong(std::string arguments);
+
+// Returns whether an argument reads a response file written by
+// `UseResponseFileIfLong`.
+bool IsResponseFileArgument(std::string_view argument);
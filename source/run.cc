@@ -31,7 +31,7 @@
 
 namespace {
 
-// Packages that have been ran.
+// Packages that have been ran during this build.
 std::set<std::string> packages;
 
 // Adds a package to run, if it's an application.
@@ -76,6 +76,8 @@ void RunGlobalRunCommand(std::string_view global_run_command) {
 }  // namespace
 
 bool RunPackages() {
+  // Packages are ran again each time they change while watching.
+  packages.clear();
   std::string_view global_run_command = GetGlobalRunCommand();
 
   if (global_run_command.empty()) {
@@ -0,0 +1,36 @@
+// Copyright 2024 Google LLC
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//      http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+#include "stage.h"
+
+#include <string_view>
+
+std::string_view StageToString(Stage stage) {
+  switch (stage) {
+    case Stage::Compile:
+      return "compile";
+    case Stage::LinkLibrary:
+      return "link library";
+    case Stage::LinkApplication:
+      return "link application";
+    case Stage::CopyAssets:
+      return "copy assets";
+    case Stage::Test:
+      return "test";
+    case Stage::Run:
+      return "run";
+    default:
+      return "unknown";
+  }
+}
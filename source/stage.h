@@ -16,10 +16,11 @@
 
 #include <string_view>
 
-// A build stage. Deferred commands are added to the command queue grouped by
-// stage. The stages are in order. Commands from earlier stages run before
-// commands from later stages. Commands in the same stage can be ran out of
-// order and in parallel.
+// A build stage. Deferred commands are added to the command queue tagged with
+// the stage describing the kind of work they do. Commands run in parallel as
+// soon as the commands they depend on have completed, regardless of stage,
+// except for `Run` commands, which run one after another once everything else
+// has been built.
 enum class Stage {
   // When the individual source files are compiled.
   Compile = 0,
@@ -30,6 +31,11 @@ enum class Stage {
   LinkApplication = 2,
   // When the binaries and assets are copied to the destination path.
   CopyAssets = 3,
+  // When the tests run, in parallel as soon as they're built.
+  Test = 4,
   // When the applications run.
-  Run = 4
+  Run = 5
 };
+
+// Converts a stage into a human readable string.
+std::string_view StageToString(Stage stage);
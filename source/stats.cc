@@ -0,0 +1,231 @@
+// Copyright 2024 Google LLC
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//      http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+#include "stats.h"
+
+#include <algorithm>
+#include <chrono>
+#include <cstdint>
+#include <filesystem>
+#include <fstream>
+#include <iomanip>
+#include <iostream>
+#include <map>
+#include <mutex>
+#include <string>
+#include <string_view>
+#include <utility>
+#include <vector>
+
+#include "invocation.h"
+#include "nlohmann/json.hpp"
+#include "stage.h"
+#include "timestamps.h"
+
+using json = ::nlohmann::json;
+
+namespace {
+
+// How many of the slowest commands to report.
+constexpr size_t kSlowestCommandsToReport = 10;
+
+// What happened to the commands of a stage.
+struct StageStats {
+  int ran = 0;
+  int failed = 0;
+  int restored = 0;
+  int up_to_date = 0;
+};
+
+// A command that ran.
+struct CommandDuration {
+  std::string destination_file;
+  // In milliseconds.
+  uint64_t duration;
+};
+
+bool recording_stats = false;
+
+std::chrono::steady_clock::time_point build_start_time;
+
+// Guards the fields below.
+std::mutex stats_mutex;
+// The phases of the invocation in the order they ran, with their durations in
+// microseconds.
+std::vector<std::pair<std::string, uint64_t>> phases;
+std::map<Stage, StageStats> stats_by_stage;
+std::vector<CommandDuration> compile_durations;
+std::vector<CommandDuration> link_durations;
+
+// The timestamp counters when the build started.
+uint64_t starting_timestamp_cache_hits = 0;
+uint64_t starting_timestamp_reads = 0;
+
+void StartBuild() {
+  build_start_time = std::chrono::steady_clock::now();
+  starting_timestamp_cache_hits = GetNumberOfTimestampCacheHits();
+  starting_timestamp_reads = GetNumberOfTimestampReads();
+}
+
+// Returns the slowest commands, slowest first.
+std::vector<CommandDuration> GetSlowestCommands(
+    std::vector<CommandDuration> commands) {
+  size_t count = std::min(commands.size(), kSlowestCommandsToReport);
+  std::partial_sort(commands.begin(), commands.begin() + count, commands.end(),
+                    [](const CommandDuration& a, const CommandDuration& b) {
+                      return a.duration > b.duration;
+                    });
+  commands.resize(count);
+  return commands;
+}
+
+json SlowestCommandsToJson(const std::vector<CommandDuration>& commands) {
+  json array = json::array();
+  for (const auto& command : commands) {
+    array.push_back({{"file", command.destination_file},
+                     {"duration_ms", command.duration}});
+  }
+  return array;
+}
+
+void PrintSlowestCommands(std::string_view title,
+                          const std::vector<CommandDuration>& commands) {
+  if (commands.empty()) return;
+  std::cout << " " << title << ":" << std::endl;
+  for (const auto& command : commands) {
+    std::cout << std::setw(10) << command.duration << " ms  "
+              << command.destination_file << std::endl;
+  }
+}
+
+}  // namespace
+
+void InitializeStats() {
+  if (!ShouldRecordStats()) return;
+  recording_stats = true;
+  StartBuild();
+}
+
+bool IsRecordingStats() { return recording_stats; }
+
+void RecordPhase(std::string_view name, uint64_t duration) {
+  if (!recording_stats) return;
+  std::scoped_lock lock(stats_mutex);
+  phases.emplace_back(name, duration);
+}
+
+void RecordUpToDateCommands(Stage stage, int count) {
+  if (!recording_stats) return;
+  std::scoped_lock lock(stats_mutex);
+  stats_by_stage[stage].up_to_date += count;
+}
+
+void RecordRestoredCommand(Stage stage) {
+  if (!recording_stats) return;
+  std::scoped_lock lock(stats_mutex);
+  stats_by_stage[stage].restored++;
+}
+
+void RecordCommandRan(Stage stage, const std::string& destination_file,
+                      uint64_t duration, bool successful) {
+  if (!recording_stats) return;
+  std::scoped_lock lock(stats_mutex);
+  StageStats& stage_stats = stats_by_stage[stage];
+  stage_stats.ran++;
+  if (!successful) stage_stats.failed++;
+  if (!successful || destination_file.empty()) return;
+  if (stage == Stage::Compile) {
+    compile_durations.push_back({destination_file, duration});
+  } else if (stage == Stage::LinkLibrary || stage == Stage::LinkApplication) {
+    link_durations.push_back({destination_file, duration});
+  }
+}
+
+void ReportStats() {
+  if (!recording_stats) return;
+  std::scoped_lock lock(stats_mutex);
+
+  uint64_t total_duration =
+      std::chrono::duration_cast<std::chrono::milliseconds>(
+          std::chrono::steady_clock::now() - build_start_time)
+          .count();
+  uint64_t timestamp_cache_hits =
+      GetNumberOfTimestampCacheHits() - starting_timestamp_cache_hits;
+  uint64_t timestamp_reads =
+      GetNumberOfTimestampReads() - starting_timestamp_reads;
+  std::vector<CommandDuration> slowest_compiles =
+      GetSlowestCommands(compile_durations);
+  std::vector<CommandDuration> slowest_links =
+      GetSlowestCommands(link_durations);
+
+  std::cout << "Build statistics (" << total_duration << " ms):" << std::endl;
+  if (!phases.empty()) {
+    std::cout << " Phases:" << std::endl;
+    for (const auto& [name, duration] : phases) {
+      std::cout << "  " << std::left << std::setw(28) << name << std::right
+                << std::setw(10) << duration / 1000 << "." << std::setfill('0')
+                << std::setw(3) << duration % 1000 << std::setfill(' ')
+                << " ms" << std::endl;
+    }
+  }
+  std::cout << " Commands:" << std::setw(22) << "ran" << std::setw(8)
+            << "failed" << std::setw(10) << "restored" << std::setw(12)
+            << "up to date" << std::endl;
+  for (const auto& [stage, stage_stats] : stats_by_stage) {
+    std::cout << "  " << std::left << std::setw(20) << StageToString(stage)
+              << std::right << std::setw(9) << stage_stats.ran << std::setw(8)
+              << stage_stats.failed << std::setw(10) << stage_stats.restored
+              << std::setw(12) << stage_stats.up_to_date << std::endl;
+  }
+  std::cout << " Timestamps: " << timestamp_cache_hits << " cached, "
+            << timestamp_reads << " read from the file system" << std::endl;
+  PrintSlowestCommands("Slowest compiles", slowest_compiles);
+  PrintSlowestCommands("Slowest links", slowest_links);
+
+  std::string_view stats_file = GetStatsFile();
+  if (!stats_file.empty()) {
+    json stats = {{"duration_ms", total_duration},
+                  {"phases", json::array()},
+                  {"stages", json::object()},
+                  {"timestamps",
+                   {{"cached", timestamp_cache_hits},
+                    {"read", timestamp_reads}}},
+                  {"slowest_compiles", SlowestCommandsToJson(slowest_compiles)},
+                  {"slowest_links", SlowestCommandsToJson(slowest_links)}};
+    for (const auto& [name, duration] : phases)
+      stats["phases"].push_back({{"name", name}, {"duration_us", duration}});
+    for (const auto& [stage, stage_stats] : stats_by_stage) {
+      stats["stages"][std::string(StageToString(stage))] = {
+          {"ran", stage_stats.ran},
+          {"failed", stage_stats.failed},
+          {"restored", stage_stats.restored},
+          {"up_to_date", stage_stats.up_to_date}};
+    }
+
+    std::filesystem::path stats_path(stats_file);
+    std::ofstream file(stats_path);
+    if (file.is_open()) {
+      file << stats.dump(/*indent=*/2) << std::endl;
+    } else {
+      std::cerr << "Cannot write the build statistics to " << stats_path << "."
+                << std::endl;
+    }
+  }
+
+  phases.clear();
+  stats_by_stage.clear();
+  compile_durations.clear();
+  link_durations.clear();
+  StartBuild();
+}
@@ -0,0 +1,51 @@
+// Copyright 2024 Google LLC
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//      http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+#pragma once
+
+#include <cstdint>
+#include <string>
+#include <string_view>
+
+#include "stage.h"
+
+// Statistics about a build, printed as a summary at the end of the build when
+// --stats is passed, and optionally written as JSON so that build times can be
+// tracked over time. Nothing is recorded unless --stats was passed.
+
+// Starts recording statistics if they were requested.
+void InitializeStats();
+
+// Returns whether statistics are being recorded.
+bool IsRecordingStats();
+
+// Records how long a phase of the invocation took, in microseconds.
+void RecordPhase(std::string_view name, uint64_t duration);
+
+// Records that commands didn't need to be queued because their outputs were up
+// to date.
+void RecordUpToDateCommands(Stage stage, int count = 1);
+
+// Records that the output of a command was restored from the object cache
+// instead of running it. Thread safe.
+void RecordRestoredCommand(Stage stage);
+
+// Records a command that ran, locally or on a remote worker, and how long it
+// took in milliseconds. Thread safe.
+void RecordCommandRan(Stage stage, const std::string& destination_file,
+                      uint64_t duration, bool successful);
+
+// Prints the statistics about the build and writes them to the stats file, if
+// there is one, then starts recording the next build.
+void ReportStats();
@@ -14,10 +14,15 @@
 
 #include "string_replace.h"
 
+#include <stddef.h>
+
+#include <algorithm>
+#include <initializer_list>
 #include <iostream>
 #include <map>
 #include <string>
 #include <string_view>
+#include <vector>
 
 namespace {
 
@@ -72,3 +77,74 @@ bool ReplaceSubstringInString(std::string& str, const std::string& placeholder,
   str.replace(index, placeholder.size(), new_value.c_str(), new_value.size());
   return true;
 }
+
+CommandTemplate::CommandTemplate(
+    std::string_view command, const std::vector<std::string_view>& variables,
+    const std::map<std::string, std::string>& constants) {
+  std::string literal;
+  size_t pos = 0;
+  while (pos < command.size()) {
+    size_t start_pos = command.find("${", pos);
+    size_t end_pos = start_pos == std::string_view::npos
+                         ? std::string_view::npos
+                         : command.find('}', start_pos + 2);
+    if (end_pos == std::string_view::npos) {
+      literal.append(command.substr(pos));
+      break;
+    }
+    literal.append(command.substr(pos, start_pos - pos));
+    pos = end_pos + 1;
+
+    std::string placeholder(
+        command.substr(start_pos + 2, end_pos - start_pos - 2));
+    auto variable_itr =
+        std::find(variables.begin(), variables.end(), placeholder);
+    if (variable_itr != variables.end()) {
+      literals_length_ += literal.size();
+      literals_.push_back(std::move(literal));
+      literal.clear();
+      variables_.push_back(variable_itr - variables.begin());
+      continue;
+    }
+
+    auto constant_itr = constants.find(placeholder);
+    if (constant_itr != constants.end()) {
+      literal += constant_itr->second;
+      continue;
+    }
+    auto itr = placeholders_and_values.find(placeholder);
+    if (itr != placeholders_and_values.end()) {
+      literal += itr->second;
+    } else {
+      std::cerr << "Encountered unknown placeholder: ${" << placeholder << "}"
+                << std::endl;
+    }
+  }
+  literals_length_ += literal.size();
+  literals_.push_back(std::move(literal));
+}
+
+std::string CommandTemplate::Expand(
+    std::initializer_list<std::string_view> values) const {
+  const std::string_view* value_array = values.begin();
+  // Two quotes, plus room for a few escaped characters.
+  size_t length = literals_length_;
+  for (size_t variable : variables_) {
+    if (variable < values.size()) length += value_array[variable].size() + 4;
+  }
+
+  std::string str;
+  str.reserve(length);
+  for (size_t index = 0; index < variables_.size(); index++) {
+    str += literals_[index];
+    if (variables_[index] >= values.size()) continue;
+    str += '"';
+    for (char c : value_array[variables_[index]]) {
+      if (c == '"' || c == '\\') str += '\\';
+      str += c;
+    }
+    str += '"';
+  }
+  str += literals_.back();
+  return str;
+}
@@ -14,8 +14,13 @@
 
 #pragma once
 
+#include <stddef.h>
+
+#include <initializer_list>
+#include <map>
 #include <string>
 #include <string_view>
+#include <vector>
 
 // Registers a placeholder for use with `ReplacePlaceholdersInString`. The
 // placeholder excludes the "${}". e.g. "${abc}" will be just "abc".
@@ -28,3 +33,28 @@ void ReplacePlaceholdersInString(std::string& str);
 // placeholder was found. The placeholder is in full format, e.g. "${abc}"
 bool ReplaceSubstringInString(std::string& str, const std::string& placeholder,
                               const std::string& new_value);
+
+// A command with placeholders that is parsed once, so that it can be expanded
+// for many files without scanning for placeholders each time.
+class CommandTemplate {
+ public:
+  // Parses a command. The placeholders named in `variables` are given values
+  // each time the command is expanded. The other placeholders are replaced when
+  // parsing, with their values in `constants` if they are in it, or else their
+  // registered values.
+  CommandTemplate(std::string_view command,
+                  const std::vector<std::string_view>& variables,
+                  const std::map<std::string, std::string>& constants = {});
+
+  // Returns the command with its variables replaced by `values`, in the order
+  // they were named in when parsing. The values are quoted, as with
+  // std::quoted, because they are paths. Thread safe.
+  std::string Expand(std::initializer_list<std::string_view> values) const;
+
+ private:
+  // The text around the variables. There is one more than there are variables.
+  std::vector<std::string> literals_;
+  // The index of the value to expand each variable into.
+  std::vector<size_t> variables_;
+  size_t literals_length_ = 0;
+};
@@ -35,8 +35,13 @@ constexpr char kTempSubDirectoryName[] = "rebs";
 // isolated to a local universe.
 constexpr char kLocalTempSubdirectoryName[] = ".build";
 
+// Appended to the name of the optimization level's sub directory in dev mode.
+constexpr char kDevModeSuffix[] = "-dev";
+
 std::filesystem::path temp_directory_path;
 
+std::filesystem::path shared_temp_directory_path;
+
 }  // namespace
 
 void InitializeTempDirectory() {
@@ -47,14 +52,22 @@ void InitializeTempDirectory() {
     temp_directory_root =
         std::filesystem::temp_directory_path() / kTempSubDirectoryName;
   }
-  temp_directory_path =
-      temp_directory_root / OptimizationLevelToString(GetOptimizationLevel());
+  shared_temp_directory_path = temp_directory_root;
+  std::string level_directory_name(
+      OptimizationLevelToString(GetOptimizationLevel()));
+  // Objects compiled for shared libraries are kept apart from the others.
+  if (IsDevMode()) level_directory_name += kDevModeSuffix;
+  temp_directory_path = temp_directory_root / level_directory_name;
   EnsureDirectoriesAndParentsExist(temp_directory_path);
   SetPlaceholder("temp directory", std::string(temp_directory_path));
 }
 
 std::filesystem::path GetTempDirectoryPath() { return temp_directory_path; }
 
+std::filesystem::path GetSharedTempDirectoryPath() {
+  return shared_temp_directory_path;
+}
+
 std::filesystem::path GetTempDirectoryPathForPackageName(
     const std::string& package_name) {
   return GetTempDirectoryPathForPackageID(GetIDOfPackageFromName(package_name));
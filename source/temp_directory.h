@@ -26,6 +26,9 @@ void FinalizeTempDirectory();
 // Returns the temp path.
 std::filesystem::path GetTempDirectoryPath();
 
+// Returns the temp path that is shared between all optimization levels.
+std::filesystem::path GetSharedTempDirectoryPath();
+
 // Ensures a directory exists. Creates it (and the parents) if neccesary.
 void EnsureDirectoriesAndParentsExist(const std::filesystem::path& path);
 
@@ -0,0 +1,271 @@
+// Copyright 2024 Google LLC
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//      http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+
+#include "test_runner.h"
+
+#include <algorithm>
+#include <chrono>
+#include <cstdint>
+#include <filesystem>
+#include <fstream>
+#include <iomanip>
+#include <iostream>
+#include <memory>
+#include <mutex>
+#include <set>
+#include <sstream>
+#include <string>
+#include <system_error>
+#include <vector>
+
+#include "build.h"
+#include "command_queue.h"
+#include "deferred_command.h"
+#include "execute.h"
+#include "invocation.h"
+#include "package_metadata.h"
+#include "packages.h"
+#include "stage.h"
+#include "stats.h"
+#include "temp_directory.h"
+#include "timestamps.h"
+
+namespace {
+
+// The name of the subdirectory inside of a test's temporary directory that
+// remembers when each of its shards last passed.
+constexpr char kTestResultsSubDirectory[] = "test_results";
+
+// A test shard that ran.
+struct TestResult {
+  std::string name;
+  bool passed;
+  // In milliseconds.
+  uint64_t duration;
+};
+
+// Test packages that have been queued during this run.
+std::set<std::string> packages;
+
+// The number of test shards that were queued to run, and that were skipped
+// without being queued because they're unchanged since they last passed.
+int queued_tests = 0;
+int unchanged_tests = 0;
+
+// Guards the results, which are recorded by the running tests.
+std::mutex results_mutex;
+std::vector<TestResult> test_results;
+
+// Returns the path of the file whose timestamp is when a shard of a test last
+// passed.
+std::filesystem::path GetPassedFilePath(const PackageMetadata& metadata,
+                                        int shard) {
+  return metadata.temp_directory / kTestResultsSubDirectory /
+         ("shard_" + std::to_string(shard) + "_of_" +
+          std::to_string(metadata.test_shards) + ".passed");
+}
+
+// Returns the name to report a shard of a test as.
+std::string GetTestName(const std::string& package_name,
+                        const PackageMetadata& metadata, int shard) {
+  if (metadata.test_shards == 1) return package_name;
+  return package_name + " (shard " + std::to_string(shard + 1) + "/" +
+         std::to_string(metadata.test_shards) + ")";
+}
+
+// Returns the command that runs a shard of a test. Test cases are split between
+// the shards with GoogleTest's sharding environment variables.
+std::string BuildTestCommand(const PackageMetadata& metadata, int shard) {
+  std::stringstream command;
+  if (metadata.test_shards > 1) {
+    command << "env GTEST_TOTAL_SHARDS=" << metadata.test_shards
+            << " GTEST_SHARD_INDEX=" << shard << " ";
+  }
+  command << std::quoted(metadata.output_path.c_str());
+  return command.str();
+}
+
+// Runs a shard of a test and records the result. If it passes, the time is
+// remembered, so that it can be skipped until it changes. Thread safe.
+bool RunTest(const std::string& name, const std::string& command,
+             const std::filesystem::path& passed_file,
+             std::stringstream& output) {
+  auto start_time = std::chrono::steady_clock::now();
+  bool passed = ExecuteCommand(command, &output);
+  auto duration = std::chrono::duration_cast<std::chrono::milliseconds>(
+      std::chrono::steady_clock::now() - start_time);
+  if (passed) {
+    std::ofstream file(passed_file, std::ios::trunc);
+    file << command << std::endl;
+  } else {
+    std::error_code error;
+    std::filesystem::remove(passed_file, error);
+  }
+
+  std::scoped_lock lock(results_mutex);
+  test_results.push_back({.name = name,
+                          .passed = passed,
+                          .duration = static_cast<uint64_t>(duration.count())});
+  return passed;
+}
+
+// Queues each shard of a test to run once the test and the shared libraries it
+// loads are built.
+bool QueueTest(const std::string& package_name) {
+  if (packages.contains(package_name)) return true;
+  packages.insert(package_name);
+
+  auto* metadata = GetMetadataForPackage(package_name);
+  if (metadata == nullptr) {
+    std::cerr << "Unable to test " << std::quoted(package_name) << "."
+              << std::endl;
+    return false;
+  }
+  if (!metadata->IsApplication()) {
+    std::cerr << "Test " << std::quoted(package_name)
+              << " isn't an application." << std::endl;
+    return false;
+  }
+
+  std::vector<std::filesystem::path> files_being_tested = {
+      metadata->output_path};
+  for (const auto& library : metadata->dynamically_linked_libaries)
+    files_being_tested.push_back(GetSharedLibraryPath(library));
+
+  // The commands producing the files being tested during this run, which the
+  // test runs after.
+  std::vector<DeferredCommand*> dependencies;
+  // The newest of the files being tested that aren't being produced.
+  uint64_t newest_timestamp = 0;
+  // Whether the test can be skipped if it's unchanged.
+  bool may_skip = ShouldOnlyRunChangedTests();
+  for (const auto& file : files_being_tested) {
+    DeferredCommand* command = GetCommandProducingFile(file);
+    if (command == nullptr) {
+      uint64_t timestamp = GetTimestampOfFile(file);
+      if (timestamp == 0) may_skip = false;
+      newest_timestamp = std::max(newest_timestamp, timestamp);
+      continue;
+    }
+    dependencies.push_back(command);
+    // In dev mode, a shared library only counts as changed when its exported
+    // symbols do, but the test could behave differently with any change.
+    if (IsDevMode() && file != metadata->output_path) may_skip = false;
+  }
+
+  EnsureDirectoriesAndParentsExist(metadata->temp_directory /
+                                   kTestResultsSubDirectory);
+  for (int shard = 0; shard < metadata->test_shards; shard++) {
+    std::filesystem::path passed_file = GetPassedFilePath(*metadata, shard);
+    uint64_t passed_timestamp = GetTimestampOfFile(passed_file);
+    bool unchanged = may_skip && passed_timestamp != 0 &&
+                     newest_timestamp <= passed_timestamp;
+    if (unchanged && dependencies.empty()) {
+      RecordUpToDateCommands(Stage::Test);
+      unchanged_tests++;
+      continue;
+    }
+
+    auto command = std::make_unique<DeferredCommand>();
+    command->command = BuildTestCommand(*metadata, shard);
+    command->destination_file = passed_file;
+    command->package_id = metadata->package_id;
+    command->cacheable = false;
+    command->action = [name = GetTestName(package_name, *metadata, shard),
+                       command_str = command->command,
+                       passed_file](std::stringstream& output) {
+      return RunTest(name, command_str, passed_file, output);
+    };
+    command->dependencies = dependencies;
+    // Only ran if rebuilding the test changed it.
+    command->skip_if_dependencies_unchanged = unchanged;
+    QueueCommand(Stage::Test, std::move(command));
+    queued_tests++;
+  }
+  return true;
+}
+
+}  // namespace
+
+std::vector<std::string> FindTestPackages(
+    const std::vector<std::string>& package_names) {
+  std::vector<std::string> tests;
+  std::set<std::string> found_tests;
+  auto add_test = [&tests, &found_tests](const std::string& test) {
+    if (found_tests.insert(test).second) tests.push_back(test);
+  };
+  for (const auto& package_name : package_names) {
+    auto* metadata = GetMetadataForPackage(package_name);
+    if (metadata == nullptr) continue;
+    if (metadata->test) add_test(package_name);
+    for (const auto& test : metadata->tests) add_test(test);
+  }
+  return tests;
+}
+
+bool TestPackages() {
+  // Tests are ran again each time they change while watching.
+  packages.clear();
+  queued_tests = 0;
+  unchanged_tests = 0;
+  test_results.clear();
+
+  std::vector<std::string> package_names;
+  ForEachInputPackage([&package_names](const std::string& package_path) {
+    package_names.push_back(GetPackageNameFromPath(package_path));
+  });
+  std::vector<std::string> tests = FindTestPackages(package_names);
+  if (tests.empty()) {
+    std::cerr << "Nothing to test." << std::endl;
+    return false;
+  }
+
+  bool successful = true;
+  for (const auto& test : tests) successful &= QueueTest(test);
+  return successful;
+}
+
+bool ReportTestResults() {
+  std::scoped_lock lock(results_mutex);
+  std::sort(test_results.begin(), test_results.end(),
+            [](const TestResult& a, const TestResult& b) {
+              return a.name < b.name;
+            });
+  int passed_tests = 0;
+  int failed_tests = 0;
+  for (const auto& result : test_results) {
+    if (result.passed) {
+      passed_tests++;
+    } else {
+      failed_tests++;
+    }
+  }
+  // Tests that were queued but didn't run were either unchanged, or couldn't be
+  // built.
+  int skipped_tests =
+      unchanged_tests + queued_tests - static_cast<int>(test_results.size());
+
+  if (failed_tests > 0) {
+    std::cout << "Failed tests:" << std::endl;
+    for (const auto& result : test_results) {
+      if (result.passed) continue;
+      std::cout << "  " << std::right << std::setw(8) << result.duration
+                << " ms  " << result.name << std::endl;
+    }
+  }
+  std::cout << "Tests: " << passed_tests << " passed, " << failed_tests
+            << " failed, " << skipped_tests << " skipped." << std::endl;
+  return failed_tests == 0;
+}
@@ -0,0 +1,36 @@
+// Copyright 2024 Google LLC
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//      http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+
+#pragma once
+
+#include <string>
+#include <vector>
+
+// Tests are application packages that set "test", and run in parallel on the
+// command queue as soon as they're built, longest first, based on how long they
+// took last time. Failed tests don't stop the build.
+
+// Returns the test packages of the packages: the ones that are tests, and the
+// tests that they list.
+std::vector<std::string> FindTestPackages(
+    const std::vector<std::string>& package_names);
+
+// Queues the tests of the packages requested in the input. Returns true if
+// successful.
+bool TestPackages();
+
+// Prints a summary of the tests that were queued, after the queued commands
+// have ran. Returns whether every test passed.
+bool ReportTestResults();
@@ -14,45 +14,93 @@
 
 #include "timestamps.h"
 
+#include <atomic>
 #include <chrono>
 #include <filesystem>
 #include <iostream>
 #include <map>
+#include <mutex>
+
+#ifndef _WIN32
+#include <sys/stat.h>
+#endif
 
 namespace {
 
 // A cache of timestamps of files.
 std::map<std::string, uint64_t> timestamps_by_filename;
 
+// Guards `timestamps_by_filename`. Files are looked up without holding the lock,
+// so two threads may occasionally look up the same file.
+std::mutex timestamps_mutex;
+
+std::atomic<uint64_t> timestamp_cache_hits = 0;
+std::atomic<uint64_t> timestamp_reads = 0;
+
 }  // namespace
 
 uint64_t GetTimestampOfFile(const std::string& file_name) {
-  auto itr = timestamps_by_filename.find(file_name);
-  if (itr != timestamps_by_filename.end()) return itr->second;
-
-  uint64_t timestamp = 0;
-  if (std::filesystem::exists(file_name)) {
-    auto last_write_time = std::filesystem::last_write_time(file_name);
-    auto time_since_epoch = last_write_time.time_since_epoch();
-    timestamp =
-        std::chrono::duration_cast<std::chrono::milliseconds>(time_since_epoch)
-            .count();
-  } else if (std::filesystem::is_directory(file_name)) {
-    // 0 is used to mean a file doesn't exist, but directories do exist, they
-    // just don't have a timestamp.
-    timestamp = 1;
+  {
+    std::scoped_lock lock(timestamps_mutex);
+    auto itr = timestamps_by_filename.find(file_name);
+    if (itr != timestamps_by_filename.end()) {
+      timestamp_cache_hits.fetch_add(1, std::memory_order_relaxed);
+      return itr->second;
+    }
   }
+
+  uint64_t timestamp = ReadTimestampOfFile(file_name);
+  std::scoped_lock lock(timestamps_mutex);
   timestamps_by_filename[file_name] = timestamp;
   return timestamp;
 }
 
+uint64_t ReadTimestampOfFile(const std::string& file_name) {
+  timestamp_reads.fetch_add(1, std::memory_order_relaxed);
+  // Timestamps are in milliseconds since the Unix epoch, with 0 meaning the
+  // file doesn't exist.
+#ifdef _WIN32
+  std::error_code error;
+  auto status = std::filesystem::status(file_name, error);
+  if (error || !std::filesystem::exists(status)) return 0;
+  auto last_write_time = std::filesystem::last_write_time(file_name, error);
+  if (error) return 0;
+  return std::chrono::duration_cast<std::chrono::milliseconds>(
+             std::chrono::file_clock::to_sys(last_write_time)
+                 .time_since_epoch())
+      .count();
+#else
+  // A single stat, rather than checking if the file exists then reading its
+  // timestamp.
+  struct stat file_stat;
+  if (stat(file_name.c_str(), &file_stat) != 0) return 0;
+#ifdef __APPLE__
+  const struct timespec& modified_time = file_stat.st_mtimespec;
+#else
+  const struct timespec& modified_time = file_stat.st_mtim;
+#endif
+  return static_cast<uint64_t>(modified_time.tv_sec) * 1000 +
+         modified_time.tv_nsec / 1000000;
+#endif
+}
+
+uint64_t GetNumberOfTimestampCacheHits() { return timestamp_cache_hits; }
+
+uint64_t GetNumberOfTimestampReads() { return timestamp_reads; }
+
 bool DoesFileExist(const std::string& file_name) {
   return GetTimestampOfFile(file_name) != 0;
 }
 
+void InvalidateTimestamps() {
+  std::scoped_lock lock(timestamps_mutex);
+  timestamps_by_filename.clear();
+}
+
 void SetTimestampOfFileToNow(const std::string& file_name) {
   auto now = std::chrono::system_clock::now();
   auto time_since_epoch = now.time_since_epoch();
+  std::scoped_lock lock(timestamps_mutex);
   timestamps_by_filename[file_name] =
       std::chrono::duration_cast<std::chrono::milliseconds>(time_since_epoch)
           .count();
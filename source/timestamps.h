@@ -19,8 +19,23 @@
 // do not matter, only that a more recent file has a higher number.
 uint64_t GetTimestampOfFile(const std::string& file_name);
 
+// Reads the timestamp of a file from the file system, bypassing the cache, with
+// the same units as `GetTimestampOfFile`. Thread safe.
+uint64_t ReadTimestampOfFile(const std::string& file_name);
+
+// Returns how many times a timestamp was found in the cache. Thread safe.
+uint64_t GetNumberOfTimestampCacheHits();
+
+// Returns how many timestamps have been read from the file system, including
+// those that bypassed the cache. Thread safe.
+uint64_t GetNumberOfTimestampReads();
+
 // Returns whether a file exists.
 bool DoesFileExist(const std::string& file_name);
 
 // Sets the timestamp of a file to now.
 void SetTimestampOfFileToNow(const std::string& file_name);
+
+// Forgets the timestamps of every file, so that files that have changed since
+// are read again.
+void InvalidateTimestamps();
@@ -0,0 +1,147 @@
+// Copyright 2024 Google LLC
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//      http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+#include "trace.h"
+
+#include <atomic>
+#include <chrono>
+#include <cstdint>
+#include <filesystem>
+#include <fstream>
+#include <iostream>
+#include <mutex>
+#include <string>
+#include <string_view>
+#include <utility>
+#include <vector>
+
+#include "invocation.h"
+#include "nlohmann/json.hpp"
+
+using json = ::nlohmann::json;
+
+namespace {
+
+// A span that has been recorded.
+struct TraceSpan {
+  std::string name;
+  std::string category;
+  // In microseconds since the trace started.
+  uint64_t start_time;
+  uint64_t duration;
+  int thread_id;
+  TraceArguments arguments;
+};
+
+bool tracing = false;
+
+std::chrono::steady_clock::time_point trace_start_time;
+
+// Guards `spans`.
+std::mutex spans_mutex;
+std::vector<TraceSpan> spans;
+
+// Threads are numbered in the order they first record a span, so the main
+// thread is usually 0.
+std::atomic<int> next_thread_id = 0;
+thread_local int thread_id = -1;
+
+int GetThreadId() {
+  if (thread_id < 0) thread_id = next_thread_id++;
+  return thread_id;
+}
+
+}  // namespace
+
+void InitializeTrace() {
+  if (GetTraceFile().empty()) return;
+  tracing = true;
+  trace_start_time = std::chrono::steady_clock::now();
+  GetThreadId();
+}
+
+void FlushTrace() {
+  if (!tracing) return;
+
+  json events = json::array();
+  {
+    std::scoped_lock lock(spans_mutex);
+    for (const auto& span : spans) {
+      json arguments = json::object();
+      for (const auto& [name, value] : span.arguments) arguments[name] = value;
+      events.push_back({{"name", span.name},
+                        {"cat", span.category},
+                        {"ph", "X"},
+                        {"ts", span.start_time},
+                        {"dur", span.duration},
+                        {"pid", 1},
+                        {"tid", span.thread_id},
+                        {"args", std::move(arguments)}});
+    }
+  }
+  for (int thread = 0; thread < next_thread_id; thread++) {
+    events.push_back(
+        {{"name", "thread_name"},
+         {"ph", "M"},
+         {"pid", 1},
+         {"tid", thread},
+         {"args",
+          {{"name", thread == 0 ? "main" : "thread " + std::to_string(thread)}}}});
+  }
+
+  std::filesystem::path trace_file(GetTraceFile());
+  std::ofstream file(trace_file);
+  if (!file.is_open()) {
+    std::cerr << "Cannot write the trace to " << trace_file << "."
+              << std::endl;
+    return;
+  }
+  file << json{{"traceEvents", std::move(events)}, {"displayTimeUnit", "ms"}};
+}
+
+bool IsTracing() { return tracing; }
+
+uint64_t GetTraceTime() {
+  return std::chrono::duration_cast<std::chrono::microseconds>(
+             std::chrono::steady_clock::now() - trace_start_time)
+      .count();
+}
+
+void RecordTraceSpan(std::string_view name, std::string_view category,
+                     uint64_t start_time, TraceArguments arguments) {
+  if (!tracing) return;
+  TraceSpan span = {.name = std::string(name),
+                    .category = std::string(category),
+                    .start_time = start_time,
+                    .duration = GetTraceTime() - start_time,
+                    .thread_id = GetThreadId(),
+                    .arguments = std::move(arguments)};
+  std::scoped_lock lock(spans_mutex);
+  spans.push_back(std::move(span));
+}
+
+ScopedTraceSpan::ScopedTraceSpan(std::string_view name,
+                                 std::string_view category)
+    : name_(name),
+      category_(category),
+      start_time_(tracing ? GetTraceTime() : 0) {}
+
+ScopedTraceSpan::~ScopedTraceSpan() {
+  RecordTraceSpan(name_, category_, start_time_, std::move(arguments_));
+}
+
+void ScopedTraceSpan::AddArgument(std::string_view name,
+                                  std::string_view value) {
+  if (tracing) arguments_.emplace_back(name, value);
+}
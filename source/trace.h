@@ -0,0 +1,63 @@
+// Copyright 2024 Google LLC
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//      http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+#pragma once
+
+#include <cstdint>
+#include <string>
+#include <string_view>
+#include <utility>
+#include <vector>
+
+// A trace records spans of the time spent building, in the Trace Event Format
+// that chrome://tracing and Perfetto can open, to show where the time goes.
+// Spans are recorded on the thread they ran on. Nothing is recorded unless a
+// trace file was passed with --trace.
+
+// The arguments of a span, shown alongside it.
+using TraceArguments = std::vector<std::pair<std::string, std::string>>;
+
+// Starts recording a trace if one was requested.
+void InitializeTrace();
+
+// Writes the trace to disk, if one is being recorded.
+void FlushTrace();
+
+// Returns whether a trace is being recorded.
+bool IsTracing();
+
+// Returns the time in microseconds since the trace started.
+uint64_t GetTraceTime();
+
+// Records a span on the current thread that started at `start_time` and ends
+// now. Thread safe.
+void RecordTraceSpan(std::string_view name, std::string_view category,
+                     uint64_t start_time, TraceArguments arguments = {});
+
+// Records a span on the current thread for the lifetime of this object.
+class ScopedTraceSpan {
+ public:
+  ScopedTraceSpan(std::string_view name, std::string_view category);
+  ~ScopedTraceSpan();
+
+  // Adds an argument to the span. Does nothing if there is no trace, so it is
+  // cheap to call regardless.
+  void AddArgument(std::string_view name, std::string_view value);
+
+ private:
+  std::string_view name_;
+  std::string_view category_;
+  uint64_t start_time_;
+  TraceArguments arguments_;
+};
@@ -0,0 +1,256 @@
+// Copyright 2024 Google LLC
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//      http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+#include "watch.h"
+
+#include <algorithm>
+#include <chrono>
+#include <filesystem>
+#include <functional>
+#include <iostream>
+#include <map>
+#include <set>
+
+#ifdef __linux__
+#include <poll.h>
+#include <sys/inotify.h>
+#include <unistd.h>
+#endif
+
+#include "config.h"
+#include "dependencies.h"
+#include "object_cache.h"
+#include "package_metadata.h"
+#include "temp_directory.h"
+#include "timestamps.h"
+
+#ifdef __linux__
+
+namespace {
+
+// How long to wait for more changes after a file changes, so that saving many
+// files at once only builds once.
+constexpr std::chrono::milliseconds kSettleTime{100};
+
+// The events that may mean that something needs to be built.
+constexpr uint32_t kWatchedEvents = IN_ATTRIB | IN_CLOSE_WRITE | IN_CREATE |
+                                    IN_DELETE | IN_MOVED_FROM | IN_MOVED_TO;
+
+// The size of the buffer to read events into.
+constexpr size_t kEventBufferSize = 64 * 1024;
+
+// What a change requires, in increasing order of severity.
+enum class Change { None, Files, PackageConfigs, Restart };
+
+// A directory that is being watched.
+struct WatchedDirectory {
+  std::filesystem::path path;
+  // Whether the directory is inside of a package, so changes to its files
+  // cause a build.
+  bool is_in_package = false;
+  // Whether the directory contains packages, so adding or removing
+  // directories changes which packages exist.
+  bool contains_packages = false;
+  // Whether the directory contains a global config file.
+  bool contains_config_files = false;
+};
+
+int inotify_fd = -1;
+
+// The watched directories, keyed by their watch descriptor.
+std::map<int, WatchedDirectory> watched_directories_by_descriptor;
+
+// The packages whose directories are being watched.
+std::set<std::filesystem::path> watched_packages;
+
+std::set<std::filesystem::path> global_config_files;
+
+// The directories that builds write to, whose changes are ignored.
+std::set<std::filesystem::path> build_output_directories;
+
+// Returns whether a file or directory should be ignored, such as version
+// control directories and editor swap files.
+bool IsHidden(const std::filesystem::path& path) {
+  return path.filename().string().starts_with('.') && !IsPackageConfigFile(path);
+}
+
+// Returns whether a path is inside of a directory that builds write to.
+bool IsBuildOutput(const std::filesystem::path& path) {
+  for (const std::filesystem::path& directory : build_output_directories) {
+    if (std::mismatch(directory.begin(), directory.end(), path.begin(),
+                      path.end())
+            .first == directory.end())
+      return true;
+  }
+  return false;
+}
+
+// Starts watching a directory, or adds to what's being watched for if it's
+// already being watched.
+void WatchDirectory(const std::filesystem::path& path, bool is_in_package,
+                    bool contains_packages, bool contains_config_files) {
+  int watch_descriptor = inotify_add_watch(inotify_fd, path.c_str(),
+                                           kWatchedEvents | IN_ONLYDIR);
+  if (watch_descriptor < 0) return;
+  WatchedDirectory& directory =
+      watched_directories_by_descriptor[watch_descriptor];
+  directory.path = path;
+  directory.is_in_package |= is_in_package;
+  directory.contains_packages |= contains_packages;
+  directory.contains_config_files |= contains_config_files;
+}
+
+// Watches a directory inside of a package and all of its subdirectories.
+void WatchPackageDirectory(const std::filesystem::path& path) {
+  WatchDirectory(path, /*is_in_package=*/true, /*contains_packages=*/false,
+                 /*contains_config_files=*/false);
+  std::error_code error;
+  for (auto itr = std::filesystem::recursive_directory_iterator(
+           path, std::filesystem::directory_options::skip_permission_denied,
+           error);
+       !error && itr != std::filesystem::recursive_directory_iterator();
+       itr.increment(error)) {
+    if (!itr->is_directory(error)) continue;
+    if (IsHidden(itr->path()) || IsBuildOutput(itr->path())) {
+      itr.disable_recursion_pending();
+      continue;
+    }
+    WatchDirectory(itr->path(), /*is_in_package=*/true,
+                   /*contains_packages=*/false,
+                   /*contains_config_files=*/false);
+  }
+}
+
+// Watches anything that isn't already being watched, such as packages that were
+// loaded by the last build.
+void WatchEverything() {
+  build_output_directories.insert(
+      std::filesystem::absolute(GetTempDirectoryPath()).lexically_normal());
+  ForEachGlobalConfigFilePath([](const std::filesystem::path& config_file) {
+    if (!global_config_files.insert(config_file).second) return;
+    WatchDirectory(config_file.parent_path(), /*is_in_package=*/false,
+                   /*contains_packages=*/false,
+                   /*contains_config_files=*/true);
+  });
+  ForEachPackageDirectory([](const std::filesystem::path& directory) {
+    WatchDirectory(std::filesystem::absolute(directory),
+                   /*is_in_package=*/false, /*contains_packages=*/true,
+                   /*contains_config_files=*/false);
+  });
+  ForEachLoadedPackage([](const PackageMetadata& metadata) {
+    if (!metadata.destination_directory.empty()) {
+      build_output_directories.insert(
+          std::filesystem::absolute(metadata.destination_directory)
+              .lexically_normal());
+    }
+    if (watched_packages.insert(metadata.package_path).second)
+      WatchPackageDirectory(metadata.package_path);
+  });
+}
+
+// Returns what an event requires.
+Change HandleEvent(const struct inotify_event& event) {
+  // Too many events were queued to know what changed.
+  if (event.mask & IN_Q_OVERFLOW) return Change::PackageConfigs;
+
+  auto itr = watched_directories_by_descriptor.find(event.wd);
+  if (itr == watched_directories_by_descriptor.end()) return Change::None;
+  if (event.mask & IN_IGNORED) {
+    // The directory was removed.
+    watched_directories_by_descriptor.erase(itr);
+    return Change::None;
+  }
+  if (event.len == 0) return Change::None;
+
+  const WatchedDirectory& directory = itr->second;
+  std::filesystem::path path = directory.path / event.name;
+  bool is_directory = event.mask & IN_ISDIR;
+  bool directory_added_or_removed =
+      is_directory &&
+      (event.mask & (IN_CREATE | IN_DELETE | IN_MOVED_FROM | IN_MOVED_TO));
+
+  if (directory.contains_config_files && global_config_files.contains(path))
+    return Change::Restart;
+  if (IsHidden(path) || IsBuildOutput(path)) return Change::None;
+  if (directory.contains_packages && directory_added_or_removed)
+    return Change::Restart;
+  if (!directory.is_in_package) return Change::None;
+
+  if (is_directory && (event.mask & (IN_CREATE | IN_MOVED_TO)))
+    WatchPackageDirectory(path);
+  if (IsPackageConfigFile(path)) return Change::PackageConfigs;
+  return Change::Files;
+}
+
+// Waits up to `timeout` milliseconds for events, or forever if it's negative,
+// and reads them. Returns false if there were no events.
+bool ReadEvents(int timeout, Change& change) {
+  struct pollfd poll_fd = {.fd = inotify_fd, .events = POLLIN, .revents = 0};
+  if (poll(&poll_fd, 1, timeout) <= 0) return false;
+
+  alignas(struct inotify_event) char buffer[kEventBufferSize];
+  ssize_t length = read(inotify_fd, buffer, sizeof(buffer));
+  if (length <= 0) return false;
+  for (char* ptr = buffer; ptr < buffer + length;) {
+    const auto* event = reinterpret_cast<const struct inotify_event*>(ptr);
+    change = std::max(change, HandleEvent(*event));
+    ptr += sizeof(struct inotify_event) + event->len;
+  }
+  return true;
+}
+
+}  // namespace
+
+bool WatchForChanges(const std::function<void()>& rebuild) {
+  inotify_fd = inotify_init1(IN_CLOEXEC);
+  if (inotify_fd < 0) {
+    std::cerr << "Cannot watch for changes." << std::endl;
+    return false;
+  }
+
+  // Changes made while building are kept, so they're built straight after.
+  Change change = Change::None;
+  while (true) {
+    WatchEverything();
+    if (change == Change::None) {
+      std::cout << "Watching for changes. Press Ctrl-C to stop." << std::endl;
+      while (change == Change::None) ReadEvents(/*timeout=*/-1, change);
+    }
+    while (ReadEvents(kSettleTime.count(), change)) {
+    }
+    if (change == Change::Restart) break;
+
+    InvalidateTimestamps();
+    InvalidateTimestampsOfDependencies();
+    InvalidateContentHashes();
+    if (change == Change::PackageConfigs) InvalidateMetadata();
+    change = Change::None;
+    rebuild();
+    while (ReadEvents(/*timeout=*/0, change)) {
+    }
+  }
+
+  close(inotify_fd);
+  inotify_fd = -1;
+  return true;
+}
+
+#else
+
+bool WatchForChanges(const std::function<void()>& rebuild) {
+  std::cerr << "Watching for changes is only supported on Linux." << std::endl;
+  return false;
+}
+
+#endif
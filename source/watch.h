@@ -0,0 +1,28 @@
+// Copyright 2024 Google LLC
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//      http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+#pragma once
+
+#include <functional>
+
+// Watches the packages that have been loaded and the global config files for
+// changes. Each time files change, the cached state that depends on them is
+// forgotten and `rebuild` is called, while everything else stays in memory
+// between builds. Changes made while a build is running are picked up by the
+// build after the next change.
+//
+// Returns true if a change requires rebs to start over, such as a change to
+// the global config or a package being added or removed, or false if watching
+// isn't supported.
+bool WatchForChanges(const std::function<void()>& rebuild);
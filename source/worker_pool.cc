@@ -0,0 +1,182 @@
+// Copyright 2024 Google LLC
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//      http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+#include "worker_pool.h"
+
+#include <stddef.h>
+
+#include <algorithm>
+#include <atomic>
+#include <condition_variable>
+#include <deque>
+#include <functional>
+#include <memory>
+#include <mutex>
+#include <thread>
+#include <vector>
+
+namespace {
+
+// A worker thread and the tasks queued on it.
+struct Worker {
+  std::thread thread;
+  // Guards `tasks`.
+  std::mutex mutex;
+  // Tasks queued on this worker. The worker runs tasks from the back, and other
+  // workers steal tasks from the front.
+  std::deque<std::function<void(int)>> tasks;
+};
+
+std::vector<std::unique_ptr<Worker>> workers;
+
+// Guards putting idle workers to sleep and waking them up.
+std::mutex idle_mutex;
+std::condition_variable task_queued;
+
+// The number of tasks in the workers' queues that have not started yet. Only
+// incremented while holding `idle_mutex` so that wake ups are never lost.
+std::atomic<size_t> queued_tasks = 0;
+
+// Whether the worker threads should exit once there are no more tasks.
+bool shutting_down = false;
+
+// The worker to queue the next task on when a task is queued from a thread
+// that is not a worker.
+std::atomic<size_t> next_worker_for_external_tasks = 0;
+
+// The ID of the worker running on this thread, or -1 if this thread is not a
+// worker.
+thread_local int current_worker_id = -1;
+
+// Takes the next task for a worker to run. This is the most recently queued
+// task on its own queue, or else the oldest task stolen from another worker.
+// Returns false if there are no tasks.
+bool TryTakeTask(int worker_id, std::function<void(int)>& task) {
+  int worker_count = workers.size();
+  for (int i = 0; i < worker_count; i++) {
+    Worker& worker = *workers[(worker_id + i) % worker_count];
+    std::scoped_lock lock(worker.mutex);
+    if (worker.tasks.empty()) continue;
+    if (i == 0) {
+      task = std::move(worker.tasks.back());
+      worker.tasks.pop_back();
+    } else {
+      task = std::move(worker.tasks.front());
+      worker.tasks.pop_front();
+    }
+    queued_tasks--;
+    return true;
+  }
+  return false;
+}
+
+void RunWorker(int worker_id) {
+  current_worker_id = worker_id;
+  while (true) {
+    std::function<void(int)> task;
+    if (TryTakeTask(worker_id, task)) {
+      task(worker_id);
+      continue;
+    }
+
+    std::unique_lock lock(idle_mutex);
+    task_queued.wait(lock, []() { return queued_tasks > 0 || shutting_down; });
+    if (queued_tasks == 0 && shutting_down) return;
+  }
+}
+
+}  // namespace
+
+void InitializeWorkerPool(int thread_count) {
+  thread_count = std::max(thread_count, 1);
+  for (int worker_id = 0; worker_id < thread_count; worker_id++)
+    workers.push_back(std::make_unique<Worker>());
+  // Start the threads once every worker exists, because workers look at each
+  // other's queues.
+  for (int worker_id = 0; worker_id < thread_count; worker_id++)
+    workers[worker_id]->thread = std::thread(RunWorker, worker_id);
+}
+
+void ShutdownWorkerPool() {
+  {
+    std::scoped_lock lock(idle_mutex);
+    shutting_down = true;
+  }
+  task_queued.notify_all();
+  for (auto& worker : workers) worker->thread.join();
+  workers.clear();
+}
+
+int GetNumberOfWorkers() { return workers.size(); }
+
+void QueueTask(std::function<void(int worker_id)> task) {
+  if (workers.empty()) {
+    // There is no pool, so run the task on this thread.
+    task(0);
+    return;
+  }
+
+  int worker_id = current_worker_id;
+  if (worker_id < 0)
+    worker_id = next_worker_for_external_tasks++ % workers.size();
+
+  {
+    Worker& worker = *workers[worker_id];
+    std::scoped_lock lock(worker.mutex);
+    worker.tasks.push_back(std::move(task));
+  }
+  {
+    std::scoped_lock lock(idle_mutex);
+    queued_tasks++;
+  }
+  task_queued.notify_one();
+}
+
+void ParallelFor(size_t count,
+                 const std::function<void(size_t index)>& on_each_index) {
+  if (count == 0) return;
+
+  // Shared with the queued helper tasks, which may start after this function
+  // has returned. They will find no indices left and exit straight away.
+  struct State {
+    std::atomic<size_t> next_index = 0;
+    std::mutex mutex;
+    std::condition_variable all_completed;
+    size_t completed = 0;
+  };
+  auto state = std::make_shared<State>();
+
+  auto do_work = [state, count, on_each_index = &on_each_index]() {
+    size_t completed = 0;
+    for (size_t index = state->next_index++; index < count;
+         index = state->next_index++) {
+      (*on_each_index)(index);
+      completed++;
+    }
+    if (completed == 0) return;
+
+    std::scoped_lock lock(state->mutex);
+    state->completed += completed;
+    if (state->completed == count) state->all_completed.notify_all();
+  };
+
+  size_t helpers = std::min(count - 1, workers.size());
+  for (size_t helper = 0; helper < helpers; helper++)
+    QueueTask([do_work](int) { do_work(); });
+  do_work();
+
+  std::unique_lock lock(state->mutex);
+  state->all_completed.wait(lock,
+                            [&state, count]() { return state->completed == count; });
+}
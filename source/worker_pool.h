@@ -0,0 +1,44 @@
+// Copyright 2024 Google LLC
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//      http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+#pragma once
+
+#include <stddef.h>
+
+#include <functional>
+
+// A pool of long lived worker threads shared by everything in REBS that runs in
+// parallel. Each worker has its own queue of tasks, and idle workers steal
+// tasks from the other workers' queues.
+
+// Starts the worker pool with the given number of worker threads.
+void InitializeWorkerPool(int thread_count);
+
+// Waits for the queued tasks to complete and stops the worker threads.
+void ShutdownWorkerPool();
+
+// Returns the number of worker threads. Worker IDs passed to tasks are in the
+// range [0, number of workers).
+int GetNumberOfWorkers();
+
+// Queues a task to run on the worker pool. The task is passed the ID of the
+// worker running it. Tasks queued from a worker are added to that worker's own
+// queue. Thread safe.
+void QueueTask(std::function<void(int worker_id)> task);
+
+// Calls `on_each_index` for each index in [0, count) in parallel across the
+// worker pool, and waits for all of the calls to complete. The calling thread
+// also does work while it waits, so this may be called from a task.
+void ParallelFor(size_t count,
+                 const std::function<void(size_t index)>& on_each_index);